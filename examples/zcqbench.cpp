@@ -0,0 +1,1226 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * zcqbench - performance benchmarks for zcqcomlib
+ *
+ * Usage: zcqbench <benchmark> [options]
+ *
+ * Benchmarks that need bus traffic transmit on a second channel, connect
+ * the RX and TX channels to the same bus. Without hardware, run them on
+ * simulated devices, e.g. ZCQ_SIMULATION=devices=1 zcqbench fdtx 0, the
+ * channels of a simulated device share one bus. "zcqbench bufsweep sim"
+ * sets up its own simulated device with fixed settings. The replay benchmark
+ * feeds a capture of USB IN data, see zcqSetUSBCapture(), through the RX
+ * path again.
+ */
+
+#include <canlib.h>
+#include <zcqcomlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static void check_canlib_error(const char* id, canStatus stat)
+{
+    if (stat == canOK) return;
+
+    char buf[64];
+    buf[0] = '\0';
+    canGetErrorText(stat, buf, sizeof(buf));
+    printf("%s: failed, stat=%d (%s)\n", id, int(stat), buf);
+}
+
+static canHandle open_channel(int channel, int flags, long bitrate)
+{
+    canHandle hnd = canOpenChannel(channel, flags | canOPEN_REQUIRE_EXTENDED);
+    if (hnd < 0) {
+        printf("ERROR: failed to open channel %d\n", channel);
+        check_canlib_error("canOpenChannel", canStatus(hnd));
+        return hnd;
+    }
+
+    canStatus stat = canSetBusParams(hnd, bitrate, 0, 0, 0, 0, 0);
+    if (stat == canOK) stat = canBusOn(hnd);
+    if (stat != canOK) {
+        check_canlib_error("canBusOn", stat);
+        canClose(hnd);
+        return canINVALID_HANDLE;
+    }
+
+    return hnd;
+}
+
+/* TX acks are off by default, the latency benches wait for them */
+static void enable_tx_ack(canHandle hnd)
+{
+    unsigned int tx_ack = 1;
+    check_canlib_error("canIoCtl", canIoCtl(hnd, canIOCTL_SET_TXACK, &tx_ack, sizeof(tx_ack)));
+}
+
+static void close_channel(canHandle hnd)
+{
+    if (hnd < 0) return;
+    canBusOff(hnd);
+    canClose(hnd);
+}
+
+/* "0,1,4" -> { 0, 1, 4 } */
+static std::vector<int> parse_channel_list(const char* text)
+{
+    std::vector<int> channels;
+    for (const char* p = text; *p; ) {
+        channels.push_back(atoi(p));
+        while (*p && *p != ',') p++;
+        if (*p == ',') p++;
+    }
+    return channels;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* Transmit back to back frames until stopped */
+struct TxLoad {
+    canHandle hnd;
+    unsigned int flags;
+    std::atomic<bool> stop;
+    std::atomic<unsigned long> sent;
+    std::thread thread;
+
+    TxLoad() : hnd(canINVALID_HANDLE), flags(canMSG_STD), stop(false), sent(0) {}
+
+    void start(canHandle _hnd, unsigned int _flags = canMSG_STD) {
+        hnd = _hnd;
+        flags = _flags;
+        stop = false;
+        sent = 0;
+        thread = std::thread([this]() {
+            unsigned char msg[8] = {0};
+            while (!stop) {
+                unsigned long n = sent;
+                memcpy(msg, &n, sizeof(n) < 8 ? sizeof(n) : 8);
+                canStatus stat = canWrite(hnd, 0x100, msg, 8, flags);
+                if (stat == canOK) sent++;
+                else std::this_thread::yield();
+            }
+        });
+    }
+
+    void finish() {
+        stop = true;
+        if (thread.joinable()) thread.join();
+    }
+};
+
+/* Print min/avg/percentiles of a list of samples in us */
+static void print_latency(const char* label, std::vector<double>& samples_in_us)
+{
+    if (samples_in_us.empty()) {
+        printf("%-14s no samples\n", label);
+        return;
+    }
+
+    std::sort(samples_in_us.begin(), samples_in_us.end());
+    double sum = 0;
+    for (double s : samples_in_us) sum += s;
+    size_t n = samples_in_us.size();
+
+    printf("%-14s %8zu %9.1f %9.1f %9.1f %9.1f %9.1f\n", label, n,
+           samples_in_us[0], sum / n, samples_in_us[n / 2],
+           samples_in_us[std::min(n - 1, n * 99 / 100)], samples_in_us[n - 1]);
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* Sustained RX rate and HW overrun rate as a function of queued USB IN transfers */
+static int bench_inpool(int argc, char** argv)
+{
+    if (argc < 2) {
+        printf("usage: zcqbench inpool <rx channel> <tx channel> [seconds]\n");
+        return 1;
+    }
+
+    int rx_channel = atoi(argv[0]);
+    int tx_channel = atoi(argv[1]);
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    const int transfer_counts[] = { 1, 2, 4, 8, 16 };
+
+    printf("%8s %12s %12s %10s %14s\n", "IN xfers", "frames", "frames/s", "overruns", "overruns/kfr");
+    for (int count : transfer_counts) {
+        /* Applied when the device is opened by the first channel */
+        check_canlib_error("zcqSetUSBInTransferCount", zcqSetUSBInTransferCount(count));
+
+        canHandle rx = open_channel(rx_channel, 0, canBITRATE_1M);
+        canHandle tx = open_channel(tx_channel, 0, canBITRATE_1M);
+        if (rx < 0 || tx < 0) {
+            close_channel(rx);
+            close_channel(tx);
+            return 1;
+        }
+
+        TxLoad load;
+        load.start(tx);
+
+        unsigned long frames = 0;
+        unsigned long overruns = 0;
+        auto t0 = bench_clock::now();
+        auto t_end = t0 + std::chrono::seconds(seconds);
+        while (bench_clock::now() < t_end) {
+            long id;
+            unsigned char msg[64];
+            unsigned int dlc, flags;
+            unsigned long time;
+            if (canReadWait(rx, &id, msg, &dlc, &flags, &time, 100) != canOK) continue;
+            if (flags & canMSGERR_HW_OVERRUN) overruns++;
+            if (!(flags & canMSG_ERROR_FRAME)) frames++;
+        }
+        double elapsed = std::chrono::duration<double>(bench_clock::now() - t0).count();
+
+        load.finish();
+        close_channel(tx);
+        close_channel(rx);
+
+        printf("%8d %12lu %12.0f %10lu %14.3f\n", count, frames, frames / elapsed, overruns,
+               frames ? 1000.0 * overruns / frames : 0.0);
+    }
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* Aggregate TX rate of one sender thread per channel vs. USB OUT buffer count */
+static int bench_txscale(int argc, char** argv)
+{
+    if (argc < 1) {
+        printf("usage: zcqbench txscale <channel,channel,...> [seconds]\n");
+        return 1;
+    }
+
+    std::vector<int> channels = parse_channel_list(argv[0]);
+    int seconds = argc > 1 ? atoi(argv[1]) : 5;
+    const int transfer_counts[] = { 2, 4, 8, 16 };
+
+    printf("%9s %9s %12s %12s\n", "OUT bufs", "channels", "frames", "frames/s");
+    for (int count : transfer_counts) {
+        check_canlib_error("zcqSetUSBOutTransferCount", zcqSetUSBOutTransferCount(count));
+
+        for (size_t n = 1; n <= channels.size(); ++n) {
+            std::vector<canHandle> handles;
+            for (size_t i = 0; i < n; ++i) {
+                canHandle hnd = open_channel(channels[i], 0, canBITRATE_1M);
+                if (hnd < 0) break;
+                handles.push_back(hnd);
+            }
+            if (handles.size() != n) {
+                for (canHandle hnd : handles) close_channel(hnd);
+                return 1;
+            }
+
+            std::vector<TxLoad> loads(n);
+            auto t0 = bench_clock::now();
+            for (size_t i = 0; i < n; ++i) loads[i].start(handles[i]);
+            std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+            unsigned long frames = 0;
+            for (TxLoad& load : loads) {
+                load.finish();
+                frames += load.sent;
+            }
+            double elapsed = std::chrono::duration<double>(bench_clock::now() - t0).count();
+
+            for (canHandle hnd : handles) close_channel(hnd);
+
+            printf("%9d %9zu %12lu %12.0f\n", count, n, frames, frames / elapsed);
+        }
+    }
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* Host side canWrite to TX ack latency, default vs. low latency TX mode */
+static int bench_txlatency(int argc, char** argv)
+{
+    if (argc < 1) {
+        printf("usage: zcqbench txlatency <channel> [load channel] [frames]\n");
+        return 1;
+    }
+
+    int channel = atoi(argv[0]);
+    int load_channel = argc > 1 ? atoi(argv[1]) : -1;
+    int frame_count = argc > 2 ? atoi(argv[2]) : 1000;
+    const struct {
+        const char* label;
+        int flags;
+    } modes[] = {
+        { "default", 0 },
+        { "low-latency", canOPEN_ZCQ_TX_LOW_LATENCY },
+    };
+
+    printf("%-14s %8s %9s %9s %9s %9s %9s  (us)\n", "mode", "frames", "min", "avg", "p50", "p99", "max");
+    for (const auto& mode : modes) {
+        canHandle hnd = open_channel(channel, mode.flags, canBITRATE_1M);
+        if (hnd < 0) return 1;
+        enable_tx_ack(hnd);
+
+        /* Background traffic on the same device keeps OUT transfers in flight */
+        canHandle load_hnd = canINVALID_HANDLE;
+        TxLoad load;
+        if (load_channel >= 0) {
+            load_hnd = open_channel(load_channel, 0, canBITRATE_1M);
+            if (load_hnd >= 0) load.start(load_hnd);
+        }
+
+        std::vector<double> samples;
+        unsigned char msg[8] = {0};
+        for (int i = 0; i < frame_count; ++i) {
+            memcpy(msg, &i, sizeof(i));
+            auto t0 = bench_clock::now();
+            if (canWrite(hnd, 0x10, msg, 8, canMSG_STD) != canOK) continue;
+
+            /* Wait for the TX ack of this frame */
+            long id;
+            unsigned char rx_msg[64];
+            unsigned int dlc, flags;
+            unsigned long time;
+            while (canReadWait(hnd, &id, rx_msg, &dlc, &flags, &time, 1000) == canOK) {
+                if ((flags & canMSG_TXACK) && id == 0x10) {
+                    samples.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - t0).count());
+                    break;
+                }
+            }
+        }
+
+        load.finish();
+        close_channel(load_hnd);
+        close_channel(hnd);
+
+        print_latency(mode.label, samples);
+    }
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* TX ack latency and channel close time per USB event handling mode */
+static int bench_events(int argc, char** argv)
+{
+    if (argc < 1) {
+        printf("usage: zcqbench events <channel> [frames]\n");
+        return 1;
+    }
+
+    int channel = atoi(argv[0]);
+    int frame_count = argc > 1 ? atoi(argv[1]) : 1000;
+    const struct {
+        const char* label;
+        int mode;
+    } modes[] = {
+        { "thread-poll", zcqUSB_EVENTS_THREAD_POLL },
+        { "thread-epoll", zcqUSB_EVENTS_THREAD_EPOLL },
+        { "application", zcqUSB_EVENTS_APPLICATION },
+    };
+
+    printf("%-14s %8s %9s %9s %9s %9s %9s  (us)\n", "mode", "frames", "min", "avg", "p50", "p99", "max");
+    for (const auto& mode : modes) {
+        /* Applied when USB event handling starts, at library init with hotplug */
+        canUnloadLibrary();
+        if (zcqSetUSBEventMode(mode.mode) != canOK) {
+            printf("%-14s not supported\n", mode.label);
+            canInitializeLibrary();
+            continue;
+        }
+        canInitializeLibrary();
+
+        canHandle hnd = open_channel(channel, 0, canBITRATE_1M);
+        if (hnd < 0) return 1;
+        enable_tx_ack(hnd);
+
+        /* In application mode canReadWait() handles USB events itself */
+        std::vector<double> samples;
+        unsigned char msg[8] = {0};
+        for (int i = 0; i < frame_count; ++i) {
+            memcpy(msg, &i, sizeof(i));
+            auto t0 = bench_clock::now();
+            if (canWrite(hnd, 0x10, msg, 8, canMSG_STD) != canOK) continue;
+
+            long id;
+            unsigned char rx_msg[64];
+            unsigned int dlc, flags;
+            unsigned long time;
+            while (canReadWait(hnd, &id, rx_msg, &dlc, &flags, &time, 1000) == canOK) {
+                if ((flags & canMSG_TXACK) && id == 0x10) {
+                    samples.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - t0).count());
+                    break;
+                }
+            }
+        }
+
+        auto t_close = bench_clock::now();
+        close_channel(hnd);
+        double close_ms = std::chrono::duration<double, std::milli>(bench_clock::now() - t_close).count();
+
+        print_latency(mode.label, samples);
+        printf("%-14s close %.1f ms\n", "", close_ms);
+    }
+
+    canUnloadLibrary();
+    zcqSetUSBEventMode(zcqUSB_EVENTS_THREAD_POLL);
+    canInitializeLibrary();
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* Aggregate TX and RX rate on channels of several devices vs. USB event groups */
+static int bench_devscale(int argc, char** argv)
+{
+    if (argc < 1) {
+        printf("usage: zcqbench devscale <channel,channel,...> [seconds]\n");
+        printf("  use channels of several devices, all on the same bus\n");
+        return 1;
+    }
+
+    std::vector<int> channels = parse_channel_list(argv[0]);
+    int seconds = argc > 1 ? atoi(argv[1]) : 5;
+    const int group_counts[] = { 0, 1, 2, 4, 8 };
+
+    printf("%7s %9s %12s %12s\n", "groups", "channels", "TX frames/s", "RX frames/s");
+    for (int groups : group_counts) {
+        /* Applied when the devices are opened */
+        check_canlib_error("zcqSetUSBEventGroups", zcqSetUSBEventGroups(groups, nullptr, 0));
+
+        std::vector<canHandle> handles;
+        for (int channel : channels) {
+            canHandle hnd = open_channel(channel, 0, canBITRATE_1M);
+            if (hnd < 0) break;
+            handles.push_back(hnd);
+        }
+        if (handles.size() != channels.size()) {
+            for (canHandle hnd : handles) close_channel(hnd);
+            zcqSetUSBEventGroups(0, nullptr, 0);
+            return 1;
+        }
+
+        size_t n = handles.size();
+        std::vector<TxLoad> loads(n);
+        std::vector<std::thread> readers;
+        std::atomic<bool> stop(false);
+        std::atomic<unsigned long> received(0);
+
+        auto t0 = bench_clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            loads[i].start(handles[i]);
+            canHandle hnd = handles[i];
+            readers.emplace_back([hnd, &stop, &received]() {
+                long id;
+                unsigned char msg[64];
+                unsigned int dlc, flags;
+                unsigned long time;
+                while (!stop) {
+                    if (canReadWait(hnd, &id, msg, &dlc, &flags, &time, 100) != canOK) continue;
+                    if (!(flags & (canMSG_ERROR_FRAME | canMSG_TXACK))) received++;
+                }
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+        unsigned long sent = 0;
+        for (TxLoad& load : loads) {
+            load.finish();
+            sent += load.sent;
+        }
+        stop = true;
+        for (std::thread& reader : readers) reader.join();
+        double elapsed = std::chrono::duration<double>(bench_clock::now() - t0).count();
+
+        for (canHandle hnd : handles) close_channel(hnd);
+
+        printf("%7d %9zu %12.0f %12.0f\n", groups, n, sent / elapsed, received / elapsed);
+    }
+
+    zcqSetUSBEventGroups(0, nullptr, 0);
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* Channel setup time and command round trips, one thread vs. a thread per channel */
+static int bench_cmdpipe(int argc, char** argv)
+{
+    if (argc < 1) {
+        printf("usage: zcqbench cmdpipe <channel,channel,...> [round trips]\n");
+        printf("  use channels of the same device\n");
+        return 1;
+    }
+
+    std::vector<int> channels = parse_channel_list(argv[0]);
+    int round_trips = argc > 1 ? atoi(argv[1]) : 1000;
+    size_t n = channels.size();
+
+    /* Each round trip is a bus on of a channel already on the bus, one
+     * command and its reply */
+    auto bus_on = [round_trips](canHandle hnd) {
+        for (int i = 0; i < round_trips; ++i) canBusOn(hnd);
+    };
+
+    printf("%-10s %12s %12s\n", "threads", "setup ms", "cmds/s");
+    for (bool parallel : { false, true }) {
+        std::vector<canHandle> handles(n, canINVALID_HANDLE);
+
+        auto t0 = bench_clock::now();
+        if (parallel) {
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < n; ++i) {
+                threads.emplace_back([&handles, &channels, i]() {
+                    handles[i] = open_channel(channels[i], 0, canBITRATE_1M);
+                });
+            }
+            for (std::thread& thread : threads) thread.join();
+        } else {
+            for (size_t i = 0; i < n; ++i) handles[i] = open_channel(channels[i], 0, canBITRATE_1M);
+        }
+        double setup_ms = std::chrono::duration<double, std::milli>(bench_clock::now() - t0).count();
+
+        if (std::find(handles.begin(), handles.end(), canINVALID_HANDLE) != handles.end()) {
+            for (canHandle hnd : handles) close_channel(hnd);
+            return 1;
+        }
+
+        auto t1 = bench_clock::now();
+        if (parallel) {
+            std::vector<std::thread> threads;
+            for (canHandle hnd : handles) threads.emplace_back(bus_on, hnd);
+            for (std::thread& thread : threads) thread.join();
+        } else {
+            for (canHandle hnd : handles) bus_on(hnd);
+        }
+        double elapsed = std::chrono::duration<double>(bench_clock::now() - t1).count();
+
+        for (canHandle hnd : handles) close_channel(hnd);
+
+        printf("%-10s %12.1f %12.0f\n", parallel ? "per-chan" : "single", setup_ms,
+               double(n) * round_trips / elapsed);
+    }
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* Library startup time, device enumeration and info retrieval, cold and
+ * warm device info cache */
+static int bench_startup(int argc, char** argv)
+{
+    int rounds = argc > 0 ? atoi(argv[0]) : 10;
+    const char* cache_path = argc > 1 ? argv[1] : "zcqbench-devices.cache";
+    const struct {
+        const char* label;
+        bool use_cache;
+        bool keep_cache;
+    } modes[] = {
+        { "no-cache", false, false },
+        { "cold", true, false },
+        { "warm", true, true },
+    };
+
+    printf("%-14s %8s %9s %9s %9s %9s %9s  (us)\n", "", "rounds", "min", "avg", "p50", "p99", "max");
+    for (const auto& mode : modes) {
+        std::vector<double> startup_samples;
+        std::vector<double> open_samples;
+        int channel_count = 0;
+
+        for (int i = 0; i < rounds; ++i) {
+            canUnloadLibrary();
+            if (!mode.keep_cache) remove(cache_path);
+            zcqSetDeviceInfoCache(mode.use_cache ? cache_path : nullptr);
+
+            /* Devices are enumerated on the first channel access */
+            auto t0 = bench_clock::now();
+            canInitializeLibrary();
+            canGetNumberOfChannels(&channel_count);
+            startup_samples.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - t0).count());
+
+            /* A cached device is reset and checked on its first open */
+            if (channel_count > 0) {
+                auto t1 = bench_clock::now();
+                canHandle hnd = canOpenChannel(0, canOPEN_REQUIRE_EXTENDED);
+                if (hnd >= 0) {
+                    open_samples.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - t1).count());
+                    canClose(hnd);
+                }
+            }
+        }
+
+        printf("%s, %d CAN channels\n", mode.label, channel_count);
+        print_latency("  startup", startup_samples);
+        print_latency("  first open", open_samples);
+    }
+
+    canUnloadLibrary();
+    remove(cache_path);
+    zcqSetDeviceInfoCache(nullptr);
+    canInitializeLibrary();
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* RX rate under load and idle TX ack latency vs. USB IN transfer size */
+static int bench_bufsweep(int argc, char** argv)
+{
+    bool simulated = argc > 0 && strcmp(argv[0], "sim") == 0;
+    if (argc < 2 && !simulated) {
+        printf("usage: zcqbench bufsweep <rx channel> <tx channel> [seconds]\n");
+        printf("       zcqbench bufsweep sim [seconds] [rx frames/s]\n");
+        return 1;
+    }
+
+    int rx_channel = 0;
+    int tx_channel = 0;
+    int seconds = 5;
+    if (simulated) {
+        /* One simulated device with fixed USB timing, device buffer and RX
+         * load, so runs compare without hardware. Its two channels share a
+         * bus and follow any USB channels */
+        seconds = argc > 1 ? atoi(argv[1]) : 5;
+        int rx_rate = argc > 2 ? atoi(argv[2]) : 4000;
+        char config[128];
+        snprintf(config, sizeof(config), "devices=1,channels=2,usb_us=125,buffer=16384,rx_rate=%d", rx_rate);
+
+        canUnloadLibrary();
+        canStatus stat = zcqSetSimulation(config);
+        canInitializeLibrary();
+        if (stat != canOK) {
+            check_canlib_error("zcqSetSimulation", stat);
+            return 1;
+        }
+
+        int channel_count = 0;
+        canGetNumberOfChannels(&channel_count);
+        rx_channel = channel_count - 2;
+        tx_channel = channel_count - 1;
+        printf("simulated, %s\n", config);
+    } else {
+        rx_channel = atoi(argv[0]);
+        tx_channel = atoi(argv[1]);
+        if (argc > 2) seconds = atoi(argv[2]);
+    }
+    const unsigned int transfer_sizes[] = { 512, 1024, 2048, 4096, 8192, 16384, 65536 };
+    const int ack_frames = 200;
+
+    printf("%8s %12s %10s %10s %10s  (us)\n", "IN size", "frames/s", "overruns", "ack p50", "ack p99");
+    for (unsigned int size : transfer_sizes) {
+        /* Applied when the device is opened by the first channel */
+        canStatus stat = zcqSetUSBTransferSize(-1, size, 0);
+        if (stat != canOK) {
+            check_canlib_error("zcqSetUSBTransferSize", stat);
+            continue;
+        }
+
+        canHandle rx = open_channel(rx_channel, 0, canBITRATE_1M);
+        canHandle tx = open_channel(tx_channel, 0, canBITRATE_1M);
+        if (rx < 0 || tx < 0) {
+            close_channel(rx);
+            close_channel(tx);
+            zcqSetUSBTransferSize(-1, 4096, 0);
+            return 1;
+        }
+        enable_tx_ack(tx);
+
+        long id;
+        unsigned char msg[64];
+        unsigned int dlc, flags;
+        unsigned long time;
+
+        /* TX ack latency while the bus is otherwise idle */
+        std::vector<double> samples;
+        for (int i = 0; i < ack_frames; ++i) {
+            memcpy(msg, &i, sizeof(i));
+            auto t0 = bench_clock::now();
+            if (canWrite(tx, 0x10, msg, 8, canMSG_STD) != canOK) continue;
+            while (canReadWait(tx, &id, msg, &dlc, &flags, &time, 1000) == canOK) {
+                if ((flags & canMSG_TXACK) && id == 0x10) {
+                    samples.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - t0).count());
+                    break;
+                }
+            }
+        }
+        std::sort(samples.begin(), samples.end());
+
+        TxLoad load;
+        load.start(tx);
+
+        unsigned long frames = 0;
+        unsigned long overruns = 0;
+        auto t0 = bench_clock::now();
+        auto t_end = t0 + std::chrono::seconds(seconds);
+        while (bench_clock::now() < t_end) {
+            if (canReadWait(rx, &id, msg, &dlc, &flags, &time, 100) != canOK) continue;
+            if (flags & canMSGERR_HW_OVERRUN) overruns++;
+            if (!(flags & canMSG_ERROR_FRAME)) frames++;
+        }
+        double elapsed = std::chrono::duration<double>(bench_clock::now() - t0).count();
+
+        load.finish();
+        close_channel(tx);
+        close_channel(rx);
+
+        size_t n = samples.size();
+        printf("%8u %12.0f %10lu %10.1f %10.1f\n", size, frames / elapsed, overruns,
+               n ? samples[n / 2] : 0.0, n ? samples[std::min(n - 1, n * 99 / 100)] : 0.0);
+    }
+
+    zcqSetUSBTransferSize(-1, 4096, 0);
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* CAN FD TX rate vs. payload length, extended commands are used when the
+ * firmware supports them */
+static int bench_fdtx(int argc, char** argv)
+{
+    if (argc < 1) {
+        printf("usage: zcqbench fdtx <channel> [seconds]\n");
+        return 1;
+    }
+
+    int channel = atoi(argv[0]);
+    int seconds = argc > 1 ? atoi(argv[1]) : 5;
+    const unsigned int lengths[] = { 8, 20, 32, 48, 64 };
+
+    canHandle hnd = canOpenChannel(channel, canOPEN_CAN_FD | canOPEN_REQUIRE_EXTENDED);
+    if (hnd < 0) {
+        printf("ERROR: failed to open channel %d\n", channel);
+        check_canlib_error("canOpenChannel", canStatus(hnd));
+        return 1;
+    }
+
+    canStatus stat = canSetBusParams(hnd, canBITRATE_1M, 0, 0, 0, 0, 0);
+    if (stat == canOK) stat = canSetBusParamsFd(hnd, canFD_BITRATE_4M_80P, 0, 0, 0);
+    if (stat == canOK) stat = canBusOn(hnd);
+    if (stat != canOK) {
+        check_canlib_error("canBusOn", stat);
+        canClose(hnd);
+        return 1;
+    }
+
+    printf("%6s %12s %12s %12s\n", "bytes", "frames", "frames/s", "kB/s");
+    for (unsigned int dlc : lengths) {
+        unsigned char msg[64];
+        memset(msg, 0x55, sizeof(msg));
+
+        unsigned long frames = 0;
+        auto t0 = bench_clock::now();
+        auto t_end = t0 + std::chrono::seconds(seconds);
+        while (bench_clock::now() < t_end) {
+            memcpy(msg, &frames, sizeof(frames));
+            stat = canWrite(hnd, 0x100, msg, dlc, canMSG_EXT | canFDMSG_FDF | canFDMSG_BRS);
+            if (stat == canOK) frames++;
+            else std::this_thread::yield();
+        }
+        double elapsed = std::chrono::duration<double>(bench_clock::now() - t0).count();
+        canWriteSync(hnd, 1000);
+
+        printf("%6u %12lu %12.0f %12.1f\n", dlc, frames, frames / elapsed,
+               frames * dlc / elapsed / 1000.0);
+    }
+
+    close_channel(hnd);
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+static int bench_replay(int argc, char** argv)
+{
+    if (argc < 2) {
+        printf("usage: zcqbench replay <capture file> <first channel> [fast]\n");
+        printf("  capture with e.g. ZCQ_USB_CAPTURE=<capture file> zcqbench inpool 0 1\n");
+        return 1;
+    }
+
+    /* The captured devices follow the USB and simulated devices */
+    const char* path = argv[0];
+    int first_channel = atoi(argv[1]);
+    bool fast = argc > 2 && strcmp(argv[2], "fast") == 0;
+
+    canStatus stat = zcqSetUSBReplay(path, fast ? zcqREPLAY_FULL_SPEED : 0);
+    if (stat != canOK) {
+        check_canlib_error("zcqSetUSBReplay", stat);
+        return 1;
+    }
+
+    int channel_count = 0;
+    canGetNumberOfChannels(&channel_count);
+
+    std::vector<canHandle> handles;
+    for (int channel = first_channel; channel < channel_count; channel++) {
+        canHandle hnd = canOpenChannel(channel, canOPEN_CAN_FD);
+        if (hnd < 0) continue;
+        stat = canSetBusParams(hnd, canBITRATE_1M, 0, 0, 0, 0, 0);
+        if (stat == canOK) stat = canSetBusParamsFd(hnd, canFD_BITRATE_4M_80P, 0, 0, 0);
+        if (stat != canOK) {
+            check_canlib_error("canSetBusParams", stat);
+            canClose(hnd);
+            continue;
+        }
+        handles.push_back(hnd);
+    }
+    if (handles.empty()) {
+        printf("ERROR: no replay channels from channel %d\n", first_channel);
+        return 1;
+    }
+
+    /* Replay starts with the first bus on, the channels should be ready */
+    for (canHandle hnd : handles) {
+        stat = canBusOn(hnd);
+        check_canlib_error("canBusOn", stat);
+    }
+
+    /* Read until the channels have been idle for a second */
+    unsigned long frames = 0;
+    unsigned long overruns = 0;
+    auto t0 = bench_clock::now();
+    auto t_last = t0;
+    while (bench_clock::now() - t_last < std::chrono::seconds(1)) {
+        bool idle = true;
+        for (canHandle hnd : handles) {
+            long id;
+            unsigned char msg[64];
+            unsigned int dlc, flags;
+            unsigned long time;
+            while (canRead(hnd, &id, msg, &dlc, &flags, &time) == canOK) {
+                idle = false;
+                frames++;
+                if (flags & (canMSGERR_HW_OVERRUN | canMSGERR_SW_OVERRUN)) overruns++;
+            }
+        }
+        if (!idle) t_last = bench_clock::now();
+        else std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double elapsed = std::chrono::duration<double>(t_last - t0).count();
+
+    printf("%8s %12s %12s %10s\n", "channels", "frames", "frames/s", "overruns");
+    printf("%8u %12lu %12.0f %10lu\n", unsigned(handles.size()), frames,
+           elapsed > 0 ? frames / elapsed : 0.0, overruns);
+
+    for (canHandle hnd : handles) close_channel(hnd);
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* Time spent in the write calls per frame, canWrite vs. canWriteBatch. Bursts
+ * stay below the TX credits of a channel and are sent at once, the bus
+ * drains them between bursts */
+static int bench_txbatch(int argc, char** argv)
+{
+    if (argc < 1) {
+        printf("usage: zcqbench txbatch <channel> [bursts]\n");
+        return 1;
+    }
+
+    int channel = atoi(argv[0]);
+    int bursts = argc > 1 ? atoi(argv[1]) : 1000;
+    const unsigned int burst_sizes[] = { 1, 4, 8, 16, 24 };
+
+    zcqTxMessage messages[24];
+    memset(messages, 0, sizeof(messages));
+    for (zcqTxMessage& message : messages) {
+        message.id = 0x100;
+        message.dlc = 8;
+        message.flags = canMSG_STD;
+    }
+
+    canHandle hnd = open_channel(channel, 0, canBITRATE_1M);
+    if (hnd < 0) return 1;
+
+    printf("%6s %14s %14s %8s\n", "burst", "canWrite us", "batch us", "speedup");
+    for (unsigned int burst : burst_sizes) {
+        double call_time[2] = { 0, 0 };
+        unsigned long frames[2] = { 0, 0 };
+        for (int mode = 0; mode < 2; ++mode) {
+            for (int b = 0; b < bursts; ++b) {
+                auto t0 = bench_clock::now();
+                if (mode == 0) {
+                    for (unsigned int i = 0; i < burst; ++i) {
+                        zcqTxMessage& message = messages[i];
+                        if (canWrite(hnd, message.id, message.msg, message.dlc, message.flags) == canOK) frames[mode]++;
+                    }
+                } else {
+                    unsigned int sent = 0;
+                    canWriteBatch(hnd, messages, burst, 0, &sent);
+                    frames[mode] += sent;
+                }
+                call_time[mode] += std::chrono::duration<double, std::micro>(bench_clock::now() - t0).count();
+
+                /* Frame time at 1 Mbit/s is about 110 us */
+                std::this_thread::sleep_for(std::chrono::microseconds(150 * burst + 500));
+            }
+        }
+
+        double single_us = frames[0] ? call_time[0] / frames[0] : 0.0;
+        double batch_us = frames[1] ? call_time[1] / frames[1] : 0.0;
+        printf("%6u %14.2f %14.2f %8.2f\n", burst, single_us, batch_us,
+               batch_us > 0 ? single_us / batch_us : 0.0);
+    }
+
+    close_channel(hnd);
+
+    return 0;
+}
+
+/* Period jitter of library scheduled object buffers, and the USB OUT
+ * transfers they need when periods coincide */
+static int bench_objbuf(int argc, char** argv)
+{
+    if (argc < 1) {
+        printf("usage: zcqbench objbuf <channel> [buffers] [seconds]\n");
+        return 1;
+    }
+
+    int channel = atoi(argv[0]);
+    int buffer_count = argc > 1 ? atoi(argv[1]) : 16;
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    const unsigned int periods_in_us[] = { 1000, 2000, 5000, 10000 };
+
+    canHandle hnd = open_channel(channel, 0, canBITRATE_1M);
+    if (hnd < 0) return 1;
+
+    std::vector<int> buffers;
+    for (int i = 0; i < buffer_count; ++i) {
+        canStatus idx = canObjBufAllocate(hnd, canOBJBUF_TYPE_PERIODIC_TX);
+        if (idx < 0) {
+            check_canlib_error("canObjBufAllocate", idx);
+            break;
+        }
+
+        unsigned char msg[8] = { (unsigned char)i, 0, 0, 0, 0, 0, 0, 0 };
+        check_canlib_error("canObjBufWrite", canObjBufWrite(hnd, idx, 0x200 + i, msg, 8, canMSG_STD));
+        check_canlib_error("canObjBufSetPeriod", canObjBufSetPeriod(hnd, idx, periods_in_us[i % 4]));
+        buffers.push_back(idx);
+    }
+    check_canlib_error("zcqResetUSBStatistics", zcqResetUSBStatistics(channel));
+
+    for (int idx : buffers) check_canlib_error("canObjBufEnable", canObjBufEnable(hnd, idx));
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    for (int idx : buffers) check_canlib_error("canObjBufDisable", canObjBufDisable(hnd, idx));
+
+    printf("%4s %8s %8s %9s %9s %9s %9s %9s %9s %9s\n", "buf", "period", "sent", "overflow", "skipped",
+           "int min", "int mean", "int max", "late avg", "late max");
+    unsigned long long total_sent = 0;
+    for (int idx : buffers) {
+        zcqObjBufStatistics stats;
+        if (zcqGetObjBufStatistics(hnd, idx, &stats) != canOK) continue;
+
+        total_sent += stats.sent;
+        printf("%4d %8u %8llu %9llu %9llu %9llu %9.1f %9llu %9.1f %9llu\n", idx, stats.period,
+               (unsigned long long)stats.sent, (unsigned long long)stats.overflows,
+               (unsigned long long)stats.skipped, (unsigned long long)stats.intervalMin,
+               stats.intervalCount ? double(stats.intervalSum) / stats.intervalCount : 0.0,
+               (unsigned long long)stats.intervalMax,
+               stats.sent ? double(stats.latenessSum) / stats.sent : 0.0,
+               (unsigned long long)stats.latenessMax);
+    }
+
+    zcqUSBStatistics usb_stats;
+    if (zcqGetUSBStatistics(channel, &usb_stats) == canOK && usb_stats.outTransfers > 0) {
+        printf("%llu frames in %llu OUT transfers, %.2f frames per transfer\n", total_sent,
+               (unsigned long long)usb_stats.outTransfers,
+               double(total_sent) / double(usb_stats.outTransfers));
+    }
+
+    check_canlib_error("canObjBufFreeAll", canObjBufFreeAll(hnd));
+    close_channel(hnd);
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* TX ack latency of a control frame written behind bulk traffic on the same channel */
+static int bench_txprio(int argc, char** argv)
+{
+    if (argc < 1) {
+        printf("usage: zcqbench txprio <channel> [frames] [device frames]\n");
+        return 1;
+    }
+
+    int channel = atoi(argv[0]);
+    int frame_count = argc > 1 ? atoi(argv[1]) : 500;
+    unsigned int device_frames = argc > 2 ? (unsigned int)atoi(argv[2]) : 8;
+    const struct {
+        const char* label;
+        int mode;
+        unsigned int device_frames;
+        unsigned int load_flags;
+    } modes[] = {
+        { "fifo", zcqTX_QUEUE_OFF, 0, canMSG_STD },
+        { "by-id", zcqTX_QUEUE_BY_ID, 0, canMSG_STD },
+        { "by-id-limit", zcqTX_QUEUE_BY_ID, device_frames, canMSG_STD },
+        { "by-class-limit", zcqTX_QUEUE_BY_CLASS, device_frames, canMSG_STD | canMSG_ZCQ_TX_PRIORITY(3) },
+    };
+
+    printf("%-14s %8s %9s %9s %9s %9s %9s  (us)\n", "mode", "frames", "min", "avg", "p50", "p99", "max");
+    for (const auto& mode : modes) {
+        canHandle hnd = open_channel(channel, 0, canBITRATE_1M);
+        if (hnd < 0) return 1;
+        enable_tx_ack(hnd);
+
+        canStatus stat = zcqSetTxQueue(hnd, mode.mode, 256, mode.device_frames);
+        if (stat != canOK) {
+            check_canlib_error("zcqSetTxQueue", stat);
+            close_channel(hnd);
+            continue;
+        }
+
+        TxLoad load;
+        load.start(hnd, mode.load_flags);
+
+        std::vector<double> samples;
+        unsigned char msg[8] = {0};
+        for (int i = 0; i < frame_count; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            memcpy(msg, &i, sizeof(i));
+            auto t0 = bench_clock::now();
+            if (canWriteWait(hnd, 0x10, msg, 8, canMSG_STD | canMSG_ZCQ_TX_PRIORITY(0), 1000) != canOK) continue;
+
+            /* Acks of the load frames are read on the way */
+            long id;
+            unsigned char rx_msg[64];
+            unsigned int dlc, flags;
+            unsigned long time;
+            while (canReadWait(hnd, &id, rx_msg, &dlc, &flags, &time, 1000) == canOK) {
+                if ((flags & canMSG_TXACK) && id == 0x10) {
+                    samples.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - t0).count());
+                    break;
+                }
+            }
+        }
+
+        load.finish();
+        close_channel(hnd);
+
+        print_latency(mode.label, samples);
+    }
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+/* TX rate of a writer pushing as fast as it can per rate limit */
+static int bench_txshape(int argc, char** argv)
+{
+    if (argc < 1) {
+        printf("usage: zcqbench txshape <channel> [seconds]\n");
+        return 1;
+    }
+
+    int channel = atoi(argv[0]);
+    int seconds = argc > 1 ? atoi(argv[1]) : 2;
+    const unsigned int limits[] = { 0, 75, 50, 25 };
+
+    printf("%6s %10s %10s %10s %9s\n", "limit", "frames", "frames/s", "timeouts", "relative");
+    double unshaped_rate = 0;
+    for (unsigned int limit : limits) {
+        canHandle hnd = open_channel(channel, 0, canBITRATE_1M);
+        if (hnd < 0) return 1;
+
+        canStatus stat = zcqSetTxRateLimit(hnd, limit, 0);
+        if (stat != canOK) {
+            check_canlib_error("zcqSetTxRateLimit", stat);
+            close_channel(hnd);
+            continue;
+        }
+
+        unsigned long frames = 0;
+        unsigned long timeouts = 0;
+        unsigned char msg[8] = {0};
+        auto t0 = bench_clock::now();
+        auto t_end = t0 + std::chrono::seconds(seconds);
+        while (bench_clock::now() < t_end) {
+            memcpy(msg, &frames, sizeof(frames) < 8 ? sizeof(frames) : 8);
+            if (canWriteWait(hnd, 0x100, msg, 8, canMSG_STD, 100) == canOK) frames++;
+            else timeouts++;
+        }
+        check_canlib_error("canWriteSync", canWriteSync(hnd, 5000));
+        double elapsed = std::chrono::duration<double>(bench_clock::now() - t0).count();
+        close_channel(hnd);
+
+        double rate = frames / elapsed;
+        if (limit == 0) unshaped_rate = rate;
+        printf("%5u%% %10lu %10.0f %10lu %8.1f%%\n", limit, frames, rate, timeouts,
+               unshaped_rate > 0 ? 100.0 * rate / unshaped_rate : 0.0);
+    }
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+static void print_usb_histogram(const char* name, const zcqUSBHistogram& histogram)
+{
+    printf("%-18s count %llu avg %.1f max %llu\n", name, (unsigned long long)histogram.count,
+           histogram.count ? double(histogram.sum) / histogram.count : 0.0,
+           (unsigned long long)histogram.max);
+    for (int i = 0; i < zcqUSB_HISTOGRAM_BUCKETS; ++i) {
+        if (histogram.buckets[i] == 0) continue;
+        unsigned long long low = i == 0 ? 0 : 1ull << (i - 1);
+        printf("  %10llu+ %12llu\n", low, (unsigned long long)histogram.buckets[i]);
+    }
+}
+
+/* USB transfer statistics under TX load with the RX channel drained */
+static int bench_usbstats(int argc, char** argv)
+{
+    if (argc < 2) {
+        printf("usage: zcqbench usbstats <rx channel> <tx channel> [seconds]\n");
+        return 1;
+    }
+
+    int rx_channel = atoi(argv[0]);
+    int tx_channel = atoi(argv[1]);
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+
+    canHandle rx = open_channel(rx_channel, 0, canBITRATE_1M);
+    canHandle tx = open_channel(tx_channel, 0, canBITRATE_1M);
+    if (rx < 0 || tx < 0) {
+        close_channel(rx);
+        close_channel(tx);
+        return 1;
+    }
+    check_canlib_error("zcqResetUSBStatistics", zcqResetUSBStatistics(tx_channel));
+
+    TxLoad load;
+    load.start(tx);
+
+    auto t_end = bench_clock::now() + std::chrono::seconds(seconds);
+    while (bench_clock::now() < t_end) {
+        long id;
+        unsigned char msg[64];
+        unsigned int dlc, flags;
+        unsigned long time;
+        canReadWait(rx, &id, msg, &dlc, &flags, &time, 100);
+    }
+
+    load.finish();
+
+    zcqUSBStatistics stats;
+    canStatus stat = zcqGetUSBStatistics(tx_channel, &stats);
+    close_channel(tx);
+    close_channel(rx);
+    if (stat != canOK) {
+        check_canlib_error("zcqGetUSBStatistics", stat);
+        return 1;
+    }
+
+    printf("IN  transfers %llu bytes %llu full %llu timeouts %llu errors %llu\n",
+           (unsigned long long)stats.inTransfers, (unsigned long long)stats.inBytes,
+           (unsigned long long)stats.inFullTransfers, (unsigned long long)stats.inTimeouts,
+           (unsigned long long)stats.inErrors);
+    printf("OUT transfers %llu bytes %llu timeouts %llu errors %llu\n",
+           (unsigned long long)stats.outTransfers, (unsigned long long)stats.outBytes,
+           (unsigned long long)stats.outTimeouts, (unsigned long long)stats.outErrors);
+    printf("submit errors %llu, sender waits %llu, sender timeouts %llu\n",
+           (unsigned long long)stats.submitErrors, (unsigned long long)stats.senderWaits,
+           (unsigned long long)stats.senderTimeouts);
+    print_usb_histogram("IN bytes", stats.inSize);
+    print_usb_histogram("IN callback us", stats.inCallbackTime);
+    print_usb_histogram("OUT latency us", stats.outLatency);
+    print_usb_histogram("sender wait us", stats.senderWaitTime);
+
+    return 0;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+struct Benchmark {
+    const char* name;
+    const char* description;
+    int (*run)(int argc, char** argv);
+};
+
+static const Benchmark benchmark_list[] = {
+    { "inpool", "RX rate and HW overruns vs. queued USB IN transfers", bench_inpool },
+    { "txscale", "Multi channel TX rate vs. USB OUT buffers", bench_txscale },
+    { "txlatency", "canWrite to TX ack latency, default vs. low latency mode", bench_txlatency },
+    { "events", "TX ack latency and close time per USB event mode", bench_events },
+    { "devscale", "Multi device TX/RX rate vs. USB event groups", bench_devscale },
+    { "cmdpipe", "Channel setup and command round trips, serial vs. concurrent", bench_cmdpipe },
+    { "startup", "Startup and first open time, cold and warm device info cache", bench_startup },
+    { "bufsweep", "RX rate and TX ack latency vs. USB IN transfer size", bench_bufsweep },
+    { "fdtx", "CAN FD TX rate vs. payload length", bench_fdtx },
+    { "replay", "RX handling rate replaying a USB IN capture", bench_replay },
+    { "usbstats", "USB transfer statistics under TX load", bench_usbstats },
+    { "txbatch", "Write call time per frame, canWrite vs. canWriteBatch", bench_txbatch },
+    { "objbuf", "Period jitter and USB batching of periodic object buffers", bench_objbuf },
+    { "txprio", "Control frame TX ack latency under bulk load per host TX queue mode", bench_txprio },
+    { "txshape", "TX rate of an unthrottled writer per TX rate limit", bench_txshape },
+};
+
+static void usage()
+{
+    printf("usage: zcqbench <benchmark> [options]\n\n");
+    for (const Benchmark& b : benchmark_list) {
+        printf("  %-12s %s\n", b.name, b.description);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    canInitializeLibrary();
+
+    int res = -1;
+    for (const Benchmark& b : benchmark_list) {
+        if (strcmp(argv[1], b.name) == 0) {
+            res = b.run(argc - 2, argv + 2);
+            break;
+        }
+    }
+
+    if (res == -1) usage();
+
+    canStatus stat = canUnloadLibrary();
+    check_canlib_error("canUnloadLibrary", stat);
+
+    return res == 0 ? 0 : 1;
+}
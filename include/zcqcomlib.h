@@ -0,0 +1,809 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * \file zcqcomlib.h
+ * \brief  zcqcomlib extensions to the CANlib API.
+ * \details
+ * Functions and flags in this file are specific to zcqcomlib and are not
+ * available in the Kvaser CANlib. Flags and ioctl codes are allocated from
+ * ranges not used by canlib.h.
+ * \defgroup grp_zcqcomlib          zcqcomlib extensions
+ * \brief zcqcomlib specific additions to CANlib
+ */
+
+#ifndef _ZCQCOMLIB_H_
+#define _ZCQCOMLIB_H_
+
+#include "canlib.h"
+
+/**
+ * \name canOPEN_ZCQ_xxx
+ * \anchor canOPEN_ZCQ_xxx
+ *
+ * Additional flags for \ref canOpenChannel().
+ * @{
+ */
+
+/**
+ * Deliver received frames and TX acknowledgements to a queue shared by all
+ * channels on the same device that are opened with this flag. Frames are
+ * read with \ref zcqReadDeviceWait() in device arrival order, the per
+ * channel \ref canRead() functions will not see them.
+ */
+#define canOPEN_ZCQ_DEVICE_RX_QUEUE         0x10000
+
+/**
+ * Like \ref canOPEN_ZCQ_DEVICE_RX_QUEUE, but LIN frames received on the
+ * same device are also delivered to the device queue.
+ */
+#define canOPEN_ZCQ_DEVICE_RX_QUEUE_LIN     0x20000
+
+/**
+ * Low latency transmit. Each TX request is submitted to USB at once and is
+ * not collected in an OUT buffer while other transfers are in flight. This
+ * gives the shortest time from \ref canWrite() to the bus, at the cost of
+ * more USB transfers under load.
+ */
+#define canOPEN_ZCQ_TX_LOW_LATENCY          0x40000
+
+/** @} */
+
+/**
+ * \name canMSG_ZCQ_xxx
+ * \anchor canMSG_ZCQ_xxx
+ *
+ * Additional message flags returned by \ref canRead() et al.
+ * @{
+ */
+
+/**
+ * Gap frame, queued once when a lost device has been recovered, see
+ * \ref zcqSetAutoRecovery(). Set together with \ref canMSG_ERROR_FRAME and
+ * \ref canMSGERR_HW_OVERRUN. The id is 0, dlc is 8 and the data holds the
+ * length of the outage in microseconds as a little endian 64 bit value.
+ * The time stamp is the host time the device came back.
+ */
+#define canMSG_ZCQ_DEVICE_GAP               0x40000000
+
+/** @} */
+
+/**
+ * \name canMSG_ZCQ_TX_PRIORITY_xxx
+ * \anchor canMSG_ZCQ_TX_PRIORITY_xxx
+ *
+ * Priority class of a frame passed to \ref canWrite() et al, used by the
+ * host transmit queue in \ref zcqTX_QUEUE_BY_CLASS mode, see
+ * \ref zcqSetTxQueue(). Class 0 is the highest and the default.
+ * @{
+ */
+#define canMSG_ZCQ_TX_PRIORITY_MASK         0x30000000
+#define canMSG_ZCQ_TX_PRIORITY(n)           ((((unsigned int)(n)) & 3) << 28)
+/** @} */
+
+/**
+ * \name zcqTX_QUEUE_xxx
+ * \anchor zcqTX_QUEUE_xxx
+ *
+ * Host transmit queue modes, see \ref zcqSetTxQueue()
+ * @{
+ */
+#define zcqTX_QUEUE_OFF         0   ///< Writes wait for, or fail on, a full device transmit buffer
+#define zcqTX_QUEUE_BY_ID       1   ///< Lowest CAN id first, as bus arbitration would
+#define zcqTX_QUEUE_BY_CLASS    2   ///< Lowest \ref canMSG_ZCQ_TX_PRIORITY_xxx class first, in write order within a class
+/** @} */
+
+/**
+ * \name zcqBUS_xxx
+ * \anchor zcqBUS_xxx
+ *
+ * Bus type of a \ref zcqDeviceMessage
+ * @{
+ */
+#define zcqBUS_CAN      0   ///< CAN or CAN FD frame
+#define zcqBUS_LIN      1   ///< LIN frame, id holds the protected id
+/** @} */
+
+/**
+ * \name zcqUSB_EVENTS_xxx
+ * \anchor zcqUSB_EVENTS_xxx
+ *
+ * USB event handling modes for \ref zcqSetUSBEventMode()
+ * @{
+ */
+#define zcqUSB_EVENTS_THREAD_POLL   0   ///< Library thread, libusb poll loop (default)
+#define zcqUSB_EVENTS_THREAD_EPOLL  1   ///< Library thread, epoll on the USB fds (Linux only)
+#define zcqUSB_EVENTS_APPLICATION   2   ///< No library thread, see \ref zcqHandleEvents()
+/** @} */
+
+/**
+ * \name zcqTHREAD_POLICY_xxx
+ * \anchor zcqTHREAD_POLICY_xxx
+ *
+ * Scheduling policies for \ref zcqSetThreadScheduling()
+ * @{
+ */
+#define zcqTHREAD_POLICY_OTHER  0   ///< Default time sharing scheduling (default)
+#define zcqTHREAD_POLICY_FIFO   1   ///< SCHED_FIFO, time critical priority on Windows
+#define zcqTHREAD_POLICY_RR     2   ///< SCHED_RR, time critical priority on Windows
+/** @} */
+
+/**
+ * \name zcqTHREAD_STATUS_xxx
+ * \anchor zcqTHREAD_STATUS_xxx
+ *
+ * Bits returned by \ref zcqGetThreadSchedulingStatus()
+ * @{
+ */
+#define zcqTHREAD_STATUS_POLICY_APPLIED     0x1 ///< Policy and priority were set
+#define zcqTHREAD_STATUS_AFFINITY_APPLIED   0x2 ///< CPU affinity was set
+#define zcqTHREAD_STATUS_POLICY_FAILED      0x4 ///< Policy or priority was refused
+#define zcqTHREAD_STATUS_AFFINITY_FAILED    0x8 ///< CPU affinity was refused
+/** @} */
+
+/**
+ * \name zcqREPLAY_xxx
+ * \anchor zcqREPLAY_xxx
+ *
+ * Flags for \ref zcqSetUSBReplay()
+ * @{
+ */
+#define zcqREPLAY_FULL_SPEED    0x1 ///< Deliver the transfers back to back, not at the recorded pace
+/** @} */
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * A file descriptor the library waits on for USB events, see
+ * \ref zcqGetUSBPollFds().
+ */
+typedef struct {
+    int   fd;       ///< File descriptor
+    short events;   ///< poll() events to wait for, POLLIN and/or POLLOUT
+} zcqPollFd;
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Frame read from a device level RX queue.
+ */
+typedef struct {
+    int           busType;      ///< One of \ref zcqBUS_xxx
+    int           channel;      ///< Device local CAN or LIN channel index
+    long          id;           ///< Identifier
+    unsigned char msg[64];      ///< Frame data
+    unsigned int  dlc;          ///< Data length
+    unsigned int  flags;        ///< \ref canMSG_xxx or LIN flags
+    unsigned long time;         ///< Time stamp
+} zcqDeviceMessage;
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Frame sent with \ref canWriteBatch().
+ */
+typedef struct {
+    long          id;           ///< Identifier
+    unsigned char msg[64];      ///< Frame data
+    unsigned int  dlc;          ///< Data length
+    unsigned int  flags;        ///< \ref canMSG_xxx and \ref canFDMSG_xxx flags, as for \ref canWrite()
+} zcqTxMessage;
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Number of buckets in a \ref zcqUSBHistogram
+ */
+#define zcqUSB_HISTOGRAM_BUCKETS    24
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Distribution of a value in power of two buckets. buckets[0] counts the
+ * value 0, buckets[i] the values from 2^(i-1) to 2^i - 1 and the last
+ * bucket all larger values.
+ */
+typedef struct {
+    uint64_t count;                              ///< Number of values
+    uint64_t sum;                                ///< Sum of the values
+    uint64_t max;                                ///< Largest value
+    uint64_t buckets[zcqUSB_HISTOGRAM_BUCKETS];  ///< Values per bucket
+} zcqUSBHistogram;
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * USB transfer statistics of a device, see \ref zcqGetUSBStatistics().
+ * Times are in microseconds.
+ */
+typedef struct {
+    uint64_t inTransfers;           ///< Completed IN transfers
+    uint64_t inBytes;               ///< Bytes received
+    uint64_t inFullTransfers;       ///< IN transfers filled to the transfer size
+    uint64_t inTimeouts;            ///< IN transfers that timed out
+    uint64_t inErrors;              ///< IN transfers that failed
+    zcqUSBHistogram inSize;         ///< Bytes per completed IN transfer
+    zcqUSBHistogram inCallbackTime; ///< Time spent handling the data of an IN transfer
+    uint64_t outTransfers;          ///< Completed OUT transfers
+    uint64_t outBytes;              ///< Bytes sent
+    uint64_t outTimeouts;           ///< OUT transfers that timed out, their commands are lost
+    uint64_t outErrors;             ///< OUT transfers that failed
+    zcqUSBHistogram outLatency;     ///< Time from OUT submission to completion
+    uint64_t submitErrors;          ///< Transfers libusb refused to submit
+    uint64_t senderWaits;           ///< Sends blocked with all OUT buffers in flight
+    uint64_t senderTimeouts;        ///< Blocked sends that timed out
+    zcqUSBHistogram senderWaitTime; ///< Time blocked sends waited for an OUT buffer
+} zcqUSBStatistics;
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Transmit statistics of a periodic object buffer, see
+ * \ref zcqGetObjBufStatistics(). Times are in microseconds and taken on the
+ * host when a frame is queued to the device, not when it is on the bus.
+ * The values run from the last \ref canObjBufEnable().
+ */
+typedef struct {
+    uint32_t period;                ///< Transmission period
+    uint64_t sent;                  ///< Periodic frames queued
+    uint64_t burstSent;             ///< Frames queued by \ref canObjBufSendBurst()
+    uint64_t overflows;             ///< Periods lost to a full transmit buffer
+    uint64_t errors;                ///< Frames the channel refused, e.g. invalid flags
+    uint64_t skipped;               ///< Periods skipped because the scheduler ran late
+    uint64_t intervalCount;         ///< Intervals measured between consecutive frames
+    uint64_t intervalMin;           ///< Shortest interval
+    uint64_t intervalMax;           ///< Longest interval
+    uint64_t intervalSum;           ///< Sum of the intervals, for the mean
+    uint64_t latenessMax;           ///< Longest time from due to queued
+    uint64_t latenessSum;           ///< Sum of the times from due to queued
+} zcqObjBufStatistics;
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Reads up to \a count frames from the device level RX queue of the device
+ * \a hnd belongs to. The handle must be opened with
+ * \ref canOPEN_ZCQ_DEVICE_RX_QUEUE or \ref canOPEN_ZCQ_DEVICE_RX_QUEUE_LIN.
+ *
+ * \param[in]  hnd       An open handle to a CAN channel.
+ * \param[out] messages  Buffer receiving at most \a count frames.
+ * \param[in]  count     Size of \a messages.
+ * \param[out] received  Number of frames written to \a messages.
+ * \param[in]  timeout   Milliseconds to wait if the queue is empty.
+ *                       0xFFFFFFFF gives an infinite timeout.
+ *
+ * \return \ref canOK (zero) if at least one frame was read.
+ * \return \ref canERR_TIMEOUT (negative) if no frame arrived in time.
+ * \return \ref canERR_xxx (negative) if failure
+ */
+canStatus CANLIBAPI zcqReadDeviceWait (const CanHandle hnd,
+                                       zcqDeviceMessage *messages,
+                                       unsigned int count,
+                                       unsigned int *received,
+                                       unsigned long timeout);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Sends \a count frames in order, like that many \ref canWriteWait()
+ * calls. TX credits and the USB OUT buffer are taken once for up to 64
+ * frames at a time and the frames go out in as few USB transfers as they
+ * fit in, which takes far less CPU per frame than single writes when
+ * replaying logs or flashing at full bus rate. Stops at the first frame
+ * that can't be sent.
+ *
+ * \param[in]  hnd       An open handle to a CAN channel.
+ * \param[in]  messages  Frames to send.
+ * \param[in]  count     Number of frames in \a messages.
+ * \param[in]  timeout   Milliseconds to wait for space in the transmit
+ *                       buffer, per frame. 0 returns at once when it is full.
+ * \param[out] sent      Number of frames queued, the frames after it were
+ *                       not sent. May be NULL.
+ *
+ * \return \ref canOK (zero) if all frames were queued
+ * \return \ref canERR_TXBUFOFL (negative) if the transmit buffer was full
+ * \return \ref canERR_TIMEOUT (negative) if no space came up in time
+ * \return \ref canERR_PARAM (negative) if a frame has a DLC above 64,
+ *         nothing is sent then
+ * \return \ref canERR_xxx (negative) if failure, the status of the frame
+ *         at index \a sent
+ */
+canStatus CANLIBAPI canWriteBatch (const CanHandle hnd,
+                                   const zcqTxMessage *messages,
+                                   unsigned int count,
+                                   unsigned long timeout,
+                                   unsigned int *sent);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Reads the transmit statistics of a periodic object buffer. Periodic
+ * buffers allocated with \ref canOBJBUF_TYPE_PERIODIC_TX are served by a
+ * library thread for all handles, frames of a channel due within 100 us are
+ * queued together in one USB transfer. A period that finds the transmit
+ * buffer full is lost and counted in overflows, the interval and lateness
+ * values give the period jitter on the host.
+ *
+ * \param[in]  hnd    An open handle to a CAN channel.
+ * \param[in]  idx    The index of a periodic object buffer.
+ * \param[out] stats  Receives the statistics.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if \a idx is not allocated or \a stats is NULL
+ * \return \ref canERR_xxx (negative) if failure
+ */
+canStatus CANLIBAPI zcqGetObjBufStatistics (const CanHandle hnd, int idx,
+                                            zcqObjBufStatistics *stats);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Sets up the host transmit queue of a channel. The device transmits the
+ * frames it holds in the order they were written, so a frame written
+ * behind a long burst waits for the whole burst. With the queue on, frames
+ * the device has no room for are kept in the library and handed to the
+ * device in priority order as it acknowledges earlier frames, and
+ * \ref canWrite() only fails when the host queue is full.
+ *
+ * \a deviceFrames limits the frames held in the device, in any mode. A
+ * high priority frame can only overtake frames still in the host queue, so
+ * a small limit gives it a shorter wait at some cost in bus utilization.
+ * The settings are reset when the handle is closed.
+ *
+ * A failed transmission makes the device drop the frames it holds, the
+ * host queue is kept. Frames dropped this way make the next
+ * \ref canWriteSync() fail.
+ *
+ * \param[in] hnd           An open handle to a CAN channel.
+ * \param[in] mode          One of \ref zcqTX_QUEUE_xxx.
+ * \param[in] queueSize     Number of frames the host queue holds, 1 - 65536.
+ * \param[in] deviceFrames  Frames held in the device, 0 for the device limit.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if \a mode or \a queueSize is invalid
+ * \return \ref canERR_NOT_SUPPORTED (negative) if the channel has no host queue
+ */
+canStatus CANLIBAPI zcqSetTxQueue (const CanHandle hnd, int mode,
+                                   unsigned int queueSize,
+                                   unsigned int deviceFrames);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Limits the transmit rate of a channel to a share of the bus, so an
+ * application writing faster than the bus drains doesn't fill the device
+ * transmit buffer and delay other nodes. Each frame is charged the time it
+ * occupies the bus, with worst case bit stuffing and the data phase of
+ * CAN FD frames at the data bitrate, against a token bucket refilled at
+ * \a percent of real time. Frames over the limit are held in the host
+ * transmit queue, see \ref zcqSetTxQueue(), and \ref canWrite() only fails
+ * when it is full. Set the bitrates before writing, the cost of a frame is
+ * fixed when it is queued. The limit is removed when the handle is closed.
+ *
+ * \param[in] hnd        An open handle to a CAN channel.
+ * \param[in] percent    Share of the bus time, 1 - 100. 0 removes the limit.
+ * \param[in] burstTime  Bus time in microseconds that may be sent back to
+ *                       back after an idle period, 0 for the default 1000.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if \a percent is over 100
+ * \return \ref canERR_NOT_SUPPORTED (negative) if the channel can't shape its traffic
+ */
+canStatus CANLIBAPI zcqSetTxRateLimit (const CanHandle hnd,
+                                       unsigned int percent,
+                                       unsigned int burstTime);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Sets the number of USB IN bulk transfers kept queued per device. More
+ * transfers give the device somewhere to put data while a completed
+ * transfer is being decoded, which avoids HW overruns under burst load.
+ * The value is used the next time a device is opened, i.e. when the first
+ * channel on it is opened. The default is 4.
+ *
+ * \param[in] count  Number of transfers, 1 - 32.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if \a count is out of range
+ */
+canStatus CANLIBAPI zcqSetUSBInTransferCount (int count);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Sets the number of USB OUT buffers per device. Commands are collected in
+ * one buffer while the others are in flight. With more buffers, senders on
+ * different channels block less often, because they only wait when every
+ * buffer has been submitted. The value is used the next time a device is
+ * opened. The default is 4, 2 gives the classic double buffering.
+ *
+ * \param[in] count  Number of buffers, 2 - 32.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if \a count is out of range
+ */
+canStatus CANLIBAPI zcqSetUSBOutTransferCount (int count);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Sets how long commands may be collected in an OUT buffer while another
+ * transfer is in flight. After this delay the buffer is queued behind the
+ * in-flight transfers and is not held back until they complete. When no
+ * transfer is in flight, commands are always submitted at once. The value
+ * is used the next time a device is opened. The default is 250 us.
+ *
+ * \param[in] delay_us  Max delay in microseconds.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if \a delay_us is out of range
+ */
+canStatus CANLIBAPI zcqSetUSBOutMaxDelay (unsigned int delay_us);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Selects how USB events are handled. The mode is used the next time USB
+ * event handling starts. With USB hotplug support that is when devices are
+ * enumerated, on the first channel access after \ref canInitializeLibrary(),
+ * so set the mode before it.
+ *
+ * With \ref zcqUSB_EVENTS_APPLICATION no library thread is started. The
+ * application calls \ref zcqHandleEvents() from its own thread or event
+ * loop, and blocking library calls handle events on the calling thread
+ * while they wait. Calls that wait with channel locks held, like
+ * \ref canBusOn() or a \ref canWrite() waiting for USB buffer space, only
+ * handle command replies and transfer completions. Frames received
+ * meanwhile are delivered by the next \ref zcqHandleEvents() or blocking
+ * read.
+ *
+ * \param[in] mode  One of \ref zcqUSB_EVENTS_xxx
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if \a mode is not supported on
+ *         this platform
+ */
+canStatus CANLIBAPI zcqSetUSBEventMode (int mode);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Sets scheduling policy, priority and CPU affinity of threads started by
+ * the library, like the USB event thread. Threads started after this call
+ * use the new settings, threads already running keep theirs. This replaces
+ * the settings read from the environment variables ZCQ_THREAD_POLICY
+ * (other, fifo or rr), ZCQ_THREAD_PRIORITY and ZCQ_THREAD_CPUS (e.g. 2,3
+ * or 2-3).
+ *
+ * Real-time policies need privileges, e.g. CAP_SYS_NICE or an RLIMIT_RTPRIO
+ * limit on Linux. Use \ref zcqGetThreadSchedulingStatus() to see whether
+ * the settings took effect.
+ *
+ * \param[in] policy     One of \ref zcqTHREAD_POLICY_xxx
+ * \param[in] priority   Priority for \ref zcqTHREAD_POLICY_FIFO and
+ *                       \ref zcqTHREAD_POLICY_RR, 1 - 99 on Linux.
+ * \param[in] cpus       CPU numbers the threads may run on, NULL for all.
+ * \param[in] cpu_count  Number of entries in \a cpus.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if a parameter is invalid
+ */
+canStatus CANLIBAPI zcqSetThreadScheduling (int policy, int priority,
+                                            const int *cpus, unsigned int cpu_count);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Reports whether the scheduling settings took effect for the library
+ * threads started since they were last changed. A failing thread is also
+ * reported in the library log.
+ *
+ * \param[out] status  Combination of \ref zcqTHREAD_STATUS_xxx, zero if no
+ *                     thread has been started or nothing was requested.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if \a status is NULL
+ */
+canStatus CANLIBAPI zcqGetThreadSchedulingStatus (unsigned int *status);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Spreads devices over \a group_count USB event groups. Each group has its
+ * own libusb context and event thread, so transfers of devices in
+ * different groups are handled in parallel. Devices are assigned round
+ * robin in enumeration order, a \a group_count equal to the number of
+ * devices gives each device its own thread. The event thread of group n is
+ * pinned to \a cpus[n] when given, otherwise the \ref
+ * zcqSetThreadScheduling() CPU set is used.
+ *
+ * The value is used the next time a device is opened. The default 0
+ * handles all devices in one event thread. Groups are not used with
+ * \ref zcqUSB_EVENTS_APPLICATION.
+ *
+ * \param[in] group_count  Number of groups, 0 - 16.
+ * \param[in] cpus         CPU per group, NULL for no pinning.
+ * \param[in] cpu_count    Number of entries in \a cpus.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if a parameter is invalid
+ */
+canStatus CANLIBAPI zcqSetUSBEventGroups (int group_count,
+                                          const int *cpus, unsigned int cpu_count);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Handles pending USB events on the calling thread, waiting at most
+ * \a timeout milliseconds for an event. Received frames and TX
+ * acknowledges are queued on their channels before this returns. Only
+ * needed with \ref zcqUSB_EVENTS_APPLICATION.
+ *
+ * \param[in] timeout  Milliseconds to wait for an event, 0 only handles
+ *                     events that are already pending.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_NOTINITIALIZED (negative) if the library is not initialized
+ * \return \ref canERR_xxx (negative) if failure
+ */
+canStatus CANLIBAPI zcqHandleEvents (unsigned long timeout);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Gets the file descriptors USB events arrive on, for integration in an
+ * application event loop. Call \ref zcqHandleEvents() with a zero timeout
+ * when any of them is ready. The set changes when devices are opened or
+ * closed, fetch it again after \ref canOpenChannel() and \ref canClose().
+ *
+ * \param[out] fds       Buffer receiving at most \a count descriptors.
+ * \param[in]  count     Size of \a fds.
+ * \param[out] returned  Number of descriptors written to \a fds.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_NOT_SUPPORTED (negative) if the platform has no
+ *         USB poll fds, e.g. Windows
+ * \return \ref canERR_xxx (negative) if failure
+ */
+canStatus CANLIBAPI zcqGetUSBPollFds (zcqPollFd *fds,
+                                      unsigned int count,
+                                      unsigned int *returned);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Keeps serial number, firmware version and channel counts of each device
+ * in a file, so later startups need no info round trips for known devices.
+ * Entries are keyed by USB bus path, vendor and product ID and USB serial
+ * string. A cached device is reset and its info checked when it is first
+ * opened, a stale entry is logged and corrected. An entry that can't be
+ * checked is evicted and the info retrieved again. When the
+ * channel count differs, that open fails with \ref canERR_INTERNAL and the
+ * device is enumerated again with the real count, with hotplug at once,
+ * otherwise after \ref canUnloadLibrary(). This replaces the file set by
+ * the ZCQ_DEVICE_CACHE environment variable.
+ *
+ * Devices are enumerated on the first channel access, e.g.
+ * \ref canGetNumberOfChannels() or \ref canOpenChannel(), not in
+ * \ref canInitializeLibrary(). Call this before that access.
+ *
+ * \param[in] path  Cache file, NULL or an empty string disables the cache.
+ *
+ * \return \ref canOK (zero) if success
+ */
+canStatus CANLIBAPI zcqSetDeviceInfoCache (const char *path);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Automatic recovery of devices that drop off the bus. When enabled, a
+ * device with open channels that disappears keeps its channel numbers and
+ * handles. Reads return \ref canERR_TIMEOUT and writes fail while it is
+ * gone. When a device with the same serial number arrives it is reopened
+ * and the bitrate, CAN FD data bitrate, driver mode and bus on state of
+ * each open CAN channel are set again. Frames sent or received during the
+ * outage are lost, a \ref canMSG_ZCQ_DEVICE_GAP frame is queued to every
+ * restored channel. Open LIN channels are not restored. Disabled by
+ * default.
+ *
+ * \param[in] enable  Non zero to enable recovery.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_NOT_SUPPORTED (negative) if the platform has no USB
+ *         hotplug, which is needed to see the device return
+ */
+canStatus CANLIBAPI zcqSetAutoRecovery (int enable);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Sets the size of USB IN bulk transfers and OUT buffers. Larger IN
+ * transfers give fewer completions per second for bulk capture, smaller
+ * ones hand frames over sooner on latency critical setups. An OUT buffer
+ * collects commands until it is full or submitted. The sizes are used the
+ * next time the device is opened. Sizes are multiples of 32 bytes from 64
+ * to 65536, the defaults are 4096 bytes.
+ *
+ * \param[in] channel   A CAN channel of the device, or -1 to set the
+ *                      default for devices without their own setting.
+ * \param[in] in_size   IN transfer size, 0 keeps the current size. It must
+ *                      be a multiple of the IN endpoint max packet size, a
+ *                      default is rounded up to one when a device is opened.
+ * \param[in] out_size  OUT buffer size, 0 keeps the current size. At least
+ *                      128 bytes, a CAN FD frame is placed in one buffer.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_NOTFOUND (negative) if \a channel does not exist
+ * \return \ref canERR_PARAM (negative) if a size is invalid
+ */
+canStatus CANLIBAPI zcqSetUSBTransferSize (int channel, unsigned int in_size,
+                                           unsigned int out_size);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Sets the timeout of USB bulk transfers. An IN transfer that times out is
+ * submitted again, the commands in an OUT transfer that times out are
+ * lost. The value is used the next time the device is opened. The default
+ * is 60000 ms.
+ *
+ * \param[in] channel     A CAN channel of the device, or -1 to set the
+ *                        default for devices without their own setting.
+ * \param[in] timeout_ms  Timeout in milliseconds, 0 waits forever.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_NOTFOUND (negative) if \a channel does not exist
+ * \return \ref canERR_PARAM (negative) if \a timeout_ms is invalid
+ */
+canStatus CANLIBAPI zcqSetUSBTransferTimeout (int channel, unsigned int timeout_ms);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Reads the USB transfer statistics of a device. The counters run from the
+ * time the device was enumerated or last reset, across closes and
+ * reopens. Many full IN transfers or IN callback times close to the USB
+ * frame time mean the IN side is saturated, more or larger IN transfers
+ * help. Frequent sender waits mean the OUT buffers are, see
+ * \ref zcqSetUSBOutTransferCount(). The values are read while transfers
+ * complete and may be off by the transfers in progress.
+ *
+ * \param[in]  channel  A CAN channel of the device.
+ * \param[out] stats    Receives the statistics.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_NOTFOUND (negative) if \a channel does not exist
+ * \return \ref canERR_PARAM (negative) if \a stats is NULL
+ */
+canStatus CANLIBAPI zcqGetUSBStatistics (int channel, zcqUSBStatistics *stats);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Sets the USB transfer statistics of a device to zero.
+ *
+ * \param[in] channel  A CAN channel of the device.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_NOTFOUND (negative) if \a channel does not exist
+ */
+canStatus CANLIBAPI zcqResetUSBStatistics (int channel);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Adds simulated Zeno devices after the USB devices, for runs and
+ * benchmarks without hardware. A simulated device runs the device side of
+ * the USB protocol on its own thread: commands are answered after one USB
+ * frame, frames sent on a channel are acknowledged after their time on the
+ * bus and, in loopback mode, received by the other bus on channels of the
+ * device. It can also generate RX traffic at a fixed rate. A full device
+ * buffer drops frames and flags the next one with a HW overrun, like the
+ * hardware does. This replaces the settings read from the ZCQ_SIMULATION
+ * environment variable.
+ *
+ * The settings are a comma separated list of key=value pairs, keys not
+ * given keep their defaults:
+ *  - devices: number of simulated devices, 0 - 16 (1)
+ *  - channels: CAN channels per device, 1 - 8 (4)
+ *  - lin: LIN channels per device, 0 or 2 (0)
+ *  - loopback: channels of a device share one bus (1)
+ *  - rx_rate: generated RX frames per second and bus on channel (0)
+ *  - rx_burst: generated frames back to back (1)
+ *  - rx_dlc: generated data length, -1 cycles through all lengths (8)
+ *  - rx_id, rx_ext: identifier of generated frames (0x123, 0)
+ *  - tx_pending: TX frames the device buffers per channel, 1 - 128 (64)
+ *  - buffer: device buffer for data to the host in bytes (16384)
+ *  - usb_us: USB frame interval in microseconds (125)
+ *  - clock_ms: clock info interrupt interval in milliseconds (100)
+ *
+ * Devices are enumerated on the first channel access, call this before it.
+ *
+ * \param[in] config  Settings, NULL or an empty string for no simulated
+ *                    devices.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if \a config can't be parsed
+ */
+canStatus CANLIBAPI zcqSetSimulation (const char *config);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Writes the raw data of every completed USB IN transfer to a file, with
+ * its completion time and the info of the device it came from. This covers
+ * USB and simulated devices and replaces the file read from the
+ * ZCQ_USB_CAPTURE environment variable. The file is truncated.
+ *
+ * \param[in] path  Capture file, NULL or an empty string stops capturing.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if the file can't be created
+ */
+canStatus CANLIBAPI zcqSetUSBCapture (const char *path);
+
+/**
+ * \ingroup grp_zcqcomlib
+ *
+ * Replays a capture made with \ref zcqSetUSBCapture(). Each captured device
+ * is added as a simulated device after the USB and simulated devices, with
+ * the serial number, firmware version, capabilities and channel counts of
+ * the original. From the first bus on, the recorded transfers are fed
+ * through the normal IN data handling with their original boundaries,
+ * replies to commands left out. Commands are answered by the simulated
+ * device and frames sent are acknowledged by it, clock info interrupts are
+ * generated and not replayed. Timestamps of replayed frames are the ones
+ * the original device reported. This replaces the settings read from the
+ * ZCQ_USB_REPLAY and ZCQ_USB_REPLAY_FAST environment variables.
+ *
+ * Devices are enumerated on the first channel access, call this before it.
+ *
+ * \param[in] path   Capture file, NULL or an empty string for no replay.
+ * \param[in] flags  \ref zcqREPLAY_xxx flags.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if the file can't be opened or
+ *         \a flags is invalid
+ */
+canStatus CANLIBAPI zcqSetUSBReplay (const char *path, unsigned int flags);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _ZCQCOMLIB_H_ */
@@ -36,10 +36,14 @@
 #endif
 
 #include "canlib.h"
+#include "zcqcomlib.h"
 #include "zcqcore.h"
 #include "zcanchannel.h"
+#include "zcanobjbufscheduler.h"
 #include "zdebug.h"
 #include <string.h>
+#include <limits.h>
+#include <algorithm>
 #include <mutex>
 
 /*** ---------------------------==*+*+*==---------------------------------- ***/
@@ -104,6 +108,7 @@ static const char *canlib_error_text_list[] = {
 #define MAX_CANLIB_HANDLES 128
 static ZRef<ZCANChannel> handle_map_list[MAX_CANLIB_HANDLES];
 static std::mutex open_close_mutex;
+static ZCANObjBufScheduler obj_buf_scheduler;
 
 static inline ZCANChannel* getChannel(CanHandle handle)
 {
@@ -111,6 +116,31 @@ static inline ZCANChannel* getChannel(CanHandle handle)
     return handle_map_list[handle];
 }
 
+static canStatus translateSendResult(ZCANChannel::SendResult r)
+{
+    canStatus status;
+    switch(r) {
+    case ZCANChannel::SendStatusOK:
+        status = canOK;
+        break;
+    case ZCANChannel::SendTimeout:
+        status = canERR_TIMEOUT;
+        break;
+    case ZCANChannel::TransmitBufferOveflow:
+        status = canERR_TXBUFOFL;
+        break;
+    case ZCANChannel::SendInvalidParam:
+        status = canERR_PARAM;
+        break;
+    case ZCANChannel::SendError:
+    default:
+        status = canERR_INTERNAL;
+        break;
+    }
+
+    return status;
+}
+
 /*** ---------------------------==*+*+*==---------------------------------- ***/
 void CANLIBAPI canInitializeLibrary (void)
 {
@@ -119,12 +149,19 @@ void CANLIBAPI canInitializeLibrary (void)
 
 canStatus CANLIBAPI canClose (const CanHandle handle)
 {
-    std::lock_guard<std::mutex> lock(open_close_mutex);
-    auto can_channel = getChannel(handle);
-    if ( can_channel == nullptr ) return canERR_INVHANDLE;
+    ZRef<ZCANChannel> can_channel;
+    {
+        std::lock_guard<std::mutex> lock(open_close_mutex);
+        can_channel = getChannel(handle);
+        if ( can_channel == nullptr ) return canERR_INVHANDLE;
+        handle_map_list[handle] = nullptr;
+    }
 
+    obj_buf_scheduler.freeAll(handle);
+
+    /* Device commands run without the table lock, the channel serializes
+     * its own open and close. Channels close in parallel */
     can_channel->close();
-    handle_map_list[handle] = nullptr;
 
     return canOK;
 }
@@ -352,6 +389,7 @@ canStatus CANLIBAPI canWrite (const CanHandle handle,
 {
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
+    if ( dlc > 64 ) return canERR_PARAM;
 
     ZCANChannel::SendResult r;
     r = can_channel->send(static_cast<const uint32_t>(id),
@@ -359,37 +397,20 @@ canStatus CANLIBAPI canWrite (const CanHandle handle,
                           static_cast<uint8_t>(dlc),
                           flags, 0);
 
-    canStatus status;
-    switch(r) {
-    case ZCANChannel::SendStatusOK:
-        status = canOK;
-        break;
-    case ZCANChannel::SendTimeout:
-        status = canERR_TIMEOUT;
-        break;
-    case ZCANChannel::TransmitBufferOveflow:
-        status = canERR_TXBUFOFL;
-        break;
-    case ZCANChannel::SendInvalidParam:
-        status = canERR_PARAM;
-        break;
-    case ZCANChannel::SendError:
-        status = canERR_INTERNAL;
-        break;
-    }
 
-    return status;
+    return translateSendResult(r);
 }
 
 canStatus CANLIBAPI canWriteSync (const CanHandle handle,
                                   unsigned long timeout)
 {
-    ZUNUSED(timeout)
-
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    /* 0xFFFFFFFF gives an infinite timeout, other large values are clamped
+     * instead of wrapping to a negative int */
+    int timeout_in_ms = (timeout == 0xFFFFFFFFul) ? -1 : int(std::min(timeout, (unsigned long)INT_MAX));
+    return translateSendResult(can_channel->waitForTxIdle(timeout_in_ms));
 }
 
 canStatus CANLIBAPI canRead (const CanHandle handle,
@@ -447,6 +468,273 @@ canStatus CANLIBAPI canReadWait (const CanHandle handle,
     return canOK;
 }
 
+canStatus CANLIBAPI zcqReadDeviceWait (const CanHandle handle,
+                                       zcqDeviceMessage *messages,
+                                       unsigned int count,
+                                       unsigned int *received,
+                                       unsigned long timeout)
+{
+    if ( messages == nullptr || received == nullptr || count == 0 ) return canERR_PARAM;
+    *received = 0;
+
+    auto can_channel = getChannel(handle);
+    if ( can_channel == nullptr ) return canERR_INVHANDLE;
+
+    ZCANChannel::DeviceFrame frames[64];
+    unsigned int frame_count = 0;
+    ZCANChannel::ReadResult r;
+    r = can_channel->readDeviceWait(frames, std::min(count, 64u), frame_count, int(timeout));
+    if ( r != ZCANChannel::ReadStatusOK ) {
+        if ( r == ZCANChannel::ReadTimeout ) return canERR_TIMEOUT;
+        else return canERR_INTERNAL;
+    }
+
+    for ( unsigned int i = 0; i < frame_count; ++i ) {
+        const ZCANChannel::DeviceFrame& frame = frames[i];
+        zcqDeviceMessage& message = messages[i];
+        message.busType = frame.bus_type == ZCANChannel::DeviceFrameLIN ? zcqBUS_LIN : zcqBUS_CAN;
+        message.channel = frame.channel_nr;
+        message.id = long(frame.id);
+        memcpy(message.msg, frame.msg, std::min<size_t>(frame.dlc, sizeof(message.msg)));
+        message.dlc = frame.dlc;
+        message.flags = frame.flags;
+        message.time = static_cast<unsigned long>(frame.timestamp_in_us);
+    }
+    *received = frame_count;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI canWriteBatch (const CanHandle handle,
+                                   const zcqTxMessage *messages,
+                                   unsigned int count,
+                                   unsigned long timeout,
+                                   unsigned int *sent)
+{
+    if ( sent != nullptr ) *sent = 0;
+    if ( messages == nullptr && count > 0 ) return canERR_PARAM;
+
+    auto can_channel = getChannel(handle);
+    if ( can_channel == nullptr ) return canERR_INVHANDLE;
+
+    /* Checked before anything is sent, a DLC cast to uint8_t would wrap to
+     * another valid one */
+    for ( unsigned int i = 0; i < count; ++i ) {
+        if ( messages[i].dlc > 64 ) return canERR_PARAM;
+    }
+
+    ZCANChannel::TxFrame frames[64];
+    unsigned int total_sent = 0;
+    ZCANChannel::SendResult r = ZCANChannel::SendStatusOK;
+    while ( total_sent < count && r == ZCANChannel::SendStatusOK ) {
+        unsigned int frame_count = std::min(count - total_sent, 64u);
+        for ( unsigned int i = 0; i < frame_count; ++i ) {
+            const zcqTxMessage& message = messages[total_sent + i];
+            ZCANChannel::TxFrame& frame = frames[i];
+            frame.id = static_cast<uint32_t>(message.id);
+            frame.msg = message.msg;
+            frame.dlc = static_cast<uint8_t>(message.dlc);
+            frame.flags = message.flags;
+        }
+
+        unsigned int frames_sent = 0;
+        r = can_channel->sendBatch(frames, frame_count, frames_sent, int(timeout));
+        total_sent += frames_sent;
+    }
+    if ( sent != nullptr ) *sent = total_sent;
+
+    return translateSendResult(r);
+}
+
+canStatus CANLIBAPI zcqSetUSBInTransferCount (int count)
+{
+    if (!setUSBInTransferCount(count)) return canERR_PARAM;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetUSBOutTransferCount (int count)
+{
+    if (!setUSBOutTransferCount(count)) return canERR_PARAM;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetUSBOutMaxDelay (unsigned int delay_us)
+{
+    if ( delay_us > 1000000 ) return canERR_PARAM;
+    if (!setUSBOutMaxDelay(int(delay_us))) return canERR_PARAM;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetUSBEventMode (int mode)
+{
+    if (!setUSBEventMode(mode)) return canERR_PARAM;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetUSBEventGroups (int group_count,
+                                          const int *cpus, unsigned int cpu_count)
+{
+    if ( cpus == nullptr && cpu_count > 0 ) return canERR_PARAM;
+    if (!setUSBEventGroups(group_count, cpus, cpu_count)) return canERR_PARAM;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqHandleEvents (unsigned long timeout)
+{
+    int res = handleUSBEvents(int(std::min(timeout, 1000000ul)));
+    if ( res == -1 ) return canERR_NOTINITIALIZED;
+    if ( res < 0 ) return canERR_INTERNAL;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqGetUSBPollFds (zcqPollFd *fds,
+                                      unsigned int count,
+                                      unsigned int *returned)
+{
+    if ( fds == nullptr || returned == nullptr ) return canERR_PARAM;
+    *returned = 0;
+
+    int poll_fds[64];
+    short poll_events[64];
+    int res = getUSBPollFds(poll_fds, poll_events, int(std::min(count, 64u)));
+    if ( res == -1 ) return canERR_NOTINITIALIZED;
+    if ( res < 0 ) return canERR_NOT_SUPPORTED;
+
+    for ( int i = 0; i < res; ++i ) {
+        fds[i].fd = poll_fds[i];
+        fds[i].events = poll_events[i];
+    }
+    *returned = unsigned(res);
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetThreadScheduling (int policy, int priority,
+                                            const int *cpus, unsigned int cpu_count)
+{
+    if ( cpus == nullptr && cpu_count > 0 ) return canERR_PARAM;
+    if (!setThreadScheduling(policy, priority, cpus, cpu_count)) return canERR_PARAM;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqGetThreadSchedulingStatus (unsigned int *status)
+{
+    if ( status == nullptr ) return canERR_PARAM;
+    *status = getThreadSchedulingStatus();
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetDeviceInfoCache (const char *path)
+{
+    setDeviceInfoCache(path);
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetAutoRecovery (int enable)
+{
+    if (!setAutoRecovery(enable != 0)) return canERR_NOT_SUPPORTED;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetUSBTransferSize (int channel, unsigned int in_size,
+                                           unsigned int out_size)
+{
+    if ( in_size > 0x7fffffffu || out_size > 0x7fffffffu ) return canERR_PARAM;
+
+    int res = setUSBTransferSizes(channel, int(in_size), int(out_size));
+    if ( res == -1 ) return canERR_NOTFOUND;
+    if ( res < 0 ) return canERR_PARAM;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetUSBTransferTimeout (int channel, unsigned int timeout_ms)
+{
+    if ( timeout_ms > 0x7fffffffu ) return canERR_PARAM;
+
+    int res = setUSBTransferTimeout(channel, int(timeout_ms));
+    if ( res == -1 ) return canERR_NOTFOUND;
+    if ( res < 0 ) return canERR_PARAM;
+
+    return canOK;
+}
+
+static void copyUSBHistogram(zcqUSBHistogram& histogram, const ZUSBStatistics::Histogram& source)
+{
+    static_assert(zcqUSB_HISTOGRAM_BUCKETS == ZUSB_HISTOGRAM_BUCKETS, "histogram bucket count mismatch");
+
+    histogram.count = source.count;
+    histogram.sum = source.sum;
+    histogram.max = source.max;
+    for ( int i = 0; i < zcqUSB_HISTOGRAM_BUCKETS; ++i ) histogram.buckets[i] = source.buckets[i];
+}
+
+canStatus CANLIBAPI zcqGetUSBStatistics (int channel, zcqUSBStatistics *stats)
+{
+    if ( stats == nullptr ) return canERR_PARAM;
+
+    ZUSBStatistics::Snapshot snapshot;
+    if ( getUSBStatistics(channel, snapshot) < 0 ) return canERR_NOTFOUND;
+
+    stats->inTransfers = snapshot.in_transfers;
+    stats->inBytes = snapshot.in_bytes;
+    stats->inFullTransfers = snapshot.in_full_transfers;
+    stats->inTimeouts = snapshot.in_timeouts;
+    stats->inErrors = snapshot.in_errors;
+    copyUSBHistogram(stats->inSize, snapshot.in_size);
+    copyUSBHistogram(stats->inCallbackTime, snapshot.in_callback_time);
+    stats->outTransfers = snapshot.out_transfers;
+    stats->outBytes = snapshot.out_bytes;
+    stats->outTimeouts = snapshot.out_timeouts;
+    stats->outErrors = snapshot.out_errors;
+    copyUSBHistogram(stats->outLatency, snapshot.out_latency);
+    stats->submitErrors = snapshot.submit_errors;
+    stats->senderWaits = snapshot.sender_waits;
+    stats->senderTimeouts = snapshot.sender_timeouts;
+    copyUSBHistogram(stats->senderWaitTime, snapshot.sender_wait_time);
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqResetUSBStatistics (int channel)
+{
+    if ( resetUSBStatistics(channel) < 0 ) return canERR_NOTFOUND;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetSimulation (const char *config)
+{
+    if (!setSimulation(config)) return canERR_PARAM;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetUSBCapture (const char *path)
+{
+    if (!setUSBCapture(path)) return canERR_PARAM;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetUSBReplay (const char *path, unsigned int flags)
+{
+    if ((flags & ~unsigned(zcqREPLAY_FULL_SPEED)) != 0) return canERR_PARAM;
+    if (!setUSBReplay(path, (flags & zcqREPLAY_FULL_SPEED) != 0)) return canERR_PARAM;
+
+    return canOK;
+}
+
 canStatus CANLIBAPI canReadSpecific (const CanHandle handle, long id, void * msg,
                                      unsigned int * dlc, unsigned int * flag,
                                      unsigned long * time)
@@ -675,13 +963,29 @@ canStatus CANLIBAPI canIoCtl (const CanHandle handle,
                               void *buf,
                               unsigned int buflen)
 {
-    ZUNUSED(func)
-    ZUNUSED(buf)
-    ZUNUSED(buflen)
-
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
+    switch(func) {
+    case canIOCTL_SET_TXACK: {
+        if ( buf == nullptr || buflen < sizeof(uint32_t) ) return canERR_PARAM;
+        uint32_t mode = *static_cast<uint32_t*>(buf);
+        if ( mode > ZCANChannel::TxAckOffInternal ) return canERR_PARAM;
+        if (!can_channel->setTxAckMode(ZCANChannel::TxAckMode(mode))) return canERR_NOT_SUPPORTED;
+        return canOK;
+    }
+
+    case canIOCTL_GET_TXACK:
+        if ( buf == nullptr || buflen < sizeof(uint32_t) ) return canERR_PARAM;
+        *static_cast<uint32_t*>(buf) = uint32_t(can_channel->getTxAckMode());
+        return canOK;
+
+    case canIOCTL_SET_LOCAL_TXECHO:
+        if ( buf == nullptr || buflen < sizeof(uint8_t) ) return canERR_PARAM;
+        if (!can_channel->setLocalTxEcho(*static_cast<uint8_t*>(buf) != 0)) return canERR_NOT_SUPPORTED;
+        return canOK;
+    }
+
     return canERR_NOT_IMPLEMENTED;
 }
 
@@ -697,22 +1001,9 @@ canStatus CANLIBAPI canReadTimer (const CanHandle handle, unsigned long *time)
 
 CanHandle CANLIBAPI canOpenChannel (int channel, int flags)
 {
-    std::lock_guard<std::mutex> lock(open_close_mutex);
-
     ZRef<ZCANChannel> can_channel = getCANChannel(unsigned(channel));
     if ( can_channel == nullptr ) return canERR_NOTFOUND;
 
-    int handle = canINVALID_HANDLE;
-    for(int i = 0; i < MAX_CANLIB_HANDLES; ++i) {
-        if ( handle_map_list[i] == nullptr ) {
-            handle = i;
-            break;
-        }
-    }
-    if ( handle == canERR_INVHANDLE ) {
-        return canERR_NOHANDLES;
-    }
-
     uint32_t capabilities = can_channel->getCapabilites();
 
     if ( (flags & canOPEN_REQUIRE_EXTENDED) &&
@@ -730,13 +1021,38 @@ CanHandle CANLIBAPI canOpenChannel (int channel, int flags)
         _flags |= ZCANChannel::CanFD | ZCANChannel::CanFDNonISO;
     }
 
+    if ( flags & (canOPEN_ZCQ_DEVICE_RX_QUEUE | canOPEN_ZCQ_DEVICE_RX_QUEUE_LIN) ) {
+        if ( !(capabilities & ZCANChannel::DeviceRxQueue) ) return canERR_NOT_SUPPORTED;
+        _flags |= ZCANChannel::DeviceRxQueue;
+    }
+
+    if ( flags & canOPEN_ZCQ_DEVICE_RX_QUEUE_LIN ) {
+        _flags |= ZCANChannel::DeviceRxQueueLIN;
+    }
+
+    if ( flags & canOPEN_ZCQ_TX_LOW_LATENCY ) {
+        if ( !(capabilities & ZCANChannel::TxLowLatency) ) return canERR_NOT_SUPPORTED;
+        _flags |= ZCANChannel::TxLowLatency;
+    }
+
+    /* Device commands run without the table lock, the channel serializes
+     * its own open and close. Channels open in parallel */
     if (!can_channel->open(_flags)) {
         return canERR_INTERNAL;
     }
 
-    handle_map_list[handle] = can_channel;
+    {
+        std::lock_guard<std::mutex> lock(open_close_mutex);
+        for(int handle = 0; handle < MAX_CANLIB_HANDLES; ++handle) {
+            if ( handle_map_list[handle] == nullptr ) {
+                handle_map_list[handle] = can_channel;
+                return handle;
+            }
+        }
+    }
 
-    return handle;
+    can_channel->close();
+    return canERR_NOHANDLES;
 }
 
 canStatus CANLIBAPI canGetNumberOfChannels (int *channel_count)
@@ -930,27 +1246,34 @@ canStatus CANLIBAPI canObjBufFreeAll (const CanHandle handle)
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    obj_buf_scheduler.freeAll(handle);
+
+    return canOK;
 }
 
 canStatus CANLIBAPI canObjBufAllocate (const CanHandle handle, int type)
 {
-    ZUNUSED(type)
-
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    /* Periodic buffers are served by the library, auto response needs the firmware */
+    if ( type == canOBJBUF_TYPE_AUTO_RESPONSE ) return canERR_NOT_SUPPORTED;
+    if ( type != canOBJBUF_TYPE_PERIODIC_TX ) return canERR_PARAM;
+
+    int index = obj_buf_scheduler.allocate(handle, can_channel);
+    if ( index < 0 ) return canERR_NOMEM;
+
+    return canStatus(index);
 }
 
 canStatus CANLIBAPI canObjBufFree (const CanHandle handle, int idx)
 {
-    ZUNUSED(idx)
-
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    if (!obj_buf_scheduler.freeBuffer(handle, idx)) return canERR_PARAM;
+
+    return canOK;
 }
 
 canStatus CANLIBAPI canObjBufWrite (const CanHandle handle,
@@ -960,16 +1283,17 @@ canStatus CANLIBAPI canObjBufWrite (const CanHandle handle,
                                     unsigned int dlc,
                                     unsigned int flags)
 {
-    ZUNUSED(idx)
-    ZUNUSED(id)
-    ZUNUSED(msg)
-    ZUNUSED(dlc)
-    ZUNUSED(flags)
-
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    if ( dlc > 64 ) return canERR_PARAM;
+
+    bool r = obj_buf_scheduler.write(handle, idx, uint32_t(id),
+                                     static_cast<const uint8_t*>(msg),
+                                     static_cast<uint8_t>(dlc), flags);
+    if (!r) return canERR_PARAM;
+
+    return canOK;
 }
 
 canStatus CANLIBAPI canObjBufSetFilter (const CanHandle handle,
@@ -977,86 +1301,152 @@ canStatus CANLIBAPI canObjBufSetFilter (const CanHandle handle,
                                         unsigned int code,
                                         unsigned int mask)
 {
-    ZUNUSED(idx)
     ZUNUSED(code)
     ZUNUSED(mask)
 
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    /* Filters only apply to auto response buffers */
+    if (!obj_buf_scheduler.isAllocated(handle, idx)) return canERR_PARAM;
+
+    return canERR_NOT_SUPPORTED;
 }
 
 canStatus CANLIBAPI canObjBufSetFlags (const CanHandle handle,
                                        int idx,
                                        unsigned int flags)
 {
-    ZUNUSED(idx)
     ZUNUSED(flags)
 
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    /* Flags only apply to auto response buffers */
+    if (!obj_buf_scheduler.isAllocated(handle, idx)) return canERR_PARAM;
+
+    return canERR_NOT_SUPPORTED;
 }
 
 canStatus CANLIBAPI canObjBufSetPeriod (const CanHandle handle,
                                         int idx,
                                         unsigned int period)
 {
-    ZUNUSED(idx)
-    ZUNUSED(period)
-
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    if (!obj_buf_scheduler.setPeriod(handle, idx, period)) return canERR_PARAM;
+
+    return canOK;
 }
 
 canStatus CANLIBAPI canObjBufSetMsgCount (const CanHandle handle,
                                           int idx,
                                           unsigned int count)
 {
-    ZUNUSED(idx)
-    ZUNUSED(count)
-
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    if (!obj_buf_scheduler.setMessageCount(handle, idx, count)) return canERR_PARAM;
+
+    return canOK;
 }
 
 canStatus CANLIBAPI canObjBufEnable (const CanHandle handle, int idx)
 {
-    ZUNUSED(idx)
-
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    if (!obj_buf_scheduler.enable(handle, idx)) return canERR_PARAM;
+
+    return canOK;
 }
 
 canStatus CANLIBAPI canObjBufDisable (const CanHandle handle, int idx)
 {
-    ZUNUSED(idx)
-
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    if (!obj_buf_scheduler.disable(handle, idx)) return canERR_PARAM;
+
+    return canOK;
 }
 
 canStatus CANLIBAPI canObjBufSendBurst (const CanHandle handle,
                                         int idx,
                                         unsigned int burstlen)
 {
-    ZUNUSED(idx)
-    ZUNUSED(burstlen)
+    auto can_channel = getChannel(handle);
+    if ( can_channel == nullptr ) return canERR_INVHANDLE;
+
+    if (!obj_buf_scheduler.sendBurst(handle, idx, burstlen)) return canERR_PARAM;
 
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqGetObjBufStatistics (const CanHandle handle, int idx,
+                                            zcqObjBufStatistics *stats)
+{
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
 
-    return canERR_NOT_IMPLEMENTED;
+    if ( stats == nullptr ) return canERR_PARAM;
+
+    ZCANObjBufScheduler::Statistics statistics;
+    if (!obj_buf_scheduler.getStatistics(handle, idx, statistics)) return canERR_PARAM;
+
+    stats->period = statistics.period_in_us;
+    stats->sent = statistics.sent;
+    stats->burstSent = statistics.burst_sent;
+    stats->overflows = statistics.overflows;
+    stats->errors = statistics.errors;
+    stats->skipped = statistics.skipped;
+    stats->intervalCount = statistics.interval_count;
+    stats->intervalMin = statistics.interval_min_in_us;
+    stats->intervalMax = statistics.interval_max_in_us;
+    stats->intervalSum = statistics.interval_sum_in_us;
+    stats->latenessMax = statistics.lateness_max_in_us;
+    stats->latenessSum = statistics.lateness_sum_in_us;
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetTxQueue (const CanHandle handle, int mode,
+                                   unsigned int queue_size,
+                                   unsigned int device_frames)
+{
+    auto can_channel = getChannel(handle);
+    if ( can_channel == nullptr ) return canERR_INVHANDLE;
+
+    switch ( mode ) {
+    case zcqTX_QUEUE_OFF:
+    case zcqTX_QUEUE_BY_ID:
+    case zcqTX_QUEUE_BY_CLASS:
+        break;
+    default:
+        return canERR_PARAM;
+    }
+    if ( queue_size == 0 || queue_size > 65536 ) return canERR_PARAM;
+
+    if (!can_channel->setTxQueue(ZCANChannel::TxQueueMode(mode), queue_size, device_frames)) {
+        return canERR_NOT_SUPPORTED;
+    }
+
+    return canOK;
+}
+
+canStatus CANLIBAPI zcqSetTxRateLimit (const CanHandle handle,
+                                       unsigned int percent,
+                                       unsigned int burst_time)
+{
+    auto can_channel = getChannel(handle);
+    if ( can_channel == nullptr ) return canERR_INVHANDLE;
+
+    if ( percent > 100 ) return canERR_PARAM;
+
+    if (!can_channel->setTxRateLimit(percent, burst_time)) return canERR_NOT_SUPPORTED;
+
+    return canOK;
 }
 
 canStatus CANLIBAPI canResetBus (const CanHandle handle)
@@ -1076,6 +1466,7 @@ canStatus CANLIBAPI canWriteWait (const CanHandle handle,
 {
     auto can_channel = getChannel(handle);
     if ( can_channel == nullptr ) return canERR_INVHANDLE;
+    if ( dlc > 64 ) return canERR_PARAM;
 
     ZCANChannel::SendResult r;
     r = can_channel->send(static_cast<const uint32_t>(id),
@@ -1083,30 +1474,13 @@ canStatus CANLIBAPI canWriteWait (const CanHandle handle,
                           static_cast<uint8_t>(dlc),
                           flags, int(timeout));
 
-    canStatus status;
-    switch(r) {
-    case ZCANChannel::SendStatusOK:
-        status = canOK;
-        break;
-    case ZCANChannel::SendTimeout:
-        status = canERR_TIMEOUT;
-        break;
-    case ZCANChannel::TransmitBufferOveflow:
-        status = canERR_TXBUFOFL;
-        break;
-    case ZCANChannel::SendInvalidParam:
-        status = canERR_PARAM;
-        break;
-    case ZCANChannel::SendError:
-        status = canERR_INTERNAL;
-        break;
-    }
 
-    return status;
+    return translateSendResult(r);
 }
 
 canStatus CANLIBAPI canUnloadLibrary (void)
 {
+    obj_buf_scheduler.stop();
     uninitializeZCQCommLibrary();
     return canOK;
 }
@@ -75,6 +75,40 @@ public:
                             const uint8_t dlc, const uint32_t flag,
                             int timeout_in_ms) = 0;
 
+    struct TxFrame {
+        uint32_t id;
+        const uint8_t* msg;
+        uint8_t dlc;
+        uint32_t flags;
+    };
+
+    /**
+     * Send frames in order, stops at the first one that fails and returns
+     * its result. sent is the number of frames queued before it.
+     */
+    virtual SendResult sendBatch(const TxFrame* frames, unsigned int count,
+                                 unsigned int& sent, int timeout_in_ms) {
+        /* Optionally implemented, one send per frame */
+        for ( sent = 0; sent < count; ++sent ) {
+            const TxFrame& frame = frames[sent];
+            SendResult result = send(frame.id, frame.msg, frame.dlc, frame.flags, timeout_in_ms);
+            if ( result != SendStatusOK ) return result;
+        }
+
+        return SendStatusOK;
+    }
+
+    /**
+     * Wait until every frame sent on the channel has been acknowledged by
+     * the device. A timeout of -1 waits forever, 0 only checks.
+     */
+    virtual SendResult waitForTxIdle(int timeout_in_ms) {
+        /* Optionally implemented */
+        ZUNUSED(timeout_in_ms)
+
+        return SendError;
+    }
+
     enum EventTypeID {
         RX,
         TX,
@@ -121,6 +155,93 @@ public:
 
     virtual int getBusLoad() = 0;
 
+    enum DeviceFrameBusType {
+        DeviceFrameCAN,
+        DeviceFrameLIN
+    };
+
+    struct DeviceFrame {
+        DeviceFrameBusType bus_type;
+        int channel_nr;
+        uint32_t id;
+        uint8_t msg[64];
+        uint8_t dlc;
+        uint32_t flags;
+        uint64_t timestamp_in_us;
+    };
+
+    /**
+     * Read frames from the device level RX queue, all channels of the
+     * device opened with DeviceRxQueue are delivered here in arrival order.
+     */
+    virtual ReadResult readDeviceWait(DeviceFrame* frames, unsigned int max_count,
+                                      unsigned int& count, int timeout_in_ms) {
+        /* Optionally implemented */
+        ZUNUSED(frames)
+        ZUNUSED(max_count)
+        ZUNUSED(timeout_in_ms)
+
+        count = 0;
+        return ReadError;
+    }
+
+    /**
+     * TX acknowledge delivery to the RX queue. Acknowledges are always used
+     * internally to release TX credits, TxAckOffInternal is the same as TxAckOff.
+     */
+    virtual bool setTxAckMode(TxAckMode mode) {
+        /* Optionally implemented */
+        ZUNUSED(mode)
+
+        return false;
+    }
+
+    /**
+     * Host TX queue. Frames the device has no credits for are queued in the
+     * library, up to queue_size, and handed to the device in priority order
+     * as TX acks free credits. device_frames limits the frames queued in the
+     * device in any mode, so queued frames overtake fewer, 0 uses the device
+     * limit.
+     */
+    virtual bool setTxQueue(TxQueueMode mode, unsigned int queue_size, unsigned int device_frames) {
+        /* Optionally implemented */
+        ZUNUSED(mode)
+        ZUNUSED(queue_size)
+        ZUNUSED(device_frames)
+
+        return false;
+    }
+
+    /**
+     * TX rate shaping. Limits the transmit rate to percent of the bus time,
+     * with bursts of up to burst_in_us bus time, by holding frames in the
+     * host TX queue. percent 0 turns shaping off, burst_in_us 0 uses the
+     * default.
+     */
+    virtual bool setTxRateLimit(unsigned int percent, unsigned int burst_in_us) {
+        /* Optionally implemented */
+        ZUNUSED(percent)
+        ZUNUSED(burst_in_us)
+
+        return false;
+    }
+
+    virtual TxAckMode getTxAckMode() {
+        /* Optionally implemented */
+        return TxAckOn;
+    }
+
+    /**
+     * Local TX echo, transmitted frames are delivered to the other handles
+     * on the channel as received frames, never to the sending handle.
+     */
+    virtual bool setLocalTxEcho(bool enabled) {
+        /* Optionally implemented */
+        ZUNUSED(enabled)
+
+        return false;
+    }
+
     virtual ZCANDriver* getCANDriver() const = 0;
 protected:
 
@@ -59,9 +59,13 @@ public:
         ISO15765UnknownType = 0x40000,
         CanFDFrame          = 0x80000,
         CanFDBitrateSwitch  = 0x100000,
-        CanFDESI            = 0x200000
+        CanFDESI            = 0x200000,
+        TxPriorityMask      = 0x30000000, /* Host TX queue priority class, 0 is the highest */
+        DeviceGap           = 0x40000000  /* Device was lost and recovered, data holds the outage in us */
     };
 
+    enum { TxPriorityShift = 28 };
+
     enum CapabilitesMask {
         ExtendedCAN      = 0x00000001L,
         BusStatistics    = 0x00000002L,
@@ -76,6 +80,9 @@ public:
         Remote           = 0x00040000L,
         CanFD            = 0x00080000L,
         CanFDNonISO      = 0x00100000L,
+        TxLowLatency     = 0x10000000L,
+        DeviceRxQueueLIN = 0x20000000L,
+        DeviceRxQueue    = 0x40000000L,
         SharedMode       = 0x80000000L
     };
 
@@ -99,6 +106,18 @@ public:
         SendInvalidParam = -3,
         SendError = -4
     };
+
+    enum TxAckMode {
+        TxAckOff = 0,
+        TxAckOn = 1,
+        TxAckOffInternal = 2
+    };
+
+    enum TxQueueMode {
+        TxQueueOff = 0,         /* Senders wait for device credits */
+        TxQueueById = 1,        /* Lowest arbitration ID first */
+        TxQueueByClass = 2      /* Lowest TxPriorityMask class first, FIFO within a class */
+    };
 };
 
 #endif /* ZCANFLAGS_H */
@@ -0,0 +1,605 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "zcanobjbufscheduler.h"
+#include "zthreadscheduling.h"
+#include "zdebug.h"
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#ifdef Z_OS_LINUX
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#define ZCAN_OBJBUF_BURST_BATCH     64      /* Burst frames queued per tick and buffer */
+
+ZCANObjBufScheduler::ZCANObjBufScheduler()
+    : running(false), woken(false), in_service(false), thread(nullptr)
+#ifdef Z_OS_LINUX
+      , timer_fd(-1), wakeup_fd(-1)
+#endif
+{
+    /* no op */
+}
+
+ZCANObjBufScheduler::~ZCANObjBufScheduler()
+{
+    stop();
+}
+
+int ZCANObjBufScheduler::allocate(int handle, ZCANChannel* channel)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto& buffers = handle_buffers[handle];
+    size_t index = 0;
+    while ( index < buffers.size() && buffers[index] != nullptr ) index++;
+    if ( index >= ZCAN_OBJBUF_MAX_COUNT ) return -1;
+    if ( index == buffers.size() ) buffers.emplace_back();
+
+    Buffer* buffer = new Buffer();
+    buffer->handle = handle;
+    buffer->index = int(index);
+    buffer->channel = channel;
+    buffers[index].reset(buffer);
+
+    startUnlocked();
+
+    return int(index);
+}
+
+bool ZCANObjBufScheduler::freeBuffer(int handle, int index)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    /* Due entries point at the buffers while frames are sent unlocked */
+    service_cond.wait(lock, [this]() { return !in_service; });
+
+    Buffer* buffer = findBufferUnlocked(handle, index);
+    if ( buffer == nullptr ) return false;
+
+    removeEntriesUnlocked(buffer);
+
+    auto& buffers = handle_buffers[handle];
+    buffers[size_t(index)].reset();
+    if ( std::all_of(buffers.begin(), buffers.end(),
+                     [](const std::unique_ptr<Buffer>& b) { return b == nullptr; }) ) {
+        handle_buffers.erase(handle);
+    }
+
+    return true;
+}
+
+void ZCANObjBufScheduler::freeAll(int handle)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    service_cond.wait(lock, [this]() { return !in_service; });
+
+    auto it = handle_buffers.find(handle);
+    if ( it == handle_buffers.end() ) return;
+
+    for ( auto& buffer : it->second ) {
+        if ( buffer != nullptr ) removeEntriesUnlocked(buffer.get());
+    }
+    handle_buffers.erase(it);
+}
+
+bool ZCANObjBufScheduler::isAllocated(int handle, int index)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return findBufferUnlocked(handle, index) != nullptr;
+}
+
+bool ZCANObjBufScheduler::write(int handle, int index, uint32_t id, const uint8_t* msg,
+                                uint8_t dlc, uint32_t flags)
+{
+    if ( dlc > 64 || (dlc > 0 && msg == nullptr) ) return false;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Buffer* buffer = findBufferUnlocked(handle, index);
+    if ( buffer == nullptr ) return false;
+
+    /* An enabled buffer sends the new contents from its next period */
+    buffer->id = id;
+    if ( dlc > 0 ) memcpy(buffer->msg, msg, dlc);
+    buffer->dlc = dlc;
+    buffer->flags = flags;
+    buffer->has_data = true;
+
+    return true;
+}
+
+bool ZCANObjBufScheduler::setPeriod(int handle, int index, uint32_t period_in_us)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Buffer* buffer = findBufferUnlocked(handle, index);
+    if ( buffer == nullptr ) return false;
+
+    buffer->period_in_us = period_in_us;
+    buffer->statistics.period_in_us = period_in_us;
+
+    if ( buffer->enabled ) {
+        uint64_t now_in_us = nowInUs();
+        uint64_t due_in_us = now_in_us;
+        if ( buffer->last_sent_in_us != 0 ) {
+            due_in_us = std::max(now_in_us, buffer->last_sent_in_us + period_in_us);
+        }
+        schedulePeriodicUnlocked(buffer, due_in_us);
+    }
+
+    return true;
+}
+
+bool ZCANObjBufScheduler::setMessageCount(int handle, int index, uint32_t count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Buffer* buffer = findBufferUnlocked(handle, index);
+    if ( buffer == nullptr ) return false;
+
+    buffer->message_count = count;
+    buffer->remaining = count;
+
+    return true;
+}
+
+bool ZCANObjBufScheduler::enable(int handle, int index)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Buffer* buffer = findBufferUnlocked(handle, index);
+    if ( buffer == nullptr || !buffer->has_data ) return false;
+
+    buffer->enabled = true;
+    buffer->remaining = buffer->message_count;
+    buffer->last_sent_in_us = 0;
+    memset(&buffer->statistics, 0, sizeof(buffer->statistics));
+    buffer->statistics.period_in_us = buffer->period_in_us;
+
+    /* The first frame goes out at once, a buffer without period waits for setPeriod() */
+    schedulePeriodicUnlocked(buffer, nowInUs());
+
+    return true;
+}
+
+bool ZCANObjBufScheduler::disable(int handle, int index)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Buffer* buffer = findBufferUnlocked(handle, index);
+    if ( buffer == nullptr ) return false;
+
+    /* Queued entries of the old generation are dropped when they come due */
+    buffer->enabled = false;
+    buffer->generation++;
+
+    return true;
+}
+
+bool ZCANObjBufScheduler::sendBurst(int handle, int index, uint32_t count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Buffer* buffer = findBufferUnlocked(handle, index);
+    if ( buffer == nullptr || !buffer->has_data ) return false;
+
+    buffer->burst_pending += count;
+    if ( buffer->burst_pending > 0 && !buffer->burst_scheduled ) {
+        buffer->burst_scheduled = true;
+        scheduleUnlocked({ nowInUs(), buffer, 0, true });
+    }
+
+    return true;
+}
+
+bool ZCANObjBufScheduler::getStatistics(int handle, int index, Statistics& statistics)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Buffer* buffer = findBufferUnlocked(handle, index);
+    if ( buffer == nullptr ) return false;
+
+    statistics = buffer->statistics;
+
+    return true;
+}
+
+void ZCANObjBufScheduler::stop()
+{
+    std::unique_ptr<std::thread> stopping_thread;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+        wakeUp();
+        stopping_thread = std::move(thread);
+    }
+
+    if ( stopping_thread != nullptr ) stopping_thread->join();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    heap.clear();
+    handle_buffers.clear();
+
+#ifdef Z_OS_LINUX
+    if ( timer_fd >= 0 ) {
+        ::close(timer_fd);
+        timer_fd = -1;
+    }
+
+    if ( wakeup_fd >= 0 ) {
+        ::close(wakeup_fd);
+        wakeup_fd = -1;
+    }
+#endif
+}
+
+ZCANObjBufScheduler::Buffer* ZCANObjBufScheduler::findBufferUnlocked(int handle, int index)
+{
+    auto it = handle_buffers.find(handle);
+    if ( it == handle_buffers.end() ) return nullptr;
+    if ( index < 0 || size_t(index) >= it->second.size() ) return nullptr;
+
+    return it->second[size_t(index)].get();
+}
+
+void ZCANObjBufScheduler::scheduleUnlocked(const Entry& entry)
+{
+    bool earliest = heap.empty() || entry.due_in_us < heap.front().due_in_us;
+
+    heap.push_back(entry);
+    std::push_heap(heap.begin(), heap.end(), entryAfter);
+
+    /* The thread picks up the next due time itself after a service run */
+    if ( earliest && !in_service ) wakeUp();
+}
+
+void ZCANObjBufScheduler::schedulePeriodicUnlocked(Buffer* buffer, uint64_t due_in_us)
+{
+    buffer->generation++;
+    if ( !buffer->enabled || buffer->period_in_us == 0 ) return;
+
+    scheduleUnlocked({ due_in_us, buffer, buffer->generation, false });
+}
+
+void ZCANObjBufScheduler::removeEntriesUnlocked(Buffer* buffer)
+{
+    heap.erase(std::remove_if(heap.begin(), heap.end(),
+                              [buffer](const Entry& entry) { return entry.buffer == buffer; }),
+               heap.end());
+    std::make_heap(heap.begin(), heap.end(), entryAfter);
+}
+
+void ZCANObjBufScheduler::startUnlocked()
+{
+    if ( thread != nullptr ) return;
+
+#ifdef Z_OS_LINUX
+    if ( timer_fd < 0 ) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if ( timer_fd < 0 || wakeup_fd < 0 ) {
+            zError("Object buffer scheduler failed to create timerfd: %d, using condition wait", errno);
+            if ( timer_fd >= 0 ) ::close(timer_fd);
+            if ( wakeup_fd >= 0 ) ::close(wakeup_fd);
+            timer_fd = -1;
+            wakeup_fd = -1;
+        }
+    }
+#endif
+
+    running = true;
+    woken = false;
+    thread.reset(new std::thread(&ZCANObjBufScheduler::run, this));
+}
+
+void ZCANObjBufScheduler::wakeUp()
+{
+    woken = true;
+    wakeup_cond.notify_one();
+
+#ifdef Z_OS_LINUX
+    if ( wakeup_fd >= 0 ) {
+        uint64_t one = 1;
+        if ( ::write(wakeup_fd, &one, sizeof(one)) < 0 ) {
+            zError("Object buffer scheduler wakeup failed: %d", errno);
+        }
+    }
+#endif
+}
+
+void ZCANObjBufScheduler::run()
+{
+    zDebug("Object buffer scheduler started");
+    ZThreadScheduling::applyToCurrentThread("CAN periodic TX");
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while ( running ) {
+        serviceDueUnlocked(lock, nowInUs());
+
+        uint64_t due_in_us = heap.empty() ? UINT64_MAX : heap.front().due_in_us;
+        waitUntil(lock, due_in_us);
+    }
+
+    zDebug("Object buffer scheduler ended");
+}
+
+void ZCANObjBufScheduler::waitUntil(std::unique_lock<std::mutex>& lock, uint64_t due_in_us)
+{
+#ifdef Z_OS_LINUX
+    if ( timer_fd >= 0 ) {
+        /* An absolute time in the past expires at once, zero disarms */
+        itimerspec timer_spec;
+        memset(&timer_spec, 0, sizeof(timer_spec));
+        if ( due_in_us != UINT64_MAX ) {
+            timer_spec.it_value.tv_sec = time_t(due_in_us / 1000000);
+            timer_spec.it_value.tv_nsec = long(due_in_us % 1000000) * 1000;
+        }
+        if ( timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer_spec, nullptr) < 0 ) {
+            zError("Object buffer scheduler timerfd_settime failed: %d", errno);
+        }
+
+        /* The eventfd keeps wakeups made while unlocked */
+        woken = false;
+        lock.unlock();
+
+        pollfd poll_fds[2];
+        poll_fds[0].fd = timer_fd;
+        poll_fds[0].events = POLLIN;
+        poll_fds[0].revents = 0;
+        poll_fds[1].fd = wakeup_fd;
+        poll_fds[1].events = POLLIN;
+        poll_fds[1].revents = 0;
+        if ( poll(poll_fds, 2, -1) < 0 && errno != EINTR ) {
+            zError("Object buffer scheduler poll failed: %d", errno);
+        }
+
+        uint64_t value;
+        if ( read(timer_fd, &value, sizeof(value)) < 0 ) { /* not expired */ }
+        if ( read(wakeup_fd, &value, sizeof(value)) < 0 ) { /* not woken */ }
+
+        lock.lock();
+        return;
+    }
+#endif
+
+    if ( !woken ) {
+        if ( due_in_us == UINT64_MAX ) {
+            wakeup_cond.wait(lock, [this]() { return woken; });
+        } else {
+            uint64_t now_in_us = nowInUs();
+            if ( due_in_us > now_in_us ) {
+                wakeup_cond.wait_for(lock, std::chrono::microseconds(due_in_us - now_in_us),
+                                     [this]() { return woken; });
+            }
+        }
+    }
+    woken = false;
+}
+
+void ZCANObjBufScheduler::serviceDueUnlocked(std::unique_lock<std::mutex>& lock, uint64_t now_in_us)
+{
+    due_entries.clear();
+    while ( !heap.empty() && heap.front().due_in_us <= now_in_us + ZCAN_OBJBUF_TICK_US ) {
+        std::pop_heap(heap.begin(), heap.end(), entryAfter);
+        Entry entry = heap.back();
+        heap.pop_back();
+
+        if ( !entry.burst && entry.generation != entry.buffer->generation ) continue;
+        due_entries.push_back(entry);
+    }
+
+    if ( due_entries.empty() ) return;
+
+    /* Buffers are not freed while in service, the mutex is released
+     * around each channel's sendBatch() */
+    in_service = true;
+
+    /* One batch per channel, in due order within the channel */
+    std::stable_sort(due_entries.begin(), due_entries.end(),
+                     [](const Entry& a, const Entry& b) {
+        return a.buffer->channel.get() < b.buffer->channel.get();
+    });
+
+    size_t first = 0;
+    while ( first < due_entries.size() ) {
+        ZCANChannel* channel = due_entries[first].buffer->channel.get();
+        size_t last = first + 1;
+        while ( last < due_entries.size() && due_entries[last].buffer->channel.get() == channel ) last++;
+
+        sendChannelUnlocked(lock, &due_entries[first], unsigned(last - first), nowInUs());
+        first = last;
+    }
+
+    in_service = false;
+    service_cond.notify_all();
+}
+
+void ZCANObjBufScheduler::sendChannelUnlocked(std::unique_lock<std::mutex>& lock, const Entry* entries,
+                                              unsigned int count, uint64_t now_in_us)
+{
+    ZRef<ZCANChannel> channel = entries[0].buffer->channel;
+
+    frame_data.clear();
+    frames.clear();
+    frame_entries.clear();
+    entry_sent.assign(count, 0);
+    entry_refused.assign(count, false);
+    entry_copies.assign(count, 0);
+
+    for ( unsigned int i = 0; i < count; ++i ) {
+        Buffer* buffer = entries[i].buffer;
+        uint32_t copies = entries[i].burst ? std::min<uint32_t>(buffer->burst_pending, ZCAN_OBJBUF_BURST_BATCH) : 1;
+        entry_copies[i] = copies;
+        for ( uint32_t c = 0; c < copies; ++c ) {
+            frame_data.emplace_back();
+            memcpy(frame_data.back().msg, buffer->msg, sizeof(buffer->msg));
+            frames.push_back({ buffer->id, nullptr, buffer->dlc, buffer->flags });
+            frame_entries.push_back(i);
+        }
+    }
+    for ( size_t k = 0; k < frames.size(); ++k ) frames[k].msg = frame_data[k].msg;
+
+    /* Frames are queued without waiting, the rest of a full buffer is lost
+     * for this period. A frame the channel refuses is skipped. */
+    lock.unlock();
+
+    size_t next = 0;
+    while ( next < frames.size() ) {
+        unsigned int sent = 0;
+        ZCANChannel::SendResult result = channel->sendBatch(&frames[next], unsigned(frames.size() - next),
+                                                            sent, 0);
+        size_t batch_start = next;
+        for ( size_t k = next; k < next + sent; ++k ) entry_sent[frame_entries[k]]++;
+        next += sent;
+
+        if ( result == ZCANChannel::SendStatusOK ) break;
+        if ( result == ZCANChannel::TransmitBufferOveflow || result == ZCANChannel::SendTimeout ) break;
+
+        if ( next >= frames.size() ) {
+            /* Every frame was queued but the USB submit failed */
+            for ( size_t k = batch_start; k < next; ++k ) {
+                entry_sent[frame_entries[k]]--;
+                entry_refused[frame_entries[k]] = true;
+            }
+            break;
+        }
+
+        entry_refused[frame_entries[next]] = true;
+        next++;
+    }
+
+    lock.lock();
+
+    for ( unsigned int i = 0; i < count; ++i ) {
+        const Entry& entry = entries[i];
+        Buffer* buffer = entry.buffer;
+
+        if ( !entry.burst ) {
+            periodicSentUnlocked(entry, entry_sent[i] > 0, entry_refused[i], now_in_us);
+            continue;
+        }
+
+        buffer->statistics.burst_sent += entry_sent[i];
+        buffer->burst_pending -= std::min(buffer->burst_pending, entry_sent[i]);
+        buffer->burst_scheduled = false;
+        if ( entry_refused[i] ) {
+            buffer->statistics.errors++;
+            buffer->burst_pending = 0;
+        }
+
+        if ( buffer->burst_pending > 0 ) {
+            /* Continue at once while the channel takes frames, retry later when it is full */
+            bool all_sent = entry_sent[i] == entry_copies[i];
+            buffer->burst_scheduled = true;
+            scheduleUnlocked({ all_sent ? now_in_us : now_in_us + ZCAN_OBJBUF_BURST_RETRY_US,
+                               buffer, 0, true });
+        }
+    }
+}
+
+void ZCANObjBufScheduler::periodicSentUnlocked(const Entry& entry, bool sent, bool refused,
+                                               uint64_t now_in_us)
+{
+    Buffer* buffer = entry.buffer;
+    Statistics& statistics = buffer->statistics;
+
+    if ( sent ) {
+        statistics.sent++;
+
+        uint64_t lateness = now_in_us > entry.due_in_us ? now_in_us - entry.due_in_us : 0;
+        statistics.lateness_max_in_us = std::max(statistics.lateness_max_in_us, lateness);
+        statistics.lateness_sum_in_us += lateness;
+
+        if ( buffer->last_sent_in_us != 0 ) {
+            uint64_t interval = now_in_us - buffer->last_sent_in_us;
+            if ( statistics.interval_count == 0 || interval < statistics.interval_min_in_us ) {
+                statistics.interval_min_in_us = interval;
+            }
+            statistics.interval_max_in_us = std::max(statistics.interval_max_in_us, interval);
+            statistics.interval_sum_in_us += interval;
+            statistics.interval_count++;
+        }
+        buffer->last_sent_in_us = now_in_us;
+
+        if ( entry.generation != buffer->generation ) {
+            /* Disabled or rescheduled while the frame was being sent */
+            return;
+        }
+
+        if ( buffer->message_count != 0 && --buffer->remaining == 0 ) {
+            buffer->enabled = false;
+            buffer->generation++;
+            return;
+        }
+    } else if ( refused ) {
+        statistics.errors++;
+    } else {
+        statistics.overflows++;
+    }
+    if ( entry.generation != buffer->generation ) return;
+
+    /* Stay on the period grid, periods the thread slept through are skipped */
+    uint64_t period = buffer->period_in_us;
+    uint64_t due_in_us = entry.due_in_us + period;
+    if ( due_in_us <= now_in_us ) {
+        uint64_t missed = (now_in_us - due_in_us) / period + 1;
+        statistics.skipped += missed;
+        due_in_us += missed * period;
+    }
+
+    scheduleUnlocked({ due_in_us, buffer, buffer->generation, false });
+}
+
+bool ZCANObjBufScheduler::entryAfter(const Entry& a, const Entry& b)
+{
+    return a.due_in_us > b.due_in_us;
+}
+
+uint64_t ZCANObjBufScheduler::nowInUs()
+{
+#ifdef Z_OS_LINUX
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return uint64_t(now.tv_sec) * 1000000 + uint64_t(now.tv_nsec) / 1000;
+#else
+    return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
@@ -0,0 +1,170 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef ZCANOBJBUFSCHEDULER_H
+#define ZCANOBJBUFSCHEDULER_H
+
+#include "zcanchannel.h"
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#define ZCAN_OBJBUF_MAX_COUNT       32      /* Object buffers per handle */
+#define ZCAN_OBJBUF_TICK_US         100     /* Frames due this close together are sent in one batch */
+#define ZCAN_OBJBUF_BURST_RETRY_US  1000    /* Retry interval of a burst stopped by a full TX buffer */
+
+/**
+ * Host side periodic transmit for the canObjBuf functions. One thread
+ * serves the buffers of all handles from a heap ordered by due time and
+ * sleeps on a timerfd until the next one is due (Linux), or on a condition
+ * variable elsewhere. Frames of a channel that are due in the same tick
+ * are queued with one sendBatch() call, which puts them in one USB
+ * transfer. Frames are queued without waiting, a period that finds the
+ * transmit buffer full is counted and skipped. The frames are copied and
+ * sent with the mutex released, so the canObjBuf calls never wait for USB.
+ */
+class ZCANObjBufScheduler {
+public:
+    struct Statistics {
+        uint32_t period_in_us;
+        uint64_t sent;                  /* Periodic frames queued */
+        uint64_t burst_sent;            /* Frames queued by sendBurst() */
+        uint64_t overflows;             /* Periods lost to a full transmit buffer */
+        uint64_t errors;                /* Frames the channel refused */
+        uint64_t skipped;               /* Periods skipped because the scheduler ran late */
+        uint64_t interval_count;        /* Intervals between consecutive periodic frames */
+        uint64_t interval_min_in_us;
+        uint64_t interval_max_in_us;
+        uint64_t interval_sum_in_us;
+        uint64_t lateness_max_in_us;    /* Time from due to queued */
+        uint64_t lateness_sum_in_us;
+    };
+
+    ZCANObjBufScheduler();
+    ~ZCANObjBufScheduler();
+
+    /* Returns the buffer index or -1 if all buffers of the handle are used */
+    int allocate(int handle, ZCANChannel* channel);
+    bool freeBuffer(int handle, int index);
+    void freeAll(int handle);
+    bool isAllocated(int handle, int index);
+
+    bool write(int handle, int index, uint32_t id, const uint8_t* msg,
+               uint8_t dlc, uint32_t flags);
+    bool setPeriod(int handle, int index, uint32_t period_in_us);
+    /* Number of frames sent after enable(), 0 sends until disabled */
+    bool setMessageCount(int handle, int index, uint32_t count);
+    bool enable(int handle, int index);
+    bool disable(int handle, int index);
+    bool sendBurst(int handle, int index, uint32_t count);
+    bool getStatistics(int handle, int index, Statistics& statistics);
+
+    /* Frees all buffers and stops the thread, it starts again on the next allocate() */
+    void stop();
+
+private:
+    struct Buffer {
+        int handle;
+        int index;
+        ZRef<ZCANChannel> channel;
+        uint32_t id;
+        uint8_t msg[64];
+        uint8_t dlc;
+        uint32_t flags;
+        bool has_data;
+        bool enabled;
+        uint32_t period_in_us;
+        uint32_t message_count;
+        uint32_t remaining;
+        uint32_t burst_pending;
+        bool burst_scheduled;
+        uint32_t generation;            /* Bumped when the periodic schedule changes */
+        uint64_t last_sent_in_us;
+        Statistics statistics;
+    };
+
+    struct Entry {
+        uint64_t due_in_us;
+        Buffer* buffer;
+        uint32_t generation;
+        bool burst;
+    };
+
+    Buffer* findBufferUnlocked(int handle, int index);
+    void scheduleUnlocked(const Entry& entry);
+    void schedulePeriodicUnlocked(Buffer* buffer, uint64_t due_in_us);
+    void removeEntriesUnlocked(Buffer* buffer);
+    void startUnlocked();
+    void wakeUp();
+
+    void run();
+    void waitUntil(std::unique_lock<std::mutex>& lock, uint64_t due_in_us);
+    void serviceDueUnlocked(std::unique_lock<std::mutex>& lock, uint64_t now_in_us);
+    void sendChannelUnlocked(std::unique_lock<std::mutex>& lock, const Entry* entries, unsigned int count,
+                             uint64_t now_in_us);
+    void periodicSentUnlocked(const Entry& entry, bool sent, bool refused, uint64_t now_in_us);
+
+    static bool entryAfter(const Entry& a, const Entry& b);
+    static uint64_t nowInUs();
+
+    std::mutex mutex;
+    std::map<int, std::vector<std::unique_ptr<Buffer>>> handle_buffers;
+    std::vector<Entry> heap;
+    std::vector<Entry> due_entries;
+    /* Copies of the buffer contents, sent with the mutex released */
+    struct FrameData {
+        uint8_t msg[64];
+    };
+    std::vector<FrameData> frame_data;
+    std::vector<ZCANChannel::TxFrame> frames;
+    std::vector<unsigned int> frame_entries;
+    std::vector<uint32_t> entry_sent;
+    std::vector<bool> entry_refused;
+    std::vector<uint32_t> entry_copies;
+
+    bool running;
+    bool woken;
+    bool in_service;
+    std::condition_variable service_cond;   /* Signalled when in_service is cleared */
+    std::condition_variable wakeup_cond;
+    std::unique_ptr<std::thread> thread;
+#ifdef Z_OS_LINUX
+    int timer_fd;
+    int wakeup_fd;
+#endif
+};
+
+#endif /* ZCANOBJBUFSCHEDULER_H */
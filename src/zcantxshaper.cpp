@@ -0,0 +1,120 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "zcantxshaper.h"
+#include <algorithm>
+#include <chrono>
+
+ZCANTxShaper::ZCANTxShaper()
+    : percent(0),
+      capacity_in_ns(0),
+      tokens_in_ns(0),
+      last_refill_in_ns(0)
+{
+}
+
+void ZCANTxShaper::configure(unsigned int _percent, unsigned int burst_in_us)
+{
+    if ( burst_in_us == 0 ) burst_in_us = ZCAN_TX_SHAPER_DEFAULT_BURST_US;
+
+    percent = std::min(_percent, 100u);
+    capacity_in_ns = uint64_t(burst_in_us) * 1000;
+
+    /* Start with a full bucket */
+    tokens_in_ns = capacity_in_ns;
+    last_refill_in_ns = nowInNs();
+}
+
+uint64_t ZCANTxShaper::delayInNs(uint32_t cost_in_ns, uint64_t now_in_ns)
+{
+    if ( percent == 0 ) return 0;
+
+    if ( now_in_ns > last_refill_in_ns ) {
+        uint64_t refill = (now_in_ns - last_refill_in_ns) * percent / 100;
+        tokens_in_ns = std::min(capacity_in_ns, tokens_in_ns + refill);
+        last_refill_in_ns = now_in_ns;
+    }
+
+    /* A frame longer than the burst waits for a full bucket */
+    uint64_t cost = std::min(uint64_t(cost_in_ns), capacity_in_ns);
+    if ( tokens_in_ns >= cost ) return 0;
+
+    return ((cost - tokens_in_ns) * 100 + percent - 1) / percent;
+}
+
+void ZCANTxShaper::consume(uint32_t cost_in_ns)
+{
+    if ( percent == 0 ) return;
+
+    uint64_t cost = std::min(uint64_t(cost_in_ns), capacity_in_ns);
+    tokens_in_ns -= std::min(tokens_in_ns, cost);
+}
+
+uint32_t ZCANTxShaper::frameBusTimeInNs(bool extended, bool fd, bool bitrate_switch,
+                                        unsigned int data_length, int bitrate, int data_bitrate)
+{
+    if ( bitrate <= 0 ) return 0;
+    if ( data_bitrate <= 0 || !bitrate_switch ) data_bitrate = bitrate;
+
+    /* CRC delimiter, ACK slot and delimiter, EOF and intermission */
+    const unsigned int tail_bits = 1 + 2 + 7 + 3;
+    unsigned int nominal_bits;
+    unsigned int data_bits = 0;
+
+    if (!fd) {
+        /* SOF to the end of the CRC is stuffed, 34 bits without data for
+         * a standard frame and 54 for an extended frame */
+        unsigned int stuffed_bits = (extended ? 54 : 34) + 8 * data_length;
+        nominal_bits = stuffed_bits + (stuffed_bits - 1) / 4 + tail_bits;
+    } else {
+        /* Arbitration phase up to BRS, then ESI, DLC and data at the data
+         * bitrate, followed by the stuff count and a 17 or 21 bit CRC with
+         * fixed stuff bits */
+        unsigned int arbitration_bits = extended ? 36 : 17;
+        unsigned int payload_bits = 5 + 8 * data_length;
+        unsigned int crc_bits = data_length > 16 ? 4 + 21 + 7 : 4 + 17 + 6;
+
+        nominal_bits = arbitration_bits + (arbitration_bits - 1) / 4 + tail_bits;
+        data_bits = payload_bits + payload_bits / 4 + crc_bits;
+    }
+
+    uint64_t time_in_ns = uint64_t(nominal_bits) * 1000000000 / unsigned(bitrate) +
+                          uint64_t(data_bits) * 1000000000 / unsigned(data_bitrate);
+
+    return uint32_t(std::min(time_in_ns, uint64_t(UINT32_MAX)));
+}
+
+uint64_t ZCANTxShaper::nowInNs()
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
@@ -0,0 +1,74 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef ZCANTXSHAPER_H
+#define ZCANTXSHAPER_H
+
+#include <stdint.h>
+
+#define ZCAN_TX_SHAPER_DEFAULT_BURST_US  1000    /* Bus time a channel may send back to back */
+
+/**
+ * Token bucket limiting the transmit rate of a channel to a fraction of
+ * the bus. Tokens are bus time in nanoseconds, refilled at percent of real
+ * time up to the burst size, and each frame costs the time it occupies the
+ * bus at the nominal and data phase bitrates. The caller holds frames the
+ * bucket has no room for, the shaper only does the accounting and is not
+ * thread safe.
+ */
+class ZCANTxShaper {
+public:
+    ZCANTxShaper();
+
+    /* percent 0 disables the shaper, burst_in_us 0 uses the default */
+    void configure(unsigned int percent, unsigned int burst_in_us);
+    bool isEnabled() const { return percent != 0; }
+
+    /* Nanoseconds until a frame of cost_in_ns fits, 0 when it fits now */
+    uint64_t delayInNs(uint32_t cost_in_ns, uint64_t now_in_ns);
+    void consume(uint32_t cost_in_ns);
+
+    /* Bus time of a frame with worst case bit stuffing, data_length in
+     * bytes. bitrate 0 returns 0, data_bitrate 0 uses bitrate */
+    static uint32_t frameBusTimeInNs(bool extended, bool fd, bool bitrate_switch,
+                                     unsigned int data_length, int bitrate, int data_bitrate);
+
+    static uint64_t nowInNs();
+
+private:
+    unsigned int percent;
+    uint64_t capacity_in_ns;
+    uint64_t tokens_in_ns;
+    uint64_t last_refill_in_ns;
+};
+
+#endif // ZCANTXSHAPER_H
@@ -33,143 +33,360 @@
 #include "zcqcore.h"
 #include "zzenocandriver.h"
 #include "zzenolindriver.h"
+#include "zusbcontext.h"
+#include "zthreadscheduling.h"
+#include "zzenodeviceinfocache.h"
+#include "zzenosimdevice.h"
+#include "zzenousbcapture.h"
 #include <cassert>
 #include <vector>
+#include <atomic>
+#include <mutex>
 
 /*** ---------------------------==*+*+*==---------------------------------- ***/
+struct ZCQChannelTable {
+  std::vector<ZRef<ZCANChannel> > can_channel_list;
+  std::vector<ZRef<ZLINChannel> > lin_channel_list;
+};
+
 class ZCQCore {
 public:
   ZCQCore();
+  ~ZCQCore();
 
+  void publishChannelTable();
+
+  ZCQChannelTable* channels() const {
+      return channel_table.load(std::memory_order_acquire);
+  }
+
+  ZRef<ZZenoCANDriver> zeno_can_driver;
   std::vector<ZRef<ZCANDriver> > can_driver_list;
-  std::vector<ZRef<ZCANChannel> > can_channel_list;
-  std::vector<ZRef<ZLINChannel> > lin_channel_list;
+
+  /* The channel table is replaced as a whole when devices come and go and
+   * is read without locks. Callers may still use channel pointers from a
+   * replaced table, so those are kept until the library is uninitialized */
+  std::atomic<ZCQChannelTable*> channel_table;
+  std::vector<ZCQChannelTable*> retired_channel_tables;
+  std::mutex publish_mutex;
 };
 
 static std::mutex init_mutex;
-static ZCQCore* __instance = nullptr;
+static bool library_initialized = false;
+static std::atomic<ZCQCore*> __instance(nullptr);
+
+/* Devices are enumerated and channels created on first use, not in
+ * canInitializeLibrary(), a process that never touches a channel pays
+ * nothing for them */
+static ZCQCore* instance()
+{
+    ZCQCore* core = __instance.load(std::memory_order_acquire);
+    if ( core != nullptr ) return core;
+
+    std::lock_guard<std::mutex> lock(init_mutex);
+    if ( !library_initialized ) return nullptr;
+
+    core = __instance.load(std::memory_order_relaxed);
+    if ( core == nullptr ) {
+        core = new ZCQCore();
+        __instance.store(core, std::memory_order_release);
+    }
+
+    return core;
+}
 
 /*** ---------------------------==*+*+*==---------------------------------- ***/
 ZCQCore::ZCQCore()
+    : zeno_can_driver(new ZZenoCANDriver()),
+      channel_table(nullptr)
 {
-    ZRef<ZZenoCANDriver> zeno_can_driver = new ZZenoCANDriver();
     can_driver_list.push_back(zeno_can_driver.cast<ZCANDriver>());
+    publishChannelTable();
+
+    zeno_can_driver->startHotplug([this]() { publishChannelTable(); });
+}
+
+ZCQCore::~ZCQCore()
+{
+    /* No more table updates from the hotplug thread */
+    zeno_can_driver->stopHotplug();
 
-    int number_of_channels = zeno_can_driver->getNumberOfChannels();
-    for(int i = 0; i < number_of_channels; ++i) {
-        ZRef<ZCANChannel> can_channel = zeno_can_driver->getChannel(i);
-        can_channel_list.push_back(can_channel);
+    delete channel_table.load();
+    for ( auto table : retired_channel_tables ) {
+        delete table;
     }
-    can_channel_list.shrink_to_fit();
-
-    ZRef<ZZenoLINDriver> zeno_lin_driver = zeno_can_driver->getZenoLINDriver();
-    if ( zeno_lin_driver != nullptr ) {
-        number_of_channels = zeno_lin_driver->getNumberOfChannels();
-        for(int i = 0; i < number_of_channels; ++i) {
-            ZRef<ZLINChannel> lin_channel = zeno_lin_driver->getChannel(i);
-            lin_channel_list.push_back(lin_channel);
+}
+
+void ZCQCore::publishChannelTable()
+{
+    std::lock_guard<std::mutex> lock(publish_mutex);
+
+    /* Channels in device order, new devices are added at the end */
+    ZCQChannelTable* table = new ZCQChannelTable();
+    for ( auto device : zeno_can_driver->getZenoDeviceList() ) {
+        for ( unsigned i = 0; i < device->getCANChannelCount(); ++i ) {
+            table->can_channel_list.push_back(device->getCANChannel(i));
+        }
+        for ( unsigned i = 0; i < device->getLINChannelCount(); ++i ) {
+            table->lin_channel_list.push_back(device->getLINChannel(i));
         }
-        lin_channel_list.shrink_to_fit();
     }
+    table->can_channel_list.shrink_to_fit();
+    table->lin_channel_list.shrink_to_fit();
+
+    ZCQChannelTable* old_table = channel_table.exchange(table, std::memory_order_acq_rel);
+    if ( old_table != nullptr ) retired_channel_tables.push_back(old_table);
 }
 
 /*** ---------------------------==*+*+*==---------------------------------- ***/
 void initializeZCQCommLibrary()
 {
     std::lock_guard<std::mutex> lock(init_mutex);
-    if ( __instance == nullptr ) {
-        __instance = new ZCQCore();
-    }
+    library_initialized = true;
 }
 
 void uninitializeZCQCommLibrary()
 {
     std::lock_guard<std::mutex> lock(init_mutex);
-    if ( __instance != nullptr ) {
-        delete __instance;
-        __instance = nullptr;
-    }
+    library_initialized = false;
+    delete __instance.exchange(nullptr);
 }
 
 ZCANChannel* getCANChannel(unsigned can_channel_index)
 {
-    if ( __instance == nullptr ) return nullptr;
-    if (can_channel_index >= __instance->can_channel_list.size()) return nullptr;
+    ZCQCore* core = instance();
+    if ( core == nullptr ) return nullptr;
+    ZCQChannelTable* table = core->channels();
+    if (can_channel_index >= table->can_channel_list.size()) return nullptr;
 
-    return __instance->can_channel_list[can_channel_index].get();
+    return table->can_channel_list[can_channel_index].get();
 }
 
 unsigned getNumberOfZCQCANChannels()
 {
-    if ( __instance == nullptr ) return 0;
-    return unsigned(__instance->can_channel_list.size());
+    ZCQCore* core = instance();
+    if ( core == nullptr ) return 0;
+    return unsigned(core->channels()->can_channel_list.size());
 }
 
 unsigned getNumberOfZCQLINChannels()
 {
-    if ( __instance == nullptr ) return 0;
-    return unsigned(__instance->lin_channel_list.size());
+    ZCQCore* core = instance();
+    if ( core == nullptr ) return 0;
+    return unsigned(core->channels()->lin_channel_list.size());
 }
 
 int getCANDeviceLocalChannelNr(int can_channel_index)
 {
-    if ( __instance == nullptr ) return -1;
-    assert(can_channel_index >=0);
-    assert(can_channel_index < int(__instance->can_channel_list.size()));
+    ZCQCore* core = instance();
+    if ( core == nullptr ) return -1;
+    ZCQChannelTable* table = core->channels();
+    if ( can_channel_index < 0 || can_channel_index >= int(table->can_channel_list.size()) ) return -1;
 
-    return __instance->can_channel_list[unsigned(can_channel_index)]->getChannelNr();
+    return table->can_channel_list[unsigned(can_channel_index)]->getChannelNr();
 }
 
 int getCANDeviceLocalChannelName(int can_channel_index, std::string& channel_name)
 {
-    if ( __instance == nullptr ) return -1;
-    assert(can_channel_index >=0);
-    assert(can_channel_index < int(__instance->can_channel_list.size()));
+    ZCQCore* core = instance();
+    if ( core == nullptr ) return -1;
+    ZCQChannelTable* table = core->channels();
+    if ( can_channel_index < 0 || can_channel_index >= int(table->can_channel_list.size()) ) return -1;
 
-    channel_name = __instance->can_channel_list[unsigned(can_channel_index)]->getObjectText();
+    channel_name = table->can_channel_list[unsigned(can_channel_index)]->getObjectText();
     return 0;
 }
 
 int getCANDeviceDescription(int can_channel_index, std::string& device_description)
 {
-    if ( __instance == nullptr ) return -1;
-    assert(can_channel_index >=0);
-    assert(can_channel_index < int(__instance->can_channel_list.size()));
+    ZCQCore* core = instance();
+    if ( core == nullptr ) return -1;
+    ZCQChannelTable* table = core->channels();
+    if ( can_channel_index < 0 || can_channel_index >= int(table->can_channel_list.size()) ) return -1;
 
-    device_description = __instance->can_channel_list[unsigned(can_channel_index)]->getDevicetText();
+    device_description = table->can_channel_list[unsigned(can_channel_index)]->getDevicetText();
 
     return 0;
 }
 
 int getCANDeviceFWVersion(int can_channel_index, uint32_t& fw_version)
 {
-    if ( __instance == nullptr ) return -1;
-    assert(can_channel_index >=0);
-    assert(can_channel_index < int(__instance->can_channel_list.size()));
+    ZCQCore* core = instance();
+    if ( core == nullptr ) return -1;
+    ZCQChannelTable* table = core->channels();
+    if ( can_channel_index < 0 || can_channel_index >= int(table->can_channel_list.size()) ) return -1;
 
-    fw_version = __instance->can_channel_list[unsigned(can_channel_index)]->getFirmwareVersion();
+    fw_version = table->can_channel_list[unsigned(can_channel_index)]->getFirmwareVersion();
 
     return 0;
 }
 
 int getCANDeviceProductCode(int can_channel_index, uint64_t& product_code)
 {
-    if ( __instance == nullptr ) return -1;
-    assert(can_channel_index >=0);
-    assert(can_channel_index < int(__instance->can_channel_list.size()));
+    ZCQCore* core = instance();
+    if ( core == nullptr ) return -1;
+    ZCQChannelTable* table = core->channels();
+    if ( can_channel_index < 0 || can_channel_index >= int(table->can_channel_list.size()) ) return -1;
 
-    product_code = __instance->can_channel_list[unsigned(can_channel_index)]->getProductCode();
+    product_code = table->can_channel_list[unsigned(can_channel_index)]->getProductCode();
 
     return 0;
 }
 
 int getCANDeviceSerialNumber(int can_channel_index, uint64_t& serial_number)
 {
-    if ( __instance == nullptr ) return -1;
-    assert(can_channel_index >=0);
-    assert(can_channel_index < int(__instance->can_channel_list.size()));
+    ZCQCore* core = instance();
+    if ( core == nullptr ) return -1;
+    ZCQChannelTable* table = core->channels();
+    if ( can_channel_index < 0 || can_channel_index >= int(table->can_channel_list.size()) ) return -1;
+
+    serial_number = table->can_channel_list[unsigned(can_channel_index)]->getSerialNumber();
+
+    return 0;
+}
+
+bool setUSBInTransferCount(int count)
+{
+    return ZZenoUSBDevice::setDefaultInTransferCount(count);
+}
+
+bool setUSBOutTransferCount(int count)
+{
+    return ZZenoUSBDevice::setDefaultOutTransferCount(count);
+}
+
+bool setUSBOutMaxDelay(int delay_in_us)
+{
+    return ZZenoUSBDevice::setDefaultOutMaxDelay(delay_in_us);
+}
 
-    serial_number = __instance->can_channel_list[unsigned(can_channel_index)]->getSerialNumber();
+bool setUSBEventMode(int mode)
+{
+    return ZUSBContext::setDefaultEventMode(mode);
+}
+
+bool setUSBEventGroups(int group_count, const int* cpus, unsigned cpu_count)
+{
+    std::vector<int> cpu_list;
+    if ( cpus != nullptr ) cpu_list.assign(cpus, cpus + cpu_count);
+
+    return ZZenoCANDriver::setDefaultEventGroups(group_count, cpu_list);
+}
+
+int handleUSBEvents(int timeout_in_ms)
+{
+    ZCQCore* core = instance();
+    if ( core == nullptr ) return -1;
+    if ( !core->zeno_can_driver->handleEvents(timeout_in_ms) ) return -2;
 
     return 0;
 }
+
+bool setThreadScheduling(int policy, int priority, const int* cpus, unsigned cpu_count)
+{
+    std::vector<int> cpu_list;
+    if ( cpus != nullptr ) cpu_list.assign(cpus, cpus + cpu_count);
+
+    return ZThreadScheduling::setDefault(policy, priority, cpu_list);
+}
+
+unsigned getThreadSchedulingStatus()
+{
+    return ZThreadScheduling::getStatus();
+}
+
+/* The device a CAN channel belongs to, in channel table order */
+static ZRef<ZZenoUSBDevice> getCANChannelDevice(int can_channel_index)
+{
+    ZCQCore* core = instance();
+    if ( core == nullptr || can_channel_index < 0 ) return nullptr;
+
+    unsigned first_channel = 0;
+    for ( auto device : core->zeno_can_driver->getZenoDeviceList() ) {
+        first_channel += device->getCANChannelCount();
+        if ( unsigned(can_channel_index) < first_channel ) return device;
+    }
+
+    return nullptr;
+}
+
+int setUSBTransferSizes(int can_channel_index, int in_size, int out_size)
+{
+    if ( can_channel_index == -1 ) {
+        return ZZenoUSBDevice::setDefaultTransferSizes(in_size, out_size) ? 0 : -2;
+    }
+
+    ZRef<ZZenoUSBDevice> device = getCANChannelDevice(can_channel_index);
+    if ( device == nullptr ) return -1;
+
+    return device->setTransferSizes(in_size, out_size) ? 0 : -2;
+}
+
+int setUSBTransferTimeout(int can_channel_index, int timeout_in_ms)
+{
+    if ( can_channel_index == -1 ) {
+        return ZZenoUSBDevice::setDefaultBulkTransferTimeout(timeout_in_ms) ? 0 : -2;
+    }
+
+    ZRef<ZZenoUSBDevice> device = getCANChannelDevice(can_channel_index);
+    if ( device == nullptr ) return -1;
+
+    return device->setBulkTransferTimeout(timeout_in_ms) ? 0 : -2;
+}
+
+int getUSBStatistics(int can_channel_index, ZUSBStatistics::Snapshot& snapshot)
+{
+    ZRef<ZZenoUSBDevice> device = getCANChannelDevice(can_channel_index);
+    if ( device == nullptr ) return -1;
+
+    device->getUSBStatistics(snapshot);
+    return 0;
+}
+
+int resetUSBStatistics(int can_channel_index)
+{
+    ZRef<ZZenoUSBDevice> device = getCANChannelDevice(can_channel_index);
+    if ( device == nullptr ) return -1;
+
+    device->resetUSBStatistics();
+    return 0;
+}
+
+void setDeviceInfoCache(const char* path)
+{
+    ZZenoDeviceInfoCache::setPath(path != nullptr ? path : "");
+}
+
+bool setAutoRecovery(bool enabled)
+{
+    /* Lost devices are found again by the hotplug thread */
+    if ( enabled && !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) ) return false;
+
+    ZZenoCANDriver::setDefaultAutoRecovery(enabled);
+    return true;
+}
+
+bool setSimulation(const char* config)
+{
+    return ZZenoSimDevice::setConfig(config != nullptr ? config : "");
+}
+
+bool setUSBCapture(const char* path)
+{
+    return ZZenoUSBCapture::setCapturePath(path != nullptr ? path : "");
+}
+
+bool setUSBReplay(const char* path, bool full_speed)
+{
+    return ZZenoUSBCapture::setReplayPath(path != nullptr ? path : "", full_speed);
+}
+
+int getUSBPollFds(int* fds, short* events, int max_count)
+{
+    ZCQCore* core = instance();
+    if ( core == nullptr ) return -1;
+    int count = core->zeno_can_driver->getPollFds(fds, events, max_count);
+    if ( count < 0 ) return -2;
+
+    return count;
+}
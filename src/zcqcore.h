@@ -34,6 +34,7 @@
 #define ZCQCORE_H
 
 #include "zglobal.h"
+#include "zusbstatistics.h"
 #include <string>
 
 class ZCANChannel;
@@ -59,4 +60,40 @@ int getCANDeviceSerialNumber(int can_channel_index, uint64_t& serial_number);
 
 int getCANDeviceProductCode(int can_channel_index, uint64_t& product_code);
 
+bool setUSBInTransferCount(int count);
+
+bool setUSBOutTransferCount(int count);
+
+bool setUSBOutMaxDelay(int delay_in_us);
+
+bool setUSBEventMode(int mode);
+
+bool setUSBEventGroups(int group_count, const int* cpus, unsigned cpu_count);
+
+int handleUSBEvents(int timeout_in_ms);
+
+int getUSBPollFds(int* fds, short* events, int max_count);
+
+bool setThreadScheduling(int policy, int priority, const int* cpus, unsigned cpu_count);
+
+unsigned getThreadSchedulingStatus();
+
+void setDeviceInfoCache(const char* path);
+
+int setUSBTransferSizes(int can_channel_index, int in_size, int out_size);
+
+int setUSBTransferTimeout(int can_channel_index, int timeout_in_ms);
+
+int getUSBStatistics(int can_channel_index, ZUSBStatistics::Snapshot& snapshot);
+
+int resetUSBStatistics(int can_channel_index);
+
+bool setAutoRecovery(bool enabled);
+
+bool setSimulation(const char* config);
+
+bool setUSBCapture(const char* path);
+
+bool setUSBReplay(const char* path, bool full_speed);
+
 #endif /* ZCQCORE_H */
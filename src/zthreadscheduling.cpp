@@ -0,0 +1,242 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "zthreadscheduling.h"
+#include "zdebug.h"
+
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#ifdef Z_OS_WINDOWS
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#endif
+
+static std::mutex scheduling_mutex;
+static std::once_flag environment_once;
+static int scheduling_policy = ZThreadScheduling::PolicyDefault;
+static int scheduling_priority = 0;
+static std::vector<int> scheduling_cpus;
+static std::atomic<unsigned int> scheduling_status(0);
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+bool ZThreadScheduling::setDefault(int policy, int priority, const std::vector<int>& cpus)
+{
+    if ( policy < PolicyDefault || policy > PolicyRoundRobin ) return false;
+    for ( int cpu : cpus ) {
+        if ( cpu < 0 ) return false;
+    }
+
+    /* Settings from the API replace the environment */
+    std::call_once(environment_once, loadEnvironment);
+
+    std::lock_guard<std::mutex> lock(scheduling_mutex);
+    scheduling_policy = policy;
+    scheduling_priority = priority;
+    scheduling_cpus = cpus;
+    scheduling_status = 0;
+
+    return true;
+}
+
+void ZThreadScheduling::applyToCurrentThread(const char* thread_name, int cpu)
+{
+    std::call_once(environment_once, loadEnvironment);
+
+    int policy;
+    int priority;
+    std::vector<int> cpus;
+    {
+        std::lock_guard<std::mutex> lock(scheduling_mutex);
+        policy = scheduling_policy;
+        priority = scheduling_priority;
+        cpus = scheduling_cpus;
+    }
+
+    if ( cpu >= 0 ) cpus.assign(1, cpu);
+
+    if ( policy != PolicyDefault ) {
+        if ( applyPolicy(policy, priority) ) {
+            scheduling_status |= SchedulingApplied;
+            zDebug("%s thread: policy %d priority %d", thread_name, policy, priority);
+        } else {
+            scheduling_status |= SchedulingFailed;
+            zError("%s thread: failed to set policy %d priority %d", thread_name, policy, priority);
+        }
+    }
+
+    if ( !cpus.empty() ) {
+        if ( applyAffinity(cpus) ) {
+            scheduling_status |= AffinityApplied;
+        } else {
+            scheduling_status |= AffinityFailed;
+            zError("%s thread: failed to set CPU affinity", thread_name);
+        }
+    }
+}
+
+unsigned int ZThreadScheduling::getStatus()
+{
+    return scheduling_status;
+}
+
+void ZThreadScheduling::loadEnvironment()
+{
+    std::lock_guard<std::mutex> lock(scheduling_mutex);
+
+    const char* policy_text = getenv("ZCQ_THREAD_POLICY");
+    if ( policy_text != nullptr ) {
+        if ( strcmp(policy_text, "fifo") == 0 ) {
+            scheduling_policy = PolicyFifo;
+        } else if ( strcmp(policy_text, "rr") == 0 ) {
+            scheduling_policy = PolicyRoundRobin;
+        } else if ( strcmp(policy_text, "other") == 0 ) {
+            scheduling_policy = PolicyDefault;
+        } else {
+            zError("ZCQ_THREAD_POLICY: unknown policy '%s', use other, fifo or rr", policy_text);
+        }
+    }
+
+    const char* priority_text = getenv("ZCQ_THREAD_PRIORITY");
+    if ( priority_text != nullptr ) {
+        scheduling_priority = atoi(priority_text);
+    }
+
+    const char* cpus_text = getenv("ZCQ_THREAD_CPUS");
+    if ( cpus_text != nullptr && !parseCPUList(cpus_text, scheduling_cpus) ) {
+        zError("ZCQ_THREAD_CPUS: invalid CPU list '%s', e.g. 2,3 or 2-3", cpus_text);
+        scheduling_cpus.clear();
+    }
+}
+
+bool ZThreadScheduling::parseCPUList(const char* text, std::vector<int>& cpus)
+{
+    /* Comma separated CPU numbers and ranges, "0,2-3" */
+    cpus.clear();
+    const char* p = text;
+    while ( *p ) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if ( end == p || first < 0 ) return false;
+        long last = first;
+        p = end;
+
+        if ( *p == '-' ) {
+            p++;
+            last = strtol(p, &end, 10);
+            if ( end == p || last < first ) return false;
+            p = end;
+        }
+
+        for ( long cpu = first; cpu <= last; ++cpu ) cpus.push_back(int(cpu));
+
+        if ( *p == ',' ) p++;
+        else if ( *p ) return false;
+    }
+
+    return !cpus.empty();
+}
+
+#ifdef Z_OS_WINDOWS
+bool ZThreadScheduling::applyPolicy(int policy, int priority)
+{
+    ZUNUSED(policy)
+    ZUNUSED(priority)
+
+    return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+}
+
+bool ZThreadScheduling::applyAffinity(const std::vector<int>& cpus)
+{
+    DWORD_PTR mask = 0;
+    for ( int cpu : cpus ) {
+        if ( cpu >= int(sizeof(DWORD_PTR) * 8) ) return false;
+        mask |= DWORD_PTR(1) << cpu;
+    }
+
+    return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+}
+#else
+bool ZThreadScheduling::applyPolicy(int policy, int priority)
+{
+    int sched_policy = policy == PolicyFifo ? SCHED_FIFO : SCHED_RR;
+    int min_priority = sched_get_priority_min(sched_policy);
+    int max_priority = sched_get_priority_max(sched_policy);
+    if ( priority < min_priority || priority > max_priority ) {
+        zError("priority %d out of range %d - %d", priority, min_priority, max_priority);
+        return false;
+    }
+
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+
+    /* Needs CAP_SYS_NICE or an RLIMIT_RTPRIO limit on Linux */
+    int res = pthread_setschedparam(pthread_self(), sched_policy, &param);
+    if ( res != 0 ) {
+        zError("pthread_setschedparam: %s", strerror(res));
+        return false;
+    }
+
+    return true;
+}
+
+bool ZThreadScheduling::applyAffinity(const std::vector<int>& cpus)
+{
+#ifdef Z_OS_LINUX
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for ( int cpu : cpus ) {
+        if ( cpu >= CPU_SETSIZE ) return false;
+        CPU_SET(cpu, &cpu_set);
+    }
+
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if ( res != 0 ) {
+        zError("pthread_setaffinity_np: %s", strerror(res));
+        return false;
+    }
+
+    return true;
+#else
+    /* No thread CPU affinity on this platform */
+    ZUNUSED(cpus)
+    return false;
+#endif
+}
+#endif
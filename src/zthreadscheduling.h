@@ -0,0 +1,76 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef ZTHREADSCHEDULING_H
+#define ZTHREADSCHEDULING_H
+
+#include "zglobal.h"
+#include <vector>
+
+/**
+ * Scheduling policy, priority and CPU affinity of the threads started by
+ * the library. Settings come from the ZCQ_THREAD_POLICY, ZCQ_THREAD_PRIORITY
+ * and ZCQ_THREAD_CPUS environment variables and can be replaced through
+ * setDefault(). Each library thread calls applyToCurrentThread() when it
+ * starts, threads already running keep their settings.
+ */
+class ZThreadScheduling {
+public:
+    enum Policy {
+        PolicyDefault = 0,      /* Leave the thread as created, SCHED_OTHER */
+        PolicyFifo = 1,         /* SCHED_FIFO, time critical on Windows */
+        PolicyRoundRobin = 2    /* SCHED_RR, time critical on Windows */
+    };
+
+    enum StatusMask {
+        SchedulingApplied = 0x1,
+        AffinityApplied   = 0x2,
+        SchedulingFailed  = 0x4,
+        AffinityFailed    = 0x8
+    };
+
+    static bool setDefault(int policy, int priority, const std::vector<int>& cpus);
+
+    /* cpu >= 0 pins the thread to that CPU instead of the configured set */
+    static void applyToCurrentThread(const char* thread_name, int cpu = -1);
+
+    /* StatusMask bits of all threads started since the settings last changed */
+    static unsigned int getStatus();
+
+private:
+    static void loadEnvironment();
+    static bool parseCPUList(const char* text, std::vector<int>& cpus);
+    static bool applyPolicy(int policy, int priority);
+    static bool applyAffinity(const std::vector<int>& cpus);
+};
+
+#endif /* ZTHREADSCHEDULING_H */
@@ -38,10 +38,14 @@
 #include <thread>
 #include <chrono>
 
+static std::atomic<int> default_event_mode(ZUSBContext::EventThreadPoll);
+static thread_local int restricted_event_handling = 0;
+
 /*** ---------------------------==*+*+*==---------------------------------- ***/
 ZUSBContext::ZUSBContext()
-    : usb_context_owned(true),
-      usb_event_thread(nullptr), start_ref_count(0)
+    : usb_context(nullptr), usb_context_owned(true), parent_context(nullptr),
+      usb_event_thread(nullptr), event_mode(EventThreadPoll),
+      event_thread_cpu(-1), start_ref_count(0)
 {
     int res = libusb_init(&usb_context);
     if ( res != 0 ) {
@@ -53,7 +57,10 @@ ZUSBContext::ZUSBContext()
 ZUSBContext::ZUSBContext(ZUSBContext* _usb_context)
     : usb_context(_usb_context->getUSBContext()),
       usb_context_owned(false),
+      parent_context(_usb_context),
       usb_event_thread(nullptr),
+      event_mode(EventThreadPoll),
+      event_thread_cpu(-1),
       start_ref_count(0)
 {
 
@@ -67,25 +74,53 @@ ZUSBContext::~ZUSBContext()
 
 void ZUSBContext::startRef()
 {
+    /* One event loop per libusb context, shared contexts use the owner's */
+    if ( parent_context != nullptr ) {
+        parent_context->startRef();
+        return;
+    }
+
     std::lock_guard<std::mutex> lock(mutex);
     if ( start_ref_count == 0 ) {
         assert(usb_event_thread == nullptr);
-        usb_event_thread = new ZUSBEventThread(usb_context);
-        usb_event_thread->start();
+        event_mode = default_event_mode.load();
 
-        /* Wait for USB thread to start */
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if ( event_mode != EventApplication ) {
+            usb_event_thread = new ZUSBEventThread(usb_context,
+                                                   event_mode == EventThreadEpoll ?
+                                                   ZUSBEventThread::EpollLoop :
+                                                   ZUSBEventThread::PollLoop,
+                                                   event_thread_cpu);
+            usb_event_thread->start();
+        }
     }
     start_ref_count ++;
 }
 
 void ZUSBContext::stopUnRef()
 {
+    if ( parent_context != nullptr ) {
+        parent_context->stopUnRef();
+        return;
+    }
+
     std::lock_guard<std::mutex> lock(mutex);
     start_ref_count --;
     assert(start_ref_count >= 0);
-    if ( start_ref_count == 0 ) {
-        assert(usb_event_thread != nullptr);
+    if ( start_ref_count == 0 && usb_event_thread != nullptr ) {
+        usb_event_thread->waitAndDelete();
+        usb_event_thread = nullptr;
+    }
+}
+
+void ZUSBContext::stopEventThread()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if ( start_ref_count != 0 ) {
+        zError("USB context destroyed with %d users of its event thread", start_ref_count);
+    }
+    start_ref_count = 0;
+    if ( usb_event_thread != nullptr ) {
         usb_event_thread->waitAndDelete();
         usb_event_thread = nullptr;
     }
@@ -93,10 +128,13 @@ void ZUSBContext::stopUnRef()
 
 bool ZUSBContext::handleEvents(int& completed)
 {
-    if (libusb_handle_events_completed(usb_context, &completed) < 0)
-        return false;
+    /* Called with channel locks held, see handleEventsFromWait() */
+    bool restricted = isApplicationDriven();
+    if ( restricted ) restricted_event_handling ++;
+    int res = libusb_handle_events_completed(usb_context, &completed);
+    if ( restricted ) restricted_event_handling --;
 
-    return true;
+    return res >= 0;
 }
 
 bool ZUSBContext::handleEvents(timeval& time_val, int& completed)
@@ -109,6 +147,56 @@ bool ZUSBContext::handleEvents(timeval& time_val, int& completed)
     return true;
 }
 
+bool ZUSBContext::handleEventsFromWait(int timeout_in_us, bool restricted)
+{
+    timeval time_val;
+    time_val.tv_sec = timeout_in_us / 1000000;
+    time_val.tv_usec = timeout_in_us % 1000000;
+
+    if ( restricted ) restricted_event_handling ++;
+    int res = libusb_handle_events_timeout_completed(usb_context, &time_val, nullptr);
+    if ( restricted ) restricted_event_handling --;
+
+    return res >= 0;
+}
+
+bool ZUSBContext::isApplicationDriven() const
+{
+    if ( parent_context != nullptr ) return parent_context->isApplicationDriven();
+    return event_mode == EventApplication;
+}
+
+bool ZUSBContext::isRestrictedEventHandling()
+{
+    return restricted_event_handling != 0;
+}
+
+bool ZUSBContext::setDefaultEventMode(int mode)
+{
+    switch(mode) {
+    case EventThreadPoll:
+    case EventApplication:
+        break;
+
+    case EventThreadEpoll:
+#ifndef Z_OS_LINUX
+        return false;
+#endif
+        break;
+
+    default:
+        return false;
+    }
+
+    default_event_mode = mode;
+    return true;
+}
+
+int ZUSBContext::getDefaultEventMode()
+{
+    return default_event_mode;
+}
+
 std::string ZUSBContext::translateLibUSBErrorCode(int error_code)
 {
     std::string error_text;
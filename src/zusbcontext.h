@@ -36,10 +36,17 @@
 #include "zrefcountingobjbase.h"
 #include "libusb.h"
 #include <mutex>
+#include <atomic>
 
 class ZUSBEventThread;
 class ZUSBContext : public ZRefCountingObjBase {
 public:
+    enum EventMode {
+        EventThreadPoll = 0,    /* Library thread, libusb poll loop */
+        EventThreadEpoll = 1,   /* Library thread, epoll on the libusb poll fds */
+        EventApplication = 2    /* No library thread, events are handled by the application */
+    };
+
     ZUSBContext();
     ZUSBContext(ZUSBContext* _usb_context);
     ~ZUSBContext();
@@ -48,10 +55,32 @@ public:
 
     void stopUnRef();
 
+    /* Stops the event thread whatever the start count, before the
+     * context is destroyed */
+    void stopEventThread();
+
     bool handleEvents(int& completed);
 
     bool handleEvents(timeval& time_val, int& completed);
 
+    /* Handle events from a library wait in application mode, restricted
+     * is set when the caller may hold channel locks */
+    bool handleEventsFromWait(int timeout_in_us, bool restricted);
+
+    bool isApplicationDriven() const;
+
+    /* CPU the event thread is pinned to when started, -1 for the default */
+    void setEventThreadCPU(int cpu) {
+        event_thread_cpu = cpu;
+    }
+
+    /* True while this thread handles events with channel locks held */
+    static bool isRestrictedEventHandling();
+
+    /* Event mode used when event handling is started */
+    static bool setDefaultEventMode(int mode);
+    static int getDefaultEventMode();
+
     static std::string translateLibUSBErrorCode(int error_code);
 
     libusb_context* getUSBContext() const {
@@ -60,7 +89,10 @@ public:
 private:
     libusb_context* usb_context;
     bool usb_context_owned;
+    ZUSBContext* parent_context;
     ZRef<ZUSBEventThread> usb_event_thread;
+    std::atomic<int> event_mode;
+    int event_thread_cpu;
 
     std::mutex mutex;
     int start_ref_count;
@@ -31,11 +31,25 @@
  */
 
 #include "zusbeventthread.h"
+#include "zthreadscheduling.h"
 #include "zdebug.h"
 #include "assert.h"
 
-ZUSBEventThread::ZUSBEventThread(libusb_context* _usb_context)
-    : running(0), usb_context(_usb_context),
+#ifdef Z_OS_LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+ZUSBEventThread::ZUSBEventThread(libusb_context* _usb_context, EventLoop _event_loop, int _cpu)
+    :
+#ifdef Z_OS_LINUX
+      epoll_fd(-1), wakeup_fd(-1),
+#endif
+      running(0), started(false),
+      event_loop(_event_loop), cpu(_cpu), usb_context(_usb_context),
       usb_event_thread(nullptr)
 {
     /* no op */
@@ -44,15 +58,54 @@ ZUSBEventThread::ZUSBEventThread(libusb_context* _usb_context)
 void ZUSBEventThread::waitAndDelete()
 {
     running = 1;
+
+#ifdef Z_OS_LINUX
+    if ( wakeup_fd >= 0 ) {
+        uint64_t one = 1;
+        if ( write(wakeup_fd, &one, sizeof(one)) < 0 ) {
+            zError("USB event thread wakeup failed: %d", errno);
+        }
+    }
+#endif
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    /* Wake the poll loop now and not at the next 100 ms timeout */
+    libusb_interrupt_event_handler(usb_context);
+#endif
+
     usb_event_thread->join();
     usb_event_thread.reset();
+
+#ifdef Z_OS_LINUX
+    closeEpoll();
+#endif
 }
 
 void ZUSBEventThread::run()
+{
+    zDebug("USB event thread started");
+    ZThreadScheduling::applyToCurrentThread("USB event", cpu);
+    {
+        std::lock_guard<std::mutex> lock(start_mutex);
+        started = true;
+        start_cond.notify_all();
+    }
+
+#ifdef Z_OS_LINUX
+    if ( event_loop == EpollLoop ) {
+        runEpollLoop();
+    } else {
+        runPollLoop();
+    }
+#else
+    runPollLoop();
+#endif
+    zDebug("**** USB event thread ended");
+}
+
+void ZUSBEventThread::runPollLoop()
 {
     const int timeout_in_ms = 100;
 
-    zDebug("USB event thread started");
     while(!running) {
         timeval time_val;
         time_val.tv_sec = timeout_in_ms / 1000;
@@ -61,11 +114,123 @@ void ZUSBEventThread::run()
         // libusb_handle_events_timeout(usb_context,&time_val);
         libusb_handle_events_timeout_completed(usb_context, &time_val, &running);
     }
-    zDebug("**** USB event thread ended");
 }
 
 void ZUSBEventThread::start()
 {
     assert(usb_event_thread == nullptr);
+
+#ifdef Z_OS_LINUX
+    if ( event_loop == EpollLoop && !setupEpoll() ) {
+        zError("USB event thread failed to setup epoll, using poll loop");
+        closeEpoll();
+        event_loop = PollLoop;
+    }
+#endif
+
     usb_event_thread.reset(new std::thread(&ZUSBEventThread::run,this));
+
+    /* Wait for USB thread to start */
+    std::unique_lock<std::mutex> lock(start_mutex);
+    start_cond.wait(lock, [this]() { return started; });
+}
+
+#ifdef Z_OS_LINUX
+bool ZUSBEventThread::setupEpoll()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if ( epoll_fd < 0 ) return false;
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( wakeup_fd < 0 ) return false;
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = wakeup_fd;
+    if ( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event) < 0 ) return false;
+
+    /* Windows and some old platforms do not expose poll fds */
+    const libusb_pollfd** poll_fds = libusb_get_pollfds(usb_context);
+    if ( poll_fds == nullptr ) return false;
+
+    for ( int i = 0; poll_fds[i] != nullptr; ++i ) {
+        addPollFd(poll_fds[i]->fd, poll_fds[i]->events);
+    }
+    libusb_free_pollfds(poll_fds);
+
+    libusb_set_pollfd_notifiers(usb_context, __pollfdAdded, __pollfdRemoved, this);
+
+    return true;
+}
+
+void ZUSBEventThread::closeEpoll()
+{
+    if ( epoll_fd >= 0 ) {
+        libusb_set_pollfd_notifiers(usb_context, nullptr, nullptr, nullptr);
+        ::close(epoll_fd);
+        epoll_fd = -1;
+    }
+
+    if ( wakeup_fd >= 0 ) {
+        ::close(wakeup_fd);
+        wakeup_fd = -1;
+    }
+}
+
+void ZUSBEventThread::runEpollLoop()
+{
+    const int max_events = 16;
+    epoll_event events[max_events];
+
+    while(!running) {
+        /* Poll fds include a timerfd when libusb has one, otherwise
+         * libusb_get_next_timeout() gives the next transfer timeout */
+        int timeout_in_ms = -1;
+        timeval next_timeout;
+        if ( libusb_get_next_timeout(usb_context, &next_timeout) == 1 ) {
+            timeout_in_ms = int(next_timeout.tv_sec * 1000 + (next_timeout.tv_usec + 999) / 1000);
+        }
+
+        int n = epoll_wait(epoll_fd, events, max_events, timeout_in_ms);
+        if ( n < 0 ) {
+            if ( errno == EINTR ) continue;
+            zError("USB event thread epoll_wait failed: %d", errno);
+            break;
+        }
+
+        for ( int i = 0; i < n; ++i ) {
+            if ( events[i].data.fd == wakeup_fd ) {
+                uint64_t value;
+                if ( read(wakeup_fd, &value, sizeof(value)) < 0 ) { /* already drained */ }
+            }
+        }
+
+        timeval zero_time_val = { 0, 0 };
+        libusb_handle_events_timeout_completed(usb_context, &zero_time_val, &running);
+    }
+}
+
+void ZUSBEventThread::addPollFd(int fd, short events)
+{
+    epoll_event event;
+    event.events = 0;
+    if ( events & POLLIN ) event.events |= EPOLLIN;
+    if ( events & POLLOUT ) event.events |= EPOLLOUT;
+    event.data.fd = fd;
+
+    if ( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0 ) {
+        zError("USB event thread failed to add poll fd %d: %d", fd, errno);
+    }
+}
+
+void ZUSBEventThread::__pollfdAdded(int fd, short events, void* user_data)
+{
+    static_cast<ZUSBEventThread*>(user_data)->addPollFd(fd, events);
+}
+
+void ZUSBEventThread::__pollfdRemoved(int fd, void* user_data)
+{
+    ZUSBEventThread* _this = static_cast<ZUSBEventThread*>(user_data);
+    epoll_ctl(_this->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
 }
+#endif
@@ -36,10 +36,17 @@
 #include "zrefcountingobjbase.h"
 #include "libusb.h"
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 
 class ZUSBEventThread : public ZRefCountingObjBase {
 public:
-    ZUSBEventThread(libusb_context* _usb_context);
+    enum EventLoop {
+        PollLoop,   /* libusb_handle_events_timeout_completed() with a 100 ms timeout */
+        EpollLoop   /* epoll on the libusb poll fds, woken by an eventfd (Linux only) */
+    };
+
+    ZUSBEventThread(libusb_context* _usb_context, EventLoop _event_loop = PollLoop, int _cpu = -1);
 
     void start();
 
@@ -47,8 +54,26 @@ public:
 
 private:
     void run();
+    void runPollLoop();
+#ifdef Z_OS_LINUX
+    bool setupEpoll();
+    void closeEpoll();
+    void runEpollLoop();
+    void addPollFd(int fd, short events);
+
+    static void __pollfdAdded(int fd, short events, void* user_data);
+    static void __pollfdRemoved(int fd, void* user_data);
+
+    int epoll_fd;
+    int wakeup_fd;
+#endif
 
     int running;
+    bool started;
+    std::mutex start_mutex;
+    std::condition_variable start_cond;
+    EventLoop event_loop;
+    int cpu;
     libusb_context* usb_context;
     std::unique_ptr<std::thread> usb_event_thread;
 };
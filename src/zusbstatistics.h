@@ -0,0 +1,189 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef ZUSBSTATISTICS_H
+#define ZUSBSTATISTICS_H
+
+#include "zglobal.h"
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+
+#define ZUSB_HISTOGRAM_BUCKETS  24
+
+/**
+ * USB transfer statistics of a device. Counters and histograms are updated
+ * from the transfer callbacks without locks and read at any time, a
+ * snapshot taken while transfers complete may be off by the transfers in
+ * progress.
+ */
+class ZUSBStatistics {
+public:
+    /* Bucket 0 counts the value 0, bucket i the values in [2^(i-1), 2^i)
+     * and the last bucket everything above */
+    struct Histogram {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[ZUSB_HISTOGRAM_BUCKETS];
+    };
+
+    struct Snapshot {
+        uint64_t in_transfers;
+        uint64_t in_bytes;
+        uint64_t in_full_transfers;     /* Filled to the transfer size */
+        uint64_t in_timeouts;
+        uint64_t in_errors;
+        Histogram in_size;              /* Bytes per completed transfer */
+        Histogram in_callback_time;     /* us spent handling the data */
+
+        uint64_t out_transfers;
+        uint64_t out_bytes;
+        uint64_t out_timeouts;
+        uint64_t out_errors;
+        Histogram out_latency;          /* us from submission to completion */
+
+        uint64_t submit_errors;
+        uint64_t sender_waits;          /* Senders blocked, all buffers in flight */
+        uint64_t sender_timeouts;
+        Histogram sender_wait_time;     /* us blocked */
+    };
+
+    class AtomicHistogram {
+    public:
+        AtomicHistogram() { reset(); }
+
+        void add(uint64_t value) {
+            count.fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(value, std::memory_order_relaxed);
+            buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+
+            uint64_t current = max.load(std::memory_order_relaxed);
+            while ( value > current &&
+                    !max.compare_exchange_weak(current, value, std::memory_order_relaxed) ) { }
+        }
+
+        void read(Histogram& histogram) const {
+            histogram.count = count.load(std::memory_order_relaxed);
+            histogram.sum = sum.load(std::memory_order_relaxed);
+            histogram.max = max.load(std::memory_order_relaxed);
+            for ( int i = 0; i < ZUSB_HISTOGRAM_BUCKETS; ++i ) {
+                histogram.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+            }
+        }
+
+        void reset() {
+            count.store(0, std::memory_order_relaxed);
+            sum.store(0, std::memory_order_relaxed);
+            max.store(0, std::memory_order_relaxed);
+            for ( int i = 0; i < ZUSB_HISTOGRAM_BUCKETS; ++i ) {
+                buckets[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        static int bucketIndex(uint64_t value) {
+            int index = 0;
+            while ( value != 0 && index < ZUSB_HISTOGRAM_BUCKETS - 1 ) {
+                value >>= 1;
+                index ++;
+            }
+            return index;
+        }
+
+    private:
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+        std::atomic<uint64_t> buckets[ZUSB_HISTOGRAM_BUCKETS];
+    };
+
+    ZUSBStatistics() { reset(); }
+
+    static void increment(std::atomic<uint64_t>& counter, uint64_t value = 1) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void read(Snapshot& snapshot) const {
+        snapshot.in_transfers = in_transfers.load(std::memory_order_relaxed);
+        snapshot.in_bytes = in_bytes.load(std::memory_order_relaxed);
+        snapshot.in_full_transfers = in_full_transfers.load(std::memory_order_relaxed);
+        snapshot.in_timeouts = in_timeouts.load(std::memory_order_relaxed);
+        snapshot.in_errors = in_errors.load(std::memory_order_relaxed);
+        in_size.read(snapshot.in_size);
+        in_callback_time.read(snapshot.in_callback_time);
+
+        snapshot.out_transfers = out_transfers.load(std::memory_order_relaxed);
+        snapshot.out_bytes = out_bytes.load(std::memory_order_relaxed);
+        snapshot.out_timeouts = out_timeouts.load(std::memory_order_relaxed);
+        snapshot.out_errors = out_errors.load(std::memory_order_relaxed);
+        out_latency.read(snapshot.out_latency);
+
+        snapshot.submit_errors = submit_errors.load(std::memory_order_relaxed);
+        snapshot.sender_waits = sender_waits.load(std::memory_order_relaxed);
+        snapshot.sender_timeouts = sender_timeouts.load(std::memory_order_relaxed);
+        sender_wait_time.read(snapshot.sender_wait_time);
+    }
+
+    void reset() {
+        for ( std::atomic<uint64_t>* counter : { &in_transfers, &in_bytes, &in_full_transfers,
+                                                 &in_timeouts, &in_errors, &out_transfers,
+                                                 &out_bytes, &out_timeouts, &out_errors,
+                                                 &submit_errors, &sender_waits, &sender_timeouts } ) {
+            counter->store(0, std::memory_order_relaxed);
+        }
+        in_size.reset();
+        in_callback_time.reset();
+        out_latency.reset();
+        sender_wait_time.reset();
+    }
+
+    std::atomic<uint64_t> in_transfers;
+    std::atomic<uint64_t> in_bytes;
+    std::atomic<uint64_t> in_full_transfers;
+    std::atomic<uint64_t> in_timeouts;
+    std::atomic<uint64_t> in_errors;
+    AtomicHistogram in_size;
+    AtomicHistogram in_callback_time;
+
+    std::atomic<uint64_t> out_transfers;
+    std::atomic<uint64_t> out_bytes;
+    std::atomic<uint64_t> out_timeouts;
+    std::atomic<uint64_t> out_errors;
+    AtomicHistogram out_latency;
+
+    std::atomic<uint64_t> submit_errors;
+    std::atomic<uint64_t> sender_waits;
+    std::atomic<uint64_t> sender_timeouts;
+    AtomicHistogram sender_wait_time;
+};
+
+#endif /* ZUSBSTATISTICS_H */
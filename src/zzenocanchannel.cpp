@@ -34,6 +34,7 @@
 #include "zzenousbdevice.h"
 #include "zzenocandriver.h"
 #include "zdebug.h"
+#include "zthreadscheduling.h"
 #include <string.h>
 #include <algorithm>
 
@@ -53,14 +54,26 @@ ZZenoCANChannel::ZZenoCANChannel(int _channel_index,
                                  ZZenoUSBDevice* _usb_can_device)
     : channel_index(_channel_index),
       is_open(false),is_canfd_mode(false),
+      device_rx_queue_mode(false), device_rx_queue_flags(0),
+      tx_ack_mode(TxAckOff), local_tx_echo(true), tx_low_latency(false),
       usb_can_device(_usb_can_device),
-      tx_request_count(0), tx_next_trans_id(0),
+      tx_request_count(0), tx_next_trans_id(0), tx_dropped_count(0),
+      tx_flush_generation(0),
       max_outstanding_tx_requests(31),
       rx_message_fifo(2048),
-      tx_message_fifo(1024),
+      tx_queue_sequence(0),
+      tx_queue_mode(TxQueueOff),
+      tx_queue_size(ZENO_TX_QUEUE_DEFAULT_SIZE),
+      tx_device_frame_limit(0),
+      tx_shaper_running(false),
+      tx_shaper_waiting(false),
       bus_active_bit_count(0),
       last_measure_time_in_us(0),
       current_bitrate(0),
+      channel_open_flags(0),
+      current_data_bitrate(0),
+      current_driver_mode(-1),
+      is_bus_on(false),
       // tx_id(0),
       open_start_ref_timestamp_in_us(0),
       usb_display_name(usb_can_device->getObjectText()),
@@ -73,6 +86,7 @@ ZZenoCANChannel::ZZenoCANChannel(int _channel_index,
 
     memset(&canfd_msg_p1, 0 , sizeof(canfd_msg_p1));
     memset(&canfd_msg_p2, 0 , sizeof(canfd_msg_p2));
+    memset(tx_slots, 0, sizeof(tx_slots));
 }
 
 ZZenoCANChannel::~ZZenoCANChannel()
@@ -107,6 +121,8 @@ int ZZenoCANChannel::getChannelNr()
 
 bool ZZenoCANChannel::open(int open_flags)
 {
+    std::lock_guard<std::mutex> open_close_lock(open_close_mutex);
+
     is_open++;
 
     if (is_open.load() > 1) {
@@ -116,20 +132,44 @@ bool ZZenoCANChannel::open(int open_flags)
     }
 
     if ( open_flags & ZCANFlags::SharedMode ) {
+        is_open--;
         last_error_text = "Shared mode not supported on this CAN channel";
         return false;
     }
 
     flushRxFifo();
     flushTxFifo();
+    tx_dropped_count = 0;
 
     if (!usb_can_device->open()) {
         is_open--;
         return false;
     }
 
-    std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex); // Have to lock when sending usb-commands
+    std::unique_lock<std::mutex> command_lock(command_mutex);
+
+    if (!sendOpenUnlocked(open_flags)) {
+        zCritical("(ZenoUSB) Ch%d failed to open Zeno CAN channel: %s", channel_index+1, last_error_text.c_str());
+        command_lock.unlock();
+        closeUnlocked();
+        return false;
+    }
+
+    channel_open_flags = open_flags;
+    tx_low_latency = (open_flags & TxLowLatency) != 0;
 
+    if ( open_flags & DeviceRxQueue ) {
+        device_rx_queue_flags = open_flags & (DeviceRxQueue | DeviceRxQueueLIN);
+        usb_can_device->enableDeviceRxQueue(device_rx_queue_flags & DeviceRxQueueLIN);
+        device_rx_queue_mode = true;
+    }
+
+    return true;
+}
+
+bool ZZenoCANChannel::sendOpenUnlocked(int open_flags)
+{
+    /* command_mutex must be held */
     ZenoOpen cmd;
     ZenoOpenResponse reply;
 
@@ -152,14 +192,16 @@ bool ZZenoCANChannel::open(int open_flags)
 
     if (!usb_can_device->sendAndWhaitReply(zenoRequest(cmd), zenoReply(reply))) {
         last_error_text = usb_can_device->getLastErrorText();
-        zCritical("(ZenoUSB) Ch%d failed to open Zeno CAN channel: %s", channel_index+1, last_error_text.c_str());
-        close();
         return false;
     }
 
     initializeDeviceTimeDrift();
 
-    max_outstanding_tx_requests = reply.max_pending_tx_msgs;
+    {
+        /* A transaction ID is reused only after its ack, see hasTxSpaceUnlocked() */
+        std::lock_guard<std::mutex> tx_lock(tx_message_fifo_mutex);
+        max_outstanding_tx_requests = std::min(unsigned(reply.max_pending_tx_msgs), unsigned(ZENO_TX_SLOT_COUNT));
+    }
     base_clock_divisor = std::max(unsigned(reply.base_clock_divisor),1u);
     open_start_ref_timestamp_in_us = uint64_t(reply.clock_start_ref / 70);
 
@@ -174,15 +216,98 @@ bool ZZenoCANChannel::open(int open_flags)
 #endif
     
     zDebug("Zeno - max outstanding TX: %d Base clock divisor: %d", reply.max_pending_tx_msgs, base_clock_divisor);
-    
+
     return true;
 }
 
+void ZZenoCANChannel::recover(int64_t outage_in_us)
+{
+    std::lock_guard<std::mutex> open_close_lock(open_close_mutex);
+    if (is_open.load() == 0) return;
+
+    bool reopened;
+    {
+        std::lock_guard<std::mutex> command_lock(command_mutex);
+        reopened = sendOpenUnlocked(channel_open_flags);
+    }
+
+    {
+        /* Requests in flight were lost with the device, as were requests
+         * sent before the channel was open again. Writers waiting for TX
+         * credits are released, frames in the host queue are kept */
+        std::lock_guard<std::mutex> tx_lock(tx_message_fifo_mutex);
+        flushTxSlots();
+        tx_message_fifo_cond.notify_all();
+    }
+
+    if (!reopened) {
+        zCritical("(ZenoUSB) Ch%d failed to reopen Zeno CAN channel: %s", channel_index+1, last_error_text.c_str());
+        queueGapFrame(outage_in_us);
+        return;
+    }
+
+    bool restored = true;
+    if ( current_bitrate != 0 ) {
+        restored &= setBusParameters(current_bitrate, 0, 0);
+    }
+    if ( current_data_bitrate != 0 ) {
+        restored &= setBusParametersFd(current_data_bitrate, 0, 0);
+    }
+    if ( current_driver_mode >= 0 ) {
+        restored &= setDriverMode(DriverMode(current_driver_mode));
+    }
+    if ( is_bus_on ) {
+        restored &= busOn();
+    }
+
+    if ( restored ) zInfo("(ZenoUSB) Ch%d restored after device recovery", channel_index+1);
+    else zError("(ZenoUSB) Ch%d only partly restored after device recovery: %s", channel_index+1, last_error_text.c_str());
+
+    resumeTxQueue();
+    queueGapFrame(outage_in_us);
+}
+
+void ZZenoCANChannel::queueGapFrame(int64_t outage_in_us)
+{
+    /* Error frame with the outage length in us as little endian data,
+     * stamped with the host time the device came back */
+    FifoRxCANMessage gap;
+    memset(&gap, 0, sizeof(gap));
+    gap.flags = ZENO_HOST_FLAG_DEVICE_GAP;
+    gap.timestamp = uint64_t(std::chrono::system_clock::now().time_since_epoch() / std::chrono::microseconds(1));
+    gap.dlc = 8;
+    for ( int i = 0; i < 8; ++i ) {
+        gap.data[i] = uint8_t(uint64_t(outage_in_us) >> (8 * i));
+    }
+
+    if ( device_rx_queue_mode ) {
+        ZZenoUSBDevice::DeviceRxMessage rx;
+        memset(&rx, 0, sizeof(rx));
+        rx.bus_type = DeviceFrameCAN;
+        rx.channel = uint8_t(channel_index);
+        rx.can = gap;
+        usb_can_device->queueDeviceRxMessage(rx);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock_rx(rx_message_fifo_mutex);
+    FifoRxCANMessage* rx_message = rx_message_fifo.writePtr();
+    *rx_message = gap;
+    commitRxMessage(rx_message);
+}
+
 bool ZZenoCANChannel::close()
 {
+    std::lock_guard<std::mutex> open_close_lock(open_close_mutex);
+    return closeUnlocked();
+}
+
+bool ZZenoCANChannel::closeUnlocked()
+{
+    /* open_close_mutex must be held */
     ZZenoCANChannel::busOff();
 
-    std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex);
+    std::lock_guard<std::mutex> command_lock(command_mutex);
 
     ZenoClose cmd;
     ZenoResponse reply;
@@ -196,11 +321,35 @@ bool ZZenoCANChannel::close()
         zCritical("(ZenoUSB) Ch%d failed to close Zeno CAN channel: %s", channel_index+1, last_error_text.c_str());
     }
 
+    if ( device_rx_queue_mode ) {
+        device_rx_queue_mode = false;
+        usb_can_device->disableDeviceRxQueue(device_rx_queue_flags & DeviceRxQueueLIN);
+        device_rx_queue_flags = 0;
+    }
+
     event_callback = std::function<void(EventData)>();
     is_canfd_mode = false;
+    tx_ack_mode = TxAckOff;
+    local_tx_echo = true;
+    tx_low_latency = false;
     current_bitrate = 0;
+    channel_open_flags = 0;
+    current_data_bitrate = 0;
+    current_driver_mode = -1;
+    is_bus_on = false;
+    stopTxShaper();
     usb_can_device->close();
-    is_open--;
+    {
+        /* Release canWriteSync() waiters, their frames are not acknowledged */
+        std::lock_guard<std::mutex> tx_lock(tx_message_fifo_mutex);
+        tx_queue_mode = TxQueueOff;
+        tx_queue_size = ZENO_TX_QUEUE_DEFAULT_SIZE;
+        tx_device_frame_limit = 0;
+        flushTxFifo();
+        is_open--;
+        tx_idle_cond.notify_all();
+        tx_message_fifo_cond.notify_all();
+    }
 
     return true;
 }
@@ -214,7 +363,9 @@ uint32_t ZZenoCANChannel::getCapabilites()
              ErrorCounters |
              ExtendedCAN   |
              TxRequest     |
-             TxAcknowledge;
+             TxAcknowledge |
+             TxLowLatency  |
+             DeviceRxQueue;
 
     if ( channel_index < 4) {
         capabilities |= CanFD | CanFDNonISO;
@@ -228,7 +379,7 @@ bool ZZenoCANChannel::busOn()
     zDebug("ZenoCAN Ch%d Bus On", channel_index+1);
     if (!checkOpen()) return false;
 
-    std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex);
+    std::lock_guard<std::mutex> command_lock(command_mutex);
 
     ZenoBusOn cmd;
     ZenoResponse reply;
@@ -243,6 +394,8 @@ bool ZZenoCANChannel::busOn()
         return false;
     }
 
+    is_bus_on = true;
+
     /* Bus load statistic */
     auto t_now = std::chrono::time_point_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()).time_since_epoch();
     last_measure_time_in_us = t_now.count();
@@ -256,7 +409,7 @@ bool ZZenoCANChannel::busOff()
     zDebug("ZenoCAN Ch%d Bus Off", channel_index+1);
     if (!checkOpen()) return false;
 
-    std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex);
+    std::lock_guard<std::mutex> command_lock(command_mutex);
 
     ZenoBusOff cmd;
     ZenoResponse reply;
@@ -271,6 +424,8 @@ bool ZZenoCANChannel::busOff()
         return false;
     }
 
+    is_bus_on = false;
+
     return true;
 }
 
@@ -281,7 +436,7 @@ bool ZZenoCANChannel::setBusParameters(int bitrate, int sample_point, int sjw)
 
     if (!checkOpen()) return false;
 
-    std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex);
+    std::lock_guard<std::mutex> command_lock(command_mutex);
 
     ZenoBitTiming cmd;
     ZenoResponse reply;
@@ -445,7 +600,7 @@ bool ZZenoCANChannel::setBusParametersFd(int bitrate, int sample_point, int sjw)
 
     if (!checkOpen()) return false;
 
-    std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex);
+    std::lock_guard<std::mutex> command_lock(command_mutex);
 
     ZenoBitTiming cmd;
     ZenoResponse reply;
@@ -577,6 +732,8 @@ bool ZZenoCANChannel::setBusParametersFd(int bitrate, int sample_point, int sjw)
         return false;
     }
 
+    current_data_bitrate = bitrate;
+
     return true;
 }
 
@@ -585,7 +742,7 @@ bool ZZenoCANChannel::setDriverMode(ZCANFlags::DriverMode driver_mode)
     ZenoOpMode cmd;
     ZenoResponse reply;
 
-    std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex);
+    std::lock_guard<std::mutex> command_lock(command_mutex);
 
     memset(&cmd,0,sizeof(ZenoOpMode));
     cmd.h.cmd_id = ZENO_CMD_SET_OP_MODE;
@@ -611,6 +768,8 @@ bool ZZenoCANChannel::setDriverMode(ZCANFlags::DriverMode driver_mode)
         return false;
     }
 
+    current_driver_mode = driver_mode;
+
     return true;
 }
 
@@ -620,7 +779,11 @@ bool ZZenoCANChannel::readFromRXFifo(ZZenoCANChannel::FifoRxCANMessage& rx,
     std::unique_lock<std::mutex> lock_rx(rx_message_fifo_mutex);
     
     if ( rx_message_fifo.isEmpty()) {
-        if ( timeout_in_ms != -1) {
+        if ( usb_can_device->isApplicationDrivenEvents() ) {
+            /* No USB event thread, handle events while waiting */
+            auto ready = [this]() { return !rx_message_fifo.isEmpty(); };
+            if (!usb_can_device->waitForEvents(lock_rx, timeout_in_ms, ready)) return false;
+        } else if ( timeout_in_ms != -1) {
             std::chrono::milliseconds timeout(timeout_in_ms);
             /* Wait for RX FIFO */
             std::cv_status rc;
@@ -720,6 +883,68 @@ ZCANFlags::ReadResult ZZenoCANChannel::readWait(uint32_t& id, uint8_t *msg,
         return ReadTimeout;
     }
 
+    translateRxMessage(rx, id, msg, dlc, flags, driver_timestmap_in_us);
+
+    return ReadStatusOK;
+}
+
+ZCANFlags::ReadResult ZZenoCANChannel::readDeviceWait(DeviceFrame* frames, unsigned int max_count,
+                                                      unsigned int& count, int timeout_in_ms)
+{
+    count = 0;
+    if (!checkOpen()) return ReadError;
+
+    if (!device_rx_queue_mode) {
+        last_error_text = "CAN Channel " + std::to_string(channel_index+1) + " is not opened in device RX queue mode";
+        return ReadError;
+    }
+
+    /* Frames that can't be translated, e.g. for a channel the device info
+     * does not list, are skipped and reading goes on for the rest of the
+     * timeout. OK is only returned with frames */
+    ZZenoUSBDevice::DeviceRxMessage rx_messages[64];
+    auto t_start = std::chrono::steady_clock::now();
+    int remaining_in_ms = timeout_in_ms;
+    while ( true ) {
+        unsigned int rx_count = usb_can_device->readDeviceRxQueue(rx_messages,
+                                                                  std::min(max_count, 64u),
+                                                                  remaining_in_ms);
+        if ( rx_count == 0 ) {
+            onReadTimeoutCheck();
+            return ReadTimeout;
+        }
+
+        for ( unsigned int i = 0; i < rx_count; ++i ) {
+            if (usb_can_device->translateDeviceRxMessage(rx_messages[i], frames[count])) {
+                count++;
+            }
+        }
+
+        if ( count > 0 ) return ReadStatusOK;
+
+        zDebug("ZenoCAN Ch%d %u device RX frames skipped, unknown bus or channel", channel_index+1, rx_count);
+        if ( timeout_in_ms >= 0 ) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t_start);
+            remaining_in_ms = std::max(0, timeout_in_ms - int(elapsed.count()));
+        }
+    }
+}
+
+void ZZenoCANChannel::translateRxMessage(const FifoRxCANMessage& rx,
+                                         uint32_t& id, uint8_t *msg,
+                                         uint8_t& dlc, uint32_t& flags,
+                                         uint64_t& driver_timestmap_in_us)
+{
+    if ( rx.flags & ZENO_HOST_FLAG_DEVICE_GAP ) {
+        /* Gap frame, the timestamp is already host UTC time */
+        id = 0;
+        flags = ErrorFrame | ErrorHWOverrun | DeviceGap;
+        dlc = rx.dlc;
+        driver_timestmap_in_us = rx.timestamp;
+        memcpy(msg, rx.data, dlc);
+        return;
+    }
+
     flags = 0;
     id = uint32_t(rx.id);
     unsigned msg_bit_count = 0;
@@ -776,8 +1001,6 @@ ZCANFlags::ReadResult ZZenoCANChannel::readWait(uint32_t& id, uint8_t *msg,
     driver_timestmap_in_us = uint64_t(adjusted_timestamp_in_us);
 
     memcpy(msg, rx.data, dlc);
-
-    return ReadStatusOK;
 }
 
 ZCANFlags::SendResult ZZenoCANChannel::send(const uint32_t id,
@@ -788,206 +1011,507 @@ ZCANFlags::SendResult ZZenoCANChannel::send(const uint32_t id,
 {
 
     if (!checkOpen()) return SendError;
-    if (is_canfd_mode && (flags &  ZCANChannel::CanFDFrame))
-        return sendFD(id,msg,dlc,flags,timeout_in_ms);
     // qDebug() << "ZENO_CMD_CAN20_TX_REQUEST" << hex << id;;
 
-    ZenoTxCAN20Request request;
-    request.h.cmd_id = ZENO_CMD_CAN20_TX_REQUEST;
-    request.channel = uint8_t(channel_index);
-    request.h.transaction_id = tx_next_trans_id & 0x7f;
+    uint32_t request_flags;
+    bool fd;
+    int request_size;
+    SendResult result = prepareTxRequest(dlc, flags, request_flags, fd, request_size);
+    if ( result != SendStatusOK ) return result;
+
+    std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex);
+
+    /* Frames still queued from an earlier mode are sent first */
+    if ( isTxQueuedUnlocked() ) {
+        return queueTxRequest(tx_lock, id, msg, dlc, flags, request_flags, fd, request_size, timeout_in_ms);
+    }
+
+    result = acquireTxSpace(tx_lock, timeout_in_ms);
+    if ( result != SendStatusOK ) return result;
+
+    /* Encode the request in place in the USB OUT buffer */
+    std::unique_lock<std::mutex> out_lock;
+    uint8_t* request = reinterpret_cast<uint8_t*>(usb_can_device->reserveTxRequest(out_lock, timeout_in_ms, request_size));
+    if ( request == nullptr ) {
+        last_error_text = usb_can_device->getLastErrorText();
+
+        return SendError;
+    }
+
+    uint8_t transaction_id = tx_next_trans_id & ZENO_TX_TRANS_ID_MASK;
+    encodeTxRequest(request, fd, id, msg, dlc, request_flags, transaction_id);
     tx_next_trans_id ++;
 
-    request.id = uint32_t(id);
-    request.dlc = dlc & 0x0F;
-    request.flags = 0;
+    // qDebug() << " enqueue" << (tx_next_trans_id & 0x7f) << tx_request_count;
 
-    if (flags & Extended) {
-        request.flags |= ZenoCANFlagExtended;
-    } else if (flags & Standard ){
-        request.flags |= ZenoCANFlagStandard;
-    } else {
-        return SendInvalidParam;
+    /* The request is in the OUT buffer once committed, even when the submit
+     * fails it goes out with the next one. Its ID is taken and its slot
+     * stored first, so no later frame reuses the ID before the ack */
+    storeTxSlot(id, request_flags, transaction_id, fd ? dlc : (dlc & 0x0F), msg, txDataLength(fd, dlc));
+
+    if (! usb_can_device->commitTxRequest(out_lock, tx_low_latency)) {
+        last_error_text = usb_can_device->getLastErrorText();
+
+        return SendError;
     }
 
-    memcpy(request.data, msg, 8);
+    return SendStatusOK;
+}
 
+ZCANFlags::SendResult ZZenoCANChannel::sendBatch(const TxFrame* frames, unsigned int count,
+                                                 unsigned int& sent, int timeout_in_ms)
+{
+    sent = 0;
+    if (!checkOpen()) return SendError;
+
+    /* TX credits and the OUT buffer are taken once for the batch, the
+     * requests are committed together and submitted by the same rules as
+     * a single request. While waiting for credits the collected requests
+     * are submitted and the OUT buffer lock is released */
     std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex);
-    tx_request_count ++;
-    if ( tx_request_count >= int(max_outstanding_tx_requests) ) {
-        if (timeout_in_ms > 0) {
-            if ( !waitForSpaceInTxFifo(tx_lock, timeout_in_ms) ) {
-                last_error_text = "Timeout request waiting for space in transmit buffer";
-                tx_request_count --;
+    if ( isTxQueuedUnlocked() ) {
+        /* Queued frames are ordered one by one */
+        tx_lock.unlock();
+        return ZCANChannel::sendBatch(frames, count, sent, timeout_in_ms);
+    }
 
-                return SendTimeout;
-            }
-        } else {
-            last_error_text = "Transmit request buffer overflow";
-            tx_request_count --;
+    std::unique_lock<std::mutex> out_lock;
+    SendResult result = SendStatusOK;
 
-            return TransmitBufferOveflow;
+    while ( sent < count ) {
+        const TxFrame& frame = frames[sent];
+
+        uint32_t request_flags;
+        bool fd;
+        int request_size;
+        result = prepareTxRequest(frame.dlc, frame.flags, request_flags, fd, request_size);
+        if ( result != SendStatusOK ) break;
+
+        if ( !hasTxSpaceUnlocked() && out_lock.owns_lock() ) {
+            if (! usb_can_device->submitTxRequests(out_lock, tx_low_latency)) {
+                last_error_text = usb_can_device->getLastErrorText();
+                result = SendError;
+                break;
+            }
         }
+        /* The timeout applies to each frame */
+        int frame_timeout_in_ms = timeout_in_ms;
+        result = acquireTxSpace(tx_lock, frame_timeout_in_ms);
+        if ( result != SendStatusOK ) break;
+
+        /* Keeps out_lock on failure, the frames before are submitted below */
+        uint8_t* request = reinterpret_cast<uint8_t*>(usb_can_device->reserveTxRequest(out_lock, frame_timeout_in_ms, request_size));
+        if ( request == nullptr ) {
+            last_error_text = usb_can_device->getLastErrorText();
+            result = SendError;
+            break;
+        }
+
+        uint8_t transaction_id = tx_next_trans_id & ZENO_TX_TRANS_ID_MASK;
+        encodeTxRequest(request, fd, frame.id, frame.msg, frame.dlc, request_flags, transaction_id);
+        usb_can_device->commitTxRequest(out_lock, tx_low_latency, true);
+        tx_next_trans_id ++;
+
+        storeTxSlot(frame.id, request_flags, transaction_id, fd ? frame.dlc : (frame.dlc & 0x0F),
+                    frame.msg, txDataLength(fd, frame.dlc));
+        sent ++;
     }
 
-    if (! usb_can_device->queueTxRequest(zenoRequest(request), timeout_in_ms)) {
+    if ( out_lock.owns_lock() && !usb_can_device->submitTxRequests(out_lock, tx_low_latency) ) {
+        /* The requests stay collected in the OUT buffer */
         last_error_text = usb_can_device->getLastErrorText();
-        tx_request_count --;
-
         return SendError;
     }
 
-    // qDebug() << " enqueue" << (tx_next_trans_id & 0x7f) << tx_request_count;
-    // qDebug() << " enqueue " << request.cmdIOPSeq.transId;
+    return result;
+}
 
-    FifoTxCANMessage* tx_request = tx_message_fifo.writePtr();
-    tx_request->id = uint32_t(id);
-    tx_request->flags = request.flags;
-    tx_request->transaction_id = request.h.transaction_id;
-    tx_request->dlc = request.dlc;
-    memcpy(tx_request->data, msg, 8);
+ZCANFlags::SendResult ZZenoCANChannel::waitForTxIdle(int timeout_in_ms)
+{
+    if (!checkOpen()) return SendError;
 
-    tx_message_fifo.write();
+    /* Acks decrement tx_request_count under the TX lock, waiters are only
+     * woken when it reaches zero with the host queue empty, the FIFO is
+     * flushed or the channel closes */
+    std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex);
+    unsigned int flush_generation = tx_flush_generation;
+    auto idle = [this]() { return (tx_request_count == 0 && tx_queue.empty()) || is_open.load() == 0; };
+
+    bool is_idle;
+    if ( usb_can_device->isApplicationDrivenEvents() ) {
+        is_idle = usb_can_device->waitForEvents(tx_lock, timeout_in_ms, idle);
+    } else if ( timeout_in_ms == -1 ) {
+        tx_idle_cond.wait(tx_lock, idle);
+        is_idle = true;
+    } else {
+        is_idle = tx_idle_cond.wait_for(tx_lock, std::chrono::milliseconds(std::max(timeout_in_ms, 0)), idle);
+    }
+
+    if (!is_idle) {
+        last_error_text = "Timeout waiting for " + std::to_string(tx_request_count) + " TX acknowledges";
+        return SendTimeout;
+    }
+
+    if (!checkOpen()) return SendError;
+
+    /* Every waiter released by a flush fails, a later call reports frames
+     * dropped before it once */
+    if ( tx_dropped_count > 0 || tx_flush_generation != flush_generation ) {
+        last_error_text = (tx_dropped_count > 0 ? std::to_string(tx_dropped_count) + " " : std::string()) +
+                          "TX frames dropped without acknowledge";
+        tx_dropped_count = 0;
+        return SendError;
+    }
 
     return SendStatusOK;
 }
 
-void ZZenoCANChannel::setEventCallback(unsigned int notifyFlags, std::function<void(const EventData&)> callback)
+ZCANFlags::SendResult ZZenoCANChannel::queueTxRequest(std::unique_lock<std::mutex>& tx_lock, uint32_t id,
+                                                      const uint8_t* msg, uint8_t dlc, uint32_t flags,
+                                                      uint32_t request_flags, bool fd, int request_size,
+                                                      int timeout_in_ms)
 {
-    if (!checkOpen()) return;
-    event_callback = callback;
-    notify_flags = notifyFlags;
+    /* tx_lock holds tx_message_fifo_mutex */
+    if ( tx_queue.size() >= tx_queue_size ) {
+        if ( timeout_in_ms <= 0 ) {
+            last_error_text = "Transmit queue overflow";
+            return TransmitBufferOveflow;
+        }
+
+        auto has_room = [this]() { return tx_queue.size() < tx_queue_size || is_open.load() == 0; };
+        bool room;
+        if ( usb_can_device->isApplicationDrivenEvents() ) {
+            room = usb_can_device->waitForEvents(tx_lock, timeout_in_ms, has_room);
+        } else {
+            room = tx_message_fifo_cond.wait_for(tx_lock, std::chrono::milliseconds(timeout_in_ms), has_room);
+        }
+
+        if (!room) {
+            last_error_text = "Timeout request waiting for space in transmit queue";
+            return SendTimeout;
+        }
+        if (!checkOpen()) return SendError;
+    }
+
+    tx_queue.emplace_back();
+    QueuedTxFrame& frame = tx_queue.back();
+    frame.priority = txQueuePriority(id, flags);
+    frame.sequence = tx_queue_sequence++;
+    frame.id = id;
+    frame.request_flags = request_flags;
+    frame.fd = fd;
+    frame.request_size = request_size;
+    frame.dlc = dlc;
+    frame.bus_time_in_ns = 0;
+    if ( tx_shaper.isEnabled() ) {
+        frame.bus_time_in_ns = ZCANTxShaper::frameBusTimeInNs(request_flags & ZenoCANFlagExtended, fd,
+                                                              fd && (request_flags & ZenoCANFlagFDBRS),
+                                                              txDataLength(fd, dlc),
+                                                              current_bitrate, current_data_bitrate);
+    }
+    if ( msg != nullptr ) memcpy(frame.data, msg, txDataLength(fd, dlc));
+    std::push_heap(tx_queue.begin(), tx_queue.end(), txQueueAfter);
+
+    drainTxQueueUnlocked();
+
+    return SendStatusOK;
 }
 
-ZCANFlags::SendResult ZZenoCANChannel::sendFD(const uint32_t id,
-                                               const uint8_t *msg,
-                                               const uint8_t dlc,
-                                               const uint32_t flags,
-                                               int timeout_in_ms)
+void ZZenoCANChannel::drainTxQueueUnlocked()
 {
-    bool dlc_valid = false;
-    if ( dlc <= 8 ) {
-        dlc_valid = true;
-    } else {
-        switch(dlc) {
-        case 12:
-        case 16:
-        case 20:
-        case 24:
-        case 32:
-        case 48:
-        case 64:
-            dlc_valid = true;
+    /* tx_message_fifo_mutex must be held. Runs on the USB event thread for
+     * TX acks, so the OUT buffer is never waited for */
+    if ( tx_queue.empty() ) return;
+
+    std::unique_lock<std::mutex> out_lock;
+    bool drained = false;
+    uint64_t now_in_ns = tx_shaper.isEnabled() ? ZCANTxShaper::nowInNs() : 0;
+    while ( !tx_queue.empty() && hasTxSpaceUnlocked() ) {
+        const QueuedTxFrame& frame = tx_queue.front();
+        if ( tx_shaper.delayInNs(frame.bus_time_in_ns, now_in_ns) != 0 ) {
+            /* The shaper thread sends it when the bucket has refilled */
+            if (!tx_shaper_waiting) tx_shaper_cond.notify_one();
             break;
-        default:
-            dlc_valid = false;
         }
+
+        uint8_t* request = reinterpret_cast<uint8_t*>(usb_can_device->tryReserveTxRequest(out_lock, frame.request_size));
+        if ( request == nullptr ) {
+            usb_can_device->requestTxQueueResume();
+            break;
+        }
+
+        uint8_t transaction_id = tx_next_trans_id & ZENO_TX_TRANS_ID_MASK;
+        encodeTxRequest(request, frame.fd, frame.id, frame.data, frame.dlc, frame.request_flags, transaction_id);
+        usb_can_device->commitTxRequest(out_lock, tx_low_latency, true);
+        tx_next_trans_id ++;
+        tx_shaper.consume(frame.bus_time_in_ns);
+
+        storeTxSlot(frame.id, frame.request_flags, transaction_id, frame.fd ? frame.dlc : (frame.dlc & 0x0F),
+                    frame.data, txDataLength(frame.fd, frame.dlc));
+
+        std::pop_heap(tx_queue.begin(), tx_queue.end(), txQueueAfter);
+        tx_queue.pop_back();
+        drained = true;
     }
 
-    if (!dlc_valid) {
-        last_error_text = "Invalid parameter, allowed data length can be one of the following 0-8, 12, 16, 20, 24, 32, 48, 64.";
-        return SendInvalidParam;
+    if ( out_lock.owns_lock() && !usb_can_device->submitTxRequests(out_lock, tx_low_latency) ) {
+        /* The requests stay collected in the OUT buffer */
+        zError("ZenoCAN Ch%d failed to submit queued TX requests: %s", channel_index+1,
+               usb_can_device->getLastErrorText().c_str());
     }
 
-    ZenoTxCANFDRequestP1 p1_request;
-    p1_request.h.cmd_id = ZENO_CMD_CANFD_P1_TX_REQUEST;
-    p1_request.channel = uint8_t(channel_index);
-    p1_request.h.transaction_id = tx_next_trans_id & 0x7f;
-    tx_next_trans_id ++;
+    /* Senders waiting for room in the queue */
+    if ( drained ) tx_message_fifo_cond.notify_all();
+}
 
-    p1_request.id = uint32_t(id);
-    p1_request.dlc = uint8_t(dlc);
-    p1_request.flags = 0;
+void ZZenoCANChannel::resumeTxQueue()
+{
+    std::lock_guard<std::mutex> tx_lock(tx_message_fifo_mutex);
+    drainTxQueueUnlocked();
+}
 
-    if (flags & Extended) {
-        p1_request.flags |= ZenoCANFlagExtended;
-    } else if (flags & Standard ){
-        p1_request.flags |= ZenoCANFlagStandard;
-    } else {
-        return SendInvalidParam;
+bool ZZenoCANChannel::setTxRateLimit(unsigned int percent, unsigned int burst_in_us)
+{
+    if (!checkOpen()) return false;
+
+    if ( percent > 100 ) {
+        last_error_text = "Invalid TX rate limit " + std::to_string(percent) + "%";
+        return false;
     }
-    if ( flags & CanFDBitrateSwitch ) {
-        p1_request.flags |= ZenoCANFlagFDBRS;
+
+    std::lock_guard<std::mutex> tx_lock(tx_message_fifo_mutex);
+
+    tx_shaper.configure(percent, burst_in_us);
+    if ( percent != 0 && tx_shaper_thread == nullptr ) {
+        tx_shaper_running = true;
+        tx_shaper_thread.reset(new std::thread(&ZZenoCANChannel::runTxShaper, this));
     }
 
-    memcpy(p1_request.data, msg, std::min(dlc, uint8_t(20)));
+    /* Frames held by an earlier limit go at the new rate */
+    drainTxQueueUnlocked();
+    tx_shaper_cond.notify_one();
+
+    return true;
+}
+
+void ZZenoCANChannel::runTxShaper()
+{
+    zDebug("ZenoCAN Ch%d TX shaper started", channel_index+1);
+    ZThreadScheduling::applyToCurrentThread("CAN TX shaper");
 
     std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex);
+    while ( tx_shaper_running ) {
+        if ( tx_queue.empty() ) {
+            tx_shaper_cond.wait(tx_lock);
+            continue;
+        }
 
-    tx_request_count ++;
-    if ( tx_request_count >= int(max_outstanding_tx_requests) ) {
-        if (timeout_in_ms > 0) {
-            if ( !waitForSpaceInTxFifo(tx_lock, timeout_in_ms) ) {
-                last_error_text = "Timeout request waiting for space in transmit buffer";
-                tx_request_count --;
+        uint64_t delay_in_ns = tx_shaper.delayInNs(tx_queue.front().bus_time_in_ns, ZCANTxShaper::nowInNs());
+        if ( delay_in_ns != 0 ) {
+            tx_shaper_waiting = true;
+            tx_shaper_cond.wait_for(tx_lock, std::chrono::nanoseconds(delay_in_ns));
+            tx_shaper_waiting = false;
+            continue;
+        }
 
-                return SendTimeout;
-            }
+        size_t queued = tx_queue.size();
+        drainTxQueueUnlocked();
+        if ( tx_queue.size() == queued ) {
+            /* Out of TX credits or OUT buffers, the acks and OUT completions
+             * drain the queue and wake this thread when the bucket runs dry */
+            tx_shaper_cond.wait(tx_lock);
+        }
+    }
+
+    zDebug("ZenoCAN Ch%d TX shaper ended", channel_index+1);
+}
+
+void ZZenoCANChannel::stopTxShaper()
+{
+    std::unique_ptr<std::thread> thread;
+    {
+        std::lock_guard<std::mutex> tx_lock(tx_message_fifo_mutex);
+        tx_shaper.configure(0, 0);
+        tx_shaper_running = false;
+        tx_shaper_cond.notify_one();
+        thread = std::move(tx_shaper_thread);
+    }
+
+    if ( thread != nullptr ) thread->join();
+}
+
+uint32_t ZZenoCANChannel::txQueuePriority(uint32_t id, uint32_t flags) const
+{
+    switch ( tx_queue_mode ) {
+    case TxQueueById:
+        /* Bus arbitration order: the 11 bit base ID, a standard frame
+         * before an extended frame with the same base, then the ID extension */
+        if ( flags & Extended ) return ((id & 0x1fffffff) << 1) | 1;
+        return (id & 0x7ff) << 19;
+    case TxQueueByClass:
+        return (flags & TxPriorityMask) >> TxPriorityShift;
+    case TxQueueOff:
+    default:
+        /* Behind anything still queued from an earlier mode */
+        return UINT32_MAX;
+    }
+}
+
+bool ZZenoCANChannel::txQueueAfter(const QueuedTxFrame& a, const QueuedTxFrame& b)
+{
+    if ( a.priority != b.priority ) return a.priority > b.priority;
+    return a.sequence > b.sequence;
+}
+
+ZCANFlags::SendResult ZZenoCANChannel::prepareTxRequest(uint8_t dlc, uint32_t flags, uint32_t& request_flags,
+                                                        bool& fd, int& request_size)
+{
+    /* canlib applications pass the canFDMSG_xxx flags, as received */
+    fd = is_canfd_mode && (flags & (ZCANChannel::CanFDFrame | canFDMSG_FDF));
+
+    if ( fd ) {
+        bool dlc_valid = false;
+        if ( dlc <= 8 ) {
+            dlc_valid = true;
         } else {
-            last_error_text ="Transmit request buffer overflow";
-            tx_request_count --;
+            switch(dlc) {
+            case 12:
+            case 16:
+            case 20:
+            case 24:
+            case 32:
+            case 48:
+            case 64:
+                dlc_valid = true;
+                break;
+            default:
+                dlc_valid = false;
+            }
+        }
 
-            return TransmitBufferOveflow;
+        if (!dlc_valid) {
+            last_error_text = "Invalid parameter, allowed data length can be one of the following 0-8, 12, 16, 20, 24, 32, 48, 64.";
+            return SendInvalidParam;
         }
     }
 
-    if (! usb_can_device->queueTxRequest(zenoRequest(p1_request), timeout_in_ms)) {
-        last_error_text = usb_can_device->getLastErrorText();
-        tx_request_count --;
+    if (flags & Extended) {
+        request_flags = ZenoCANFlagExtended;
+    } else if (flags & Standard ){
+        request_flags = ZenoCANFlagStandard;
+    } else {
+        return SendInvalidParam;
+    }
+    if ( fd && (flags & (CanFDBitrateSwitch | canFDMSG_BRS)) ) {
+        request_flags |= ZenoCANFlagFDBRS;
+    }
 
-        return SendError;
+    /* CAN FD bytes 0-19 go in P1, 20-47 in P2 and 48-63 in P3 */
+    if ( !fd ) {
+        request_size = ZENO_CMD_SIZE;
+    } else {
+        request_size = (dlc > 20) ? 2 * ZENO_CMD_SIZE : ZENO_CMD_SIZE;
+        if ( dlc > 48 ) request_size += ZENO_CMD_SIZE;
     }
 
-    if ( dlc > 20 ) {
-        ZenoTxCANFDRequestP2 p2_request;
-        p2_request.h.cmd_id = ZENO_CMD_CANFD_P2_TX_REQUEST;
-        p2_request.channel = uint8_t(channel_index);
-        p2_request.h.transaction_id = p1_request.h.transaction_id;
-        p2_request.dlc = p1_request.dlc;
+    return SendStatusOK;
+}
 
-        memcpy(p2_request.data, msg + 20, std::min(size_t(dlc-20), size_t(28)));
+ZCANFlags::SendResult ZZenoCANChannel::acquireTxSpace(std::unique_lock<std::mutex>& tx_lock, int& timeout_in_ms)
+{
+    if ( hasTxSpaceUnlocked() ) return SendStatusOK;
 
-        if (! usb_can_device->queueTxRequest(zenoRequest(p2_request), timeout_in_ms)) {
-            last_error_text = usb_can_device->getLastErrorText();
-            tx_request_count --;
+    if (timeout_in_ms > 0) {
+        if ( !waitForSpaceInTxFifo(tx_lock, timeout_in_ms) ) {
+            last_error_text = "Timeout request waiting for space in transmit buffer";
 
-            return SendError;
+            return SendTimeout;
         }
+    } else {
+        last_error_text = "Transmit request buffer overflow";
 
-        if ( dlc > 48 ) {
-            ZenoTxCANFDRequestP3 p3_request;
-            p3_request.h.cmd_id = ZENO_CMD_CANFD_P3_TX_REQUEST;
-            p3_request.channel = uint8_t(channel_index);
-            p3_request.h.transaction_id = p1_request.h.transaction_id;
-            p3_request.dlc = p1_request.dlc;
+        return TransmitBufferOveflow;
+    }
 
-            memcpy(p3_request.data, msg + 48, std::min(size_t(dlc-48), size_t(16)));
+    return SendStatusOK;
+}
 
-            if (! usb_can_device->queueTxRequest(zenoRequest(p3_request), timeout_in_ms)) {
-                last_error_text = usb_can_device->getLastErrorText();
-                tx_request_count --;
+uint8_t ZZenoCANChannel::txDataLength(bool fd, uint8_t dlc)
+{
+    return fd ? std::min(dlc, uint8_t(64)) : std::min(uint8_t(dlc & 0x0F), uint8_t(8));
+}
 
-                return SendError;
-            }
-        }
+void ZZenoCANChannel::encodeTxRequest(uint8_t* request, bool fd, uint32_t id, const uint8_t* msg,
+                                      uint8_t dlc, uint32_t request_flags, uint8_t transaction_id)
+{
+    /* request points to a zeroed OUT buffer slot of the size from prepareTxRequest() */
+    if ( !fd ) {
+        ZenoTxCAN20Request* can20_request = reinterpret_cast<ZenoTxCAN20Request*>(request);
+        can20_request->h.cmd_id = ZENO_CMD_CAN20_TX_REQUEST;
+        can20_request->h.transaction_id = transaction_id;
+        can20_request->channel = uint8_t(channel_index);
+        can20_request->id = id;
+        can20_request->dlc = dlc & 0x0F;
+        can20_request->flags = request_flags;
+        memcpy(can20_request->data, msg, txDataLength(false, dlc));
+        return;
     }
 
-    // qDebug() << " enqueue" << (tx_next_trans_id & 0x7f) << tx_request_count;
-    // qDebug() << " enqueue " << request.cmdIOPSeq.transId;
-    // tx_message_fifo.write(request);
+    ZenoTxCANFDRequestP1* p1_request = reinterpret_cast<ZenoTxCANFDRequestP1*>(request);
+    p1_request->h.cmd_id = ZENO_CMD_CANFD_P1_TX_REQUEST;
+    p1_request->h.transaction_id = transaction_id;
+    p1_request->channel = uint8_t(channel_index);
+    p1_request->id = id;
+    p1_request->dlc = dlc;
+    p1_request->flags = request_flags;
+    memcpy(p1_request->data, msg, std::min(dlc, uint8_t(20)));
+    request += ZENO_CMD_SIZE;
 
-    FifoTxCANMessage* tx_request = tx_message_fifo.writePtr();
-    tx_request->id = uint32_t(id);
-    tx_request->flags = p1_request.flags;
-    tx_request->transaction_id = p1_request.h.transaction_id;
-    tx_request->dlc = p1_request.dlc;
-    memcpy(tx_request->data, msg, std::min(dlc, uint8_t(64)));
+    if ( dlc > 20 ) {
+        ZenoTxCANFDRequestP2* p2_request = reinterpret_cast<ZenoTxCANFDRequestP2*>(request);
+        p2_request->h.cmd_id = ZENO_CMD_CANFD_P2_TX_REQUEST;
+        p2_request->h.transaction_id = transaction_id;
+        p2_request->channel = uint8_t(channel_index);
+        p2_request->dlc = dlc;
+        memcpy(p2_request->data, msg + 20, std::min(size_t(dlc-20), size_t(28)));
+        request += ZENO_CMD_SIZE;
+    }
 
-    tx_message_fifo.write();
+    if ( dlc > 48 ) {
+        ZenoTxCANFDRequestP3* p3_request = reinterpret_cast<ZenoTxCANFDRequestP3*>(request);
+        p3_request->h.cmd_id = ZENO_CMD_CANFD_P3_TX_REQUEST;
+        p3_request->h.transaction_id = transaction_id;
+        p3_request->channel = uint8_t(channel_index);
+        p3_request->dlc = dlc;
+        memcpy(p3_request->data, msg + 48, std::min(size_t(dlc-48), size_t(16)));
+    }
+}
 
-    return SendStatusOK;
+void ZZenoCANChannel::storeTxSlot(uint32_t id, uint32_t flags, uint8_t transaction_id,
+                                  uint8_t dlc, const uint8_t* msg, uint8_t data_length)
+{
+    /* tx_message_fifo_mutex must be held. The payload is only needed when
+     * the ack is delivered to the RX queue */
+    TxSlot& slot = tx_slots[transaction_id & ZENO_TX_TRANS_ID_MASK];
+    assert(!slot.in_use);
+    slot.id = id;
+    slot.flags = flags;
+    slot.dlc = dlc;
+    slot.in_use = 1;
+    slot.has_data = (tx_ack_mode == TxAckOn);
+    if ( slot.has_data ) {
+        memcpy(slot.data, msg, data_length);
+    }
+
+    tx_request_count ++;
 }
 
+void ZZenoCANChannel::setEventCallback(unsigned int notifyFlags, std::function<void(const EventData&)> callback)
+{
+    if (!checkOpen()) return;
+    event_callback = callback;
+    notify_flags = notifyFlags;
+}
 
 uint64_t ZZenoCANChannel::getSerialNumber()
 {
@@ -1026,116 +1550,150 @@ int ZZenoCANChannel::getBusLoad()
     return int(busload);
 }
 
-void ZZenoCANChannel::queueMessage(ZenoCAN20Message& message)
+void ZZenoCANChannel::commitRxMessage(FifoRxCANMessage* rx_message)
 {
-    std::unique_lock<std::mutex> lock_rx(rx_message_fifo_mutex);
-    
+    /* rx_message_fifo_mutex must be held, rx_message is the FIFO write pointer */
     if ( rx_message_fifo.available() == 0 ) {
         zDebug("ZenoCAN Ch%d Zeno: RX buffer overflow: %d - %d", channel_index+1,rx_message_fifo.count(), rx_message_fifo.isEmpty());
         return;
     }
 
+    dispatchRXEvent(rx_message);
+    rx_message_fifo.write();
+    rx_message_fifo_cond.notify_one();
+}
+
+void ZZenoCANChannel::commitDeviceRxMessage(FifoRxCANMessage* rx_message)
+{
+    /* Called from the USB event thread, the device publishes staged frames
+     * once the whole incoming transfer has been handled */
+    dispatchRXEvent(rx_message);
+    usb_can_device->deviceRxStagingWrite();
+}
+
+void ZZenoCANChannel::queueMessage(ZenoCAN20Message& message)
+{
+    if ( device_rx_queue_mode ) {
+        ZZenoUSBDevice::DeviceRxMessage* rx = usb_can_device->deviceRxStagingPtr(DeviceFrameCAN, uint8_t(channel_index));
+        if (decodeMessage(message, &rx->can)) commitDeviceRxMessage(&rx->can);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock_rx(rx_message_fifo_mutex);
+
+    FifoRxCANMessage* rx_message = rx_message_fifo.writePtr();
+    if (decodeMessage(message, rx_message)) commitRxMessage(rx_message);
+}
+
+void ZZenoCANChannel::queueMessageCANFDP1(ZenoCANFDMessageP1 &message_p1)
+{
+    if ( device_rx_queue_mode ) {
+        ZZenoUSBDevice::DeviceRxMessage* rx = usb_can_device->deviceRxStagingPtr(DeviceFrameCAN, uint8_t(channel_index));
+        if (decodeMessageCANFDP1(message_p1, &rx->can)) commitDeviceRxMessage(&rx->can);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock_rx(rx_message_fifo_mutex);
+
+    FifoRxCANMessage* rx_message = rx_message_fifo.writePtr();
+    if (decodeMessageCANFDP1(message_p1, rx_message)) commitRxMessage(rx_message);
+}
+
+void ZZenoCANChannel::queueMessageCANFDP2(ZenoCANFDMessageP2 &message_p2)
+{
+    if ( device_rx_queue_mode ) {
+        ZZenoUSBDevice::DeviceRxMessage* rx = usb_can_device->deviceRxStagingPtr(DeviceFrameCAN, uint8_t(channel_index));
+        if (decodeMessageCANFDP2(message_p2, &rx->can)) commitDeviceRxMessage(&rx->can);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock_rx(rx_message_fifo_mutex);
+
     FifoRxCANMessage* rx_message = rx_message_fifo.writePtr();
+    if (decodeMessageCANFDP2(message_p2, rx_message)) commitRxMessage(rx_message);
+}
+
+void ZZenoCANChannel::queueMessageCANFDP3(ZenoCANFDMessageP3 &message_p3)
+{
+    if ( device_rx_queue_mode ) {
+        ZZenoUSBDevice::DeviceRxMessage* rx = usb_can_device->deviceRxStagingPtr(DeviceFrameCAN, uint8_t(channel_index));
+        if (decodeMessageCANFDP3(message_p3, &rx->can)) commitDeviceRxMessage(&rx->can);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock_rx(rx_message_fifo_mutex);
+
+    FifoRxCANMessage* rx_message = rx_message_fifo.writePtr();
+    if (decodeMessageCANFDP3(message_p3, rx_message)) commitRxMessage(rx_message);
+}
+
+bool ZZenoCANChannel::decodeMessage(const ZenoCAN20Message& message, FifoRxCANMessage* rx_message)
+{
     rx_message->timestamp = message.timestamp | (uint64_t(message.timestamp_msb) << 32);
     rx_message->id        = message.id;
     rx_message->flags     = message.flags;
     rx_message->dlc       = message.dlc; // Should be 1-8
     memcpy(rx_message->data, message.data,8);
 
-    dispatchRXEvent(rx_message);
-    rx_message_fifo.write();
-    rx_message_fifo_cond.notify_one(); // We are definately done with 1-8 bytes
+    return true; // We are definately done with 1-8 bytes
 }
 
-void ZZenoCANChannel::queueMessageCANFDP1(ZenoCANFDMessageP1 &message_p1)
+bool ZZenoCANChannel::decodeMessageCANFDP1(const ZenoCANFDMessageP1& message_p1, FifoRxCANMessage* rx_message)
 {
-    if ( message_p1.dlc <= 18 ) {
-        //std::lock_guard<std::mutex> lock(rx_message_fifo_mutex);
-        std::unique_lock<std::mutex> lock_rx(rx_message_fifo_mutex);
-        
-        if ( rx_message_fifo.available() == 0 ) {
-            zDebug("ZenoCAN Ch%d P1 -Zeno: RX buffer overflow: %d - %d", channel_index+1,rx_message_fifo.count(), rx_message_fifo.isEmpty());
-            return;
-        }
-
-        FifoRxCANMessage* rx_message = rx_message_fifo.writePtr();
-        rx_message->timestamp = message_p1.timestamp; // This is only 32 bit
-        rx_message->id        = message_p1.id;
-        rx_message->flags     = message_p1.flags;
-        rx_message->dlc       = message_p1.dlc;
-        memcpy(rx_message->data, message_p1.data, message_p1.dlc);
-
-        dispatchRXEvent(rx_message);
-        rx_message_fifo.write();
-        rx_message_fifo_cond.notify_one(); // We are definately done with 1-18 bytes
-    }
-    else {
+    if ( message_p1.dlc > 18 ) {
         canfd_msg_p1 = message_p1;
+            return false;
     }
+
+    rx_message->timestamp = message_p1.timestamp; // This is only 32 bit
+    rx_message->id        = message_p1.id;
+    rx_message->flags     = message_p1.flags;
+    rx_message->dlc       = message_p1.dlc;
+    memcpy(rx_message->data, message_p1.data, message_p1.dlc);
+
+    return true; // We are definately done with 1-18 bytes
 }
 
-void ZZenoCANChannel::queueMessageCANFDP2(ZenoCANFDMessageP2 &message_p2)
+bool ZZenoCANChannel::decodeMessageCANFDP2(const ZenoCANFDMessageP2& message_p2, FifoRxCANMessage* rx_message)
 {
     if ( canfd_msg_p1.dlc < 18 ) {
         memset(&canfd_msg_p1, 0 , sizeof(canfd_msg_p1)); // Out of sync, skip message
-        return;
+        return false;
     }
 
-    if ( canfd_msg_p1.dlc <= 46 ) {
-        std::unique_lock<std::mutex> lock_rx(rx_message_fifo_mutex);
-        
-        if ( rx_message_fifo.available() == 0 ) {
-            zDebug("ZenoCAN Ch%d P2 -Zeno: RX buffer overflow: %d - %d", channel_index+1,rx_message_fifo.count(), rx_message_fifo.isEmpty());
-            return;
-        }
-
-        FifoRxCANMessage* rx_message = rx_message_fifo.writePtr();
-        rx_message->timestamp = canfd_msg_p1.timestamp;
-        rx_message->id        = canfd_msg_p1.id;
-        rx_message->flags     = canfd_msg_p1.flags;
-        rx_message->dlc       = canfd_msg_p1.dlc;
-
-        memcpy(rx_message->data,      canfd_msg_p1.data, 18);
-        memcpy(rx_message->data + 18, message_p2.data,   canfd_msg_p1.dlc - 18);
-        dispatchRXEvent(rx_message);
-        rx_message_fifo.write();
-        rx_message_fifo_cond.notify_one(); // We are definately done with 18-45 bytes
-    }
-    else {
+    if ( canfd_msg_p1.dlc > 46 ) {
         canfd_msg_p2 = message_p2;
+        return false;
     }
+
+    rx_message->timestamp = canfd_msg_p1.timestamp;
+    rx_message->id        = canfd_msg_p1.id;
+    rx_message->flags     = canfd_msg_p1.flags;
+    rx_message->dlc       = canfd_msg_p1.dlc;
+
+    memcpy(rx_message->data,      canfd_msg_p1.data, 18);
+    memcpy(rx_message->data + 18, message_p2.data,   canfd_msg_p1.dlc - 18);
+
+    return true; // We are definately done with 18-45 bytes
 }
 
-void ZZenoCANChannel::queueMessageCANFDP3(ZenoCANFDMessageP3 &message_p3)
+bool ZZenoCANChannel::decodeMessageCANFDP3(const ZenoCANFDMessageP3& message_p3, FifoRxCANMessage* rx_message)
 {
-    // QByteArray b = QByteArray::fromRawData(reinterpret_cast<char*>(message_p3.data), int(18));
-    // qDebug() << "P3 data" << b.toHex('-');
-    std::unique_lock<std::mutex> lock_rx(rx_message_fifo_mutex);
-
     if ( canfd_msg_p1.dlc < 46 ) {
         memset(&canfd_msg_p1, 0 , sizeof(canfd_msg_p1));
         memset(&canfd_msg_p2, 0 , sizeof(canfd_msg_p2));
-        return;
-    }
-
-    if ( rx_message_fifo.available() == 0 ) {
-        zDebug("ZenoCAN Ch%d P3 -Zeno: RX buffer overflow: %d - %d", channel_index+1,rx_message_fifo.count(), rx_message_fifo.isEmpty());
-        return;
+        return false;
     }
 
-    FifoRxCANMessage* rx_message = rx_message_fifo.writePtr();
     rx_message->timestamp = canfd_msg_p1.timestamp;
     rx_message->id        = canfd_msg_p1.id;
     rx_message->flags     = canfd_msg_p1.flags;
     rx_message->dlc       = canfd_msg_p1.dlc;
 
-    dispatchRXEvent(rx_message);
     memcpy(rx_message->data,      canfd_msg_p1.data, 18);
     memcpy(rx_message->data + 18, canfd_msg_p2.data, 28);
     memcpy(rx_message->data + 46, message_p3.data,   canfd_msg_p1.dlc - 46);
 
-    rx_message_fifo.write();
-
 #if 0
     // Skip memset to save cpu-usage. Should not be needed
     memset(&canfd_msg_p1, 0 , sizeof(canfd_msg_p1));
@@ -1143,62 +1701,140 @@ void ZZenoCANChannel::queueMessageCANFDP3(ZenoCANFDMessageP3 &message_p3)
 #else
     canfd_msg_p1.dlc = 0; // just clear dlc which is most important
 #endif
-    rx_message_fifo_cond.notify_one(); // We are definately done with 46-64 bytes
+
+    return true; // We are definately done with 46-64 bytes
+}
+
+bool ZZenoCANChannel::setTxAckMode(TxAckMode mode)
+{
+    switch(mode) {
+    case TxAckOff:
+    case TxAckOn:
+    case TxAckOffInternal:
+        tx_ack_mode = mode;
+        return true;
+    }
+
+    last_error_text = "Invalid TX acknowledge mode " + std::to_string(int(mode));
+    return false;
 }
 
+bool ZZenoCANChannel::setTxQueue(TxQueueMode mode, unsigned int queue_size, unsigned int device_frames)
+{
+    if (!checkOpen()) return false;
+
+    if ( mode != TxQueueOff && mode != TxQueueById && mode != TxQueueByClass ) {
+        last_error_text = "Invalid TX queue mode " + std::to_string(int(mode));
+        return false;
+    }
+
+    if ( queue_size == 0 || queue_size > ZENO_TX_QUEUE_MAX_SIZE ) {
+        last_error_text = "Invalid TX queue size " + std::to_string(queue_size);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> tx_lock(tx_message_fifo_mutex);
+
+    /* Frames already queued keep their priority, a lower device limit
+     * takes effect as frames are acknowledged */
+    tx_queue_mode = mode;
+    tx_queue_size = queue_size;
+    tx_device_frame_limit = device_frames;
+    tx_queue.reserve(queue_size);
+    drainTxQueueUnlocked();
+    tx_message_fifo_cond.notify_all();
+
+    return true;
+}
+
+ZCANFlags::TxAckMode ZZenoCANChannel::getTxAckMode()
+{
+    return TxAckMode(tx_ack_mode.load());
+}
+
+bool ZZenoCANChannel::setLocalTxEcho(bool enabled)
+{
+    /* Echo goes to the other handles on the channel, never to the sending
+     * one. Without shared mode there are none, the setting is only kept */
+    local_tx_echo = enabled;
+    return true;
+}
 
 void ZZenoCANChannel::txAck(ZenoTxCANRequestAck& tx_ack)
 {
-    std::unique_lock<std::mutex> lock_tx(tx_message_fifo_mutex);
-    // static int count = 0;
+    /* The ack is always decoded to release the TX credit, it is only
+     * delivered to the RX queue when TX ack is enabled */
+    bool deliver = tx_ack_mode == TxAckOn;
 
-    int tx_count = int(tx_message_fifo.count());
+    if ( device_rx_queue_mode ) {
+        ZZenoUSBDevice::DeviceRxMessage* rx = usb_can_device->deviceRxStagingPtr(DeviceFrameCAN, uint8_t(channel_index));
+        if (!decodeTxAck(tx_ack, &rx->can)) return;
 
-    for (int i = 0; i < tx_count ; ++i ) {
-        FifoTxCANMessage m = tx_message_fifo.read();
+        dispatchTXEvent(&rx->can);
+        if ( deliver ) usb_can_device->deviceRxStagingWrite();
+        return;
+    }
 
-        if ( m.transaction_id == tx_ack.trans_id )  {
-            FifoRxCANMessage message;
+    FifoRxCANMessage message;
+    if (!decodeTxAck(tx_ack, &message)) return;
 
-            message.id = m.id;
-            message.dlc = m.dlc;
-            message.flags = uint8_t(m.flags | ZenoCANFlagTxAck);
-            // message.dlc = tx_ack.dlc;
-            message.timestamp = tx_ack.timestamp | (uint64_t(tx_ack.timestamp_msb) << 32);
-            memcpy(message.data, m.data, m.dlc);
+    if ( !deliver ) {
+        dispatchTXEvent(&message);
+        return;
+    }
 
-            tx_request_count --;
-            assert(tx_request_count >= 0);
+    std::lock_guard<std::mutex> lock_rx(rx_message_fifo_mutex);
 
-            tx_message_fifo_mutex.unlock();
+    if ( rx_message_fifo.available() == 0 ) {
+        zDebug("Zeno: RX buffer overflow (TxACK) fifo-count: %d-%d", rx_message_fifo.count(), rx_message_fifo.isEmpty());
+        return;
+    }
+    rx_message_fifo.write(message);
 
-            if ( tx_ack.flags & ZenoCANErrorFrame ) {
-                zDebug("ZenoCAN Ch%d TX failed, remove pending TX", channel_index+1);
-                flushTxFifo();
-                return;
-            }
+    dispatchTXEvent(&message);
 
-            rx_message_fifo_mutex.lock();
+    rx_message_fifo_cond.notify_one();
+}
 
-            if ( rx_message_fifo.available() == 0 ) {
-                zDebug("Zeno: RX buffer overflow (TxACK) fifo-count: %d-%d", rx_message_fifo.count(), rx_message_fifo.isEmpty());
-                rx_message_fifo_mutex.unlock();
-                return;
-            }
-            rx_message_fifo.write(message);
+bool ZZenoCANChannel::decodeTxAck(const ZenoTxCANRequestAck& tx_ack, FifoRxCANMessage* rx_message)
+{
+    std::lock_guard<std::mutex> lock_tx(tx_message_fifo_mutex);
 
-            dispatchTXEvent(&message);
+    TxSlot& slot = tx_slots[tx_ack.trans_id & ZENO_TX_TRANS_ID_MASK];
+    if ( !slot.in_use ) {
+        zDebug("ZenoCAN Ch%d -- TX ack with transId: %d not queued", channel_index+1, tx_ack.trans_id);
+        return false;
+    }
 
-            rx_message_fifo_cond.notify_one();
-            return;
-        }
+    if ( tx_ack.flags & ZenoCANErrorFrame ) {
+        /* The device dropped its pending requests, the host queue is kept */
+        zDebug("ZenoCAN Ch%d TX failed, remove pending TX", channel_index+1);
+        flushTxSlots();
+        tx_message_fifo_cond.notify_all();
+        drainTxQueueUnlocked();
+        return false;
+    }
 
-        zDebug("ZenoCAN Ch%d *** Writing back to TX fifo TID%d-%d-%x", channel_index+1, m.transaction_id, tx_ack.trans_id, m.id);
-        tx_message_fifo.write(m);
+    rx_message->id = slot.id;
+    rx_message->dlc = slot.dlc;
+    rx_message->flags = uint8_t(slot.flags | ZenoCANFlagTxAck);
+    rx_message->timestamp = tx_ack.timestamp | (uint64_t(tx_ack.timestamp_msb) << 32);
+    if ( slot.has_data ) {
+        memcpy(rx_message->data, slot.data, std::min(slot.dlc, uint8_t(64)));
+    } else {
+        memset(rx_message->data, 0, sizeof(rx_message->data));
     }
 
+    slot.in_use = 0;
+    tx_request_count --;
+    assert(tx_request_count >= 0);
     tx_message_fifo_cond.notify_one();
-    zDebug("ZenoCAN Ch%d -- TX ack with transId: %d not queued", channel_index+1, tx_ack.trans_id);
+
+    /* The freed credit goes to the highest priority queued frame */
+    drainTxQueueUnlocked();
+    if ( tx_request_count == 0 && tx_queue.empty() ) tx_idle_cond.notify_all();
+
+    return true;
 }
 
 bool ZZenoCANChannel::getDeviceTimeInUs(int64_t &timestamp_in_us)
@@ -1216,7 +1852,7 @@ bool ZZenoCANChannel::getZenoDeviceTimeInUs(int64_t& timestamp_in_us)
 {
     if (!checkOpen()) return false;
 
-    std::unique_lock<std::mutex> tx_lock(tx_message_fifo_mutex);
+    std::lock_guard<std::mutex> command_lock(command_mutex);
 
     ZenoReadClock cmd;
     ZenoReadClockResponse reply;
@@ -1261,9 +1897,28 @@ void ZZenoCANChannel::flushRxFifo()
 
 void ZZenoCANChannel::flushTxFifo()
 {
-    tx_message_fifo.clear();
+    flushTxSlots();
+
+    if ( !tx_queue.empty() ) {
+        zDebug("ZenoCAN Ch%d %d queued TX frames dropped", channel_index+1, int(tx_queue.size()));
+        tx_dropped_count += unsigned(tx_queue.size());
+        tx_flush_generation++;
+        tx_queue.clear();
+        tx_idle_cond.notify_all();
+    }
+}
+
+void ZZenoCANChannel::flushTxSlots()
+{
+    /* Requests the device holds, they are not acked */
+    if ( tx_request_count > 0 ) {
+        tx_dropped_count += unsigned(tx_request_count);
+        tx_flush_generation++;
+    }
+    for ( TxSlot& slot : tx_slots ) slot.in_use = 0;
     tx_request_count = 0;
     tx_next_trans_id = 0;
+    if ( tx_queue.empty() ) tx_idle_cond.notify_all();
 
     /* TODO: send flush CMD to Zeno */
 }
@@ -1278,28 +1933,31 @@ bool ZZenoCANChannel::checkOpen()
     return true;
 }
 
-bool ZZenoCANChannel::waitForSpaceInTxFifo(std::unique_lock<std::mutex>& lock_tx, int& timeout_in_ms)
+bool ZZenoCANChannel::hasTxSpaceUnlocked() const
 {
-    auto t_start = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()).time_since_epoch();
-    std::chrono::milliseconds timeout(timeout_in_ms);
-
-    while ( timeout.count() > 0 &&
-            tx_message_fifo.count() >=  max_outstanding_tx_requests) {
-        std::cv_status wait_result;
-
-        wait_result = tx_message_fifo_cond.wait_for(lock_tx, timeout);
-        // qDebug()  << "ZenoCAN-Ch" << channel_index  << "wait for TX space" << tx_message_fifo.count() << tx_ack_received << wait_success;
+    /* One request is kept in reserve below the device limit. The next ID
+     * may still be outstanding when acks arrive out of order */
+    return tx_request_count + 1 < int(max_outstanding_tx_requests) &&
+           (tx_device_frame_limit == 0 || tx_request_count < int(tx_device_frame_limit)) &&
+           !tx_slots[tx_next_trans_id & ZENO_TX_TRANS_ID_MASK].in_use;
+}
 
-        auto t_now = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()).time_since_epoch();
-        timeout -= (t_now - t_start);
+bool ZZenoCANChannel::waitForSpaceInTxFifo(std::unique_lock<std::mutex>& lock_tx, int& timeout_in_ms)
+{
+    auto t_start = std::chrono::steady_clock::now();
+    bool has_space;
 
-        if (wait_result == std::cv_status::no_timeout) break;
-        tx_message_fifo_mutex.unlock();
+    if ( usb_can_device->isApplicationDrivenEvents() ) {
+        /* TX acks are handled by this thread, lock_tx is released meanwhile */
+        auto ready = [this]() { return hasTxSpaceUnlocked(); };
+        has_space = usb_can_device->waitForEvents(lock_tx, timeout_in_ms, ready);
+    } else {
+        has_space = tx_message_fifo_cond.wait_for(lock_tx, std::chrono::milliseconds(timeout_in_ms),
+                                                  [this]() { return hasTxSpaceUnlocked(); });
     }
 
-    timeout_in_ms = int(timeout.count());
-    int tx_count = tx_message_fifo.count();
-    tx_message_fifo_mutex.unlock();
-    
-    return tx_count < max_outstanding_tx_requests;
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t_start);
+    timeout_in_ms = std::max(0, timeout_in_ms - int(elapsed.count()));
+
+    return has_space;
 }
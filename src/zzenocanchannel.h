@@ -36,12 +36,28 @@
 #include "zcanchannel.h"
 #include "zthreadlocalstring.h"
 #include "zzenotimersynch.h"
+#include "zcantxshaper.h"
 #include "zenocan.h"
 #include "zring.h"
 
 #include <condition_variable>
 #include <atomic>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
+
+/* Host generated RX flag, not sent by the device. Marks the gap frame
+ * queued when a lost device has been recovered */
+#define ZENO_HOST_FLAG_DEVICE_GAP 0x80000000
+
+/* TX transaction IDs are 7 bit, one ack slot per ID */
+#define ZENO_TX_SLOT_COUNT      128
+#define ZENO_TX_TRANS_ID_MASK   0x7f
+
+/* Host TX queue, frames waiting for device credits */
+#define ZENO_TX_QUEUE_DEFAULT_SIZE  256
+#define ZENO_TX_QUEUE_MAX_SIZE      65536
 
 class ZZenoUSBDevice;
 class ZZenoCANChannel : public ZCANChannel, public ZZenoTimerSynch {
@@ -68,6 +84,9 @@ public:
     SendResult send(const uint32_t id, const uint8_t *msg,
                     const uint8_t dlc, const uint32_t flags,
                     int timeout_in_ms) override;
+    SendResult sendBatch(const TxFrame* frames, unsigned int count,
+                         unsigned int& sent, int timeout_in_ms) override;
+    SendResult waitForTxIdle(int timeout_in_ms) override;
 
     void setEventCallback(unsigned int notifyFlags, std::function<void(const EventData&)> callback) override;
 
@@ -77,12 +96,48 @@ public:
 
     int getBusLoad() override;
 
+    ReadResult readDeviceWait(DeviceFrame* frames, unsigned int max_count,
+                              unsigned int& count, int timeout_in_ms) override;
+
+    struct FifoRxCANMessage {
+        uint64_t timestamp;
+        uint32_t id;
+        uint32_t flags;
+        uint8_t dlc;
+        uint8_t data[64];
+    };
+
     void queueMessage(ZenoCAN20Message& message);
     void queueMessageCANFDP1(ZenoCANFDMessageP1& message_p1);
     void queueMessageCANFDP2(ZenoCANFDMessageP2& message_p2);
     void queueMessageCANFDP3(ZenoCANFDMessageP3& message_p3);
     void txAck(ZenoTxCANRequestAck& tx_ack);
 
+    /* Decode into rx_message, returns true when a complete frame is available */
+    bool decodeMessage(const ZenoCAN20Message& message, FifoRxCANMessage* rx_message);
+    bool decodeMessageCANFDP1(const ZenoCANFDMessageP1& message_p1, FifoRxCANMessage* rx_message);
+    bool decodeMessageCANFDP2(const ZenoCANFDMessageP2& message_p2, FifoRxCANMessage* rx_message);
+    bool decodeMessageCANFDP3(const ZenoCANFDMessageP3& message_p3, FifoRxCANMessage* rx_message);
+    bool decodeTxAck(const ZenoTxCANRequestAck& tx_ack, FifoRxCANMessage* rx_message);
+
+    void translateRxMessage(const FifoRxCANMessage& rx,
+                            uint32_t& id, uint8_t *msg,
+                            uint8_t& dlc, uint32_t& flags,
+                            uint64_t& driver_timestmap_in_us);
+
+    bool setTxAckMode(TxAckMode mode) override;
+    bool setTxQueue(TxQueueMode mode, unsigned int queue_size, unsigned int device_frames) override;
+    bool setTxRateLimit(unsigned int percent, unsigned int burst_in_us) override;
+    TxAckMode getTxAckMode() override;
+    bool setLocalTxEcho(bool enabled) override;
+
+    /* Hand queued frames to the device after an OUT buffer was freed */
+    void resumeTxQueue();
+
+    bool isDeviceRxQueueMode() const {
+        return device_rx_queue_mode.load();
+    }
+
     bool getDeviceTimeInUs(int64_t& timestamp_in_us) override;
 
     uint64_t getDeviceClock() override;
@@ -92,17 +147,36 @@ public:
 private:
     void flushRxFifo();
     void flushTxFifo();
+    void flushTxSlots();
     bool checkOpen();
+    bool sendOpenUnlocked(int open_flags);
+    bool closeUnlocked();
+    void recover(int64_t outage_in_us);
+    void queueGapFrame(int64_t outage_in_us);
+    bool hasTxSpaceUnlocked() const;
     bool waitForSpaceInTxFifo(std::unique_lock<std::mutex>& lock, int& timeout_in_ms);
     bool getZenoDeviceTimeInUs(int64_t &timestamp_in_us);
-    SendResult sendFD(const uint32_t id, const uint8_t *msg,
-                      const uint8_t dlc, const uint32_t flags,
-                      int timeout_in_ms);
+    SendResult prepareTxRequest(uint8_t dlc, uint32_t flags, uint32_t& request_flags,
+                                bool& fd, int& request_size);
+    SendResult acquireTxSpace(std::unique_lock<std::mutex>& tx_lock, int& timeout_in_ms);
+    void encodeTxRequest(uint8_t* request, bool fd, uint32_t id, const uint8_t* msg,
+                         uint8_t dlc, uint32_t request_flags, uint8_t transaction_id);
+    static uint8_t txDataLength(bool fd, uint8_t dlc);
+    SendResult queueTxRequest(std::unique_lock<std::mutex>& tx_lock, uint32_t id, const uint8_t* msg,
+                              uint8_t dlc, uint32_t flags, uint32_t request_flags, bool fd,
+                              int request_size, int timeout_in_ms);
+    void drainTxQueueUnlocked();
+    uint32_t txQueuePriority(uint32_t id, uint32_t flags) const;
 
     int channel_index;
     std::atomic<int> is_open;
 
     bool is_canfd_mode;
+    std::atomic<bool> device_rx_queue_mode;
+    int device_rx_queue_flags;
+    std::atomic<int> tx_ack_mode;
+    std::atomic<bool> local_tx_echo;          /* Stored only, no other handles to echo to */
+    bool tx_low_latency;
     ZZenoUSBDevice* usb_can_device;
 
     ZThreadLocalString last_error_text;
@@ -111,45 +185,101 @@ private:
     std::mutex rx_message_fifo_mutex;
     std::condition_variable rx_message_fifo_cond;
 
+    /* Held across open, close and the reopen after a device recovery, so
+     * the device commands of one channel never interleave. Taken before
+     * command_mutex */
+    std::mutex open_close_mutex;
+
+    /* Channel commands, open and the reopen after a device recovery
+     * included, wait for their reply with command_mutex held. TX acks
+     * ahead of the reply are decoded under tx_message_fifo_mutex on the
+     * thread delivering the reply, so it is not held while waiting.
+     * command_mutex is taken before tx_message_fifo_mutex */
+    std::mutex command_mutex;
+
     /* TX logic */
     std::mutex tx_message_fifo_mutex;
     std::condition_variable tx_message_fifo_cond;
+    std::condition_variable tx_idle_cond;     /* Signalled when tx_request_count reaches 0 */
     int tx_request_count;
     int tx_next_trans_id;
+    unsigned int tx_dropped_count;            /* Frames flushed unacked, reported by waitForTxIdle() */
+    unsigned int tx_flush_generation;         /* Counts flushes dropping frames, fails the waiters */
     // int tx_request_received;
     unsigned int max_outstanding_tx_requests;
 
-    struct FifoRxCANMessage {
-        uint64_t timestamp;
-        uint32_t id;
-        uint32_t flags;
-        uint8_t dlc;
-        uint8_t data[64];
-    };
     bool readFromRXFifo(FifoRxCANMessage& rx, int timeout_in_ms);
 
-    struct FifoTxCANMessage {
+    /* Outstanding TX request, indexed by transaction ID. Holds what the
+     * TX ack frame is made of, the payload only when the ack is delivered */
+    struct TxSlot {
         uint32_t id;
         uint32_t flags;
-        uint8_t transaction_id;
         uint8_t dlc;
+        uint8_t in_use;
+        uint8_t has_data;
         uint8_t data[64];
     };
+    void storeTxSlot(uint32_t id, uint32_t flags, uint8_t transaction_id,
+                     uint8_t dlc, const uint8_t* msg, uint8_t data_length);
 
     void dispatchRXEvent(FifoRxCANMessage* rx_message);
     void dispatchTXEvent(FifoRxCANMessage* rx_message);
+    void commitRxMessage(FifoRxCANMessage* rx_message);
+    void commitDeviceRxMessage(FifoRxCANMessage* rx_message);
 
     ZenoCANFDMessageP1 canfd_msg_p1;
     ZenoCANFDMessageP2 canfd_msg_p2;
 
     ZRing<FifoRxCANMessage> rx_message_fifo;
-    ZRing<FifoTxCANMessage> tx_message_fifo;
+    TxSlot tx_slots[ZENO_TX_SLOT_COUNT];
+
+    /* Host TX queue, a heap with the highest priority frame at the front.
+     * Lower priority values go first, the sequence keeps FIFO order
+     * within a priority. Guarded by tx_message_fifo_mutex */
+    struct QueuedTxFrame {
+        uint32_t priority;
+        uint64_t sequence;
+        uint32_t id;
+        uint32_t request_flags;
+        bool fd;
+        int request_size;
+        uint8_t dlc;
+        uint32_t bus_time_in_ns;        /* Shaper cost, 0 when queued unshaped */
+        uint8_t data[64];
+    };
+    static bool txQueueAfter(const QueuedTxFrame& a, const QueuedTxFrame& b);
+    std::vector<QueuedTxFrame> tx_queue;
+    uint64_t tx_queue_sequence;
+    TxQueueMode tx_queue_mode;
+    unsigned int tx_queue_size;
+    unsigned int tx_device_frame_limit;
+
+    /* TX rate shaping. Frames the token bucket has no room for wait in
+     * tx_queue, the shaper thread hands them on when it has refilled.
+     * Guarded by tx_message_fifo_mutex */
+    bool isTxQueuedUnlocked() const {
+        return tx_queue_mode != TxQueueOff || tx_shaper.isEnabled() || !tx_queue.empty();
+    }
+    void runTxShaper();
+    void stopTxShaper();
+    ZCANTxShaper tx_shaper;
+    std::unique_ptr<std::thread> tx_shaper_thread;
+    std::condition_variable tx_shaper_cond;
+    bool tx_shaper_running;
+    bool tx_shaper_waiting;             /* In a timed wait for tokens */
 
     /* Calculate bus load */
     int64_t bus_active_bit_count;
     int64_t last_measure_time_in_us;
     int current_bitrate;
 
+    /* Replayed when the device is recovered */
+    int channel_open_flags;
+    int current_data_bitrate;
+    int current_driver_mode; /* -1 when not set */
+    bool is_bus_on;
+
     // int tx_id;
 
     uint64_t open_start_ref_timestamp_in_us;
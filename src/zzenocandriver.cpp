@@ -32,14 +32,26 @@
 
 #include "zzenocandriver.h"
 #include "zzenolindriver.h"
+#include "zzenosimdevice.h"
 #include "zusbcontext.h"
+#include "zthreadscheduling.h"
 #include "zdebug.h"
 #include <map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+static std::mutex event_group_config_mutex;
+static int event_group_count = 0;
+static std::vector<int> event_group_cpus;
+static std::atomic<bool> default_auto_recovery(false);
 
 ZZenoCANDriver::ZZenoCANDriver()
 : ZCANDriver("zeno-can-driver", "Zuragon Zeno USB CAN driver"),
   usb_context(new ZUSBContext()),
   enumerate_pending(false), driver_ref_count(0),
+  hotplug_registered(false), hotplug_handle(0),
+  hotplug_running(false),
   lin_driver(nullptr)
 {
     setDriverPriorityOrder(0);
@@ -48,6 +60,18 @@ ZZenoCANDriver::ZZenoCANDriver()
 
 ZZenoCANDriver::~ZZenoCANDriver()
 {
+    stopHotplug();
+
+    /* Devices close their handles in the group contexts first */
+    lin_driver = nullptr;
+    device_list.clear();
+    removed_device_list.clear();
+
+    std::lock_guard<std::mutex> lock(event_group_mutex);
+    for ( auto& group_context : event_group_contexts ) {
+        if ( group_context != nullptr ) group_context->stopEventThread();
+    }
+    event_group_contexts.clear();
 }
 
 const std::string ZZenoCANDriver::getObjectText() const
@@ -57,6 +81,8 @@ const std::string ZZenoCANDriver::getObjectText() const
 
 int ZZenoCANDriver::getNumberOfChannels()
 {
+    /* The hotplug thread changes device_list */
+    std::lock_guard<std::mutex> lock(driver_mutex);
     int channel_count = 0;
     for ( auto device : device_list ) {
         channel_count += device->getCANChannelCount();
@@ -74,6 +100,8 @@ const std::string ZZenoCANDriver::getChannelName(int channel_index)
 
 ZCANChannel* ZZenoCANDriver::getChannel(int channel_index)
 {
+    /* Channels of a removed device stay alive in removed_device_list */
+    std::lock_guard<std::mutex> lock(driver_mutex);
     int channel_offset = 0;
     for(auto device : device_list) {
         int index = channel_index - channel_offset;
@@ -117,8 +145,19 @@ bool ZZenoCANDriver::enumerateDevicesUnlocked()
         return false;
     }
 
-    unsigned int device_index = 0;
-    bool device_list_updated = false;
+    /* Open and query the Zeno devices in parallel, each one takes several
+     * USB round trips */
+    struct EnumeratedDevice {
+        int device_no;
+        libusb_device* device;
+        std::string display_name;
+        ZRef<ZZenoUSBDevice> zeno_usb_device;
+        double elapsed_in_ms;
+        bool simulated;
+        std::shared_ptr<const ZZenoUSBCapture::Device> replay;
+    };
+    std::vector<EnumeratedDevice> enumerated_devices;
+
     for (int i = 0; i < cnt; i++) {
         libusb_device *device = list[i];
 
@@ -129,46 +168,88 @@ bool ZZenoCANDriver::enumerateDevicesUnlocked()
         std::map<int,std::string>::iterator k;
         if (descriptor.idVendor == ZURAGON_VENDOR_ID &&
             (k = product_id_table.find(descriptor.idProduct)) != product_id_table.end()) {
+            enumerated_devices.push_back({ i, device, k->second, nullptr, 0, false, nullptr });
+        }
+    }
 
-            ZRef<ZZenoUSBDevice> zeno_usb_device;
-            zeno_usb_device = new ZZenoUSBDevice(this,i, device, k->second);
-
-            if ( device_index < device_list.size() ) {
-                /* Check if channel is already at the same index */
-                ZRef<ZZenoUSBDevice> __zeno_usb_device = device_list[device_index];
-                if ( !__zeno_usb_device->isDeviceGoneOrDisconnected() &&
-                     __zeno_usb_device->getSerialNumber() == zeno_usb_device->getSerialNumber() ) {
-                    /* Assume channel already enumerated, don't change */
-                    zeno_usb_device = __zeno_usb_device;
-                } else {
-                    /* New device */
-                    device_list_updated = true;
-                }
-            } else {
-                /* New device */
-                device_list_updated = true;
-            }
+    /* Simulated devices follow the USB devices, see ZCQ_SIMULATION */
+    ZZenoSimDevice::Config sim_config = ZZenoSimDevice::getConfig();
+    for ( int i = 0; i < sim_config.device_count; i++ ) {
+        enumerated_devices.push_back({ i, nullptr, std::string(), nullptr, 0, true, nullptr });
+    }
 
-            new_zeno_can_device_list.push_back(zeno_usb_device);
-            if (zeno_usb_device->getLINChannelCount() > 0 ) {
-                new_zeno_lin_device_list.push_back(zeno_usb_device);
-            }
-            device_index ++;
+    /* Followed by one simulated device per captured device, see ZCQ_USB_REPLAY */
+    std::vector<std::shared_ptr<const ZZenoUSBCapture::Device> > replay_devices;
+    bool replay_full_speed = false;
+    ZZenoUSBCapture::loadReplay(replay_devices, replay_full_speed);
+    for ( size_t i = 0; i < replay_devices.size(); i++ ) {
+        enumerated_devices.push_back({ sim_config.device_count + int(i), nullptr, std::string(), nullptr, 0, true,
+                                       replay_devices[i] });
+    }
+
+    auto t_start = std::chrono::steady_clock::now();
+    auto construct = [this, &sim_config, replay_full_speed](EnumeratedDevice& e) {
+        auto t0 = std::chrono::steady_clock::now();
+        if ( e.simulated ) e.zeno_usb_device = new ZZenoSimDevice(this, e.device_no, sim_config, e.replay, replay_full_speed);
+        else e.zeno_usb_device = new ZZenoUSBDevice(this, e.device_no, e.device, e.display_name);
+        e.elapsed_in_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    };
+
+    if ( enumerated_devices.size() == 1 ) {
+        construct(enumerated_devices[0]);
+    } else {
+        std::vector<std::thread> threads;
+        for ( EnumeratedDevice& e : enumerated_devices ) {
+            threads.emplace_back([&construct, &e]() {
+                ZThreadScheduling::applyToCurrentThread("Zeno enumerate");
+                construct(e);
+            });
         }
+        for ( std::thread& thread : threads ) thread.join();
     }
 
-    if ( !new_zeno_can_device_list.empty() ) {
-        if ( lin_driver == nullptr ) {
-            lin_driver = new ZZenoLINDriver(this);
+    for ( const EnumeratedDevice& e : enumerated_devices ) {
+        if ( e.simulated ) {
+            zInfo("(ZenoUSB) %s serial %x enumerated in %.1f ms",
+                  e.zeno_usb_device->getObjectText().c_str(), e.zeno_usb_device->getSerialNumber(),
+                  e.elapsed_in_ms);
+            continue;
         }
-        lin_driver->updateDeviceList(new_zeno_can_device_list);
+        zInfo("(ZenoUSB) %s bus %d address %d serial %x enumerated in %.1f ms",
+              e.display_name.c_str(), libusb_get_bus_number(e.device), libusb_get_device_address(e.device),
+              e.zeno_usb_device->getSerialNumber(), e.elapsed_in_ms);
     }
-    else {
-        if ( lin_driver != nullptr ) {
-            lin_driver = nullptr;
+    zInfo("(ZenoUSB) %d device(s) enumerated in %.1f ms", int(enumerated_devices.size()),
+          std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count());
 
-            // VxLINDriverFactory::instance()->dispatchChannelListUpdated();
+    unsigned int device_index = 0;
+    bool device_list_updated = false;
+    for ( EnumeratedDevice& e : enumerated_devices ) {
+        ZRef<ZZenoUSBDevice> zeno_usb_device = e.zeno_usb_device;
+
+        if ( device_index < device_list.size() ) {
+            /* Check if channel is already at the same index */
+            ZRef<ZZenoUSBDevice> __zeno_usb_device = device_list[device_index];
+            if ( !__zeno_usb_device->isDeviceGoneOrDisconnected() &&
+                 !__zeno_usb_device->isDeviceInfoStale() &&
+                 __zeno_usb_device->getSerialNumber() == zeno_usb_device->getSerialNumber() ) {
+                /* Assume channel already enumerated, don't change */
+                zeno_usb_device = __zeno_usb_device;
+            } else {
+                /* New device */
+                device_list_updated = true;
+            }
+        } else {
+            /* New device */
+            device_list_updated = true;
         }
+
+        zeno_usb_device->setDeviceIndex(int(device_index));
+        new_zeno_can_device_list.push_back(zeno_usb_device);
+        if (zeno_usb_device->getLINChannelCount() > 0 ) {
+            new_zeno_lin_device_list.push_back(zeno_usb_device);
+        }
+        device_index ++;
     }
 
     if ( device_list.size() != new_zeno_can_device_list.size() ) {
@@ -178,11 +259,245 @@ bool ZZenoCANDriver::enumerateDevicesUnlocked()
 
     device_list = new_zeno_can_device_list;
     device_list.shrink_to_fit();
+    updateLINDriverUnlocked();
     libusb_free_device_list(list,1);
 
     return device_list_updated;
 }
 
+void ZZenoCANDriver::updateLINDriverUnlocked()
+{
+    /* Kept once created, even with no devices left. LIN channels of a
+     * removed device may still be open and reach it through the device */
+    if ( lin_driver == nullptr ) {
+        if ( device_list.empty() ) return;
+        lin_driver = new ZZenoLINDriver(this);
+    }
+    lin_driver->updateDeviceList(device_list);
+}
+
+bool ZZenoCANDriver::startHotplug(std::function<void()> _device_list_changed)
+{
+    if ( !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) ) {
+        zInfo("USB hotplug not supported on this platform");
+        return false;
+    }
+
+    device_list_changed = _device_list_changed;
+    hotplug_running = true;
+    hotplug_thread.reset(new std::thread(&ZZenoCANDriver::hotplugRun, this));
+
+    /* ENUMERATE reports devices already present too, so a device plugged in
+     * after the first enumeration is not missed. Known devices are skipped */
+    int res = libusb_hotplug_register_callback(usb_context->getUSBContext(),
+                                               LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                                               LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                               LIBUSB_HOTPLUG_ENUMERATE,
+                                               ZURAGON_VENDOR_ID,
+                                               LIBUSB_HOTPLUG_MATCH_ANY,
+                                               LIBUSB_HOTPLUG_MATCH_ANY,
+                                               __hotplugCallback, this,
+                                               &hotplug_handle);
+    if ( res != LIBUSB_SUCCESS ) {
+        zError("failed to register USB hotplug callback: %s",
+               ZUSBContext::translateLibUSBErrorCode(res).c_str());
+        stopHotplug();
+        return false;
+    }
+
+    /* Hotplug events are delivered by the USB event handling */
+    hotplug_registered = true;
+    usb_context->startRef();
+
+    return true;
+}
+
+void ZZenoCANDriver::stopHotplug()
+{
+    if ( hotplug_registered ) {
+        libusb_hotplug_deregister_callback(usb_context->getUSBContext(), hotplug_handle);
+        usb_context->stopUnRef();
+        hotplug_registered = false;
+    }
+
+    if ( hotplug_thread != nullptr ) {
+        {
+            std::lock_guard<std::mutex> lock(hotplug_mutex);
+            hotplug_running = false;
+            hotplug_cond.notify_one();
+        }
+        hotplug_thread->join();
+        hotplug_thread.reset();
+
+        for ( auto& event : hotplug_events ) {
+            libusb_unref_device(event.device);
+        }
+        hotplug_events.clear();
+    }
+}
+
+void ZZenoCANDriver::setDefaultAutoRecovery(bool enabled)
+{
+    default_auto_recovery = enabled;
+}
+
+bool ZZenoCANDriver::isAutoRecoveryEnabled()
+{
+    return default_auto_recovery;
+}
+
+int ZZenoCANDriver::__hotplugCallback(libusb_context* ctx, libusb_device* device,
+                                      libusb_hotplug_event event, void* user_data)
+{
+    ZUNUSED(ctx)
+    ZZenoCANDriver* _this = static_cast<ZZenoCANDriver*>(user_data);
+
+    /* Called from USB event handling, opening the device has to wait for
+     * the hotplug thread */
+    std::lock_guard<std::mutex> lock(_this->hotplug_mutex);
+    HotplugEvent hotplug_event;
+    hotplug_event.device = libusb_ref_device(device);
+    hotplug_event.arrived = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+    _this->hotplug_events.push_back(hotplug_event);
+    _this->hotplug_cond.notify_one();
+
+    return 0;
+}
+
+void ZZenoCANDriver::refreshDevice(libusb_device* device)
+{
+    std::lock_guard<std::mutex> lock(hotplug_mutex);
+    if ( !hotplug_running ) return;
+
+    HotplugEvent hotplug_event;
+    hotplug_event.device = libusb_ref_device(device);
+    hotplug_event.arrived = true;
+    hotplug_events.push_back(hotplug_event);
+    hotplug_cond.notify_one();
+}
+
+void ZZenoCANDriver::hotplugRun()
+{
+    ZThreadScheduling::applyToCurrentThread("USB hotplug");
+
+    std::unique_lock<std::mutex> lock(hotplug_mutex);
+    while ( hotplug_running ) {
+        hotplug_cond.wait(lock, [this]() { return !hotplug_running || !hotplug_events.empty(); });
+
+        std::vector<HotplugEvent> events;
+        events.swap(hotplug_events);
+        lock.unlock();
+
+        bool changed = false;
+        for ( auto& event : events ) {
+            if ( event.arrived ) changed |= deviceArrived(event.device);
+            else changed |= deviceLeft(event.device);
+            libusb_unref_device(event.device);
+        }
+
+        if ( changed && device_list_changed ) device_list_changed();
+
+        lock.lock();
+    }
+}
+
+bool ZZenoCANDriver::deviceArrived(libusb_device* device)
+{
+    libusb_device_descriptor descriptor;
+    if ( libusb_get_device_descriptor(device, &descriptor) != LIBUSB_SUCCESS ) return false;
+
+    auto k = product_id_table.find(descriptor.idProduct);
+    if ( k == product_id_table.end() ) return false;
+
+    {
+        std::lock_guard<std::mutex> lock(driver_mutex);
+        for ( auto zeno_usb_device : device_list ) {
+            if ( zeno_usb_device->getUSBDevice() == device &&
+                 !zeno_usb_device->isDeviceInfoStale() ) return false;
+        }
+    }
+
+    /* Opens the device to read its info, done without the driver lock */
+    ZRef<ZZenoUSBDevice> zeno_usb_device = new ZZenoUSBDevice(this, libusb_get_device_address(device),
+                                                              device, k->second);
+    zInfo("USB device arrived: %s serial %u", k->second.c_str(), zeno_usb_device->getSerialNumber());
+
+    ZRef<ZZenoUSBDevice> lost_device;
+    {
+        std::lock_guard<std::mutex> lock(driver_mutex);
+        for ( size_t index = 0; index < device_list.size(); ++index ) {
+            ZRef<ZZenoUSBDevice> __zeno_usb_device = device_list[index];
+            if ( __zeno_usb_device->isDeviceInfoStale() && __zeno_usb_device->getUSBDevice() == device ) {
+                /* Enumerated with stale cached info, takes the old place */
+                removed_device_list.push_back(__zeno_usb_device);
+                zeno_usb_device->setDeviceIndex(int(index));
+                device_list[index] = zeno_usb_device;
+                updateLINDriverUnlocked();
+                return true;
+            }
+
+            if ( !__zeno_usb_device->isDeviceGoneOrDisconnected() ||
+                 __zeno_usb_device->getSerialNumber() != zeno_usb_device->getSerialNumber() ) continue;
+
+            if ( __zeno_usb_device->isLost() ) {
+                lost_device = __zeno_usb_device;
+                break;
+            }
+
+            /* Lost and closed before it came back, takes the old place */
+            removed_device_list.push_back(__zeno_usb_device);
+            zeno_usb_device->setDeviceIndex(int(index));
+            device_list[index] = zeno_usb_device;
+            updateLINDriverUnlocked();
+            return true;
+        }
+    }
+
+    if ( lost_device != nullptr ) {
+        /* Same device back, the lost one keeps its channels and numbering */
+        zeno_usb_device = nullptr;
+        lost_device->recover(device);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(driver_mutex);
+    zeno_usb_device->setDeviceIndex(int(device_list.size()));
+    device_list.push_back(zeno_usb_device);
+    updateLINDriverUnlocked();
+
+    return true;
+}
+
+bool ZZenoCANDriver::deviceLeft(libusb_device* device)
+{
+    std::lock_guard<std::mutex> lock(driver_mutex);
+    auto i = std::find_if(device_list.begin(), device_list.end(),
+                          [device](const ZRef<ZZenoUSBDevice>& zeno_usb_device) {
+                              return zeno_usb_device->getUSBDevice() == device;
+                          });
+    if ( i == device_list.end() ) return false;
+
+    ZRef<ZZenoUSBDevice> zeno_usb_device = *i;
+    zInfo("USB device left: serial %u", zeno_usb_device->getSerialNumber());
+
+    if ( default_auto_recovery && zeno_usb_device->isOpen() ) {
+        /* Kept in place until the same serial number arrives */
+        zeno_usb_device->deviceLost();
+        return false;
+    }
+
+    zeno_usb_device->setDeviceGone();
+    removed_device_list.push_back(zeno_usb_device);
+    device_list.erase(i);
+
+    for ( size_t index = 0; index < device_list.size(); ++index ) {
+        device_list[index]->setDeviceIndex(int(index));
+    }
+    updateLINDriverUnlocked();
+
+    return true;
+}
+
 void ZZenoCANDriver::driverRef()
 {
     std::lock_guard<std::mutex> lock(driver_mutex);
@@ -211,9 +526,93 @@ void ZZenoCANDriver::driverUnref()
 
 std::vector<ZRef<ZZenoUSBDevice> > ZZenoCANDriver::getZenoDeviceList() const
 {
+    std::lock_guard<std::mutex> lock(driver_mutex);
     return device_list;
 }
 
+bool ZZenoCANDriver::handleEvents(int timeout_in_ms)
+{
+    std::vector<ZRef<ZZenoUSBDevice> > devices;
+    {
+        std::lock_guard<std::mutex> lock(driver_mutex);
+        devices = device_list;
+    }
+
+    /* Frames received while a library call waited with channel locks held */
+    for ( auto device : devices ) {
+        device->handleDeferredData();
+    }
+
+    timeval time_val;
+    time_val.tv_sec = timeout_in_ms / 1000;
+    time_val.tv_usec = (timeout_in_ms % 1000) * 1000;
+
+    int completed = 0;
+    return usb_context->handleEvents(time_val, completed);
+}
+
+int ZZenoCANDriver::getPollFds(int* fds, short* events, int max_count)
+{
+    const libusb_pollfd** poll_fds = libusb_get_pollfds(usb_context->getUSBContext());
+    if ( poll_fds == nullptr ) return -1;
+
+    int count = 0;
+    for ( int i = 0; poll_fds[i] != nullptr && count < max_count; ++i ) {
+        fds[count] = poll_fds[i]->fd;
+        events[count] = poll_fds[i]->events;
+        count ++;
+    }
+    libusb_free_pollfds(poll_fds);
+
+    return count;
+}
+
+bool ZZenoCANDriver::setDefaultEventGroups(int group_count, const std::vector<int>& cpus)
+{
+    if ( group_count < 0 || group_count > ZENO_USB_MAX_EVENT_GROUPS ) return false;
+
+    std::lock_guard<std::mutex> lock(event_group_config_mutex);
+    event_group_count = group_count;
+    event_group_cpus = cpus;
+
+    return true;
+}
+
+ZUSBContext* ZZenoCANDriver::getEventGroupContext(int device_index)
+{
+    int group;
+    int cpu = -1;
+    {
+        std::lock_guard<std::mutex> lock(event_group_config_mutex);
+        if ( event_group_count == 0 || device_index < 0 ) return nullptr;
+
+        group = device_index % event_group_count;
+        if ( size_t(group) < event_group_cpus.size() ) cpu = event_group_cpus[size_t(group)];
+    }
+
+    /* zcqHandleEvents() only handles the driver context */
+    if ( ZUSBContext::getDefaultEventMode() == ZUSBContext::EventApplication ) return nullptr;
+
+    std::lock_guard<std::mutex> lock(event_group_mutex);
+    if ( event_group_contexts.size() <= size_t(group) ) {
+        event_group_contexts.resize(size_t(group) + 1);
+    }
+
+    std::unique_ptr<ZUSBContext>& group_context = event_group_contexts[size_t(group)];
+    if ( group_context == nullptr ) {
+        group_context.reset(new ZUSBContext());
+        if ( group_context->getUSBContext() == nullptr ) {
+            group_context.reset();
+            return nullptr;
+        }
+    }
+
+    /* Used the next time the group event thread starts */
+    group_context->setEventThreadCPU(cpu);
+
+    return group_context.get();
+}
+
 void ZZenoCANDriver::init()
 {
     product_id_table[ZENO_CANUNO_PRODUCT_ID]          = "Zeno CANuno";
@@ -40,6 +40,10 @@
 #include <map>
 #include <vector>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 
 #define ZURAGON_VENDOR_ID               0x84d8
 #define ZENO_CANUNO_PRODUCT_ID          0x14
@@ -72,9 +76,49 @@ public:
 
     std::vector<ZRef<ZZenoUSBDevice> > getZenoDeviceList() const;
 
+    /* Handle USB events on the calling thread, used when the application
+     * drives USB event handling */
+    bool handleEvents(int timeout_in_ms);
+
+    /* USB poll fds, returns the fd count or -1 if not supported */
+    int getPollFds(int* fds, short* events, int max_count);
+
+    /* Devices are spread round robin over group_count USB event groups,
+     * each with its own libusb context and event thread pinned to the
+     * matching entry in cpus. 0 handles all devices in the driver context */
+    static bool setDefaultEventGroups(int group_count, const std::vector<int>& cpus);
+
+    /* Event group context for a device, nullptr for the driver context */
+    ZUSBContext* getEventGroupContext(int device_index);
+
+    /* USB hotplug, devices are added and removed one by one without
+     * touching the others. device_list_changed is called from the hotplug
+     * thread after each change */
+    bool startHotplug(std::function<void()> _device_list_changed);
+    void stopHotplug();
+
+    /* Replaces a device whose info is stale from the hotplug thread, as if
+     * it arrived again. Without hotplug it is replaced on the next
+     * enumeration */
+    void refreshDevice(libusb_device* device);
+
+    /* Automatic recovery, an open device that leaves the bus keeps its
+     * place in the device list. When a device with the same serial number
+     * arrives it is reopened and the open CAN channels are restored.
+     * Needs hotplug */
+    static void setDefaultAutoRecovery(bool enabled);
+    static bool isAutoRecoveryEnabled();
+
 private:
     void init();
     bool enumerateDevicesUnlocked();
+    void updateLINDriverUnlocked();
+
+    void hotplugRun();
+    bool deviceArrived(libusb_device* device);
+    bool deviceLeft(libusb_device* device);
+    static int __hotplugCallback(libusb_context* ctx, libusb_device* device,
+                                 libusb_hotplug_event event, void* user_data);
 
     ZUSBContext* usb_context;
     std::map<int,std::string> product_id_table;
@@ -84,6 +128,27 @@ private:
     int driver_ref_count;
     mutable std::mutex driver_mutex;
 
+    std::mutex event_group_mutex;
+    std::vector<std::unique_ptr<ZUSBContext>> event_group_contexts;
+
+    /* Hotplug */
+    struct HotplugEvent {
+        libusb_device* device;
+        bool arrived;
+    };
+
+    bool hotplug_registered;
+    libusb_hotplug_callback_handle hotplug_handle;
+    bool hotplug_running;
+    std::unique_ptr<std::thread> hotplug_thread;
+    std::mutex hotplug_mutex;
+    std::condition_variable hotplug_cond;
+    std::vector<HotplugEvent> hotplug_events;
+    std::function<void()> device_list_changed;
+
+    /* Removed devices are kept, open channels still refer to them */
+    std::vector<ZRef<ZZenoUSBDevice> > removed_device_list;
+
     /* Zeno LIN */
     ZRef<ZZenoLINDriver> lin_driver;
 };
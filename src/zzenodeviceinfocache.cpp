@@ -0,0 +1,223 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "zzenodeviceinfocache.h"
+#include "zdebug.h"
+
+#include <mutex>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+
+static std::mutex cache_mutex;
+static std::once_flag environment_once;
+static std::string cache_path;
+static bool cache_loaded = false;
+static std::map<std::string, ZZenoDeviceInfoCache::DeviceInfo> cache_entries;
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+void ZZenoDeviceInfoCache::setPath(const std::string& path)
+{
+    /* Settings from the API replace the environment */
+    std::call_once(environment_once, loadEnvironment);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache_path = path;
+    cache_loaded = false;
+    cache_entries.clear();
+}
+
+bool ZZenoDeviceInfoCache::isEnabled()
+{
+    std::call_once(environment_once, loadEnvironment);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return !cache_path.empty();
+}
+
+std::string ZZenoDeviceInfoCache::deviceKey(libusb_device* device)
+{
+    if ( !isEnabled() ) return std::string();
+
+    libusb_device_descriptor descriptor;
+    if ( libusb_get_device_descriptor(device, &descriptor) != 0 ) return std::string();
+
+    /* Bus path, "<bus>-<port>.<port>..." */
+    uint8_t ports[8];
+    int port_count = libusb_get_port_numbers(device, ports, int(sizeof(ports)));
+    std::string path = std::to_string(libusb_get_bus_number(device));
+    for ( int i = 0; i < port_count; ++i ) {
+        path += (i == 0 ? "-" : ".") + std::to_string(ports[i]);
+    }
+
+    /* The USB serial string tells units plugged into the same port apart */
+    std::string usb_serial;
+    if ( descriptor.iSerialNumber != 0 && !readUSBSerial(device, path, descriptor.iSerialNumber, usb_serial) ) {
+        return std::string();
+    }
+    for ( char& c : usb_serial ) {
+        if ( c <= ' ' ) c = '_';
+    }
+
+    char ids[16];
+    snprintf(ids, sizeof(ids), ":%04x:%04x:", descriptor.idVendor, descriptor.idProduct);
+    return path + ids + (usb_serial.empty() ? "-" : usb_serial);
+}
+
+bool ZZenoDeviceInfoCache::readUSBSerial(libusb_device* device, const std::string& path,
+                                         uint8_t string_index, std::string& usb_serial)
+{
+#ifdef Z_OS_LINUX
+    /* The kernel keeps the serial string of every device, reading it needs
+     * no device access */
+    FILE* file = fopen(("/sys/bus/usb/devices/" + path + "/serial").c_str(), "r");
+    if ( file != nullptr ) {
+        char text[128];
+        bool found = (fgets(text, sizeof(text), file) != nullptr);
+        fclose(file);
+        if ( found ) {
+            usb_serial = text;
+            while ( !usb_serial.empty() && (usb_serial.back() == '\n' || usb_serial.back() == '\r') ) {
+                usb_serial.pop_back();
+            }
+            return true;
+        }
+    }
+#else
+    ZUNUSED(path)
+#endif
+
+    /* Elsewhere it is a control transfer, still no Zeno command round trip */
+    libusb_device_handle* handle = nullptr;
+    if ( libusb_open(device, &handle) != 0 ) return false;
+
+    unsigned char text[128];
+    int len = libusb_get_string_descriptor_ascii(handle, string_index, text, int(sizeof(text)));
+    libusb_close(handle);
+    if ( len < 0 ) return false;
+
+    usb_serial.assign(reinterpret_cast<const char*>(text), size_t(len));
+    return true;
+}
+
+bool ZZenoDeviceInfoCache::lookup(const std::string& key, DeviceInfo& info)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if ( cache_path.empty() ) return false;
+    if ( !cache_loaded ) loadUnlocked();
+
+    auto it = cache_entries.find(key);
+    if ( it == cache_entries.end() ) return false;
+
+    info = it->second;
+    return true;
+}
+
+void ZZenoDeviceInfoCache::store(const std::string& key, const DeviceInfo& info)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if ( cache_path.empty() ) return;
+    if ( !cache_loaded ) loadUnlocked();
+
+    cache_entries[key] = info;
+    saveUnlocked();
+}
+
+void ZZenoDeviceInfoCache::erase(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if ( cache_path.empty() ) return;
+    if ( !cache_loaded ) loadUnlocked();
+
+    if ( cache_entries.erase(key) != 0 ) saveUnlocked();
+}
+
+void ZZenoDeviceInfoCache::loadEnvironment()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    const char* path = getenv("ZCQ_DEVICE_CACHE");
+    if ( path != nullptr ) cache_path = path;
+}
+
+void ZZenoDeviceInfoCache::loadUnlocked()
+{
+    cache_loaded = true;
+    cache_entries.clear();
+
+    FILE* file = fopen(cache_path.c_str(), "r");
+    if ( file == nullptr ) return;
+
+    /* One device per line: key serial fw_version clock_resolution can_count
+     * lin_count capabilities. Capabilities are missing in older files, the
+     * entry is then corrected when the device is first opened */
+    char line[512];
+    char key[256];
+    DeviceInfo info;
+    while ( fgets(line, sizeof(line), file) != nullptr ) {
+        info.capabilities = 0;
+        if ( sscanf(line, "%255s %x %x %d %d %d %x", key, &info.serial_number, &info.fw_version,
+                    &info.clock_resolution, &info.can_channel_count, &info.lin_channel_count,
+                    &info.capabilities) >= 6 ) {
+            cache_entries[key] = info;
+        }
+    }
+
+    fclose(file);
+}
+
+void ZZenoDeviceInfoCache::saveUnlocked()
+{
+    /* Written to a temporary file and renamed, a reader never sees half a file */
+    std::string tmp_path = cache_path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "w");
+    if ( file == nullptr ) {
+        zError("(ZenoUSB) can't write device info cache %s", tmp_path.c_str());
+        return;
+    }
+
+    for ( const auto& entry : cache_entries ) {
+        const DeviceInfo& info = entry.second;
+        fprintf(file, "%s %x %x %d %d %d %x\n", entry.first.c_str(), info.serial_number, info.fw_version,
+                info.clock_resolution, info.can_channel_count, info.lin_channel_count, info.capabilities);
+    }
+
+    bool written = (fclose(file) == 0);
+#ifdef Z_OS_WINDOWS
+    /* rename() does not replace an existing file on Windows */
+    if ( written ) remove(cache_path.c_str());
+#endif
+    if ( !written || rename(tmp_path.c_str(), cache_path.c_str()) != 0 ) {
+        zError("(ZenoUSB) can't write device info cache %s", cache_path.c_str());
+        remove(tmp_path.c_str());
+    }
+}
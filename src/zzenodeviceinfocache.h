@@ -0,0 +1,79 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef ZZENODEVICEINFOCACHE_H
+#define ZZENODEVICEINFOCACHE_H
+
+#include "zglobal.h"
+#include <libusb.h>
+#include <stdint.h>
+#include <string>
+
+/**
+ * On-disk cache of Zeno device info, so a startup needs no info round trips
+ * for devices seen before. Entries are keyed by USB bus path, vendor and
+ * product ID and the USB serial string. On Linux the serial string is read
+ * from sysfs, elsewhere the device is opened for it. The cache is off
+ * unless a file is set with setPath() or the ZCQ_DEVICE_CACHE environment
+ * variable.
+ */
+class ZZenoDeviceInfoCache {
+public:
+    struct DeviceInfo {
+        uint32_t serial_number;
+        uint32_t fw_version;
+        int clock_resolution;
+        int can_channel_count;
+        int lin_channel_count;
+        uint32_t capabilities;
+    };
+
+    /* Empty path disables the cache, entries are reloaded from the new file */
+    static void setPath(const std::string& path);
+    static bool isEnabled();
+
+    /* Empty when the cache is disabled or the serial string can't be read */
+    static std::string deviceKey(libusb_device* device);
+
+    static bool lookup(const std::string& key, DeviceInfo& info);
+    static void store(const std::string& key, const DeviceInfo& info);
+    static void erase(const std::string& key);
+
+private:
+    static bool readUSBSerial(libusb_device* device, const std::string& path,
+                              uint8_t string_index, std::string& usb_serial);
+    static void loadEnvironment();
+    static void loadUnlocked();
+    static void saveUnlocked();
+};
+
+#endif /* ZZENODEVICEINFOCACHE_H */
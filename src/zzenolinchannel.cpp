@@ -361,7 +361,11 @@ bool ZZenoLINChannel::readFromRXFifo(ZenoLINMessage& rx, uint64_t timeout_in_ms)
         std::chrono::milliseconds timeout(timeout_in_ms);
 
         /* Wait for RX FIFO */
-        rx_message_fifo_cond.wait_for(lock,timeout);
+        if ( zeno_usb_device->isApplicationDrivenEvents() ) {
+            zeno_usb_device->waitForEvents(lock, int(timeout_in_ms), [this]() { return !rx_message_fifo.isEmpty(); });
+        } else {
+            rx_message_fifo_cond.wait_for(lock,timeout);
+        }
 
         /* If RX FIFO is still empty */
         if ( rx_message_fifo.isEmpty() ) {
@@ -384,6 +388,17 @@ ZLINChannel::ReadResult ZZenoLINChannel::readWait(uint8_t& pid, uint8_t *msg,
     ZenoLINMessage rx;
     if (!readFromRXFifo(rx, uint64_t(timeout_in_ms))) return ReadTimeout;
 
+    translateRxMessage(rx, pid, msg, data_length, flags, timestamp_in_us);
+
+    return ReadStatusOK;
+}
+
+void ZZenoLINChannel::translateRxMessage(const ZenoLINMessage& rx,
+                                         uint8_t& pid, uint8_t *msg,
+                                         uint8_t& data_length,
+                                         uint32_t& flags,
+                                         uint64_t& timestamp_in_us)
+{
     pid = rx.pid & 0x3f;
     flags = rx.flags;
 
@@ -401,10 +416,10 @@ ZLINChannel::ReadResult ZZenoLINChannel::readWait(uint8_t& pid, uint8_t *msg,
     /* Calcuate and check CRC */
     if ( !(rx.flags & ZenoLINNoData) ) {
         /* First check with LIN 2.x enhanced CRC */
-        uint8_t __crc = linCalculateEnhancedCRC(rx.pid, rx.data, data_length);
+        uint8_t __crc = linCalculateEnhancedCRC(rx.pid, msg, data_length);
         if ( __crc != rx.checksum ) {
             /* Fall over to LIN 1.x classic CRC */
-            __crc = linCalculateClassicCRC(rx.data, data_length);
+            __crc = linCalculateClassicCRC(msg, data_length);
             if ( __crc == rx.checksum ) {
                 flags |= ClassicChecksum;
             }
@@ -415,8 +430,6 @@ ZLINChannel::ReadResult ZZenoLINChannel::readWait(uint8_t& pid, uint8_t *msg,
             }
         }
     }
-
-    return ReadStatusOK;
 }
 
 ZLINChannel::SendResult ZZenoLINChannel::send(uint8_t id,
@@ -589,8 +602,12 @@ bool ZZenoLINChannel::checkOpen()
 bool ZZenoLINChannel::waitForTX(std::unique_lock<std::mutex>& lock, int timeout_in_ms)
 {
     if ( tx_pending ) {
-        std::chrono::milliseconds timeout(timeout_in_ms);
-        tx_message_cond.wait_for(lock, timeout);
+        if ( zeno_usb_device->isApplicationDrivenEvents() ) {
+            zeno_usb_device->waitForEvents(lock, timeout_in_ms, [this]() { return !tx_pending; });
+        } else {
+            std::chrono::milliseconds timeout(timeout_in_ms);
+            tx_message_cond.wait_for(lock, timeout);
+        }
     }
 
     return !tx_pending;
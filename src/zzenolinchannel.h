@@ -92,6 +92,11 @@ public:
     void queueMessage(ZenoLINMessage& message);
     void txAck(ZenoTxLINRequestAck& tx_ack);
 
+    void translateRxMessage(const ZenoLINMessage& rx,
+                            uint8_t& pid, uint8_t *msg,
+                            uint8_t& data_length, uint32_t& flags,
+                            uint64_t& timestamp_in_us);
+
 private:
     bool checkOpen();
     bool waitForTX(std::unique_lock<std::mutex>& lock, int timeout_in_ms);
@@ -0,0 +1,909 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "zzenosimdevice.h"
+#include "zusbcontext.h"
+#include "zthreadscheduling.h"
+#include "zdebug.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <algorithm>
+
+static std::mutex config_mutex;
+static std::once_flag environment_once;
+static ZZenoSimDevice::Config sim_config;
+
+/* Valid payload lengths, CAN 2.0 frames use the first 9 */
+static const uint8_t sim_dlc_list[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64 };
+
+static ZZenoSimDevice::Config defaultConfig()
+{
+    ZZenoSimDevice::Config config;
+    config.device_count = 1;
+    config.can_channel_count = 4;
+    config.lin_channel_count = 0;
+    config.loopback = true;
+    config.rx_rate = 0;
+    config.rx_burst = 1;
+    config.rx_dlc = 8;
+    config.rx_id = 0x123;
+    config.rx_ext = false;
+    config.max_pending_tx = 64;
+    config.buffer_size = 16384;
+    config.usb_frame_us = 125;
+    config.clock_int_ms = 100;
+
+    return config;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+bool ZZenoSimDevice::setConfig(const std::string& text)
+{
+    /* Settings from the API replace the environment */
+    std::call_once(environment_once, loadEnvironment);
+
+    Config config;
+    if (!parseConfig(text, config)) return false;
+
+    std::lock_guard<std::mutex> lock(config_mutex);
+    sim_config = config;
+    return true;
+}
+
+ZZenoSimDevice::Config ZZenoSimDevice::getConfig()
+{
+    std::call_once(environment_once, loadEnvironment);
+
+    std::lock_guard<std::mutex> lock(config_mutex);
+    return sim_config;
+}
+
+void ZZenoSimDevice::loadEnvironment()
+{
+    std::lock_guard<std::mutex> lock(config_mutex);
+    sim_config = defaultConfig();
+    sim_config.device_count = 0;
+
+    const char* text = getenv("ZCQ_SIMULATION");
+    if ( text == nullptr ) return;
+
+    Config config;
+    if ( parseConfig(text, config) ) sim_config = config;
+    else zError("(ZenoSim) invalid ZCQ_SIMULATION: %s", text);
+}
+
+bool ZZenoSimDevice::parseConfig(const std::string& text, Config& config)
+{
+    config = defaultConfig();
+    if ( text.empty() ) {
+        config.device_count = 0;
+        return true;
+    }
+
+    size_t pos = 0;
+    while ( pos < text.size() ) {
+        size_t end = text.find(',', pos);
+        if ( end == std::string::npos ) end = text.size();
+        std::string item = text.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t eq = item.find('=');
+        if ( eq == std::string::npos ) return false;
+
+        std::string key = item.substr(0, eq);
+        std::string value_text = item.substr(eq + 1);
+        char* value_end = nullptr;
+        long value = strtol(value_text.c_str(), &value_end, 0);
+        if ( value_text.empty() || *value_end != '\0' ) return false;
+
+        auto in_range = [value](long min, long max) { return value >= min && value <= max; };
+
+        if ( key == "devices" && in_range(0, 16) ) config.device_count = int(value);
+        else if ( key == "channels" && in_range(1, 8) ) config.can_channel_count = int(value);
+        else if ( key == "lin" && (value == 0 || value == 2) ) config.lin_channel_count = int(value);
+        else if ( key == "loopback" && in_range(0, 1) ) config.loopback = value != 0;
+        else if ( key == "rx_rate" && in_range(0, 1000000) ) config.rx_rate = int(value);
+        else if ( key == "rx_burst" && in_range(1, 10000) ) config.rx_burst = int(value);
+        else if ( key == "rx_dlc" && (value == -1 ||
+                   std::find(std::begin(sim_dlc_list), std::end(sim_dlc_list), value) != std::end(sim_dlc_list)) )
+            config.rx_dlc = int(value);
+        else if ( key == "rx_id" && in_range(0, 0x1fffffff) ) config.rx_id = uint32_t(value);
+        else if ( key == "rx_ext" && in_range(0, 1) ) config.rx_ext = value != 0;
+        else if ( key == "tx_pending" && in_range(1, 128) ) config.max_pending_tx = int(value);
+        else if ( key == "buffer" && in_range(256, 16 * 1024 * 1024) ) config.buffer_size = int(value);
+        else if ( key == "usb_us" && in_range(1, 1000000) ) config.usb_frame_us = int(value);
+        else if ( key == "clock_ms" && in_range(1, 10000) ) config.clock_int_ms = int(value);
+        else return false;
+    }
+
+    return true;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+ZZenoSimDevice::ZZenoSimDevice(ZZenoCANDriver* _driver, int _device_no, const Config& _config,
+                               std::shared_ptr<const ZZenoUSBCapture::Device> _replay,
+                               bool _replay_full_speed)
+: ZZenoUSBDevice(_driver, _device_no, _replay ? "Zeno (replay)" : "Zeno CANquatro (simulated)"),
+  config(replayConfig(_config, _replay.get())),
+  device_epoch(std::chrono::steady_clock::now()),
+  sim_running(true), sim_open(false), sim_delivering(false),
+  sim_channels(size_t(config.can_channel_count)),
+  bus_free(size_t(config.can_channel_count)),
+  clock_int_enabled(false),
+  usb_overflow_count(0),
+  replay(_replay), replay_full_speed(_replay_full_speed),
+  replay_started(false), replay_index(0)
+{
+    resetChannelsUnlocked();
+    sim_thread.reset(new std::thread(&ZZenoSimDevice::run, this));
+
+    retrieveDeviceInfo();
+}
+
+ZZenoSimDevice::~ZZenoSimDevice()
+{
+    {
+        std::lock_guard<std::mutex> lock(device_mutex);
+        if ( isTransportOpen() ) {
+            open_ref_count = 0;
+            closeHandleUnlocked(false);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sim_mutex);
+        sim_running = false;
+        sim_cond.notify_all();
+    }
+    sim_thread->join();
+}
+
+ZZenoSimDevice::Config ZZenoSimDevice::replayConfig(const Config& config, const ZZenoUSBCapture::Device* replay)
+{
+    if ( replay == nullptr ) return config;
+
+    Config replay_config = config;
+    replay_config.can_channel_count = replay->info.can_channel_count;
+    replay_config.lin_channel_count = replay->info.lin_channel_count;
+    replay_config.rx_rate = 0;
+
+    return replay_config;
+}
+
+bool ZZenoSimDevice::openHandleUnlocked()
+{
+    assert(!isTransportOpen());
+
+    loadTransferSettings();
+    out_transfer_count = getDefaultOutTransferCount();
+    out_max_delay = std::chrono::microseconds(getDefaultOutMaxDelay());
+    out_buffer_pool.resize(size_t(out_transfer_count) * size_t(out_transfer_size));
+    for ( int i = 0; i < out_transfer_count; ++i ) {
+        libusb_transfer* out_bulk_transfer = libusb_alloc_transfer(0);
+        if ( out_bulk_transfer == nullptr ) {
+            last_error_text = ZUSBContext::translateLibUSBErrorCode(LIBUSB_ERROR_NO_MEM);
+            freeTransfers();
+            return false;
+        }
+
+        libusb_fill_bulk_transfer(out_bulk_transfer, nullptr, 0,
+                                  &out_buffer_pool[size_t(i) * size_t(out_transfer_size)], 0,
+                                  nullptr, this, 0);
+        out_bulk_transfers.push_back(out_bulk_transfer);
+    }
+
+    out_head = 0;
+    out_in_flight = 0;
+    handle_closing = false;
+    sim_in_buffer.resize(size_t(in_transfer_size));
+
+    std::lock_guard<std::mutex> lock(sim_mutex);
+    sim_open = true;
+    sim_in_fifo.clear();
+    next_in_transfer = std::chrono::steady_clock::now();
+    sim_cond.notify_all();
+
+    return true;
+}
+
+void ZZenoSimDevice::closeHandleUnlocked(bool stop_clock)
+{
+    if ( stop_clock ) stopClockInt();
+
+    /* Transfers not yet taken by the device thread are cancelled, it is
+     * not calling into the host afterwards */
+    handle_closing = true;
+    stopOutFlushTimer();
+    std::deque<SimOutTransfer> cancelled;
+    {
+        std::unique_lock<std::mutex> lock(sim_mutex);
+        sim_open = false;
+        sim_cond.notify_all();
+        sim_cond.wait(lock, [this]() { return !sim_delivering; });
+
+        cancelled.swap(sim_out_queue);
+        sim_in_fifo.clear();
+        clock_int_enabled = false;
+        replay_started = false;
+        resetChannelsUnlocked();
+    }
+
+    for ( auto& out : cancelled ) {
+        out.transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        outTransferCompleted(out.transfer);
+    }
+
+    {
+        /* Senders check for transfers with out_transfer_mutex held */
+        std::lock_guard<std::mutex> out_lock(out_transfer_mutex);
+        freeTransfers();
+        out_transfer_cond.notify_all();
+    }
+    deferred_in_data.clear();
+    failPendingReplies();
+}
+
+bool ZZenoSimDevice::isTransportOpen() const
+{
+    std::lock_guard<std::mutex> lock(sim_mutex);
+    return sim_open;
+}
+
+std::string ZZenoSimDevice::deviceInfoCacheKey() const
+{
+    /* Replayed devices take their info from the capture */
+    if ( replay != nullptr || !ZZenoDeviceInfoCache::isEnabled() ) return std::string();
+    return "sim:" + std::to_string(device_no);
+}
+
+bool ZZenoSimDevice::submitOutFillTransfer()
+{
+    /* out_transfer_mutex must be held, the buffer belongs to the device
+     * until the transfer completes */
+    libusb_transfer* fill_transfer = getOutFillTransfer();
+    assert(out_in_flight < out_transfer_count);
+    assert(fill_transfer->length > 0);
+
+    std::lock_guard<std::mutex> lock(sim_mutex);
+    if ( !sim_open ) {
+        last_error_text = "Device not open";
+        return false;
+    }
+
+    SimOutTransfer out;
+    out.transfer = fill_transfer;
+    out.due = std::chrono::steady_clock::now() + std::chrono::microseconds(config.usb_frame_us);
+    sim_out_queue.push_back(out);
+    sim_cond.notify_all();
+
+    outTransferSubmittedUnlocked();
+    return true;
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+void ZZenoSimDevice::run()
+{
+    ZThreadScheduling::applyToCurrentThread("Zeno simulator");
+
+    std::unique_lock<std::mutex> lock(sim_mutex);
+    while ( sim_running ) {
+        if ( !sim_open ) {
+            sim_cond.wait(lock);
+            continue;
+        }
+
+        TimePoint now = std::chrono::steady_clock::now();
+
+        /* Host commands, transfers complete in submission order */
+        if ( !sim_out_queue.empty() && sim_out_queue.front().due <= now ) {
+            libusb_transfer* out_bulk_transfer = sim_out_queue.front().transfer;
+            sim_out_queue.pop_front();
+            handleOutTransferUnlocked(out_bulk_transfer->buffer, out_bulk_transfer->length, now);
+            out_bulk_transfer->status = LIBUSB_TRANSFER_COMPLETED;
+            out_bulk_transfer->actual_length = out_bulk_transfer->length;
+
+            sim_delivering = true;
+            lock.unlock();
+            outTransferCompleted(out_bulk_transfer);
+            lock.lock();
+            sim_delivering = false;
+            sim_cond.notify_all();
+            continue;
+        }
+
+        runChannelsUnlocked(now);
+
+        if ( clock_int_enabled && next_clock_int <= now ) {
+            next_clock_int = now + std::chrono::milliseconds(config.clock_int_ms);
+
+            memset(in_interrupt_buffer, 0, sizeof(in_interrupt_buffer));
+            ZenoIntClockInfoCmd* clock_info = reinterpret_cast<ZenoIntClockInfoCmd*>(in_interrupt_buffer);
+            uint64_t ref_ticks = uint64_t(deviceTimeInUs(now)) * ZENO_SIM_REF_CLOCK_MHZ;
+            clock_info->h.cmd_id = ZENO_CLOCK_INFO_INT;
+            clock_info->clock_value_t0 = uint32_t(ref_ticks);
+            clock_info->clock_value_t1 = ref_ticks;
+            clock_info->clock_divisor = ZENO_SIM_REF_CLOCK_MHZ;
+            clock_info->usb_overflow_count = usb_overflow_count;
+
+            sim_delivering = true;
+            lock.unlock();
+            handleInterruptData();
+            lock.lock();
+            sim_delivering = false;
+            sim_cond.notify_all();
+            continue;
+        }
+
+        /* One IN transfer per USB frame, as much as fits in it */
+        if ( !sim_in_fifo.empty() && next_in_transfer <= now ) {
+            next_in_transfer = now + std::chrono::microseconds(config.usb_frame_us);
+            deliverInDataUnlocked(lock, takeInTransferUnlocked());
+            continue;
+        }
+
+        /* Recorded IN transfers bypass the device buffer, replies to this run go first */
+        if ( replay_started && replay_index < replay->transfers.size() && replayDueUnlocked(now) <= now ) {
+            int length = takeReplayTransferUnlocked();
+            if ( length > 0 ) deliverInDataUnlocked(lock, length);
+            continue;
+        }
+
+        sim_cond.wait_until(lock, nextEventUnlocked(now));
+    }
+}
+
+ZZenoSimDevice::TimePoint ZZenoSimDevice::nextEventUnlocked(TimePoint now)
+{
+    TimePoint next = now + std::chrono::milliseconds(100);
+
+    if ( !sim_out_queue.empty() ) next = std::min(next, sim_out_queue.front().due);
+    if ( !sim_in_fifo.empty() ) next = std::min(next, next_in_transfer);
+    if ( clock_int_enabled ) next = std::min(next, next_clock_int);
+    if ( replay_started && replay_index < replay->transfers.size() ) next = std::min(next, replayDueUnlocked(now));
+
+    for ( const SimChannel& ch : sim_channels ) {
+        if ( !ch.tx_queue.empty() ) next = std::min(next, ch.tx_queue.front().done);
+        if ( ch.bus_on && config.rx_rate > 0 ) next = std::min(next, ch.next_rx);
+    }
+
+    return next;
+}
+
+void ZZenoSimDevice::resetChannelsUnlocked()
+{
+    for ( SimChannel& ch : sim_channels ) {
+        ch.open = false;
+        ch.canfd = false;
+        ch.bus_on = false;
+        ch.silent = false;
+        ch.base_clock_divisor = 1;
+        ch.bitrate = 0;
+        ch.data_bitrate = 0;
+        ch.tx_queue.clear();
+        ch.tx_partial.parts_missing = 0;
+        ch.rx_seq = 0;
+        ch.rx_dlc_index = 0;
+        ch.rx_overrun = false;
+    }
+
+    std::fill(bus_free.begin(), bus_free.end(), device_epoch);
+}
+
+int ZZenoSimDevice::takeInTransferUnlocked()
+{
+    /* Whole commands only, a transfer never splits one */
+    int length = std::min(int(sim_in_fifo.size()), in_transfer_size - in_transfer_size % ZENO_CMD_SIZE);
+
+    memcpy(sim_in_buffer.data(), sim_in_fifo.data(), size_t(length));
+    sim_in_fifo.erase(sim_in_fifo.begin(), sim_in_fifo.begin() + length);
+
+    return length;
+}
+
+int ZZenoSimDevice::takeReplayTransferUnlocked()
+{
+    /* Recorded replies are left out, they would complete requests of this run */
+    const std::vector<uint8_t>& data = replay->transfers[replay_index].data;
+    if ( sim_in_buffer.size() < data.size() ) sim_in_buffer.resize(data.size());
+
+    int length = 0;
+    for ( size_t offset = 0; offset < data.size(); ) {
+        size_t cmd_size = ZENO_CMD_SIZE;
+        if ( offset + cmd_size > data.size() ) break;
+
+        if ( data[offset] != ZENO_CMD_RESPONSE ) {
+            memcpy(&sim_in_buffer[size_t(length)], &data[offset], cmd_size);
+            length += int(cmd_size);
+        }
+        offset += cmd_size;
+    }
+
+    replay_index ++;
+    if ( replay_index == replay->transfers.size() ) {
+        zInfo("(ZenoSim) %x: replay of %u IN transfers done in %.1f ms", replay->info.serial_number,
+              unsigned(replay->transfers.size()),
+              std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - replay_start).count());
+    }
+
+    return length;
+}
+
+ZZenoSimDevice::TimePoint ZZenoSimDevice::replayDueUnlocked(TimePoint now) const
+{
+    if ( replay_full_speed ) return now;
+
+    uint64_t offset_in_ns = replay->transfers[replay_index].timestamp_in_ns - replay->transfers[0].timestamp_in_ns;
+    return replay_start + std::chrono::nanoseconds(offset_in_ns);
+}
+
+void ZZenoSimDevice::deliverInDataUnlocked(std::unique_lock<std::mutex>& lock, int length)
+{
+    /* The host side may call back into the device, e.g. to send commands */
+    sim_delivering = true;
+    lock.unlock();
+    inTransferCompleted(sim_in_buffer.data(), length);
+    lock.lock();
+    sim_delivering = false;
+    sim_cond.notify_all();
+}
+
+int64_t ZZenoSimDevice::deviceTimeInUs(TimePoint t) const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(t - device_epoch).count();
+}
+
+uint64_t ZZenoSimDevice::deviceTicks(const SimChannel& ch, TimePoint t) const
+{
+    return uint64_t(deviceTimeInUs(t)) * uint64_t(ch.base_clock_divisor);
+}
+
+std::chrono::nanoseconds ZZenoSimDevice::frameTime(const SimChannel& ch, uint32_t flags, uint8_t dlc) const
+{
+    int bitrate = ch.bitrate > 0 ? ch.bitrate : 500000;
+    bool extended = (flags & ZenoCANFlagExtended) != 0;
+
+    /* Without stuff bits */
+    if ( !(flags & ZenoCANFlagFD) ) {
+        int bits = (extended ? 67 : 47) + 8 * dlc;
+        return std::chrono::nanoseconds(int64_t(bits) * 1000000000 / bitrate);
+    }
+
+    /* Arbitration and end of frame at the nominal bitrate, data and CRC at
+     * the data bitrate when the bitrate is switched */
+    int data_bitrate = ((flags & ZenoCANFlagFDBRS) && ch.data_bitrate > 0) ? ch.data_bitrate : bitrate;
+    int nominal_bits = (extended ? 41 : 22) + 12;
+    int data_bits = 8 * dlc + (dlc > 16 ? 30 : 26);
+
+    return std::chrono::nanoseconds(int64_t(nominal_bits) * 1000000000 / bitrate +
+                                    int64_t(data_bits) * 1000000000 / data_bitrate);
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+void ZZenoSimDevice::handleOutTransferUnlocked(const uint8_t* buffer, int length, TimePoint now)
+{
+    int offset = 0;
+    while ( offset < length ) {
+        int cmd_size = handleSimCommand(buffer + offset, length - offset, now);
+        if ( cmd_size == 0 ) break;
+        offset += cmd_size;
+    }
+}
+
+static int bitTimingBitrate(const ZenoBitTiming* timing)
+{
+    return ZENO_SIM_CAN_CLOCK_KHZ * 1000 / ((timing->brp + 1) * (timing->tseg1 + timing->tseg2 + 3));
+}
+
+int ZZenoSimDevice::handleSimCommand(const uint8_t* buffer, int length, TimePoint now)
+{
+    const ZenoCmd* cmd = reinterpret_cast<const ZenoCmd*>(buffer);
+    int cmd_size = ZENO_CMD_SIZE;
+    if ( cmd_size > length ) {
+        zError("(ZenoSim) truncated command %d in OUT transfer", cmd->h.cmd_id);
+        return 0;
+    }
+
+    /* Channel commands have the channel right after the header */
+    size_t channel = cmd->cmd_payload[0];
+    SimChannel* ch = channel < sim_channels.size() ? &sim_channels[channel] : nullptr;
+
+    switch(cmd->h.cmd_id) {
+    case ZENO_CMD_RESET:
+        sim_in_fifo.clear();
+        clock_int_enabled = false;
+        resetChannelsUnlocked();
+        queueResponse(cmd);
+        break;
+
+    case ZENO_CMD_INFO: {
+        ZenoInfoResponse info;
+        memset(&info, 0, sizeof(info));
+        if ( replay ) {
+            info.capabilities = replay->info.capabilities;
+            info.fw_version = replay->info.fw_version;
+            info.serial_number = replay->info.serial_number;
+        } else {
+            info.capabilities = ZenoCAPExtendedCAN | ZenoCAPTxRequest | ZenoCAPTxAcknowledge | ZenoCAPCanFD;
+            info.fw_version = 0x00010000;
+            info.serial_number = uint32_t(ZENO_SIM_SERIAL_BASE + device_no);
+        }
+        info.can_channel_count = uint8_t(config.can_channel_count);
+        info.lin_channel_count = uint8_t(config.lin_channel_count);
+        info.hw_revision = 1;
+        info.clock_resolution = ZENO_SIM_CAN_CLOCK_KHZ;
+        queueResponse(cmd, &info);
+        break;
+    }
+
+    case ZENO_CMD_OPEN: {
+        const ZenoOpen* open_cmd = reinterpret_cast<const ZenoOpen*>(cmd);
+        ZenoOpenResponse reply;
+        memset(&reply, 0, sizeof(reply));
+
+        if ( ch != nullptr ) {
+            ch->open = true;
+            ch->canfd = open_cmd->can_fd_mode != 0;
+            ch->bus_on = false;
+            ch->silent = false;
+            ch->tx_queue.clear();
+            ch->tx_partial.parts_missing = 0;
+            ch->rx_overrun = false;
+
+            /* Channels 4 and up run off the reference clock, as on the CANquatro */
+            ch->base_clock_divisor = channel >= 4 ? ZENO_SIM_REF_CLOCK_MHZ :
+                                                    std::max(int(open_cmd->base_clock_divisor), 1);
+            reply.base_clock_divisor = uint8_t(ch->base_clock_divisor);
+        }
+
+        reply.clock_start_ref = uint64_t(deviceTimeInUs(now)) * ZENO_SIM_REF_CLOCK_MHZ;
+        reply.max_pending_tx_msgs = uint16_t(config.max_pending_tx);
+        queueResponse(cmd, &reply);
+        break;
+    }
+
+    case ZENO_CMD_CLOSE:
+        if ( ch != nullptr ) {
+            ch->open = false;
+            ch->bus_on = false;
+            ch->tx_queue.clear();
+        }
+        queueResponse(cmd);
+        break;
+
+    case ZENO_CMD_BUS_ON:
+        if ( ch != nullptr ) {
+            ch->bus_on = true;
+            ch->next_rx = now;
+        }
+        if ( replay && !replay_started && !replay->transfers.empty() ) {
+            replay_started = true;
+            replay_index = 0;
+            replay_start = now;
+        }
+        queueResponse(cmd);
+        break;
+
+    case ZENO_CMD_BUS_OFF:
+        /* Frames not sent yet fail. Their acks follow the reply, the host
+         * waits for it with the channel TX lock held */
+        queueResponse(cmd);
+        if ( ch != nullptr ) {
+            ch->bus_on = false;
+            for ( const SimTxFrame& frame : ch->tx_queue ) {
+                ackTxFrame(int(channel), frame, ZenoCANErrorFrame);
+            }
+            ch->tx_queue.clear();
+        }
+        break;
+
+    case ZENO_CMD_SET_BIT_TIMING:
+        if ( ch != nullptr ) ch->bitrate = bitTimingBitrate(reinterpret_cast<const ZenoBitTiming*>(cmd));
+        queueResponse(cmd);
+        break;
+
+    case ZENO_CMD_SET_DATA_BIT_TIMING:
+        if ( ch != nullptr ) ch->data_bitrate = bitTimingBitrate(reinterpret_cast<const ZenoBitTiming*>(cmd));
+        queueResponse(cmd);
+        break;
+
+    case ZENO_CMD_SET_OP_MODE:
+        if ( ch != nullptr ) ch->silent = reinterpret_cast<const ZenoOpMode*>(cmd)->op_mode == ZENO_SILENT_MODE;
+        queueResponse(cmd);
+        break;
+
+    case ZENO_CMD_READ_CLOCK: {
+        ZenoReadClockResponse reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.clock_value = uint64_t(deviceTimeInUs(now)) * ZENO_SIM_REF_CLOCK_MHZ;
+        reply.read_count = 1;
+        reply.divisor = ZENO_SIM_REF_CLOCK_MHZ;
+        queueResponse(cmd, &reply);
+        break;
+    }
+
+    case ZEMO_CMD_START_CLOCK_INT:
+        clock_int_enabled = true;
+        next_clock_int = now + std::chrono::milliseconds(config.clock_int_ms);
+        queueResponse(cmd);
+        break;
+
+    case ZEMO_CMD_STOP_CLOCK_INT:
+        clock_int_enabled = false;
+        queueResponse(cmd);
+        break;
+
+    case ZENO_CMD_CAN20_TX_REQUEST: {
+        const ZenoTxCAN20Request* request = reinterpret_cast<const ZenoTxCAN20Request*>(cmd);
+        if ( request->channel >= sim_channels.size() ) break;
+
+        SimTxFrame frame;
+        frame.trans_id = request->h.transaction_id;
+        frame.id = request->id;
+        frame.flags = request->flags;
+        frame.dlc = std::min(uint8_t(request->dlc & 0x0f), uint8_t(8));
+        memcpy(frame.data, request->data, 8);
+        frame.parts_missing = 0;
+        queueTxFrame(request->channel, frame, now);
+        break;
+    }
+
+    case ZENO_CMD_CANFD_P1_TX_REQUEST: {
+        const ZenoTxCANFDRequestP1* request = reinterpret_cast<const ZenoTxCANFDRequestP1*>(cmd);
+        if ( request->channel >= sim_channels.size() ) break;
+
+        SimTxFrame& frame = sim_channels[request->channel].tx_partial;
+        frame.trans_id = request->h.transaction_id;
+        frame.id = request->id;
+        frame.flags = request->flags | ZenoCANFlagFD;
+        frame.dlc = std::min(request->dlc, uint8_t(64));
+        memcpy(frame.data, request->data, 20);
+        frame.parts_missing = (frame.dlc > 20 ? 1 : 0) + (frame.dlc > 48 ? 1 : 0);
+        if ( frame.parts_missing == 0 ) queueTxFrame(request->channel, frame, now);
+        break;
+    }
+
+    case ZENO_CMD_CANFD_P2_TX_REQUEST: {
+        const ZenoTxCANFDRequestP2* request = reinterpret_cast<const ZenoTxCANFDRequestP2*>(cmd);
+        if ( request->channel >= sim_channels.size() ) break;
+
+        SimTxFrame& frame = sim_channels[request->channel].tx_partial;
+        if ( frame.parts_missing == 0 || frame.trans_id != request->h.transaction_id ) break;
+
+        memcpy(frame.data + 20, request->data, 28);
+        if ( --frame.parts_missing == 0 ) queueTxFrame(request->channel, frame, now);
+        break;
+    }
+
+    case ZENO_CMD_CANFD_P3_TX_REQUEST: {
+        const ZenoTxCANFDRequestP3* request = reinterpret_cast<const ZenoTxCANFDRequestP3*>(cmd);
+        if ( request->channel >= sim_channels.size() ) break;
+
+        SimTxFrame& frame = sim_channels[request->channel].tx_partial;
+        if ( frame.parts_missing == 0 || frame.trans_id != request->h.transaction_id ) break;
+
+        memcpy(frame.data + 48, request->data, 16);
+        if ( --frame.parts_missing == 0 ) queueTxFrame(request->channel, frame, now);
+        break;
+    }
+
+    default:
+        /* LIN and other commands are accepted and answered */
+        queueResponse(cmd);
+        break;
+    }
+
+    return cmd_size;
+}
+
+void ZZenoSimDevice::queueResponse(const ZenoCmd* request, const void* response)
+{
+    ZenoResponse reply;
+    if ( response != nullptr ) memcpy(&reply, response, sizeof(reply));
+    else memset(&reply, 0, sizeof(reply));
+
+    reply.h.cmd_id = ZENO_CMD_RESPONSE;
+    reply.h.transaction_id = request->h.transaction_id;
+    reply.response_cmd_id = request->h.cmd_id;
+    reply.cmd_result_code = 0;
+
+    /* Replies are never dropped */
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(&reply);
+    sim_in_fifo.insert(sim_in_fifo.end(), data, data + ZENO_CMD_SIZE);
+}
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+void ZZenoSimDevice::queueTxFrame(int channel, const SimTxFrame& frame, TimePoint now)
+{
+    SimChannel& ch = sim_channels[size_t(channel)];
+    SimTxFrame tx = frame;
+    tx.parts_missing = 0;
+    tx.done = now;
+
+    if ( !ch.open || !ch.bus_on || ch.silent || int(ch.tx_queue.size()) >= config.max_pending_tx ) {
+        ackTxFrame(channel, tx, ZenoCANErrorFrame);
+        return;
+    }
+
+    /* Frames go out one after another on the bus */
+    TimePoint& free = bus_free[config.loopback ? 0 : size_t(channel)];
+    tx.done = std::max(now, free) + frameTime(ch, tx.flags, tx.dlc);
+    free = tx.done;
+    ch.tx_queue.push_back(tx);
+}
+
+void ZZenoSimDevice::ackTxFrame(int channel, const SimTxFrame& frame, uint8_t flags)
+{
+    const SimChannel& ch = sim_channels[size_t(channel)];
+    uint64_t ticks = deviceTicks(ch, frame.done);
+
+    ZenoTxCANRequestAck ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.h.cmd_id = ZENO_CMD_CAN_TX_ACK;
+    ack.trans_id = frame.trans_id;
+    ack.flags = uint8_t(ZenoCANFlagTxAck | flags);
+    ack.id = frame.id;
+    ack.timestamp = uint32_t(ticks);
+    ack.timestamp_msb = uint32_t(ticks >> 32);
+    ack.dlc = frame.dlc;
+    ack.channel = uint8_t(channel);
+
+    /* Acks release host TX credits, they are never dropped */
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(&ack);
+    sim_in_fifo.insert(sim_in_fifo.end(), data, data + ZENO_CMD_SIZE);
+}
+
+void ZZenoSimDevice::runChannelsUnlocked(TimePoint now)
+{
+    for ( size_t i = 0; i < sim_channels.size(); ++i ) {
+        SimChannel& ch = sim_channels[i];
+
+        /* Sent frames, received by the other channels on the bus */
+        while ( !ch.tx_queue.empty() && ch.tx_queue.front().done <= now ) {
+            SimTxFrame frame = ch.tx_queue.front();
+            ch.tx_queue.pop_front();
+            ackTxFrame(int(i), frame, 0);
+
+            if ( !config.loopback ) continue;
+            for ( size_t j = 0; j < sim_channels.size(); ++j ) {
+                const SimChannel& rx_ch = sim_channels[j];
+                if ( j == i || !rx_ch.bus_on ) continue;
+                if ( (frame.flags & ZenoCANFlagFD) && !rx_ch.canfd ) continue;
+
+                queueRxFrame(int(j), frame.id,
+                             frame.flags & (ZenoCANFlagRTR | ZenoCANFlagStandard | ZenoCANFlagExtended |
+                                            ZenoCANFlagFD | ZenoCANFlagFDBRS),
+                             frame.dlc, frame.data, frame.done);
+            }
+        }
+
+        /* Generated traffic */
+        if ( !ch.bus_on || config.rx_rate <= 0 ) continue;
+
+        if ( now - ch.next_rx > std::chrono::microseconds(ZENO_SIM_MAX_CATCH_UP_US) ) ch.next_rx = now;
+        auto burst_interval = std::chrono::nanoseconds(int64_t(config.rx_burst) * 1000000000 / config.rx_rate);
+        size_t dlc_count = ch.canfd ? sizeof(sim_dlc_list) : 9;
+
+        while ( ch.next_rx <= now ) {
+            for ( int b = 0; b < config.rx_burst; ++b ) {
+                uint8_t dlc;
+                if ( config.rx_dlc < 0 ) {
+                    dlc = sim_dlc_list[size_t(ch.rx_dlc_index) % dlc_count];
+                    ch.rx_dlc_index ++;
+                } else {
+                    dlc = uint8_t(ch.canfd ? config.rx_dlc : std::min(config.rx_dlc, 8));
+                }
+
+                uint32_t flags = config.rx_ext ? ZenoCANFlagExtended : ZenoCANFlagStandard;
+                if ( dlc > 8 ) flags |= ZenoCANFlagFD | ZenoCANFlagFDBRS;
+
+                /* Sequence number first, receivers can count lost frames */
+                uint8_t data[64];
+                memset(data, uint8_t(ch.rx_seq), sizeof(data));
+                memcpy(data, &ch.rx_seq, sizeof(ch.rx_seq));
+                ch.rx_seq ++;
+
+                queueRxFrame(int(i), config.rx_id, flags, dlc, data, ch.next_rx);
+            }
+            ch.next_rx += burst_interval;
+        }
+    }
+}
+
+bool ZZenoSimDevice::queueRxFrame(int channel, uint32_t id, uint32_t flags, uint8_t dlc,
+                                  const uint8_t* data, TimePoint t)
+{
+    SimChannel& ch = sim_channels[size_t(channel)];
+    bool fd = (flags & ZenoCANFlagFD) != 0;
+
+    int size;
+    if ( !fd ) size = ZENO_CMD_SIZE;
+    else size = ZENO_CMD_SIZE * (1 + (dlc > 18 ? 1 : 0) + (dlc > 46 ? 1 : 0));
+
+    /* Device buffer full, the frame is lost */
+    if ( sim_in_fifo.size() + size_t(size) > size_t(config.buffer_size) ) {
+        ch.rx_overrun = true;
+        usb_overflow_count ++;
+        return false;
+    }
+
+    if ( ch.rx_overrun ) {
+        flags |= ZenoCANErrorHWOverrun;
+        ch.rx_overrun = false;
+    }
+
+    uint64_t ticks = deviceTicks(ch, t);
+    size_t offset = sim_in_fifo.size();
+    sim_in_fifo.resize(offset + size_t(size), 0);
+    uint8_t* p = &sim_in_fifo[offset];
+
+    if ( !fd ) {
+        ZenoCAN20Message* message = reinterpret_cast<ZenoCAN20Message*>(p);
+        message->h.cmd_id = ZENO_CMD_CAN_RX;
+        message->flags = uint8_t(flags);
+        message->id = id;
+        message->timestamp = uint32_t(ticks);
+        message->timestamp_msb = uint32_t(ticks >> 32);
+        memcpy(message->data, data, 8);
+        message->dlc = dlc;
+        message->channel = uint8_t(channel);
+        return true;
+    }
+
+    ZenoCANFDMessageP1* message_p1 = reinterpret_cast<ZenoCANFDMessageP1*>(p);
+    message_p1->h.cmd_id = ZENO_CMD_CANFD_P1_RX;
+    message_p1->flags = uint8_t(flags);
+    message_p1->id = id;
+    message_p1->timestamp = uint32_t(ticks);
+    message_p1->dlc = dlc;
+    message_p1->channel = uint8_t(channel);
+    memcpy(message_p1->data, data, 18);
+    p += ZENO_CMD_SIZE;
+
+    if ( dlc > 18 ) {
+        ZenoCANFDMessageP2* message_p2 = reinterpret_cast<ZenoCANFDMessageP2*>(p);
+        message_p2->h.cmd_id = ZENO_CMD_CANFD_P2_RX;
+        message_p2->channel = uint8_t(channel);
+        memcpy(message_p2->data, data + 18, 28);
+        p += ZENO_CMD_SIZE;
+    }
+
+    if ( dlc > 46 ) {
+        ZenoCANFDMessageP3* message_p3 = reinterpret_cast<ZenoCANFDMessageP3*>(p);
+        message_p3->h.cmd_id = ZENO_CMD_CANFD_P3_RX;
+        message_p3->channel = uint8_t(channel);
+        memcpy(message_p3->data, data + 46, 18);
+    }
+
+    return true;
+}
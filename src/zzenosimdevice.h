@@ -0,0 +1,210 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef ZZENOSIMDEVICE_H_
+#define ZZENOSIMDEVICE_H_
+
+#include "zzenousbdevice.h"
+#include "zzenousbcapture.h"
+
+#include <deque>
+#include <thread>
+
+#define ZENO_SIM_REF_CLOCK_MHZ      70       /* Reference clock, ticks per us */
+#define ZENO_SIM_CAN_CLOCK_KHZ      40000    /* CAN core clock, bit timing base */
+#define ZENO_SIM_SERIAL_BASE        0x51000001
+#define ZENO_SIM_MAX_CATCH_UP_US    100000   /* RX generation lagging more is skipped */
+
+/**
+ * Simulated Zeno device. Speaks the zenocan.h command protocol in-process
+ * in place of the USB transport, so applications and benchmarks run
+ * without hardware. A device thread answers commands, transmits TX
+ * requests at the bus bitrate and acks them, generates RX frames and
+ * clock interrupts. Device to host data passes a device side buffer of
+ * limited size, RX frames that do not fit are dropped and the next frame
+ * delivered on the channel is flagged as HW overrun. Host data is handed
+ * over in IN transfers of the configured size, one per USB frame interval.
+ *
+ * Simulated devices are added after the USB devices when the driver
+ * enumerates. They are configured with setConfig() or the ZCQ_SIMULATION
+ * environment variable, a comma separated "key=value" list:
+ *
+ *   devices    Number of simulated devices, default 1
+ *   channels   CAN channels per device, default 4
+ *   lin        LIN channels per device, default 0
+ *   loopback   1 puts all channels of a device on one bus, frames sent on
+ *              a channel are received by the others. Default 1
+ *   rx_rate    Generated RX frames/s per bus on channel, default 0
+ *   rx_burst   Generated frames per burst, default 1
+ *   rx_dlc     Generated payload length, -1 cycles through all valid
+ *              lengths. Above 8 gives CAN FD frames on CAN FD channels.
+ *              Default 8
+ *   rx_id      Generated frame identifier, default 0x123
+ *   rx_ext     1 for 29 bit identifiers, default 0
+ *   tx_pending TX requests the device accepts per channel, default 64
+ *   buffer     Device side buffer for host data in bytes, default 16384
+ *   usb_us     USB frame interval in us, default 125
+ *   clock_ms   Clock interrupt interval in ms, default 100
+ *
+ * A device replaying a capture, see ZZenoUSBCapture, takes its info and
+ * channel counts from the capture and generates no RX traffic. It delivers
+ * the recorded IN transfers from the first bus on, at the recorded pace or
+ * back to back, with the recorded replies left out. Commands are answered
+ * as usual.
+ */
+class ZZenoSimDevice : public ZZenoUSBDevice {
+public:
+    struct Config {
+        int device_count;
+        int can_channel_count;
+        int lin_channel_count;
+        bool loopback;
+        int rx_rate;
+        int rx_burst;
+        int rx_dlc;
+        uint32_t rx_id;
+        bool rx_ext;
+        int max_pending_tx;
+        int buffer_size;
+        int usb_frame_us;
+        int clock_int_ms;
+    };
+
+    /* Empty text disables simulation. Replaces the environment setting and
+     * is used the next time devices are enumerated */
+    static bool setConfig(const std::string& text);
+    static Config getConfig();
+
+    ZZenoSimDevice(ZZenoCANDriver* _driver, int _device_no, const Config& _config,
+                   std::shared_ptr<const ZZenoUSBCapture::Device> _replay = nullptr,
+                   bool _replay_full_speed = false);
+    ~ZZenoSimDevice();
+
+    /* Data is always delivered by the device thread */
+    bool isApplicationDrivenEvents() const override {
+        return false;
+    }
+
+protected:
+    bool openHandleUnlocked() override;
+    void closeHandleUnlocked(bool stop_clock) override;
+    bool isTransportOpen() const override;
+    std::string deviceInfoCacheKey() const override;
+    bool submitOutFillTransfer() override;
+
+private:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    struct SimTxFrame {
+        uint8_t trans_id;
+        uint32_t id;
+        uint32_t flags;
+        uint8_t dlc;
+        uint8_t data[64];
+        int parts_missing;
+        TimePoint done;
+    };
+
+    struct SimChannel {
+        bool open;
+        bool canfd;
+        bool bus_on;
+        bool silent;
+        int base_clock_divisor;
+        int bitrate;
+        int data_bitrate;
+        std::deque<SimTxFrame> tx_queue;    /* On the bus, acked when done */
+        SimTxFrame tx_partial;              /* CAN FD frame waiting for parts */
+        TimePoint next_rx;
+        uint32_t rx_seq;
+        int rx_dlc_index;
+        bool rx_overrun;
+    };
+
+    struct SimOutTransfer {
+        libusb_transfer* transfer;
+        TimePoint due;
+    };
+
+    static bool parseConfig(const std::string& text, Config& config);
+    static void loadEnvironment();
+    static Config replayConfig(const Config& config, const ZZenoUSBCapture::Device* replay);
+
+    void run();
+    void resetChannelsUnlocked();
+    TimePoint nextEventUnlocked(TimePoint now);
+    void handleOutTransferUnlocked(const uint8_t* buffer, int length, TimePoint now);
+    int handleSimCommand(const uint8_t* buffer, int length, TimePoint now);
+    void queueResponse(const ZenoCmd* request, const void* response = nullptr);
+    void queueTxFrame(int channel, const SimTxFrame& frame, TimePoint now);
+    void ackTxFrame(int channel, const SimTxFrame& frame, uint8_t flags);
+    void runChannelsUnlocked(TimePoint now);
+    bool queueRxFrame(int channel, uint32_t id, uint32_t flags, uint8_t dlc,
+                      const uint8_t* data, TimePoint t);
+    int takeInTransferUnlocked();
+    int takeReplayTransferUnlocked();
+    TimePoint replayDueUnlocked(TimePoint now) const;
+    void deliverInDataUnlocked(std::unique_lock<std::mutex>& lock, int length);
+    std::chrono::nanoseconds frameTime(const SimChannel& ch, uint32_t flags, uint8_t dlc) const;
+    int64_t deviceTimeInUs(TimePoint t) const;
+    uint64_t deviceTicks(const SimChannel& ch, TimePoint t) const;
+
+    Config config;
+    TimePoint device_epoch;
+
+    mutable std::mutex sim_mutex;
+    std::condition_variable sim_cond;
+    std::unique_ptr<std::thread> sim_thread;
+    bool sim_running;
+    bool sim_open;
+    bool sim_delivering;        /* Device thread calls into the host, sim_mutex released */
+
+    std::vector<SimChannel> sim_channels;
+    std::vector<TimePoint> bus_free;
+    std::deque<SimOutTransfer> sim_out_queue;
+    std::vector<uint8_t> sim_in_fifo;   /* Device side buffer of host data */
+    std::vector<uint8_t> sim_in_buffer;
+    TimePoint next_in_transfer;
+
+    bool clock_int_enabled;
+    TimePoint next_clock_int;
+    uint8_t usb_overflow_count;
+
+    /* Capture replay, started by the first bus on */
+    std::shared_ptr<const ZZenoUSBCapture::Device> replay;
+    bool replay_full_speed;
+    bool replay_started;
+    size_t replay_index;
+    TimePoint replay_start;
+};
+
+#endif /* ZZENOSIMDEVICE_H_ */
@@ -0,0 +1,254 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "zzenousbcapture.h"
+#include "zdebug.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static std::mutex capture_mutex;
+static std::once_flag environment_once;
+static std::atomic<bool> capture_enabled(false);
+static FILE* capture_file = nullptr;
+static std::set<uint32_t> capture_devices;     /* Info written for these */
+static std::string replay_path;
+static bool replay_full_speed = false;
+
+/*** ---------------------------==*+*+*==---------------------------------- ***/
+bool ZZenoUSBCapture::setCapturePath(const std::string& path)
+{
+    /* Settings from the API replace the environment */
+    std::call_once(environment_once, loadEnvironment);
+
+    std::lock_guard<std::mutex> lock(capture_mutex);
+    closeCaptureUnlocked();
+    if ( path.empty() ) return true;
+
+    return openCaptureUnlocked(path);
+}
+
+bool ZZenoUSBCapture::isCapturing()
+{
+    std::call_once(environment_once, loadEnvironment);
+
+    return capture_enabled.load(std::memory_order_relaxed);
+}
+
+void ZZenoUSBCapture::captureInTransfer(const ZZenoDeviceInfoCache::DeviceInfo& info,
+                                        const uint8_t* data, int length)
+{
+    uint64_t timestamp_in_ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                        std::chrono::steady_clock::now().time_since_epoch()).count());
+
+    std::lock_guard<std::mutex> lock(capture_mutex);
+    if ( capture_file == nullptr ) return;
+
+    /* A replayed device is created from the info of the first record */
+    if ( capture_devices.insert(info.serial_number).second ) {
+        CaptureDeviceInfo device_info;
+        memset(&device_info, 0, sizeof(device_info));
+        device_info.fw_version = info.fw_version;
+        device_info.capabilities = info.capabilities;
+        device_info.clock_resolution = uint32_t(info.clock_resolution);
+        device_info.can_channel_count = uint8_t(info.can_channel_count);
+        device_info.lin_channel_count = uint8_t(info.lin_channel_count);
+        writeRecordUnlocked(RecordDeviceInfo, info.serial_number, timestamp_in_ns,
+                            &device_info, sizeof(device_info));
+    }
+
+    writeRecordUnlocked(RecordInTransfer, info.serial_number, timestamp_in_ns, data, uint32_t(length));
+}
+
+bool ZZenoUSBCapture::setReplayPath(const std::string& path, bool full_speed)
+{
+    std::call_once(environment_once, loadEnvironment);
+
+    std::lock_guard<std::mutex> lock(capture_mutex);
+    replay_path = path;
+    replay_full_speed = full_speed;
+
+    if ( path.empty() ) return true;
+
+    FILE* file = fopen(path.c_str(), "rb");
+    if ( file == nullptr ) {
+        zError("(ZenoUSB) can't open USB replay file %s", path.c_str());
+        replay_path.clear();
+        return false;
+    }
+    fclose(file);
+
+    return true;
+}
+
+bool ZZenoUSBCapture::loadReplay(std::vector<std::shared_ptr<const Device> >& devices, bool& full_speed)
+{
+    std::call_once(environment_once, loadEnvironment);
+
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(capture_mutex);
+        path = replay_path;
+        full_speed = replay_full_speed;
+    }
+
+    devices.clear();
+    if ( path.empty() ) return true;
+
+    FILE* file = fopen(path.c_str(), "rb");
+    if ( file == nullptr ) {
+        zError("(ZenoUSB) can't open USB replay file %s", path.c_str());
+        return false;
+    }
+
+    FileHeader header;
+    if ( fread(&header, sizeof(header), 1, file) != 1 ||
+         memcmp(header.magic, ZENO_USB_CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+         header.version != ZENO_USB_CAPTURE_VERSION ) {
+        zError("(ZenoUSB) %s is not a USB capture file", path.c_str());
+        fclose(file);
+        return false;
+    }
+
+    /* Devices in order of first appearance */
+    std::vector<std::shared_ptr<Device> > loaded;
+    std::vector<uint32_t> serial_numbers;
+    size_t transfer_count = 0;
+
+    RecordHeader record;
+    std::vector<uint8_t> data;
+    while ( fread(&record, sizeof(record), 1, file) == 1 ) {
+        data.resize(record.length);
+        if ( record.length > 0 && fread(data.data(), record.length, 1, file) != 1 ) {
+            /* Capture cut short, keep what was complete */
+            zError("(ZenoUSB) %s: truncated record", path.c_str());
+            break;
+        }
+
+        size_t index = 0;
+        while ( index < serial_numbers.size() && serial_numbers[index] != record.serial_number ) index++;
+
+        if ( record.type == RecordDeviceInfo && index == serial_numbers.size() &&
+             record.length >= sizeof(CaptureDeviceInfo) ) {
+            const CaptureDeviceInfo* device_info = reinterpret_cast<const CaptureDeviceInfo*>(data.data());
+            std::shared_ptr<Device> device(new Device());
+            device->info.serial_number = record.serial_number;
+            device->info.fw_version = device_info->fw_version;
+            device->info.capabilities = device_info->capabilities;
+            device->info.clock_resolution = int(device_info->clock_resolution);
+            device->info.can_channel_count = device_info->can_channel_count;
+            device->info.lin_channel_count = device_info->lin_channel_count;
+            loaded.push_back(device);
+            serial_numbers.push_back(record.serial_number);
+        } else if ( record.type == RecordInTransfer && index < serial_numbers.size() ) {
+            Transfer transfer;
+            transfer.timestamp_in_ns = record.timestamp_in_ns;
+            transfer.data.swap(data);
+            loaded[index]->transfers.push_back(std::move(transfer));
+            transfer_count++;
+        }
+    }
+    fclose(file);
+
+    devices.assign(loaded.begin(), loaded.end());
+    zInfo("(ZenoUSB) %s: %d device(s), %u IN transfers to replay", path.c_str(),
+          int(devices.size()), unsigned(transfer_count));
+
+    return true;
+}
+
+void ZZenoUSBCapture::loadEnvironment()
+{
+    std::lock_guard<std::mutex> lock(capture_mutex);
+
+    const char* path = getenv("ZCQ_USB_CAPTURE");
+    if ( path != nullptr && path[0] != '\0' ) openCaptureUnlocked(path);
+
+    path = getenv("ZCQ_USB_REPLAY");
+    if ( path != nullptr ) replay_path = path;
+
+    const char* fast = getenv("ZCQ_USB_REPLAY_FAST");
+    replay_full_speed = (fast != nullptr && atoi(fast) != 0);
+}
+
+bool ZZenoUSBCapture::openCaptureUnlocked(const std::string& path)
+{
+    capture_file = fopen(path.c_str(), "wb");
+    if ( capture_file == nullptr ) {
+        zError("(ZenoUSB) can't create USB capture file %s", path.c_str());
+        return false;
+    }
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ZENO_USB_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = ZENO_USB_CAPTURE_VERSION;
+    fwrite(&header, sizeof(header), 1, capture_file);
+
+    capture_devices.clear();
+    capture_enabled = true;
+    zInfo("(ZenoUSB) capturing USB IN data to %s", path.c_str());
+
+    return true;
+}
+
+void ZZenoUSBCapture::closeCaptureUnlocked()
+{
+    capture_enabled = false;
+    if ( capture_file == nullptr ) return;
+
+    fclose(capture_file);
+    capture_file = nullptr;
+}
+
+void ZZenoUSBCapture::writeRecordUnlocked(uint32_t type, uint32_t serial_number, uint64_t timestamp_in_ns,
+                                          const void* data, uint32_t length)
+{
+    RecordHeader record;
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.serial_number = serial_number;
+    record.timestamp_in_ns = timestamp_in_ns;
+    record.length = length;
+
+    /* Buffered by stdio, flushed when the capture is stopped */
+    if ( fwrite(&record, sizeof(record), 1, capture_file) != 1 ||
+         (length > 0 && fwrite(data, length, 1, capture_file) != 1) ) {
+        zError("(ZenoUSB) USB capture write failed, capture stopped");
+        closeCaptureUnlocked();
+    }
+}
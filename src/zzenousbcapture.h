@@ -0,0 +1,120 @@
+/*
+ *             Copyright 2020 by Morgan
+ *
+ * This software BSD-new. See the included COPYING file for details.
+ *
+ * License: BSD-new
+ * ==============================================================================
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the \<organization\> nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+ * IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef ZZENOUSBCAPTURE_H
+#define ZZENOUSBCAPTURE_H
+
+#include "zzenodeviceinfocache.h"
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define ZENO_USB_CAPTURE_MAGIC      "ZCQUSBIN"
+#define ZENO_USB_CAPTURE_VERSION    1
+
+/**
+ * Raw USB IN data capture and replay. When capture is on, the data of every
+ * completed IN bulk transfer is written to a file with its completion time,
+ * preceded by the info of the device it came from. A capture is replayed by
+ * simulated devices, see ZZenoSimDevice, which feed the recorded transfers
+ * through the normal IN data handling at the recorded pace or as fast as
+ * possible. Capture is off unless a file is set with setCapturePath() or the
+ * ZCQ_USB_CAPTURE environment variable, replay likewise with
+ * setReplayPath() or ZCQ_USB_REPLAY, ZCQ_USB_REPLAY_FAST=1 replays as fast
+ * as possible.
+ *
+ * The file is a header followed by records in host byte order, each a
+ * RecordHeader and length bytes of data. Records of several devices are
+ * interleaved in completion order.
+ */
+class ZZenoUSBCapture {
+public:
+    enum RecordType {
+        RecordDeviceInfo = 1,   /* CaptureDeviceInfo */
+        RecordInTransfer = 2    /* Raw IN bulk transfer data */
+    };
+
+#pragma pack(push, 1)
+    struct FileHeader {
+        char magic[8];          /* ZENO_USB_CAPTURE_MAGIC, not terminated */
+        uint32_t version;
+        uint32_t reserved;
+    };
+
+    struct RecordHeader {
+        uint32_t type;
+        uint32_t serial_number;
+        uint64_t timestamp_in_ns;   /* steady clock */
+        uint32_t length;
+        uint32_t reserved;
+    };
+
+    struct CaptureDeviceInfo {
+        uint32_t fw_version;
+        uint32_t capabilities;
+        uint32_t clock_resolution;
+        uint8_t can_channel_count;
+        uint8_t lin_channel_count;
+        uint8_t reserved[2];
+    };
+#pragma pack(pop)
+
+    struct Transfer {
+        uint64_t timestamp_in_ns;
+        std::vector<uint8_t> data;
+    };
+
+    struct Device {
+        ZZenoDeviceInfoCache::DeviceInfo info;
+        std::vector<Transfer> transfers;
+    };
+
+    /* Empty path stops the capture, an existing file is overwritten */
+    static bool setCapturePath(const std::string& path);
+    static bool isCapturing();
+    static void captureInTransfer(const ZZenoDeviceInfoCache::DeviceInfo& info,
+                                  const uint8_t* data, int length);
+
+    /* Empty path disables replay. Used the next time devices are enumerated */
+    static bool setReplayPath(const std::string& path, bool full_speed);
+    static bool loadReplay(std::vector<std::shared_ptr<const Device> >& devices, bool& full_speed);
+
+private:
+    static void loadEnvironment();
+    static bool openCaptureUnlocked(const std::string& path);
+    static void closeCaptureUnlocked();
+    static void writeRecordUnlocked(uint32_t type, uint32_t serial_number, uint64_t timestamp_in_ns,
+                                    const void* data, uint32_t length);
+};
+
+#endif /* ZZENOUSBCAPTURE_H */
@@ -33,7 +33,9 @@
 #include "zzenousbdevice.h"
 #include "zzenocandriver.h"
 #include "zusbcontext.h"
+#include "zzenousbcapture.h"
 #include "zdebug.h"
+#include "zthreadscheduling.h"
 
 #include <string.h>
 #include <assert.h>
@@ -41,6 +43,13 @@
 #include <chrono>
 #include <cmath>
 
+static std::atomic<int> default_in_transfer_count(ZENO_USB_IN_TRANSFER_COUNT);
+static std::atomic<int> default_out_transfer_count(ZENO_USB_OUT_TRANSFER_COUNT);
+static std::atomic<int> default_out_max_delay_in_us(ZENO_USB_OUT_MAX_DELAY_US);
+static std::atomic<int> default_in_transfer_size(ZENO_USB_MAX_PACKET_IN);
+static std::atomic<int> default_out_transfer_size(ZENO_USB_MAX_PACKET_OUT);
+static std::atomic<int> default_bulk_transfer_timeout_in_ms(ZENO_USB_BULK_TRANSFER_TIMEOUT);
+
 #ifdef _WIN32
   /* some bloody #define of min conflicts with C++ std::min and std::max */
   #ifdef min
@@ -51,31 +60,54 @@
   #endif
 #endif
 
-ZZenoUSBDevice::ZZenoUSBDevice(ZZenoCANDriver* _driver,
-                               int _device_no, libusb_device* _device,
+ZZenoUSBDevice::ZZenoUSBDevice(ZZenoCANDriver* _driver, int _device_no,
                                const std::string& _display_name)
 : driver(_driver), usb_context(new ZUSBContext(driver->getUSBContext())),
+  driver_usb_context(usb_context),
   device_gone_or_disconnected(false),
-  device_no(_device_no), open_ref_count(0),
-  device(_device), handle(nullptr),
+  device_info_stale(false),
+  tx_queue_resume(false),
+  device_no(_device_no), device_index(-1), open_ref_count(0), handle_closing(false),
+  device(nullptr), handle(nullptr),
   in_end_point_address(0), in_end_point_interrupt_address(0), in_max_packet_size(0),
   in_bulk_transfer_complete(0), in_interrupt_transfer_complete(0),
-  in_bulk_transfer(nullptr), in_buffer(new uint8_t[ZENO_USB_MAX_PACKET_IN]),
-  out_end_point_address(0), display_name(_display_name),
-  reply_timeout_in_ms(1000), reply_cmd_id(0), reply_received(0), reply_command(nullptr),
+  in_bulk_transfers_pending(0),
+  out_end_point_address(0), out_max_packet_size(0),
+  in_transfer_size(ZENO_USB_MAX_PACKET_IN), out_transfer_size(ZENO_USB_MAX_PACKET_OUT),
+  bulk_transfer_timeout_in_ms(ZENO_USB_BULK_TRANSFER_TIMEOUT),
+  in_transfer_size_setting(0), out_transfer_size_setting(0), bulk_transfer_timeout_setting(-1),
+  out_transfer_count(0), out_max_delay(0),
+  out_head(0), out_in_flight(0), out_reserved_size(ZENO_CMD_SIZE),
+  out_flush_running(false), out_flush_armed(false),
+  display_name(_display_name),
+  reply_timeout_in_ms(1000),
   next_transaction_id(0),
   zeno_clock_resolution(1),
   serial_number(0),
   fw_version(0),
+  capabilities(0),
+  info_from_cache(false),
   t2_clock_start_ref_in_us(0),
   t2_e_clock_start_ref_in_us(0),
   t2_e_clock_start_diff_utc_us(0),
   init_calibrate_count(0),
   drift_time_in_us(0),
   time_drift_in_us(0),
-  drift_factor(0)
+  drift_factor(0),
+  device_rx_fifo(0),
+  device_rx_queue_ref_count(0),
+  device_rx_queue_lin_ref_count(0),
+  device_rx_staging(ZENO_USB_MAX_PACKET_IN / ZENO_CMD_SIZE),
+  device_rx_staged_count(0)
 {
-    libusb_ref_device(device);
+}
+
+ZZenoUSBDevice::ZZenoUSBDevice(ZZenoCANDriver* _driver,
+                               int _device_no, libusb_device* _device,
+                               const std::string& _display_name)
+: ZZenoUSBDevice(_driver, _device_no, _display_name)
+{
+    device = libusb_ref_device(_device);
     int res;
     libusb_config_descriptor* config = nullptr;
 
@@ -136,12 +168,6 @@ ZZenoUSBDevice::ZZenoUSBDevice(ZZenoCANDriver* _driver,
 
     libusb_free_config_descriptor(config);
 
-    out_buffer[0] = new uint8_t[ZENO_USB_MAX_PACKET_OUT];
-    out_buffer[1] = new uint8_t[ZENO_USB_MAX_PACKET_OUT];
-    out_bulk_transfer[0] = nullptr;
-    out_bulk_transfer[1] = nullptr;
-    bulk_out_transfer_completed = 0;
-    next_transfer_index = -1; /* No pending TX bulk transfer */
 
     retrieveDeviceInfo();
 }
@@ -149,16 +175,40 @@ ZZenoUSBDevice::ZZenoUSBDevice(ZZenoCANDriver* _driver,
 ZZenoUSBDevice::~ZZenoUSBDevice()
 {
     if ( handle != nullptr ) close();
-    libusb_unref_device(device);
-    delete[] in_buffer;
-    delete[] out_buffer[0];
-    delete[] out_buffer[1];
+    if ( device != nullptr ) libusb_unref_device(device);
 }
 
 void ZZenoUSBDevice::retrieveDeviceInfo()
 {
+    ZZenoDeviceInfoCache::DeviceInfo info;
+
+    /* Known devices need no round trips, the info is checked on first open */
+    cache_key = deviceInfoCacheKey();
+    if ( !cache_key.empty() && ZZenoDeviceInfoCache::lookup(cache_key, info) ) {
+        zDebug("(ZenoUSB) %s: device info from cache", cache_key.c_str());
+        applyDeviceInfo(info);
+        info_from_cache = true;
+        return;
+    }
+
     if (!open()) return;
 
+    if ( queryDeviceInfo(info) ) {
+        applyDeviceInfo(info);
+        if ( !cache_key.empty() ) ZZenoDeviceInfoCache::store(cache_key, info);
+    }
+
+    close();
+}
+
+std::string ZZenoUSBDevice::deviceInfoCacheKey() const
+{
+    if ( device == nullptr ) return std::string();
+    return ZZenoDeviceInfoCache::deviceKey(device);
+}
+
+bool ZZenoUSBDevice::queryDeviceInfo(ZZenoDeviceInfoCache::DeviceInfo& info)
+{
     ZenoCmd cmd;
     ZenoResponse reply;
     memset(&cmd, 0, sizeof(cmd));
@@ -167,15 +217,13 @@ void ZZenoUSBDevice::retrieveDeviceInfo()
     zDebug("Sending reset");
     if  ( !sendAndWhaitReply(&cmd, &reply) ) {
         zCritical("(ZenoUSB): failed to reset device: %s",last_error_text.c_str());
-        close();
-        return;
+        return false;
     }
 
     cmd.h.cmd_id = ZENO_CMD_INFO;
     if  ( !sendAndWhaitReply(&cmd, &reply) ) {
         zError("(ZenoUSB): failed to retrieve device info: %s", last_error_text.c_str());
-        close();
-        return;
+        return false;
     }
 
     ZenoInfoResponse* info_response = reinterpret_cast<ZenoInfoResponse*>(&reply);
@@ -186,22 +234,87 @@ void ZZenoUSBDevice::retrieveDeviceInfo()
     zDebug("CAN channel count: %d", info_response->can_channel_count);
     zDebug("LIN channel count: %d", info_response->lin_channel_count);
 
-    zeno_clock_resolution = info_response->clock_resolution;
-    serial_number = info_response->serial_number;
-    fw_version = info_response->fw_version;
+    info.serial_number = info_response->serial_number;
+    info.fw_version = info_response->fw_version;
+    info.clock_resolution = int(info_response->clock_resolution);
+    info.can_channel_count = info_response->can_channel_count;
+    info.lin_channel_count = info_response->lin_channel_count;
+    info.capabilities = info_response->capabilities;
+
+    return true;
+}
+
+void ZZenoUSBDevice::applyDeviceInfo(const ZZenoDeviceInfoCache::DeviceInfo& info)
+{
+    zeno_clock_resolution = info.clock_resolution;
+    serial_number = info.serial_number;
+    fw_version = info.fw_version;
+    capabilities = info.capabilities;
 
     can_channel_list.clear();
-    for( int i = 0; i < info_response->can_channel_count; ++i ) {
+    for( int i = 0; i < info.can_channel_count; ++i ) {
         can_channel_list.push_back(new ZZenoCANChannel(i, this));
     }
 
     lin_channel_list.clear();
     int display_index = 1;
-    for( int i = info_response->lin_channel_count-1; i >=0 ; --i ) {
+    for( int i = info.lin_channel_count-1; i >=0 ; --i ) {
         lin_channel_list.push_back(new ZZenoLINChannel(i, display_index++, this));
     }
+}
 
-    close();
+bool ZZenoUSBDevice::verifyCachedDeviceInfo()
+{
+    /* Reset the device as an uncached startup does */
+    info_from_cache = false;
+
+    ZZenoDeviceInfoCache::DeviceInfo info;
+    bool store_info = false;
+    if ( !queryDeviceInfo(info) ) {
+        /* Unchecked cached info is not used, the entry is evicted and the
+         * device asked again as an uncached startup does */
+        zError("(ZenoUSB) %s: cached device info not verified, retrieving it again", cache_key.c_str());
+        ZZenoDeviceInfoCache::erase(cache_key);
+        store_info = true;
+        if ( !queryDeviceInfo(info) ) {
+            /* Checked again on the next open */
+            info_from_cache = true;
+            return false;
+        }
+    }
+
+    /* Channels are not open yet, a firmware update applies at once */
+    bool capabilities_changed = (info.capabilities != capabilities);
+    capabilities = info.capabilities;
+
+    if ( info.can_channel_count != int(can_channel_list.size()) ||
+         info.lin_channel_count != int(lin_channel_list.size()) ) {
+        /* The channel objects are published, the device is enumerated again
+         * with the new counts instead */
+        zError("(ZenoUSB) %s: cached channel count %d/%d, device has %d/%d",
+               cache_key.c_str(), int(can_channel_list.size()), int(lin_channel_list.size()),
+               info.can_channel_count, info.lin_channel_count);
+        ZZenoDeviceInfoCache::store(cache_key, info);
+        device_info_stale = true;
+        last_error_text = "Device channel count changed, enumerate the devices again";
+        if ( device != nullptr ) driver->refreshDevice(device);
+        return false;
+    }
+
+    if ( capabilities_changed ||
+         info.serial_number != serial_number ||
+         info.fw_version != fw_version ||
+         info.clock_resolution != zeno_clock_resolution ) {
+        zError("(ZenoUSB) %s: cached device info is stale, updated", cache_key.c_str());
+        zeno_clock_resolution = info.clock_resolution;
+        serial_number = info.serial_number;
+        fw_version = info.fw_version;
+        store_info = true;
+    }
+
+    if ( store_info ) ZZenoDeviceInfoCache::store(cache_key, info);
+
+    return true;
 }
 
 const std::string ZZenoUSBDevice::getLastErrorText()
@@ -223,10 +336,46 @@ bool ZZenoUSBDevice::open()
     }
 
     assert(open_ref_count == 0);
+    if (!openHandleUnlocked()) {
+        /* Cached channel counts stay unchecked, the next start asks the device */
+        if ( info_from_cache ) ZZenoDeviceInfoCache::erase(cache_key);
+        return false;
+    }
+
+    open_ref_count ++;
+
+    if ( info_from_cache && !verifyCachedDeviceInfo() ) {
+        open_ref_count = 0;
+        closeHandleUnlocked(false);
+        return false;
+    }
+    startClockInt();
+
+    return true;
+}
+
+bool ZZenoUSBDevice::openHandleUnlocked()
+{
     assert(handle == NULL);
-    assert(in_bulk_transfer == NULL);
+    assert(in_bulk_transfers.empty());
+
+    /* A device in an event group is opened in the group's libusb context,
+     * its transfers are then handled by the group event thread */
+    usb_context = driver_usb_context;
+    libusb_device* open_device = device;
+    ZUSBContext* group_context = driver->getEventGroupContext(device_index);
+    if ( group_context != nullptr ) {
+        open_device = findDeviceInContext(group_context->getUSBContext());
+        if ( open_device != nullptr ) {
+            usb_context = group_context;
+        } else {
+            zError("(ZenoUSB) device not found in event group context, using driver context");
+            open_device = device;
+        }
+    }
 
-    int res = libusb_open(device, &handle);
+    int res = libusb_open(open_device, &handle);
+    if ( open_device != device ) libusb_unref_device(open_device);
     if ( res ) {
         last_error_text = ZUSBContext::translateLibUSBErrorCode(res);
         device_gone_or_disconnected = (res == LIBUSB_ERROR_NO_DEVICE);
@@ -260,14 +409,39 @@ bool ZZenoUSBDevice::open()
         return false;
     }
 
-    in_bulk_transfer = libusb_alloc_transfer(0);
+    /* Keep a pool of IN transfers queued, so the device always has a
+     * pending transfer while a completed one is being handled */
+    loadTransferSettings();
+
+    int in_transfer_count = default_in_transfer_count;
+    bool in_transfers_allocated = true;
+    in_buffer_pool.resize(size_t(in_transfer_count) * size_t(in_transfer_size));
+    for ( int i = 0; i < in_transfer_count; ++i ) {
+        libusb_transfer* in_bulk_transfer = libusb_alloc_transfer(0);
+        if ( in_bulk_transfer == nullptr ) {
+            in_transfers_allocated = false;
+            break;
+        }
+        in_bulk_transfers.push_back(in_bulk_transfer);
+    }
+
+    out_transfer_count = default_out_transfer_count;
+    out_max_delay = std::chrono::microseconds(default_out_max_delay_in_us);
+    bool out_transfers_allocated = true;
+    out_buffer_pool.resize(size_t(out_transfer_count) * size_t(out_transfer_size));
+    for ( int i = 0; i < out_transfer_count; ++i ) {
+        libusb_transfer* out_bulk_transfer = libusb_alloc_transfer(0);
+        if ( out_bulk_transfer == nullptr ) {
+            out_transfers_allocated = false;
+            break;
+        }
+        out_bulk_transfers.push_back(out_bulk_transfer);
+    }
+
     in_interrupt_transfer = libusb_alloc_transfer(0);
-    out_bulk_transfer[0] = libusb_alloc_transfer(0);
-    out_bulk_transfer[1] = libusb_alloc_transfer(0);
-    if ( in_bulk_transfer == nullptr ||
-         in_interrupt_transfer == nullptr ||
-         out_bulk_transfer[0] == nullptr ||
-         out_bulk_transfer[1] == nullptr) {
+    if ( !in_transfers_allocated ||
+         !out_transfers_allocated ||
+         in_interrupt_transfer == nullptr ) {
         last_error_text = ZUSBContext::translateLibUSBErrorCode(LIBUSB_ERROR_NO_MEM);
         device_gone_or_disconnected = (res == LIBUSB_ERROR_NO_DEVICE);
         zError("(ZenoUSB) failed to allocate bulk in/out transfers");
@@ -281,11 +455,23 @@ bool ZZenoUSBDevice::open()
         return false;
     }
 
-    libusb_fill_bulk_transfer(in_bulk_transfer, handle, in_end_point_address,
-                              in_buffer, ZENO_USB_MAX_PACKET_IN,
-                              &__inBulkTransferCallback, this, ZENO_USB_BULK_TRANSFER_TIMEOUT);
+    for ( int i = 0; i < in_transfer_count; ++i ) {
+        libusb_fill_bulk_transfer(in_bulk_transfers[size_t(i)], handle, in_end_point_address,
+                                  &in_buffer_pool[size_t(i) * size_t(in_transfer_size)], in_transfer_size,
+                                  &__inBulkTransferCallback, this, unsigned(bulk_transfer_timeout_in_ms));
+    }
 
     in_bulk_transfer_complete = 0;
+    in_bulk_transfers_pending = 0;
+
+    for ( int i = 0; i < out_transfer_count; ++i ) {
+        libusb_fill_bulk_transfer(out_bulk_transfers[size_t(i)], handle, out_end_point_address,
+                                  &out_buffer_pool[size_t(i) * size_t(out_transfer_size)], 0,
+                                  &__outBulkTransferCallback, this, unsigned(bulk_transfer_timeout_in_ms));
+    }
+
+    out_head = 0;
+    out_in_flight = 0;
 
 
     libusb_fill_interrupt_transfer(in_interrupt_transfer, handle, in_end_point_interrupt_address,
@@ -293,13 +479,21 @@ bool ZZenoUSBDevice::open()
                               &__inInterruptTransferCallback, this, ZENO_USB_INTERRUPT_TRANSFER_TIMEOUT);
 
     in_interrupt_transfer_complete = 0;
+    handle_closing = false;
+
+    for ( int i = 0; i < in_transfer_count; ++i ) {
+        res = libusb_submit_transfer(in_bulk_transfers[size_t(i)]);
+        if ( res ) break;
+        in_bulk_transfers_pending ++;
+    }
 
-    res = libusb_submit_transfer(in_bulk_transfer);
     if ( res ) {
         last_error_text = ZUSBContext::translateLibUSBErrorCode(res);
         device_gone_or_disconnected = (res == LIBUSB_ERROR_NO_DEVICE);
         zError("(ZenoUSB) failed to submit bulk transfer: %s", last_error_text.c_str());
 
+        handle_closing = true;
+        cancelInTransfers();
         freeTransfers();
 
         libusb_release_interface(handle, 1);
@@ -317,6 +511,8 @@ bool ZZenoUSBDevice::open()
         device_gone_or_disconnected = (res == LIBUSB_ERROR_NO_DEVICE);
         zError("ERROR(ZenoUSB) failed to submit interrupt transfer: %s", last_error_text.c_str());
 
+        handle_closing = true;
+        cancelInTransfers();
         freeTransfers();
 
         libusb_release_interface(handle, 1);
@@ -327,92 +523,204 @@ bool ZZenoUSBDevice::open()
         return false;
     }
 
-    open_ref_count ++;
     usb_context->startRef();
 
-    startClockInt();
-
     return true;
 }
 
-void ZZenoUSBDevice::freeTransfers()
+void ZZenoUSBDevice::loadTransferSettings()
 {
-    if ( in_bulk_transfer != nullptr ) libusb_free_transfer(in_bulk_transfer);
-    if ( in_interrupt_transfer != nullptr ) libusb_free_transfer(in_interrupt_transfer);
-    if ( out_bulk_transfer[0] != nullptr ) libusb_free_transfer(out_bulk_transfer[0]);
-    if ( out_bulk_transfer[1] != nullptr ) libusb_free_transfer(out_bulk_transfer[1]);
+    in_transfer_size = in_transfer_size_setting ? in_transfer_size_setting : default_in_transfer_size.load();
+    out_transfer_size = out_transfer_size_setting ? out_transfer_size_setting : default_out_transfer_size.load();
+    bulk_transfer_timeout_in_ms = bulk_transfer_timeout_setting >= 0 ? bulk_transfer_timeout_setting :
+                                                                       default_bulk_transfer_timeout_in_ms.load();
+
+    /* A short IN transfer ends at a packet boundary, the buffer must hold
+     * whole packets or the device data overflows it */
+    if ( in_max_packet_size > 0 && in_transfer_size % in_max_packet_size ) {
+        in_transfer_size = std::min((in_transfer_size / in_max_packet_size + 1) * in_max_packet_size,
+                                    ZENO_USB_MAX_TRANSFER_SIZE);
+        zDebug("(ZenoUSB) IN transfer size rounded up to %d", in_transfer_size);
+    }
+}
 
-    in_bulk_transfer = nullptr;
-    in_interrupt_transfer = nullptr;
-    out_bulk_transfer[0] = nullptr;
-    out_bulk_transfer[1] = nullptr;
+libusb_device* ZZenoUSBDevice::findDeviceInContext(libusb_context* context) const
+{
+    libusb_device** list;
+    ssize_t cnt = libusb_get_device_list(context, &list);
+    if ( cnt < 0 ) return nullptr;
+
+    uint8_t bus_number = libusb_get_bus_number(device);
+    uint8_t device_address = libusb_get_device_address(device);
+
+    libusb_device* found = nullptr;
+    for ( ssize_t i = 0; i < cnt; ++i ) {
+        if ( libusb_get_bus_number(list[i]) == bus_number &&
+             libusb_get_device_address(list[i]) == device_address ) {
+            found = libusb_ref_device(list[i]);
+            break;
+        }
+    }
+    libusb_free_device_list(list, 1);
+
+    return found;
 }
 
-int ZZenoUSBDevice::getNextTransferIndex()
+void ZZenoUSBDevice::cancelInTransfers()
 {
-    int buffer_index;
-    if ( next_transfer_index == -1 ) {
-        libusb_fill_bulk_transfer(out_bulk_transfer[0], handle, out_end_point_address,
-                                  out_buffer[0], 0,
-                                  &__outBulkTransferCallback, this, ZENO_USB_BULK_TRANSFER_TIMEOUT);
+    if ( in_bulk_transfers_pending == 0 ) in_bulk_transfer_complete = 1;
 
-        libusb_fill_bulk_transfer(out_bulk_transfer[1], handle, out_end_point_address,
-                                  out_buffer[1], 0,
-                                  &__outBulkTransferCallback, this, ZENO_USB_BULK_TRANSFER_TIMEOUT);
+    for ( auto in_bulk_transfer : in_bulk_transfers ) {
+        libusb_cancel_transfer(in_bulk_transfer);
+    }
 
-        buffer_index = 0;
-    } else {
-        buffer_index = next_transfer_index;
+    while (!in_bulk_transfer_complete) {
+        if (!usb_context->handleEvents(in_bulk_transfer_complete))
+            break;
+    }
+}
+
+void ZZenoUSBDevice::freeTransfers()
+{
+    for ( auto in_bulk_transfer : in_bulk_transfers ) {
+        libusb_free_transfer(in_bulk_transfer);
     }
+    in_bulk_transfers.clear();
 
-    return buffer_index;
+    if ( in_interrupt_transfer != nullptr ) libusb_free_transfer(in_interrupt_transfer);
+    for ( auto out_bulk_transfer : out_bulk_transfers ) {
+        libusb_free_transfer(out_bulk_transfer);
+    }
+    out_bulk_transfers.clear();
+
+    in_interrupt_transfer = nullptr;
 }
 
 bool ZZenoUSBDevice::close()
 {
     std::lock_guard<std::mutex> lock(device_mutex);
-    assert(handle != nullptr);
 
-    if ( open_ref_count == 1 ) stopClockInt();
+    if ( !isTransportOpen() ) {
+        /* Lost and not recovered, channels are closed one by one */
+        open_ref_count--;
+        assert(open_ref_count >= 0);
+        return true;
+    }
 
     open_ref_count--;
     assert(open_ref_count >= 0);
 
-    if ( open_ref_count == 0 ) {
-        libusb_cancel_transfer(in_bulk_transfer);
-        libusb_cancel_transfer(in_interrupt_transfer);
+    if ( open_ref_count == 0 ) closeHandleUnlocked(true);
 
-        if ( out_bulk_transfer[0]->length > 0 ) libusb_cancel_transfer(out_bulk_transfer[0]);
-        if ( out_bulk_transfer[1]->length > 0 ) libusb_cancel_transfer(out_bulk_transfer[1]);
+    return true;
+}
 
-        while (!in_bulk_transfer_complete || next_transfer_index != -1) {
-            if (!usb_context->handleEvents(in_bulk_transfer_complete))
-                break;
-        }
+void ZZenoUSBDevice::closeHandleUnlocked(bool stop_clock)
+{
+    if ( stop_clock ) stopClockInt();
 
-        while (!in_interrupt_transfer_complete) {
-            if (!usb_context->handleEvents(in_interrupt_transfer_complete))
-                break;
+    /* Completed transfers are not re-submitted from here on */
+    handle_closing = true;
+    stopOutFlushTimer();
+    libusb_cancel_transfer(in_interrupt_transfer);
+
+    {
+        std::lock_guard<std::mutex> out_lock(out_transfer_mutex);
+        for ( int i = 0; i < out_in_flight; ++i ) {
+            libusb_cancel_transfer(out_bulk_transfers[size_t((out_head + i) % out_transfer_count)]);
         }
+    }
+
+    cancelInTransfers();
+
+    while (out_in_flight > 0) {
+        int out_completed = 0;
+        if (!usb_context->handleEvents(out_completed))
+            break;
+    }
 
+    while (!in_interrupt_transfer_complete) {
+        if (!usb_context->handleEvents(in_interrupt_transfer_complete))
+            break;
+    }
+
+    {
+        /* Senders check for transfers with out_transfer_mutex held */
+        std::lock_guard<std::mutex> out_lock(out_transfer_mutex);
         freeTransfers();
+        out_transfer_cond.notify_all();
+    }
+    deferred_in_data.clear();
+    failPendingReplies();
 
-        // int res = libusb_reset_device(handle);
-        // if ( res ) {
-        //   translateLibUSBErrorCode(res);
-        //   qDebug() << "ERROR(ZenoUSB) reset device failed: " << last_error_text;
-        // }
-        libusb_release_interface(handle, 0);
-        libusb_release_interface(handle, 1);
-        libusb_close(handle);
-        handle = nullptr;
+    // int res = libusb_reset_device(handle);
+    // if ( res ) {
+    //   translateLibUSBErrorCode(res);
+    //   qDebug() << "ERROR(ZenoUSB) reset device failed: " << last_error_text;
+    // }
+    libusb_release_interface(handle, 0);
+    libusb_release_interface(handle, 1);
+    libusb_close(handle);
+    handle = nullptr;
+
+    usb_context->stopUnRef();
+}
+
+void ZZenoUSBDevice::deviceLost()
+{
+    std::lock_guard<std::mutex> lock(device_mutex);
+    device_gone_or_disconnected = true;
+    if ( !isTransportOpen() ) return;
+
+    zInfo("(ZenoUSB) %s serial %u lost, waiting for it to return", display_name.c_str(), serial_number);
+    lost_time = std::chrono::steady_clock::now();
 
-        usb_context->stopUnRef();
+    /* Commands can not reach the device, skip the clock stop */
+    closeHandleUnlocked(false);
+}
+
+bool ZZenoUSBDevice::recover(libusb_device* new_device)
+{
+    int64_t outage_in_us;
+    {
+        std::lock_guard<std::mutex> lock(device_mutex);
+        if ( isTransportOpen() || open_ref_count == 0 ) return false;
+
+        libusb_unref_device(device);
+        device = libusb_ref_device(new_device);
+
+        if (!openHandleUnlocked()) {
+            zError("(ZenoUSB) %s serial %u failed to reopen: %s", display_name.c_str(),
+                   serial_number, last_error_text.c_str());
+            return false;
+        }
+        device_gone_or_disconnected = false;
+
+        /* The device restarted, reset it as a first open does */
+        ZZenoDeviceInfoCache::DeviceInfo info;
+        queryDeviceInfo(info);
+        startClockInt();
+
+        outage_in_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - lost_time).count();
+    }
+
+    zInfo("(ZenoUSB) %s serial %u recovered after %.1f ms", display_name.c_str(),
+          serial_number, double(outage_in_us) / 1000.0);
+
+    for ( auto can_channel : can_channel_list ) {
+        can_channel->recover(outage_in_us);
     }
 
     return true;
 }
 
+bool ZZenoUSBDevice::isLost() const
+{
+    std::lock_guard<std::mutex> lock(device_mutex);
+    return open_ref_count > 0 && !isTransportOpen();
+}
+
 bool ZZenoUSBDevice::isOpen() const
 {
     std::lock_guard<std::mutex> lock(device_mutex);
@@ -451,85 +759,360 @@ uint32_t ZZenoUSBDevice::getFWVersion() const
     return fw_version;
 }
 
-bool ZZenoUSBDevice::sendAndWhaitReply(ZenoCmd* request, ZenoResponse* reply)
+void ZZenoUSBDevice::getUSBStatistics(ZUSBStatistics::Snapshot& snapshot) const
 {
-    assert(handle != nullptr);
-    std::lock_guard<std::mutex> lock(send_reply_mutex);
+    usb_statistics.read(snapshot);
+}
 
-    if (!queueRequest(request)) return false;
+void ZZenoUSBDevice::resetUSBStatistics()
+{
+    usb_statistics.reset();
+}
+
+bool ZZenoUSBDevice::sendAndWhaitReply(ZenoCmd* request, ZenoResponse* reply)
+{
+    std::shared_ptr<PendingReply> pending = queueCommand(request, false);
+    if ( !pending ) return false;
 
     std::unique_lock<std::mutex> command_lock(command_mutex);
-    reply_received = 0;
-    reply_command = reply;
-    reply_cmd_id = request->h.cmd_id;
-
-    // qDebug() << "Queue reqeust";    
-    while (!reply_received) {
-        std::chrono::milliseconds reply_timeout(reply_timeout_in_ms);
-        if (command_cond.wait_for(command_lock, reply_timeout) == std::cv_status::timeout) {
-            last_error_text = "Timeout waiting for reply";
-            break;
-        }
+    auto done = [&pending]() { return pending->done; };
+
+    if ( isApplicationDrivenEvents() ) {
+        /* Callers hold channel locks, handle replies only */
+        waitForEvents(command_lock, reply_timeout_in_ms, done, true);
+    } else {
+        command_cond.wait_for(command_lock, std::chrono::milliseconds(reply_timeout_in_ms), done);
     }
 
-    reply_command = nullptr;
-    // qDebug() << "last_error_text" << last_error_text << reply_received;
+    if ( !pending->done ) {
+        removePendingReplyUnlocked(pending.get());
+        last_error_text = "Timeout waiting for reply";
+        return false;
+    }
 
-    return (reply_received != 0);
+    if ( !pending->received ) {
+        last_error_text = "Device closed while waiting for reply";
+        return false;
+    }
+
+    *reply = pending->response;
+    return true;
 }
 
-bool ZZenoUSBDevice::___queueRequestUnlocked(ZenoCmd* request, std::unique_lock<std::mutex>& lock, int timeout_in_ms) {
-    int buffer_index = getNextTransferIndex();
-    if ( buffer_index == -1) return false;
+std::future<ZZenoUSBDevice::ReplyResult> ZZenoUSBDevice::sendRequestAsync(ZenoCmd* request)
+{
+    std::shared_ptr<PendingReply> pending = queueCommand(request, true);
+    if ( !pending ) {
+        std::promise<ReplyResult> failed;
+        ReplyResult result;
+        memset(&result, 0, sizeof(result));
+        failed.set_value(result);
+        return failed.get_future();
+    }
 
-    int offset = out_bulk_transfer[buffer_index]->length;
-    // if ( (offset & -out_max_packet_size) != ((offset+HYDRA_CMD_SIZE) & -out_max_packet_size) ) {
-    //    out_bulk_transfer[buffer_index]->buffer[offset] = 0;
-    //    offset += out_max_packet_size;
-    //    offset &= - out_max_packet_size;
-    // }
+    return pending->promise.get_future();
+}
 
-    if ( (offset + ZENO_CMD_SIZE) >= ZENO_USB_MAX_PACKET_OUT ) {
-        if ( next_transfer_index == -1 ) {
-            int res = libusb_submit_transfer(out_bulk_transfer[buffer_index]);
-            if ( res ) {
-                last_error_text = ZUSBContext::translateLibUSBErrorCode(res);
-                device_gone_or_disconnected = (res == LIBUSB_ERROR_NO_DEVICE);
-                zError("(ZenoUSB) failed to submit bulk transfer: %s", last_error_text.c_str());
-                return false;
-            }
+std::shared_ptr<ZZenoUSBDevice::PendingReply> ZZenoUSBDevice::queueCommand(ZenoCmd* request, bool async)
+{
+    std::shared_ptr<PendingReply> pending = std::make_shared<PendingReply>();
+    pending->cmd_id = request->h.cmd_id;
+    pending->async = async;
+    pending->done = false;
+    pending->received = false;
+    pending->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(reply_timeout_in_ms);
+
+    std::unique_lock<std::mutex> lock(out_transfer_mutex);
+    request->h.transaction_id = uint8_t(next_transaction_id ++);
+    pending->transaction_id = request->h.transaction_id;
+
+    /* Registered before the request goes out, the reply may arrive
+     * before ___queueRequestUnlocked() returns */
+    {
+        std::lock_guard<std::mutex> command_lock(command_mutex);
+        expirePendingRepliesUnlocked();
+        pending_replies.push_back(pending);
+    }
+
+    if ( !___queueRequestUnlocked(request, lock, ZENO_USB_TX_TIMEOUT) ) {
+        std::lock_guard<std::mutex> command_lock(command_mutex);
+        removePendingReplyUnlocked(pending.get());
+        return nullptr;
+    }
+
+    return pending;
+}
+
+void ZZenoUSBDevice::completePendingReplyUnlocked(PendingReply* pending, const ZenoResponse* response)
+{
+    pending->done = true;
+    if ( response != nullptr ) {
+        pending->received = true;
+        pending->response = *response;
+    }
+
+    if ( pending->async ) {
+        ReplyResult result;
+        memset(&result, 0, sizeof(result));
+        result.received = pending->received;
+        if ( pending->received ) result.response = pending->response;
+        pending->promise.set_value(result);
+    }
+}
+
+void ZZenoUSBDevice::removePendingReplyUnlocked(PendingReply* pending)
+{
+    auto it = std::find_if(pending_replies.begin(), pending_replies.end(),
+                           [pending](const std::shared_ptr<PendingReply>& p) { return p.get() == pending; });
+    if ( it != pending_replies.end() ) pending_replies.erase(it);
+}
+
+void ZZenoUSBDevice::expirePendingRepliesUnlocked()
+{
+    /* Synchronous waiters remove their own requests on timeout */
+    auto t_now = std::chrono::steady_clock::now();
+    auto expired = [this, t_now](const std::shared_ptr<PendingReply>& p) {
+        if ( !p->async || p->deadline > t_now ) return false;
+        zError("(ZenoUSB) no reply to command %d, transaction %d", p->cmd_id, p->transaction_id);
+        completePendingReplyUnlocked(p.get(), nullptr);
+        return true;
+    };
+    pending_replies.erase(std::remove_if(pending_replies.begin(), pending_replies.end(), expired),
+                          pending_replies.end());
+}
+
+void ZZenoUSBDevice::failPendingReplies()
+{
+    std::lock_guard<std::mutex> lock(command_mutex);
+    for ( auto& pending : pending_replies ) {
+        completePendingReplyUnlocked(pending.get(), nullptr);
+    }
+    pending_replies.clear();
+    command_cond.notify_all();
+}
+
+bool ZZenoUSBDevice::___queueRequestUnlocked(ZenoCmd* request, std::unique_lock<std::mutex>& lock, int timeout_in_ms, bool low_latency) {
+    uint8_t* slot = reserveOutSlotUnlocked(lock, timeout_in_ms, ZENO_CMD_SIZE);
+    if ( slot == nullptr ) return false;
+
+    memcpy(slot, request, ZENO_CMD_SIZE);
+
+    return commitOutSlotUnlocked(low_latency);
+}
+
+uint8_t* ZZenoUSBDevice::reserveOutSlotUnlocked(std::unique_lock<std::mutex>& lock, int timeout_in_ms, int size)
+{
+    if ( out_bulk_transfers.empty() ) {
+        last_error_text = "Device not open";
+        return nullptr;
+    }
+
+    if ( size >= out_transfer_size ) {
+        last_error_text = "Request does not fit in the USB OUT buffer";
+        return nullptr;
+    }
+
+    /* All buffers submitted, wait for one to complete */
+    if (!waitForBulkTransfer(lock, timeout_in_ms)) return nullptr;
+    if ( out_bulk_transfers.empty() ) {
+        /* Closed while waiting, the device was lost */
+        last_error_text = "Device not open";
+        return nullptr;
+    }
+
+    libusb_transfer* fill_transfer = getOutFillTransfer();
+    if ( (fill_transfer->length + size) >= out_transfer_size ) {
+        if (!submitOutFillTransfer()) return nullptr;
+
+        if ( out_in_flight == out_transfer_count ) {
+            zDebug("ZenoUSB: Wait for next bulk transfer");
+            if (!waitForBulkTransfer(lock, timeout_in_ms) || out_bulk_transfers.empty()) return nullptr;
         }
+        fill_transfer = getOutFillTransfer();
+    }
+
+    if ( fill_transfer->length == 0 ) out_fill_start = std::chrono::steady_clock::now();
+    out_reserved_size = size;
+
+    return fill_transfer->buffer + fill_transfer->length;
+}
+
+bool ZZenoUSBDevice::commitOutSlotUnlocked(bool low_latency)
+{
+    libusb_transfer* fill_transfer = getOutFillTransfer();
+    fill_transfer->length += out_reserved_size;
+
+    return submitCollectedUnlocked(low_latency);
+}
+
+bool ZZenoUSBDevice::submitCollectedUnlocked(bool low_latency)
+{
+    if ( out_bulk_transfers.empty() ) {
+        /* Closed while a batch waited for a buffer */
+        last_error_text = "Device not open";
+        return false;
+    }
+    if ( getOutFillTransfer()->length == 0 ) return true;
+
+    /* Low latency requests are never held back, commands already collected
+     * are ahead of it and go out in the same transfer */
+    if ( low_latency ) return submitOutFillTransfer();
+
+    /* Adaptive coalescing: submit at once when the pipe is idle, otherwise
+     * collect commands until a transfer completes. If commands have waited
+     * longer than out_max_delay, queue them behind the in flight transfers
+     * as long as a buffer is left for collecting new commands. The flush
+     * timer does this when no send or completion comes in time. */
+    if ( out_in_flight == 0 ||
+         (out_in_flight < out_transfer_count - 1 &&
+          std::chrono::steady_clock::now() - out_fill_start >= out_max_delay) ) {
+        return submitOutFillTransfer();
+    }
 
-        zDebug("ZenoUSB: Wait for next bulk transfer");
-        next_transfer_index = (buffer_index + 1) % 2;
-        if (!waitForBulkTransfer(lock, timeout_in_ms)) return false;
-        buffer_index = next_transfer_index;
+    armOutFlushTimerUnlocked();
+    return true;
+}
 
-        offset = 0;
+void ZZenoUSBDevice::armOutFlushTimerUnlocked()
+{
+    /* out_transfer_mutex must be held. With a single buffer left the next
+     * completion submits the collected commands, the timer is not needed */
+    if ( out_flush_armed || handle_closing || out_in_flight >= out_transfer_count - 1 ) return;
+
+    out_flush_armed = true;
+    if ( out_flush_thread == nullptr ) {
+        out_flush_running = true;
+        out_flush_thread.reset(new std::thread(&ZZenoUSBDevice::runOutFlushTimer, this));
     }
+    out_flush_cond.notify_one();
+}
 
-    memcpy(out_bulk_transfer[buffer_index]->buffer + offset, request, ZENO_CMD_SIZE);
-    out_bulk_transfer[buffer_index]->length += ZENO_CMD_SIZE;
+void ZZenoUSBDevice::runOutFlushTimer()
+{
+    zDebug("(ZenoUSB) OUT flush timer started");
+    ZThreadScheduling::applyToCurrentThread("USB OUT flush");
 
-    if ( next_transfer_index == -1 ) {
-        // qDebug() << "-- submit buffer_index: " << buffer_index;
-        int res = libusb_submit_transfer(out_bulk_transfer[buffer_index]);
-        if ( res ) {
-            last_error_text = ZUSBContext::translateLibUSBErrorCode(res);
-            device_gone_or_disconnected = (res == LIBUSB_ERROR_NO_DEVICE);
-            zError("(ZenoUSB) failed to submit bulk transfer: %s", last_error_text.c_str());
-            return false;
+    std::unique_lock<std::mutex> lock(out_transfer_mutex);
+    while ( out_flush_running ) {
+        if ( !out_flush_armed ) {
+            out_flush_cond.wait(lock);
+            continue;
         }
-        next_transfer_index = (buffer_index + 1) % 2;
+
+        /* The fill buffer may have been submitted and restarted meanwhile */
+        auto due = out_fill_start + out_max_delay;
+        if ( std::chrono::steady_clock::now() < due ) {
+            out_flush_cond.wait_until(lock, due);
+            continue;
+        }
+
+        out_flush_armed = false;
+        if ( out_bulk_transfers.empty() || getOutFillTransfer()->length == 0 ) continue;
+        if ( out_in_flight < out_transfer_count - 1 ) submitOutFillTransfer();
     }
 
-    // qDebug() << "-- nt: " << next_transfer_index;
-    // qDebug() << "b0 length: " << out_bulk_transfer[0]->length;
-    // qDebug() << "b1 length: " << out_bulk_transfer[1]->length;
+    zDebug("(ZenoUSB) OUT flush timer ended");
+}
+
+void ZZenoUSBDevice::stopOutFlushTimer()
+{
+    std::unique_ptr<std::thread> thread;
+    {
+        std::lock_guard<std::mutex> lock(out_transfer_mutex);
+        out_flush_running = false;
+        out_flush_armed = false;
+        out_flush_cond.notify_one();
+        thread = std::move(out_flush_thread);
+    }
+
+    if ( thread != nullptr ) thread->join();
+}
+
+ZenoCmd* ZZenoUSBDevice::reserveTxRequest(std::unique_lock<std::mutex>& lock, int timeout_in_ms, int size)
+{
+    bool in_batch = lock.owns_lock();
+    if ( !in_batch ) lock = std::unique_lock<std::mutex>(out_transfer_mutex);
+    assert(lock.mutex() == &out_transfer_mutex);
+
+    uint8_t* slot = reserveOutSlotUnlocked(lock, timeout_in_ms, size);
+    if ( slot == nullptr ) {
+        if ( !in_batch ) lock.unlock();
+        return nullptr;
+    }
+
+    memset(slot, 0, size_t(size));
+    return reinterpret_cast<ZenoCmd*>(slot);
+}
+
+bool ZZenoUSBDevice::commitTxRequest(std::unique_lock<std::mutex>& lock, bool low_latency, bool more)
+{
+    assert(lock.owns_lock() && lock.mutex() == &out_transfer_mutex);
+
+    if ( more ) {
+        getOutFillTransfer()->length += out_reserved_size;
+        return true;
+    }
+
+    bool res = commitOutSlotUnlocked(low_latency);
+    lock.unlock();
+
+    return res;
+}
+
+ZenoCmd* ZZenoUSBDevice::tryReserveTxRequest(std::unique_lock<std::mutex>& lock, int size)
+{
+    if ( !lock.owns_lock() ) lock = std::unique_lock<std::mutex>(out_transfer_mutex);
+    assert(lock.mutex() == &out_transfer_mutex);
+
+    /* A full fill buffer is submitted first, which needs one more free buffer */
+    if ( out_bulk_transfers.empty() || out_in_flight == out_transfer_count ) return nullptr;
+    if ( getOutFillTransfer()->length + size >= out_transfer_size &&
+         out_in_flight + 1 == out_transfer_count ) return nullptr;
+
+    uint8_t* slot = reserveOutSlotUnlocked(lock, 0, size);
+    if ( slot == nullptr ) return nullptr;
+
+    memset(slot, 0, size_t(size));
+    return reinterpret_cast<ZenoCmd*>(slot);
+}
+
+bool ZZenoUSBDevice::submitTxRequests(std::unique_lock<std::mutex>& lock, bool low_latency)
+{
+    assert(lock.owns_lock() && lock.mutex() == &out_transfer_mutex);
+
+    bool res = submitCollectedUnlocked(low_latency);
+    lock.unlock();
+
+    return res;
+}
+
+bool ZZenoUSBDevice::submitOutFillTransfer()
+{
+    /* out_transfer_mutex must be held */
+    libusb_transfer* fill_transfer = getOutFillTransfer();
+    assert(out_in_flight < out_transfer_count);
+    assert(fill_transfer->length > 0);
 
+    int res = libusb_submit_transfer(fill_transfer);
+    if ( res ) {
+        ZUSBStatistics::increment(usb_statistics.submit_errors);
+        last_error_text = ZUSBContext::translateLibUSBErrorCode(res);
+        device_gone_or_disconnected = (res == LIBUSB_ERROR_NO_DEVICE);
+        zError("(ZenoUSB) failed to submit bulk transfer: %s", last_error_text.c_str());
+        return false;
+    }
+
+    outTransferSubmittedUnlocked();
     return true;
 }
 
+void ZZenoUSBDevice::outTransferSubmittedUnlocked()
+{
+    /* out_transfer_mutex must be held, the fill transfer joins the in flight ones */
+    out_submit_time[(out_head + out_in_flight) % out_transfer_count] = std::chrono::steady_clock::now();
+    out_in_flight ++;
+}
+
 bool ZZenoUSBDevice::queueRequest(ZenoCmd* request, int timeout_in_ms)
 {
     std::unique_lock<std::mutex> lock(out_transfer_mutex);
@@ -538,10 +1121,10 @@ bool ZZenoUSBDevice::queueRequest(ZenoCmd* request, int timeout_in_ms)
     return ___queueRequestUnlocked(request, lock, timeout_in_ms);
 }
 
-bool ZZenoUSBDevice::queueTxRequest(ZenoCmd* request, int timeout_in_ms)
+bool ZZenoUSBDevice::queueTxRequest(ZenoCmd* request, int timeout_in_ms, bool low_latency)
 {
     std::unique_lock<std::mutex> lock(out_transfer_mutex);
-    return ___queueRequestUnlocked(request, lock, timeout_in_ms);
+    return ___queueRequestUnlocked(request, lock, timeout_in_ms, low_latency);
 }
 
 ZZenoLINDriver* ZZenoUSBDevice::getZenoLINDriver() const
@@ -553,32 +1136,62 @@ ZZenoLINDriver* ZZenoUSBDevice::getZenoLINDriver() const
 
 bool ZZenoUSBDevice::waitForBulkTransfer(std::unique_lock<std::mutex>& lock, int timeout_in_ms)
 {
-    while (next_transfer_index != -1 &&
-           out_bulk_transfer[next_transfer_index]->length > 0 ) {
-//        qDebug() << "nt: " << next_transfer_index;
-//        qDebug() << "length: " << out_bulk_transfer[next_transfer_index]->length;
-
-        bulk_out_transfer_completed = 0;
-        while (!bulk_out_transfer_completed) {
-            std::chrono::milliseconds timeout(timeout_in_ms);
-            if (out_transfer_cond.wait_for(lock, timeout) == std::cv_status::timeout) {
-                last_error_text = "Timeout, TX buffer overflow";
-                return false;
-            }
+    if ( out_in_flight < out_transfer_count ) return true;
+
+    /* All buffers in flight, the sender is blocked until one completes */
+    ZUSBStatistics::increment(usb_statistics.sender_waits);
+    auto t_wait = std::chrono::steady_clock::now();
+    bool res = waitForBulkTransferCompletion(lock, timeout_in_ms);
+    usb_statistics.sender_wait_time.add(uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                                                 std::chrono::steady_clock::now() - t_wait).count()));
+    if ( !res && out_in_flight == out_transfer_count ) ZUSBStatistics::increment(usb_statistics.sender_timeouts);
+
+    return res;
+}
+
+bool ZZenoUSBDevice::waitForBulkTransferCompletion(std::unique_lock<std::mutex>& lock, int timeout_in_ms)
+{
+    if ( out_in_flight == out_transfer_count && isApplicationDrivenEvents() ) {
+        /* TX locks may be held by the caller, handle transfer completions only */
+        auto ready = [this]() {
+            return out_in_flight < out_transfer_count || handle_closing;
+        };
+        if (!waitForEvents(lock, timeout_in_ms, ready, true)) {
+            last_error_text = "Timeout, TX buffer overflow";
+            return false;
+        }
+
+        return !handle_closing;
+    }
+
+    std::chrono::milliseconds timeout(timeout_in_ms);
+    while ( out_in_flight == out_transfer_count ) {
+        if (out_transfer_cond.wait_for(lock, timeout) == std::cv_status::timeout) {
+            last_error_text = "Timeout, TX buffer overflow";
+            return false;
         }
 
         /* Device closed or handleEvents() failed */
-        if ( open_ref_count == 0 ) return false;
+        if ( handle_closing ) return false;
     }
 
     return true;
 }
 
-void ZZenoUSBDevice::handleIncomingData(int bytes_transferred)
+void ZZenoUSBDevice::handleIncomingData(uint8_t* in_buffer, int bytes_transferred)
 {
+    if ( ZUSBContext::isRestrictedEventHandling() ) {
+        deferIncomingData(in_buffer, bytes_transferred);
+        return;
+    }
+
+    /* Keep arrival order, data deferred earlier goes first */
+    if ( !deferred_in_data.empty() ) handleDeferredDataUnlocked();
+
     int offset = 0;
     ZenoCmd* zeno_cmd;
 
+    device_rx_staged_count = 0;
 
     // if (bytes_transferred > 32) qDebug() << " R bytes_transfered " << bytes_transferred;
     while ( offset < bytes_transferred ) {
@@ -590,21 +1203,236 @@ void ZZenoUSBDevice::handleIncomingData(int bytes_transferred)
         offset += ZENO_CMD_SIZE;
         handleCommand(zeno_cmd);
 
-        if ( zeno_cmd->h.cmd_id == ZENO_CMD_RESPONSE) {
-            std::lock_guard<std::mutex> lock(command_mutex);
-            if ( reply_command != nullptr ) {
+        if ( zeno_cmd->h.cmd_id == ZENO_CMD_RESPONSE) handleResponse(zeno_cmd);
+    }
 
-                ZenoResponse* response = reinterpret_cast<ZenoResponse*>(zeno_cmd);
-                if ( response->response_cmd_id == reply_cmd_id ) {
-                    *reply_command = *response;
-                    reply_received = 1;
-                    command_cond.notify_one();
-                }
-            }
+    /* Publish all frames for the device RX queue in one step */
+    if ( device_rx_staged_count > 0 ) flushDeviceRxStaging();
+}
+
+void ZZenoUSBDevice::inTransferCompleted(uint8_t* in_buffer, int bytes_transferred)
+{
+    auto t_start = std::chrono::steady_clock::now();
+
+    if ( ZZenoUSBCapture::isCapturing() ) captureInData(in_buffer, bytes_transferred);
+    handleIncomingData(in_buffer, bytes_transferred);
+
+    ZUSBStatistics::increment(usb_statistics.in_transfers);
+    ZUSBStatistics::increment(usb_statistics.in_bytes, uint64_t(bytes_transferred));
+    if ( bytes_transferred >= in_transfer_size ) ZUSBStatistics::increment(usb_statistics.in_full_transfers);
+    usb_statistics.in_size.add(uint64_t(bytes_transferred));
+    usb_statistics.in_callback_time.add(uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                                                 std::chrono::steady_clock::now() - t_start).count()));
+}
+
+void ZZenoUSBDevice::captureInData(const uint8_t* in_buffer, int bytes_transferred)
+{
+    /* Info is known once the device has answered INFO, the transfers before
+     * that only carry the startup replies */
+    if ( serial_number == 0 ) return;
+
+    ZZenoDeviceInfoCache::DeviceInfo info;
+    info.serial_number = serial_number;
+    info.fw_version = fw_version;
+    info.clock_resolution = zeno_clock_resolution;
+    info.can_channel_count = int(can_channel_list.size());
+    info.lin_channel_count = int(lin_channel_list.size());
+    info.capabilities = capabilities;
+    ZZenoUSBCapture::captureInTransfer(info, in_buffer, bytes_transferred);
+}
+
+void ZZenoUSBDevice::handleResponse(ZenoCmd* zeno_cmd)
+{
+    ZenoResponse* response = reinterpret_cast<ZenoResponse*>(zeno_cmd);
+
+    std::lock_guard<std::mutex> lock(command_mutex);
+    expirePendingRepliesUnlocked();
+
+    /* Match the echoed transaction ID. A reply without a known ID completes
+     * the oldest request for the command, the firmware answers in order */
+    auto it = std::find_if(pending_replies.begin(), pending_replies.end(),
+                           [response](const std::shared_ptr<PendingReply>& p) {
+        return p->cmd_id == response->response_cmd_id && p->transaction_id == response->h.transaction_id;
+    });
+    if ( it == pending_replies.end() ) {
+        it = std::find_if(pending_replies.begin(), pending_replies.end(),
+                          [response](const std::shared_ptr<PendingReply>& p) {
+            return p->cmd_id == response->response_cmd_id;
+        });
+    }
+
+    if ( it == pending_replies.end() ) {
+        zDebug("(ZenoUSB) unexpected reply to command %d, transaction %d",
+               response->response_cmd_id, response->h.transaction_id);
+        return;
+    }
+
+    std::shared_ptr<PendingReply> pending = *it;
+    pending_replies.erase(it);
+    completePendingReplyUnlocked(pending.get(), response);
+    command_cond.notify_all();
+}
+
+void ZZenoUSBDevice::deferIncomingData(uint8_t* in_buffer, int bytes_transferred)
+{
+    /* The waiting thread may hold channel locks taken by the frame and TX ack
+     * handlers, handle replies now and keep the rest for a later wait or
+     * zcqHandleEvents() */
+    for ( int offset = 0; offset < bytes_transferred; offset += ZENO_CMD_SIZE ) {
+        ZenoCmd* zeno_cmd = reinterpret_cast<ZenoCmd*>(in_buffer + offset);
+        if ( zeno_cmd->h.cmd_id == ZENO_CMD_RESPONSE ) {
+            handleResponse(zeno_cmd);
+        } else {
+            deferred_in_data.insert(deferred_in_data.end(), in_buffer + offset, in_buffer + offset + ZENO_CMD_SIZE);
         }
     }
 }
 
+void ZZenoUSBDevice::handleDeferredDataUnlocked()
+{
+    if ( deferred_in_data.empty() ) return;
+
+    std::vector<uint8_t> in_data;
+    in_data.swap(deferred_in_data);
+    handleIncomingData(in_data.data(), int(in_data.size()));
+}
+
+void ZZenoUSBDevice::handleDeferredData()
+{
+    /* Deferred data is only touched with the libusb event lock held */
+    libusb_context* ctx = usb_context->getUSBContext();
+    libusb_lock_events(ctx);
+    handleDeferredDataUnlocked();
+    libusb_unlock_events(ctx);
+}
+
+bool ZZenoUSBDevice::isApplicationDrivenEvents() const
+{
+    return usb_context->isApplicationDriven();
+}
+
+bool ZZenoUSBDevice::handleEventsFromWait(int timeout_in_us, bool restricted)
+{
+    if ( !restricted ) handleDeferredData();
+    return usb_context->handleEventsFromWait(timeout_in_us, restricted);
+}
+
+void ZZenoUSBDevice::enableDeviceRxQueue(bool include_lin)
+{
+    std::lock_guard<std::mutex> lock(device_rx_fifo_mutex);
+    if ( device_rx_queue_ref_count == 0 ) {
+        if ( device_rx_fifo.bufferSize() < ZENO_DEVICE_RX_QUEUE_SIZE ) {
+            device_rx_fifo.setNewBufferSize(ZENO_DEVICE_RX_QUEUE_SIZE);
+        } else {
+            device_rx_fifo.clear();
+        }
+    }
+
+    device_rx_queue_ref_count ++;
+    if ( include_lin ) device_rx_queue_lin_ref_count ++;
+}
+
+void ZZenoUSBDevice::disableDeviceRxQueue(bool include_lin)
+{
+    std::lock_guard<std::mutex> lock(device_rx_fifo_mutex);
+    device_rx_queue_ref_count --;
+    assert(device_rx_queue_ref_count >= 0);
+    if ( include_lin ) device_rx_queue_lin_ref_count --;
+
+    /* Wake up a reader blocked on the queue */
+    device_rx_fifo_cond.notify_all();
+}
+
+ZZenoUSBDevice::DeviceRxMessage* ZZenoUSBDevice::deviceRxStagingPtr(uint8_t bus_type, uint8_t channel)
+{
+    if ( device_rx_staged_count >= device_rx_staging.size() ) flushDeviceRxStaging();
+
+    DeviceRxMessage* rx = &device_rx_staging[device_rx_staged_count];
+    rx->bus_type = bus_type;
+    rx->channel = channel;
+
+    return rx;
+}
+
+void ZZenoUSBDevice::queueDeviceRxMessage(const DeviceRxMessage& rx)
+{
+    std::lock_guard<std::mutex> lock(device_rx_fifo_mutex);
+    if ( device_rx_fifo.available() == 0 ) {
+        zDebug("(ZenoUSB) device RX queue overflow, 1 frame dropped");
+        return;
+    }
+
+    device_rx_fifo.write(&rx, 1);
+    device_rx_fifo_cond.notify_one();
+}
+
+void ZZenoUSBDevice::flushDeviceRxStaging()
+{
+    std::lock_guard<std::mutex> lock(device_rx_fifo_mutex);
+    unsigned int count = device_rx_staged_count;
+    device_rx_staged_count = 0;
+
+    if ( count > device_rx_fifo.available() ) {
+        zDebug("(ZenoUSB) device RX queue overflow, %d frames dropped", int(count - device_rx_fifo.available()));
+        count = device_rx_fifo.available();
+    }
+
+    if ( count == 0 ) return;
+
+    device_rx_fifo.write(device_rx_staging.data(), count);
+    device_rx_fifo_cond.notify_one();
+}
+
+unsigned int ZZenoUSBDevice::readDeviceRxQueue(DeviceRxMessage* messages, unsigned int max_count, int timeout_in_ms)
+{
+    std::unique_lock<std::mutex> lock(device_rx_fifo_mutex);
+
+    auto ready = [this]() {
+        return !device_rx_fifo.isEmpty() || device_rx_queue_ref_count == 0;
+    };
+
+    if ( isApplicationDrivenEvents() ) {
+        waitForEvents(lock, timeout_in_ms, ready);
+    } else if ( timeout_in_ms == -1 ) {
+        /* Infinite wait */
+        device_rx_fifo_cond.wait(lock, ready);
+    } else if ( timeout_in_ms > 0 ) {
+        device_rx_fifo_cond.wait_for(lock, std::chrono::milliseconds(timeout_in_ms), ready);
+    }
+
+    return device_rx_fifo.read(messages, max_count);
+}
+
+bool ZZenoUSBDevice::translateDeviceRxMessage(const DeviceRxMessage& rx, ZCANChannel::DeviceFrame& frame)
+{
+    frame.bus_type = ZCANChannel::DeviceFrameBusType(rx.bus_type);
+    frame.channel_nr = rx.channel;
+
+    switch(rx.bus_type) {
+    case ZCANChannel::DeviceFrameCAN:
+        if ( rx.channel >= can_channel_list.size() ) return false;
+
+        frame.timestamp_in_us = rx.can.timestamp;
+        can_channel_list[rx.channel]->translateRxMessage(rx.can, frame.id, frame.msg,
+                                                         frame.dlc, frame.flags,
+                                                         frame.timestamp_in_us);
+        return true;
+
+    case ZCANChannel::DeviceFrameLIN: {
+        if ( rx.channel >= lin_channel_list.size() ) return false;
+
+        uint8_t pid;
+        lin_channel_list[rx.channel]->translateRxMessage(rx.lin, pid, frame.msg,
+                                                         frame.dlc, frame.flags,
+                                                         frame.timestamp_in_us);
+        frame.id = pid;
+        return true;
+    }
+    }
+
+    return false;
+}
+
 void ZZenoUSBDevice::handleInterruptData()
 {
     ZenoIntCmd* zeno_int_cmd = reinterpret_cast<ZenoIntCmd*>(in_interrupt_buffer);
@@ -757,14 +1585,16 @@ void ZZenoUSBDevice::handleCommand(ZenoCmd* zeno_cmd)
         ZenoLINMessage* zeno_lin_msg = reinterpret_cast<ZenoLINMessage*>(zeno_cmd);
         // qDebug() << "ZenoLIN-RX" << zeno_lin_msg->channel;
 
-        if ( lin_channel_list.size() == 2) {
-            switch(zeno_lin_msg->channel) {
-            case 0:
-                lin_channel_list[1]->queueMessage(*zeno_lin_msg);
-                break;
-            case 1:
-                lin_channel_list[0]->queueMessage(*zeno_lin_msg);
-                break;
+        /* Assume Zeno CANquatro - with 2 LIN channels in reverse order */
+        if ( lin_channel_list.size() == 2 && zeno_lin_msg->channel < 2 ) {
+            uint8_t lin_index = uint8_t(1 - zeno_lin_msg->channel);
+
+            if ( device_rx_queue_lin_ref_count > 0 ) {
+                DeviceRxMessage* rx = deviceRxStagingPtr(ZCANChannel::DeviceFrameLIN, lin_index);
+                rx->lin = *zeno_lin_msg;
+                deviceRxStagingWrite();
+            } else {
+                lin_channel_list[lin_index]->queueMessage(*zeno_lin_msg);
             }
         }
 
@@ -877,17 +1707,23 @@ void ZZenoUSBDevice::__inBulkTransferCallback(libusb_transfer* in_bulk_transfer)
 
     // qDebug() << " bulk complete status: " << in_bulk_transfer->status << " transferrred: " << in_bulk_transfer->actual_length;
 
-    if ( _this->open_ref_count == 0) {
+    /* Transfers on the same endpoint complete in submission order, each one
+     * is re-submitted at the end of the queue once it has been handled */
+    _this->in_bulk_transfers_pending --;
+    assert(_this->in_bulk_transfers_pending >= 0);
+
+    if ( _this->handle_closing ) {
         /* Device closed do not re-submit transfer */
-        _this->in_bulk_transfer_complete = 1;
+        if ( _this->in_bulk_transfers_pending == 0 ) _this->in_bulk_transfer_complete = 1;
         return;
     }
 
     if ( in_bulk_transfer->status != LIBUSB_TRANSFER_TIMED_OUT &&
          in_bulk_transfer->status != LIBUSB_TRANSFER_CANCELLED &&
          in_bulk_transfer->status != LIBUSB_TRANSFER_COMPLETED ) {
+        ZUSBStatistics::increment(_this->usb_statistics.in_errors);
         zError("(ZenoUSB) unexcepted bulk transfer status: %d", in_bulk_transfer->status);
-        _this->in_bulk_transfer_complete = 1;
+        if ( _this->in_bulk_transfers_pending == 0 ) _this->in_bulk_transfer_complete = 1;
         return;
     }
 
@@ -895,20 +1731,41 @@ void ZZenoUSBDevice::__inBulkTransferCallback(libusb_transfer* in_bulk_transfer)
         zDebug(" --- in bulk transfer was canceled");
     }
 
+    if ( in_bulk_transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+        ZUSBStatistics::increment(_this->usb_statistics.in_timeouts);
+    }
+
     if ( in_bulk_transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-        _this->handleIncomingData(in_bulk_transfer->actual_length);
+        _this->inTransferCompleted(in_bulk_transfer->buffer, in_bulk_transfer->actual_length);
     }
 
     /* Re-submit bulk transfer */
     int res;
     assert(_this->in_bulk_transfer_complete == 0);
-    res = libusb_submit_transfer(_this->in_bulk_transfer);
+    res = libusb_submit_transfer(in_bulk_transfer);
     if ( res ) {
+        ZUSBStatistics::increment(_this->usb_statistics.submit_errors);
         _this->last_error_text = ZUSBContext::translateLibUSBErrorCode(res);
         _this->device_gone_or_disconnected = (res == LIBUSB_ERROR_NO_DEVICE);
         zError("(ZenoUSB) failed to submit bulk transfer: %s", _this->last_error_text.c_str());
-        _this->in_bulk_transfer_complete = 1;
+        if ( _this->in_bulk_transfers_pending == 0 ) _this->in_bulk_transfer_complete = 1;
+        return;
     }
+
+    _this->in_bulk_transfers_pending ++;
+}
+
+bool ZZenoUSBDevice::setDefaultInTransferCount(int count)
+{
+    if ( count < 1 || count > ZENO_USB_MAX_IN_TRANSFER_COUNT ) return false;
+
+    default_in_transfer_count = count;
+    return true;
+}
+
+int ZZenoUSBDevice::getDefaultInTransferCount()
+{
+    return default_in_transfer_count;
 }
 
 void ZZenoUSBDevice::__inInterruptTransferCallback(libusb_transfer *in_interrupt_transfer)
@@ -917,7 +1774,7 @@ void ZZenoUSBDevice::__inInterruptTransferCallback(libusb_transfer *in_interrupt
 
     // qDebug() << __PRETTY_FUNCTION__ << "in" << in_interrupt_transfer->status <<  _this->open_ref_count;
 
-    if ( _this->open_ref_count == 0) {
+    if ( _this->handle_closing ) {
         /* Device closed do not re-submit transfer */
         _this->in_interrupt_transfer_complete = 1;
         return;
@@ -956,15 +1813,56 @@ void ZZenoUSBDevice::__inInterruptTransferCallback(libusb_transfer *in_interrupt
 void ZZenoUSBDevice::__outBulkTransferCallback(libusb_transfer* out_bulk_transfer)
 {
     ZZenoUSBDevice* _this = static_cast<ZZenoUSBDevice*>(out_bulk_transfer->user_data);
-    std::lock_guard<std::mutex> lock(_this->out_transfer_mutex);
+    _this->outTransferCompleted(out_bulk_transfer);
+}
+
+void ZZenoUSBDevice::outTransferCompleted(libusb_transfer* out_bulk_transfer)
+{
+    completeOutTransfer(out_bulk_transfer);
+
+    /* Channels take the TX lock before out_transfer_mutex, so stalled host
+     * TX queues are resumed after it is released. Restricted event handling
+     * may run with a TX lock held, the next completion resumes them */
+    if ( tx_queue_resume.load() && !ZUSBContext::isRestrictedEventHandling() &&
+         tx_queue_resume.exchange(false) ) {
+        for ( auto& can_channel : can_channel_list ) {
+            can_channel->resumeTxQueue();
+        }
+    }
+}
+
+void ZZenoUSBDevice::completeOutTransfer(libusb_transfer* out_bulk_transfer)
+{
+    std::lock_guard<std::mutex> lock(out_transfer_mutex);
 
     // qDebug() << " TX bulk complete status: " << out_bulk_transfer->status << " transferrred: " << out_bulk_transfer->actual_length;
-    _this->bulk_out_transfer_completed = 1;
-    _this->out_transfer_cond.notify_one();
 
-    if ( _this->open_ref_count == 0) {
+    /* OUT transfers complete in submission order */
+    assert(out_in_flight > 0);
+    assert(out_bulk_transfer == out_bulk_transfers[size_t(out_head)]);
+    switch ( out_bulk_transfer->status ) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        ZUSBStatistics::increment(usb_statistics.out_transfers);
+        ZUSBStatistics::increment(usb_statistics.out_bytes, uint64_t(out_bulk_transfer->actual_length));
+        usb_statistics.out_latency.add(uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                                                std::chrono::steady_clock::now() - out_submit_time[out_head]).count()));
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        ZUSBStatistics::increment(usb_statistics.out_timeouts);
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        break;
+    default:
+        ZUSBStatistics::increment(usb_statistics.out_errors);
+        break;
+    }
+    out_bulk_transfer->length = 0;
+    out_head = (out_head + 1) % out_transfer_count;
+    out_in_flight --;
+    out_transfer_cond.notify_all();
+
+    if ( handle_closing ) {
         /* Device closed do not re-submit transfer */
-        _this->next_transfer_index = -1;
         return;
     }
 
@@ -972,34 +1870,107 @@ void ZZenoUSBDevice::__outBulkTransferCallback(libusb_transfer* out_bulk_transfe
          out_bulk_transfer->status != LIBUSB_TRANSFER_CANCELLED &&
          out_bulk_transfer->status != LIBUSB_TRANSFER_COMPLETED ) {
         zCritical("(ZenoUSB) unexcepted transfer status: %d", out_bulk_transfer->status);
-        _this->next_transfer_index = -1;
         return;
     }
 
-    assert(_this->next_transfer_index != -1);
-    int res;
-    out_bulk_transfer->length = 0;
-
-    libusb_transfer* next_transfer;
-    if ( out_bulk_transfer == _this->out_bulk_transfer[0] ) {
-        _this->next_transfer_index = 0;
-        next_transfer = _this->out_bulk_transfer[1];
-    } else {
-        assert(out_bulk_transfer == _this->out_bulk_transfer[1]);
-        _this->next_transfer_index = 1;
-        next_transfer = _this->out_bulk_transfer[0];
-    }
-
-    if ( next_transfer->length > 0 ) {
-        res = libusb_submit_transfer(next_transfer);
-        if ( res ) {
-            _this->last_error_text = ZUSBContext::translateLibUSBErrorCode(res);
-            _this->device_gone_or_disconnected = (res == LIBUSB_ERROR_NO_DEVICE);
-            zError("(ZenoUSB) failed to submit bulk transfer: %s", _this->last_error_text.c_str());
-            _this->next_transfer_index = -1;
+    /* Submit the commands collected while the transfer was in flight, keep
+     * collecting behind other in flight transfers until max delay is reached */
+    libusb_transfer* fill_transfer = getOutFillTransfer();
+    if ( fill_transfer->length > 0 ) {
+        if ( out_in_flight == 0 ||
+             (out_in_flight < out_transfer_count - 1 &&
+              std::chrono::steady_clock::now() - out_fill_start >= out_max_delay) ) {
+            submitOutFillTransfer();
+        } else {
+            armOutFlushTimerUnlocked();
         }
-        // _this->next_transfer_index = (_this->next_transfer_index + 1) % 2;
-    } else {
-        _this->next_transfer_index = -1;
     }
 }
+
+bool ZZenoUSBDevice::setDefaultOutTransferCount(int count)
+{
+    if ( count < 2 || count > ZENO_USB_MAX_OUT_TRANSFER_COUNT ) return false;
+
+    default_out_transfer_count = count;
+    return true;
+}
+
+int ZZenoUSBDevice::getDefaultOutTransferCount()
+{
+    return default_out_transfer_count;
+}
+
+bool ZZenoUSBDevice::setDefaultOutMaxDelay(int delay_in_us)
+{
+    if ( delay_in_us < 0 ) return false;
+
+    default_out_max_delay_in_us = delay_in_us;
+    return true;
+}
+
+int ZZenoUSBDevice::getDefaultOutMaxDelay()
+{
+    return default_out_max_delay_in_us;
+}
+
+/* Whole commands, and room for at least two since a buffer is submitted
+ * before the next command would fill it */
+static bool validTransferSize(int size)
+{
+    return size == 0 ||
+           (size >= 2 * ZENO_CMD_SIZE && size <= ZENO_USB_MAX_TRANSFER_SIZE && size % ZENO_CMD_SIZE == 0);
+}
+
+static bool validOutTransferSize(int size)
+{
+    /* A CAN FD frame is reserved in one piece, up to 96 bytes */
+    return size == 0 || (validTransferSize(size) && size >= 4 * ZENO_CMD_SIZE);
+}
+
+bool ZZenoUSBDevice::setDefaultTransferSizes(int in_size, int out_size)
+{
+    if ( !validTransferSize(in_size) || !validOutTransferSize(out_size) ) return false;
+
+    if ( in_size ) default_in_transfer_size = in_size;
+    if ( out_size ) default_out_transfer_size = out_size;
+    return true;
+}
+
+bool ZZenoUSBDevice::setDefaultBulkTransferTimeout(int timeout_in_ms)
+{
+    if ( timeout_in_ms < 0 ) return false;
+
+    default_bulk_transfer_timeout_in_ms = timeout_in_ms;
+    return true;
+}
+
+bool ZZenoUSBDevice::setTransferSizes(int in_size, int out_size)
+{
+    if ( !validTransferSize(in_size) || !validOutTransferSize(out_size) ) {
+        last_error_text = "Invalid USB transfer size";
+        return false;
+    }
+
+    if ( in_size && in_max_packet_size > 0 && in_size % in_max_packet_size ) {
+        last_error_text = "IN transfer size is not a multiple of the endpoint max packet size " +
+                          std::to_string(in_max_packet_size);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(device_mutex);
+    if ( in_size ) in_transfer_size_setting = in_size;
+    if ( out_size ) out_transfer_size_setting = out_size;
+    return true;
+}
+
+bool ZZenoUSBDevice::setBulkTransferTimeout(int timeout_in_ms)
+{
+    if ( timeout_in_ms < 0 ) {
+        last_error_text = "Invalid USB transfer timeout";
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(device_mutex);
+    bulk_transfer_timeout_setting = timeout_in_ms;
+    return true;
+}
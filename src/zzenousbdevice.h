@@ -36,17 +36,34 @@
 #include "zzenocanchannel.h"
 #include "zzenolinchannel.h"
 #include "zenocan.h"
+#include "zzenodeviceinfocache.h"
+#include "zusbstatistics.h"
 #include <libusb.h>
 
 #include <vector>
+#include <algorithm>
 #include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
 #include <mutex>
+#include <thread>
 
-#define ZENO_USB_BULK_TRANSFER_TIMEOUT      60000 /* 60 seconds in ms */
+#define ZENO_USB_BULK_TRANSFER_TIMEOUT      60000 /* Default, 60 seconds in ms */
 #define ZENO_USB_INTERRUPT_TRANSFER_TIMEOUT 60000 /* 60 seconds in ms */
 #define ZENO_USB_TX_TIMEOUT                  5000  /* 5 seconds in ms */
-#define ZENO_USB_MAX_PACKET_IN               4096
-#define ZENO_USB_MAX_PACKET_OUT              4096
+#define ZENO_USB_MAX_PACKET_IN               4096  /* Default IN transfer size */
+#define ZENO_USB_MAX_PACKET_OUT              4096  /* Default OUT buffer size */
+#define ZENO_USB_MAX_TRANSFER_SIZE           65536
+#define ZENO_DEVICE_RX_QUEUE_SIZE            8192
+#define ZENO_USB_IN_TRANSFER_COUNT           4     /* Default IN transfers kept queued */
+#define ZENO_USB_MAX_IN_TRANSFER_COUNT       32
+#define ZENO_USB_OUT_TRANSFER_COUNT          4     /* Default OUT buffers */
+#define ZENO_USB_MAX_OUT_TRANSFER_COUNT      32
+#define ZENO_USB_OUT_MAX_DELAY_US            250   /* Max coalescing delay while a transfer is in flight */
+#define ZENO_USB_WAIT_EVENT_SLICE_US         10000 /* Max time a library wait handles events before re-checking */
+#define ZENO_USB_MAX_EVENT_GROUPS            16
 // #define ZENO_MAX_OUTSTANDING_TX_REQUEST        31
 
 class ZUSBContext;
@@ -76,11 +93,57 @@ public:
 
     uint32_t getSerialNumber() const;
 
+    /* Index among the Zeno devices of the driver, selects the USB event group */
+    void setDeviceIndex(int _device_index) {
+        device_index = _device_index;
+    }
+
     uint32_t getFWVersion() const;
 
+    /* Transfer statistics since the device was created or last reset */
+    void getUSBStatistics(ZUSBStatistics::Snapshot& snapshot) const;
+    void resetUSBStatistics();
+
+    /* Commands from different channels may be in flight at the same time,
+     * each reply is matched to its request by transaction ID */
     bool sendAndWhaitReply(ZenoCmd* request, ZenoResponse* reply);
+
+    struct ReplyResult {
+        bool received;
+        ZenoResponse response;
+    };
+
+    /* Queue a command and return at once. received is false when the reply
+     * timed out or the device was closed. Expired requests are completed
+     * when the next command is queued or a reply arrives, wait on the future
+     * with a timeout. With application driven events the reply is only
+     * received while zcqHandleEvents() or another library wait runs */
+    std::future<ReplyResult> sendRequestAsync(ZenoCmd* request);
     bool queueRequest(ZenoCmd* request, int timeout_in_ms = ZENO_USB_TX_TIMEOUT);
-    bool queueTxRequest(ZenoCmd* request, int timeout_in_ms = ZENO_USB_TX_TIMEOUT);
+    bool queueTxRequest(ZenoCmd* request, int timeout_in_ms = ZENO_USB_TX_TIMEOUT, bool low_latency = false);
+
+    /* Zero copy TX, reserve a zeroed command slot in the OUT buffer and
+     * encode the request in place. out_transfer_mutex is held by lock from
+     * reserve until commit, dropping the lock without commit discards it.
+     * size may cover several commands, they go out in the same transfer.
+     * Batches commit with more set to keep the lock for the next reserve,
+     * submitTxRequests() then submits and releases it. A failed reserve
+     * releases the lock unless it was held on entry, so a batch can still
+     * submit the requests it has committed */
+    ZenoCmd* reserveTxRequest(std::unique_lock<std::mutex>& lock, int timeout_in_ms = ZENO_USB_TX_TIMEOUT,
+                              int size = ZENO_CMD_SIZE);
+    bool commitTxRequest(std::unique_lock<std::mutex>& lock, bool low_latency = false, bool more = false);
+    bool submitTxRequests(std::unique_lock<std::mutex>& lock, bool low_latency = false);
+
+    /* Like reserveTxRequest() but fails where it would wait for an OUT
+     * completion, for callers on the USB event thread. The lock is kept on
+     * failure so requests reserved before can still be submitted. After a
+     * failure requestTxQueueResume() has the next OUT completion resume
+     * the host TX queues of the channels */
+    ZenoCmd* tryReserveTxRequest(std::unique_lock<std::mutex>& lock, int size = ZENO_CMD_SIZE);
+    void requestTxQueueResume() {
+        tx_queue_resume = true;
+    }
 
     int getNextTransactionID() const {
         return next_transaction_id;
@@ -100,6 +163,28 @@ public:
         return device_gone_or_disconnected;
     }
 
+    void setDeviceGone() {
+        device_gone_or_disconnected = true;
+    }
+
+    /* Set when the first open finds other channel counts than the cached
+     * device info, the device is then replaced on the next enumeration */
+    bool isDeviceInfoStale() const {
+        return device_info_stale;
+    }
+
+    /* Automatic recovery. An open device that leaves the bus is marked lost,
+     * its USB handle is closed while the channels stay open. recover()
+     * reopens it on the reappeared USB device and replays the state of the
+     * open CAN channels, a gap frame tells readers how long it was gone */
+    void deviceLost();
+    bool recover(libusb_device* new_device);
+    bool isLost() const;
+
+    libusb_device* getUSBDevice() const {
+        return device;
+    }
+
     bool isInitClockCalibrationDone() const {
         return init_calibrate_count == 0;
     }
@@ -116,11 +201,140 @@ public:
         return t2_e_clock_start_diff_utc_us;
     }
 
+    /* Device level RX queue, shared by all channels opened with DeviceRxQueue */
+    struct DeviceRxMessage {
+        uint8_t bus_type; /* ZCANChannel::DeviceFrameBusType */
+        uint8_t channel;
+        union {
+            ZZenoCANChannel::FifoRxCANMessage can;
+            ZenoLINMessage lin;
+        };
+    };
+
+    void enableDeviceRxQueue(bool include_lin);
+    void disableDeviceRxQueue(bool include_lin);
+    void queueDeviceRxMessage(const DeviceRxMessage& rx);
+    unsigned int readDeviceRxQueue(DeviceRxMessage* messages, unsigned int max_count, int timeout_in_ms);
+    bool translateDeviceRxMessage(const DeviceRxMessage& rx, ZCANChannel::DeviceFrame& frame);
+
+    /* Number of IN bulk transfers kept queued, used when a device is opened */
+    static bool setDefaultInTransferCount(int count);
+    static int getDefaultInTransferCount();
+
+    /* Number of OUT buffers and the max coalescing delay, used when a device is opened */
+    static bool setDefaultOutTransferCount(int count);
+    static int getDefaultOutTransferCount();
+    static bool setDefaultOutMaxDelay(int delay_in_us);
+    static int getDefaultOutMaxDelay();
+
+    /* IN transfer and OUT buffer sizes in bytes and the bulk transfer
+     * timeout in ms (0 waits forever), used when a device is opened.
+     * A size of 0 keeps the current value. Per device settings are checked
+     * against the endpoint max packet size and override the defaults, a
+     * default IN size is rounded up to a multiple of it on open */
+    static bool setDefaultTransferSizes(int in_size, int out_size);
+    static bool setDefaultBulkTransferTimeout(int timeout_in_ms);
+    bool setTransferSizes(int in_size, int out_size);
+    bool setBulkTransferTimeout(int timeout_in_ms);
+
+    /* Application driven USB events, no library event thread */
+    virtual bool isApplicationDrivenEvents() const;
+    void handleDeferredData();
+
+    /* Wait until pred() is true, handling USB events on the calling thread.
+     * lock is released while events are handled. restricted is set when the
+     * caller holds other channel locks, only command replies and transfer
+     * completions are then handled and frame data is deferred. */
+    template<class Predicate>
+    bool waitForEvents(std::unique_lock<std::mutex>& lock, int timeout_in_ms,
+                       Predicate pred, bool restricted = false) {
+        auto t_end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_in_ms);
+        bool polled = false;
+
+        while (!pred()) {
+            int64_t slice_in_us = ZENO_USB_WAIT_EVENT_SLICE_US;
+            if ( timeout_in_ms != -1 ) {
+                int64_t remaining_in_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                            t_end - std::chrono::steady_clock::now()).count();
+                if ( remaining_in_us <= 0 && polled ) return false;
+                slice_in_us = std::max(int64_t(0), std::min(remaining_in_us, slice_in_us));
+            }
+
+            lock.unlock();
+            bool success = handleEventsFromWait(int(slice_in_us), restricted);
+            lock.lock();
+
+            polled = true;
+            if ( !success ) return pred();
+        }
+
+        return true;
+    }
+
+    DeviceRxMessage* deviceRxStagingPtr(uint8_t bus_type, uint8_t channel);
+    void deviceRxStagingWrite() {
+        device_rx_staged_count++;
+    }
+
 protected:
+    /* Devices without a USB transport, see ZZenoSimDevice. The transport
+     * is replaced by overriding the virtual methods below */
+    ZZenoUSBDevice(ZZenoCANDriver* _driver, int _device_no,
+                   const std::string& _display_name);
+
+    virtual bool openHandleUnlocked();
+    virtual void closeHandleUnlocked(bool stop_clock);
+    virtual bool isTransportOpen() const {
+        return handle != nullptr;
+    }
+    /* Device info cache key needing no device access, empty for none */
+    virtual std::string deviceInfoCacheKey() const;
+    void loadTransferSettings();
     void freeTransfers();
-    int getNextTransferIndex();
+    libusb_device* findDeviceInContext(libusb_context* context) const;
+    void cancelInTransfers();
+    libusb_transfer* getOutFillTransfer() const {
+        return out_bulk_transfers[size_t((out_head + out_in_flight) % out_transfer_count)];
+    }
+    virtual bool submitOutFillTransfer();
+    void outTransferSubmittedUnlocked();
+    void outTransferCompleted(libusb_transfer* out_bulk_transfer);
+    void completeOutTransfer(libusb_transfer* out_bulk_transfer);
+    uint8_t* reserveOutSlotUnlocked(std::unique_lock<std::mutex>& lock, int timeout_in_ms, int size);
+    bool commitOutSlotUnlocked(bool low_latency);
+    bool submitCollectedUnlocked(bool low_latency);
+    void armOutFlushTimerUnlocked();
+    void runOutFlushTimer();
+    void stopOutFlushTimer();
     bool waitForBulkTransfer(std::unique_lock<std::mutex>& lock, int timeout_in_ms);
-    void handleIncomingData(int bytes_transferred);
+    bool waitForBulkTransferCompletion(std::unique_lock<std::mutex>& lock, int timeout_in_ms);
+    void inTransferCompleted(uint8_t* in_buffer, int bytes_transferred);
+    void handleIncomingData(uint8_t* in_buffer, int bytes_transferred);
+    void captureInData(const uint8_t* in_buffer, int bytes_transferred);
+    void deferIncomingData(uint8_t* in_buffer, int bytes_transferred);
+    void handleDeferredDataUnlocked();
+    void handleResponse(ZenoCmd* zeno_cmd);
+    bool queryDeviceInfo(ZZenoDeviceInfoCache::DeviceInfo& info);
+    void applyDeviceInfo(const ZZenoDeviceInfoCache::DeviceInfo& info);
+    bool verifyCachedDeviceInfo();
+
+    struct PendingReply {
+        uint8_t cmd_id;
+        uint8_t transaction_id;
+        bool async;
+        bool done;
+        bool received;
+        std::chrono::steady_clock::time_point deadline;
+        ZenoResponse response;
+        std::promise<ReplyResult> promise;
+    };
+
+    std::shared_ptr<PendingReply> queueCommand(ZenoCmd* request, bool async);
+    void completePendingReplyUnlocked(PendingReply* pending, const ZenoResponse* response);
+    void removePendingReplyUnlocked(PendingReply* pending);
+    void expirePendingRepliesUnlocked();
+    void failPendingReplies();
+    bool handleEventsFromWait(int timeout_in_us, bool restricted);
     void handleInterruptData();
     void handleCommand(ZenoCmd* zeno_cmd);
     void startClockInt();
@@ -131,12 +345,21 @@ protected:
 
     ZZenoCANDriver* driver;
     ZUSBContext* usb_context;
-    bool device_gone_or_disconnected;
+    ZUSBContext* driver_usb_context;
+    std::atomic<bool> device_gone_or_disconnected;
+    std::atomic<bool> device_info_stale;
+    std::atomic<bool> tx_queue_resume;
+    std::chrono::steady_clock::time_point lost_time;
 
     mutable std::mutex device_mutex;
     int device_no;
+    int device_index;
     int open_ref_count;
 
+    /* Set while the transport closes, also when the device is lost with
+     * channels still open. Transfer callbacks and senders check it */
+    std::atomic<bool> handle_closing;
+
     libusb_device* device;
     libusb_device_handle* handle;
 
@@ -146,19 +369,44 @@ protected:
     int in_max_packet_size;
     int in_bulk_transfer_complete;
     int in_interrupt_transfer_complete;
-    libusb_transfer* in_bulk_transfer;
+    int in_bulk_transfers_pending;
+    std::vector<libusb_transfer*> in_bulk_transfers;
     libusb_transfer* in_interrupt_transfer;
-    uint8_t* in_buffer;
+    std::vector<uint8_t> in_buffer_pool;
     uint8_t in_interrupt_buffer[16];
 
-    /* USB outgoing data from device */
+    /* USB outgoing data from device, a ring of OUT buffers where
+     * [out_head, out_head + out_in_flight) are submitted and the
+     * next buffer collects new commands */
     uint8_t out_end_point_address;
     int out_max_packet_size;
-    uint8_t* out_buffer[2];
-    libusb_transfer* out_bulk_transfer[2];
+    int in_transfer_size;
+    int out_transfer_size;
+    int bulk_transfer_timeout_in_ms;
+
+    /* Per device settings, 0 and -1 use the defaults */
+    int in_transfer_size_setting;
+    int out_transfer_size_setting;
+    int bulk_transfer_timeout_setting;
+    int out_transfer_count;
+    std::chrono::microseconds out_max_delay;
+    std::vector<libusb_transfer*> out_bulk_transfers;
+    std::vector<uint8_t> out_buffer_pool;
+    int out_head;
+    int out_in_flight;
+    int out_reserved_size;
+    std::chrono::steady_clock::time_point out_fill_start;
+    std::chrono::steady_clock::time_point out_submit_time[ZENO_USB_MAX_OUT_TRANSFER_COUNT];
+
+    /* Submits commands held back longer than out_max_delay when no
+     * transfer completes in time, see armOutFlushTimerUnlocked() */
+    std::unique_ptr<std::thread> out_flush_thread;
+    std::condition_variable out_flush_cond;
+    bool out_flush_running;
+    bool out_flush_armed;
+
+    ZUSBStatistics usb_statistics;
 
-    int next_transfer_index;
-    int bulk_out_transfer_completed;
     std::mutex out_transfer_mutex;
     std::condition_variable out_transfer_cond;
 
@@ -170,18 +418,21 @@ protected:
 
     /* Reply state */
     int reply_timeout_in_ms;
-    uint8_t reply_cmd_id;
-    int reply_received;
-    ZenoResponse* reply_command;
-    std::mutex send_reply_mutex;
+    std::vector<std::shared_ptr<PendingReply> > pending_replies; /* In send order */
     std::mutex command_mutex;
     std::condition_variable command_cond;
 
+    /* IN data received by restricted event handling, see waitForEvents() */
+    std::vector<uint8_t> deferred_in_data;
+
     /* Card info */
     uint8_t next_transaction_id;
     int zeno_clock_resolution;
     uint32_t serial_number;
     uint32_t fw_version;
+    uint32_t capabilities;
+    std::string cache_key;
+    bool info_from_cache;       /* Not yet checked against the device */
 
     /* Clock info */
     int64_t t2_clock_start_ref_in_us;
@@ -194,8 +445,19 @@ protected:
     ZZenoTimerSynch::ZTimeVal time_drift_in_us;
     double   drift_factor;
 
+    /* Device level RX queue */
+    void flushDeviceRxStaging();
+
+    std::mutex device_rx_fifo_mutex;
+    std::condition_variable device_rx_fifo_cond;
+    ZRing<DeviceRxMessage> device_rx_fifo;
+    int device_rx_queue_ref_count;
+    std::atomic<int> device_rx_queue_lin_ref_count;
+    std::vector<DeviceRxMessage> device_rx_staging;
+    unsigned int device_rx_staged_count;
+
 private:
-    bool ___queueRequestUnlocked(ZenoCmd* request, std::unique_lock<std::mutex>& lock, int timeout_in_ms);
+    bool ___queueRequestUnlocked(ZenoCmd* request, std::unique_lock<std::mutex>& lock, int timeout_in_ms, bool low_latency = false);
     static void __inBulkTransferCallback(libusb_transfer* in_bulk_transfer);
     static void __inInterruptTransferCallback(libusb_transfer* in_interrupt_transfer);
     static void __outBulkTransferCallback(libusb_transfer* out_bulk_transfer);